@@ -21,223 +21,1259 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include "CWK2Q3.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include "CWK2Q3Internal.h"
 
-#define MAX_LOAD_FACTOR 0.7
+#define DEFAULT_INITIAL_SIZE 10
+#define SHRINK_TARGET_LOAD_FACTOR(map) \
+    (((map)->config.min_load_factor + max_load_factor_of(map)) / 2)
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+#define MIX_MULTIPLIER 0x9e3779b97f4a7c15ULL
+#define SIPHASH_ROTATE(value, bits) (((value) << (bits)) | ((value) >> (64 - (bits))))
+#define SIPHASH_ROUND(v0, v1, v2, v3) \
+    do { \
+      v0 += v1; v1 = SIPHASH_ROTATE(v1, 13); v1 ^= v0; v0 = SIPHASH_ROTATE(v0, 32); \
+      v2 += v3; v3 = SIPHASH_ROTATE(v3, 16); v3 ^= v2; \
+      v0 += v3; v3 = SIPHASH_ROTATE(v3, 21); v3 ^= v0; \
+      v2 += v1; v1 = SIPHASH_ROTATE(v1, 17); v1 ^= v2; v2 = SIPHASH_ROTATE(v2, 32); \
+    } while (0)
 
-static char** hash_map; // this is where you should store your names
-static int current_size = 0; // Should be size_t, but this would break the hash_function interface
-static int number_of_items = 0;
+static uint64_t ascii_sum(const char*);
+static uint64_t fnv1a_hash(const char*);
+static uint64_t mix_hash(const char*, uint64_t);
+static uint64_t siphash(const char*, uint64_t);
+static int64_t hash_index(const NameMap*, const char*);
+static const NameMapEngineOps *engine_ops_for(NameMapEngine);
+static void linear_probing_resize(NameMap*, int64_t);
+static void add_to_map_without_resizing(NameMap*, const char*, uint64_t, uint64_t, uint64_t);
+static void linear_probing_remove_at(NameMap*, int64_t);
+static int64_t index_of(const NameMap*, const char*, uint64_t);
+static void print_value_at_index(const NameMap*, int64_t);
+static const char *linear_probing_name_at(const NameMap*, int64_t);
+static void apply_removal_policy(NameMap*);
+static int64_t total_items(const NameMap*);
+static bool is_nearly_full(const NameMap*, int64_t);
+static bool filter_may_contain(const NameMap*, const char*, uint64_t);
+static void print_slots(const NameMap*);
+static NameMap *get_default_map();
+
+const NameMapEngineOps linear_probing_engine = {
+    .resize = linear_probing_resize,
+    .insert = add_to_map_without_resizing,
+    .remove_at = linear_probing_remove_at,
+    .index_of = index_of,
+    .home_index = home_index_for_hash,
+    .collect_probe_lengths = linear_probing_probe_lengths,
+    .print_slot = print_value_at_index,
+    .name_at = linear_probing_name_at,
+    .free_storage = NULL,
+    .compact_names = NULL
+};
+
+// The map used by the legacy, handle-free interface
+static NameMap *default_map = NULL;
 static const char* tombstone = "tombstone";
 
 /**
- * Calculates a hash of the given value.
+ * Gets the options used by <code>create_name_map</code>. Callers wanting different behaviour should
+ * start from these and override the fields they care about.
+ * @return The default options.
+ */
+NameMapConfig default_name_map_config()
+{
+  NameMapConfig config = {
+      .cache_hashes = false,
+      .hash_policy = HASH_POLICY_ASCII_SUM,
+      .hash_seed = 0,
+      .engine = NAME_MAP_ENGINE_LINEAR_PROBING,
+      .own_keys = false,
+      .max_tombstone_fraction = 0,
+      .min_load_factor = 0,
+      .max_load_factor = 0,
+      .incremental_resize_step = 0,
+      .bloom_filter = false,
+      .time_resizes = false,
+      .inline_key_bytes = 0,
+      .count_names = false
+  };
+  return config;
+}
+
+/**
+ * Creates a new, empty map with the default options.
+ * @param initial_size The initial capacity of the map. If this is less than <code>1</code>, the map
+ * will be left uninitialised and will be given a capacity of 10 when the first name is added.
+ * @return The new map. This must be freed with <code>free_name_map</code>.
+ */
+NameMap *create_name_map(int initial_size)
+{
+  NameMapConfig config = default_name_map_config();
+  return create_name_map_with_config(initial_size, &config);
+}
+
+/**
+ * Creates a new, empty map.
+ * @param initial_size The initial capacity of the map. If this is less than <code>1</code>, the map
+ * will be left uninitialised and will be given a capacity of 10 when the first name is added.
+ * @param config The options for the map. These are copied, so needn't outlive the call.
+ * @return The new map. This must be freed with <code>free_name_map</code>.
+ */
+NameMap *create_name_map_with_config(int initial_size, const NameMapConfig *config)
+{
+  return create_name_map_with_capacity(initial_size > 0 ? (size_t) initial_size : 0, config);
+}
+
+/**
+ * Creates a new, empty map. Unlike <code>create_name_map_with_config</code>, the capacity may be
+ * beyond the range of an int.
+ * @param initial_capacity The initial capacity of the map. If this is <code>0</code>, the map will
+ * be left uninitialised and will be given a capacity of 10 when the first name is added.
+ * @param config The options for the map. These are copied, so needn't outlive the call.
+ * @return The new map. This must be freed with <code>free_name_map</code>.
+ */
+NameMap *create_name_map_with_capacity(size_t initial_capacity, const NameMapConfig *config)
+{
+  NameMap *map = calloc(1, sizeof(NameMap));
+  if (!map) {
+    printf("Failed to allocate memory for the name map\n");
+    exit(1);
+  }
+  map->config = *config;
+  map->engine = engine_ops_for(config->engine);
+  map->inline_key_words = inline_key_words_for(config);
+
+  // Engines that copy names into their own storage don't need an arena to own them
+  if (map->config.own_keys && !map->engine->compact_names)
+    map->key_arena = create_key_arena(0);
+
+  // A seeded map that wasn't given a seed gets its own, so that different maps (and different runs)
+  // don't share a hash function
+  if (hash_policy_uses_seed(map->config.hash_policy) && map->config.hash_seed == 0)
+    map->config.hash_seed = choose_hash_seed(map);
+
+  if (initial_capacity > 0)
+    resize_name_map_to_capacity(map, initial_capacity);
+
+  return map;
+}
+
+/**
+ * Frees the map and its underlying data structure. The names themselves are not freed as these are
+ * owned by the caller.
+ * @param map The map to free. May be <code>NULL</code>, in which case nothing happens.
+ */
+void free_name_map(NameMap *map)
+{
+  if (!map)
+    return;
+
+  free_retiring_map(map);
+  if (map->engine->free_storage)
+    map->engine->free_storage(map);
+  free_slots(map);
+  free_key_arena(map->key_arena);
+  map->key_arena = NULL;
+  free_bloom_filter(map->bloom_filter);
+  free_bloom_filter(map->next_bloom_filter);
+  free(map);
+}
+
+/**
+ * Gets the implementation of the given engine.
+ * @param engine The engine.
+ * @return The operations implementing the engine. Unknown engines fall back to linear probing.
+ */
+static const NameMapEngineOps *engine_ops_for(NameMapEngine engine)
+{
+  switch (engine)
+  {
+    case NAME_MAP_ENGINE_ROBIN_HOOD:
+      return &robin_hood_engine;
+    case NAME_MAP_ENGINE_GROUP_PROBING:
+      return &group_probing_engine;
+    case NAME_MAP_ENGINE_CUCKOO:
+      return &cuckoo_engine;
+    case NAME_MAP_ENGINE_COMPACT:
+      return &compact_engine;
+    case NAME_MAP_ENGINE_LINEAR_PROBING:
+    default:
+      return &linear_probing_engine;
+  }
+}
+
+/**
+ * Allocates fresh, empty slots for the map, replacing (but not freeing) any existing slots. Engines
+ * should take a copy of the map before calling this if they need to move the existing names over.
+ * @param map The map to allocate slots for.
+ * @param size The number of slots to allocate.
+ */
+void allocate_slots(NameMap *map, int64_t size)
+{
+  // The compact engine stores offsets into its string pool instead of pointers. Either way, the
+  // slots start out zeroed, i.e. empty.
+  if (map->engine == &compact_engine)
+  {
+    map->name_offsets = calloc((size_t) size, sizeof(uint32_t));
+    if (!map->name_offsets) {
+      printf("Failed to allocate memory for the name offsets\n");
+      exit(1);
+    }
+  } else
+  {
+    map->hash_map = calloc((size_t) size, sizeof(char*));
+    if (!map->hash_map) {
+      printf("Failed to allocate memory for the hash_map\n");
+      exit(1);
+    }
+  }
+
+  // The fingerprints are only meaningful in occupied slots, so these needn't be zeroed
+  map->fingerprints = NULL;
+  if (map->config.cache_hashes)
+  {
+    map->fingerprints = malloc((size_t) size * sizeof(uint64_t));
+    if (!map->fingerprints) {
+      printf("Failed to allocate memory for the fingerprints\n");
+      exit(1);
+    }
+  }
+
+  // Likewise, the counts are set whenever a name is stored
+  map->counts = NULL;
+  if (map->config.count_names)
+  {
+    map->counts = malloc((size_t) size * sizeof(uint64_t));
+    if (!map->counts) {
+      printf("Failed to allocate memory for the counts\n");
+      exit(1);
+    }
+  }
+
+  map->inline_keys = NULL;
+  if (map->inline_key_words > 0)
+  {
+    map->inline_keys = malloc((size_t) size * map->inline_key_words * sizeof(uint64_t));
+    if (!map->inline_keys) {
+      printf("Failed to allocate memory for the inline keys\n");
+      exit(1);
+    }
+  }
+
+  map->current_size = size;
+  map->number_of_items = 0;
+  map->number_of_tombstones = 0;
+}
+
+/**
+ * Frees the slots allocated by <code>allocate_slots</code>.
+ * @param map The map (or a copy of the map) whose slots should be freed.
+ */
+void free_slots(NameMap *map)
+{
+  free(map->hash_map);
+  map->hash_map = NULL;
+  free(map->name_offsets);
+  map->name_offsets = NULL;
+  free(map->fingerprints);
+  map->fingerprints = NULL;
+  free(map->inline_keys);
+  map->inline_keys = NULL;
+  free(map->counts);
+  map->counts = NULL;
+}
+
+/**
+ * Gets the map used by the legacy interface, creating it if it doesn't yet exist.
+ * @return The default map.
+ */
+static NameMap *get_default_map()
+{
+  if (!default_map)
+    default_map = create_name_map(0);
+  return default_map;
+}
+
+/**
+ * Calculates the sum of the ASCII values of the key, as required by the specification.
  * @param key The value to hash.
- * @return The hash, i.e. the ideal position for the element to be stored in the hash map.
+ * @return The sum. Each byte is summed as an unsigned value, and the sum is 64-bit, so it never
+ * overflows (a key would need more than 2^56 bytes) and is never negative.
  */
-// This should really return a size_t but I don't want to change the interface provided
-int hash_function(const char *key)
+static uint64_t ascii_sum(const char *key)
 {
-  int sum = 0;
-  int ascii_value;
+  uint64_t sum = 0;
+  unsigned char ascii_value;
 
   // Iteratively loop through the key until we get to the end of the array, adding the ASCII value
   // each time
-  while ((ascii_value = (int) *key++))
-    sum += ascii_value; // this may overflow for very long strings, but that's acceptable
+  while ((ascii_value = (unsigned char) *key++))
+    sum += ascii_value;
+
+  return sum;
+}
+
+/**
+ * Calculates the 64-bit FNV-1a hash of the key.
+ * @param key The value to hash.
+ * @return The hash.
+ */
+static uint64_t fnv1a_hash(const char *key)
+{
+  uint64_t hash = FNV_OFFSET_BASIS;
+  while (*key)
+  {
+    hash ^= (unsigned char) *key++;
+    hash *= FNV_PRIME;
+  }
+  return hash;
+}
+
+/**
+ * Mixes the bits of a 64-bit value so that every input bit affects every output bit. This is the
+ * finaliser from MurmurHash3.
+ * @param value The value to mix.
+ * @return The mixed value.
+ */
+uint64_t mix64(uint64_t value)
+{
+  value ^= value >> 33;
+  value *= 0xff51afd7ed558ccdULL;
+  value ^= value >> 33;
+  value *= 0xc4ceb9fe1a85ec53ULL;
+  value ^= value >> 33;
+  return value;
+}
+
+/**
+ * Calculates a fast, well-distributed 64-bit hash of the key. The key is consumed 8 bytes at a
+ * time, with each word multiplied into the state, before the result is mixed.
+ * @param key The value to hash.
+ * @param seed A value that is mixed into the hash. Different seeds give unrelated hashes.
+ * @return The hash.
+ */
+static uint64_t mix_hash(const char *key, uint64_t seed)
+{
+  size_t length = strlen(key);
+  uint64_t hash = seed ^ (length * MIX_MULTIPLIER);
+  uint64_t word;
+
+  // Consume as many complete words as possible. memcpy is used as the key may not be aligned.
+  for (; length >= sizeof(word); length -= sizeof(word), key += sizeof(word))
+  {
+    memcpy(&word, key, sizeof(word));
+    hash = (hash ^ mix64(word)) * MIX_MULTIPLIER;
+  }
+
+  // Pack any remaining bytes into a final, partial word
+  if (length > 0)
+  {
+    word = 0;
+    memcpy(&word, key, length);
+    hash = (hash ^ mix64(word)) * MIX_MULTIPLIER;
+  }
 
-  // Module with the current size, as specified
-  return sum % current_size;
+  return mix64(hash);
+}
+
+/**
+ * Calculates SipHash-1-3 of the key: one round per 8-byte word of the key, and three to finish.
+ * Unlike <code>mix_hash</code>, the seed is mixed into the whole state, and every word passes
+ * through rounds that depend on it, so nothing about which keys collide can be learned without it.
+ * @param key The value to hash.
+ * @param seed The secret that the hash is keyed with. The 128-bit key is derived from this.
+ * @return The hash.
+ */
+static uint64_t siphash(const char *key, uint64_t seed)
+{
+  uint64_t k0 = seed;
+  uint64_t k1 = mix64(seed ^ MIX_MULTIPLIER);
+  uint64_t v0 = k0 ^ 0x736f6d6570736575ULL;
+  uint64_t v1 = k1 ^ 0x646f72616e646f6dULL;
+  uint64_t v2 = k0 ^ 0x6c7967656e657261ULL;
+  uint64_t v3 = k1 ^ 0x7465646279746573ULL;
+
+  size_t length = strlen(key);
+  uint64_t last_word = (uint64_t) length << 56;
+  uint64_t word;
+  for (size_t remaining = length; ; remaining -= sizeof(word), key += sizeof(word))
+  {
+    // The last word holds any remaining bytes, with the length in its top byte
+    if (remaining < sizeof(word))
+    {
+      word = 0;
+      memcpy(&word, key, remaining);
+      word |= last_word;
+    } else
+      memcpy(&word, key, sizeof(word));
+
+    v3 ^= word;
+    SIPHASH_ROUND(v0, v1, v2, v3);
+    v0 ^= word;
+    if (remaining < sizeof(word))
+      break;
+  }
+
+  v2 ^= 0xff;
+  SIPHASH_ROUND(v0, v1, v2, v3);
+  SIPHASH_ROUND(v0, v1, v2, v3);
+  SIPHASH_ROUND(v0, v1, v2, v3);
+  return v0 ^ v1 ^ v2 ^ v3;
+}
+
+/**
+ * Chooses a seed for a map whose hash policy needs one but wasn't given one. The seed is read from
+ * the system's random number source where there is one, so that it can't be guessed by someone
+ * choosing names to collide. Otherwise, it is based on the time and the map's address, which
+ * still varies it between maps and runs.
+ * @param owner The structure being given the seed.
+ * @return The seed, which is never <code>0</code>.
+ */
+uint64_t choose_hash_seed(const void *owner)
+{
+  uint64_t seed = 0;
+  FILE *random_source = fopen("/dev/urandom", "rb");
+  if (random_source)
+  {
+    if (fread(&seed, sizeof(seed), 1, random_source) != 1)
+      seed = 0;
+    fclose(random_source);
+  }
+  if (seed == 0)
+    seed = mix64((uint64_t) time(NULL) ^ (uint64_t) (uintptr_t) owner);
+  return seed != 0 ? seed : MIX_MULTIPLIER;
+}
+
+/**
+ * Calculates the hash used by <code>HASH_POLICY_FAST</code>, for structures outside the map that
+ * want the same hash (such as the typed maps in CWK2Q3TypedMap.h).
+ * @param name The value to hash.
+ * @return The hash.
+ */
+uint64_t hash_name(const char *name)
+{
+  return mix_hash(name, 0);
+}
+
+/**
+ * Calculates the full hash of the given value, according to the map's hash policy.
+ * @param map The map that the hash is being calculated for.
+ * @param key The value to hash.
+ * @return The hash. This needs reducing with <code>index_for_hash</code> to get a slot index.
+ */
+uint64_t hash_of(const NameMap *map, const char *key)
+{
+  return hash_with_config(&map->config, key);
+}
+
+/**
+ * Calculates the full hash of the given value, according to the hash policy in the config. This
+ * lets structures other than <code>NameMap</code> share the map's hash functions.
+ * @param config The config holding the hash policy and seed.
+ * @param key The value to hash.
+ * @return The hash.
+ */
+uint64_t hash_with_config(const NameMapConfig *config, const char *key)
+{
+  switch (config->hash_policy)
+  {
+    case HASH_POLICY_FAST:
+      return mix_hash(key, 0);
+    case HASH_POLICY_SEEDED:
+      return mix_hash(key, config->hash_seed);
+    case HASH_POLICY_FNV1A:
+      return fnv1a_hash(key);
+    case HASH_POLICY_SIPHASH:
+      return siphash(key, config->hash_seed);
+    case HASH_POLICY_ASCII_SUM:
+    default:
+      return ascii_sum(key);
+  }
+}
+
+/**
+ * Reduces a hash given by <code>hash_of</code> to an index in the map.
+ * @param map The map that the index is being calculated for.
+ * @param hash The hash of the value.
+ * @return The ideal position for the element to be stored in the hash map.
+ */
+int64_t index_for_hash(const NameMap *map, uint64_t hash)
+{
+  // Modulo with the current size, as specified. Every policy (including the ASCII sum) gives an
+  // unsigned 64-bit hash, so this is in range however large the map is.
+  return (int64_t) (hash % (uint64_t) map->current_size);
+}
+
+/**
+ * Gets the first slot that a search for a name looks at, for the engines whose searches start at
+ * the slot given by <code>index_for_hash</code>.
+ * @param map The map being searched.
+ * @param name The name being searched for. Not needed by these engines.
+ * @param hash The hash of the name, as given by <code>hash_of</code>.
+ * @return The index of the name's ideal position.
+ */
+int64_t home_index_for_hash(const NameMap *map, const char *name, uint64_t hash)
+{
+  (void) name;
+  return index_for_hash(map, hash);
+}
+
+/**
+ * Calculates a hash of the given value.
+ * @param map The map that the hash is being calculated for.
+ * @param key The value to hash.
+ * @return The hash, i.e. the ideal position for the element to be stored in the hash map.
+ */
+static int64_t hash_index(const NameMap *map, const char *key)
+{
+  return index_for_hash(map, hash_of(map, key));
+}
+
+/**
+ * Calculates a fingerprint of the given value that is stored alongside it when the map caches
+ * hashes. For the 64-bit hash policies this is just the full hash. The ASCII sum is useless as a
+ * fingerprint (anagrams always share it), so a 64-bit FNV-1a hash is used instead.
+ * @param map The map that the fingerprint is being calculated for.
+ * @param key The value to fingerprint.
+ * @param hash The hash of the value, as given by <code>hash_of</code>.
+ * @return The fingerprint, or <code>0</code> if the map doesn't cache hashes.
+ */
+uint64_t fingerprint_of(const NameMap *map, const char *key, uint64_t hash)
+{
+  if (!map->config.cache_hashes)
+    return 0;
+  return map->config.hash_policy == HASH_POLICY_ASCII_SUM ? fnv1a_hash(key) : hash;
+}
+
+/**
+ * Recovers the hash of a value that is already stored in the map, avoiding rehashing the value if
+ * the hash is cached as its fingerprint.
+ * @param map The map holding the value.
+ * @param index The index of the value.
+ * @return The hash of the value, as given by <code>hash_of</code>.
+ */
+uint64_t stored_hash_at(const NameMap *map, int64_t index)
+{
+  if (map->fingerprints && map->config.hash_policy != HASH_POLICY_ASCII_SUM)
+    return map->fingerprints[index];
+  return hash_of(map, slot_name(map, index));
+}
+
+/**
+ * Gets the count of a name that is already stored in the map, so that it can be carried along
+ * when the name is moved.
+ * @param map The map holding the name.
+ * @param index The index of the name.
+ * @return The number of times the name has been added, or <code>1</code> if the map doesn't count
+ * names.
+ */
+uint64_t stored_count_at(const NameMap *map, int64_t index)
+{
+  return map->counts ? map->counts[index] : 1;
+}
+
+/**
+ * Calculates the hash used by the map's Bloom filter. This needs to be well spread even if the
+ * map's own hash isn't, so is mixed, and is based on FNV-1a for the ASCII-sum policy (which gives
+ * every anagram the same hash).
+ * @param map The map that the hash is being calculated for.
+ * @param key The value to hash.
+ * @param hash The hash of the value, as given by <code>hash_of</code>.
+ * @return The hash.
+ */
+uint64_t filter_hash_of(const NameMap *map, const char *key, uint64_t hash)
+{
+  return mix64(map->config.hash_policy == HASH_POLICY_ASCII_SUM ? fnv1a_hash(key) : hash);
+}
+
+/**
+ * Calculates a hash of the given value against the default map.
+ * @param key The value to hash.
+ * @return The hash, i.e. the ideal position for the element to be stored in the hash map.
+ */
+// This should really return a size_t but I don't want to change the interface provided. Maps with
+// more slots than an int can index should use name_map_home_slot instead.
+int hash_function(const char *key)
+{
+  return (int) hash_index(get_default_map(), key);
 }
 
 /**
  * Attempts to add a value to the map, but does not attempt to resize the map if the load factor is
  * exceeded. Note that the value will not be added if an equivalent value already stored in the map.
+ * @param map The map to add the value to.
  * @param name The value to add to the map.
+ * @param hash The hash of <code>name</code>, as given by <code>hash_of</code>.
+ * @param fingerprint The fingerprint of <code>name</code>, as given by <code>fingerprint_of</code>.
+ * @param count If the map counts names, the count to store with the value, or to add to the count
+ * of the equivalent value if there is one.
  */
-static void add_to_map_without_resizing(const char *name)
+static void add_to_map_without_resizing(
+    NameMap *map, const char *name, uint64_t hash, uint64_t fingerprint, uint64_t count
+)
 {
-  // Calculate the hash of the element
-  int index = hash_function(name);
+  // Find the ideal position of the element
+  int64_t index = index_for_hash(map, hash);
+  InlineKey key;
+  if (map->inline_keys)
+    make_inline_key(map, name, &key);
 
   // If we find a tombstone element, we should overwrite it with the new value, assuming that a
   // duplicate of name wasn't found. To begin with, assume there is no tombstone to overwrite.
-  int first_tombstone_index = -1;
+  int64_t first_tombstone_index = -1;
 
   // Iterate through every element until we come across a NULL element. Even if we come across a
   // tombstone, we need to keep iterating until a NULL element to make sure that we aren't adding a
   // duplicate.
-  while (hash_map[index])
+  while (map->hash_map[index])
   {
+    if (map->hash_map[index] == tombstone)
+    {
+      // If the index is a tombstone index, this would be a good place to insert the new value.
+      // Remember this place, but continue checking to make sure there isn't a duplicate for this
+      // name before we add it
+      if (first_tombstone_index == -1)
+        first_tombstone_index = index;
+    }
     // Make sure we don't allow duplicates! If the name is already contained in the table, don't add
-    // the new one
-    if (strcmp(hash_map[index], name) == 0)
+    // the new one, but do count it. If we're caching hashes, only names with a matching fingerprint
+    // can be equal.
+    else if ((!map->fingerprints || map->fingerprints[index] == fingerprint)
+             && slot_holds_name(map, index, &key, name))
+    {
+      if (map->counts)
+        map->counts[index] += count;
       return;
+    }
 
-    // If the index is a tombstone index, this would be a good place to insert the new value.
-    // Remember this place, but continue checking to make sure there isn't a duplicate for this name
-    // before we add it
-    if (first_tombstone_index == -1 && hash_map[index] == tombstone)
-      first_tombstone_index = index;
-
-    index = next_index(index);
+    index = next_index(map, index);
   }
 
   // If we found a tombstone index, put the new name there. Otherwise, put the element where the
   // NULL element was detected
-  hash_map[first_tombstone_index == -1 ? index : first_tombstone_index] = (char*) name;
+  if (first_tombstone_index != -1)
+  {
+    index = first_tombstone_index;
+    map->number_of_tombstones--;
+  }
+  map->hash_map[index] = (char*) name;
+  if (map->fingerprints)
+    map->fingerprints[index] = fingerprint;
+  if (map->inline_keys)
+    store_inline_key(map, index, &key);
+  if (map->counts)
+    map->counts[index] = count;
 
   // We've successfully added a new element, so update the number of elements so we can determine
   // the new load factor
-  number_of_items++;
+  map->number_of_items++;
 }
 
 /**
  * Gets the next index from the current index. Usually, this will return <code>current_index + 1
  * </code>, although if this would be beyond the end of the array, <code>0</code> is returned
  * instead.
+ * @param map The map being iterated.
  * @param current_index The index to increment.
  * @return The index of the proceeding index.
  */
-static int next_index(int current_index)
+int64_t next_index(const NameMap *map, int64_t current_index)
 {
   // Try to increment the index. If this takes us past the end of the array, start over from the
   // beginning
-  return ++current_index >= current_size ? 0 : current_index;
+  return ++current_index >= map->current_size ? 0 : current_index;
 }
 
 /**
  * Changes the capacity of the map to the new given size. Elements will be copied over to the new
- * map on re-size. If <code>new_size &lt; 1</code>, or the new size would cause the load factory of
- * 0.7 to be exceeded, the map will not be resized.
+ * map on re-size. If <code>new_size &lt; 1</code>, or the new size would cause the map's maximum
+ * load factor (0.7 by default) to be exceeded, the map will not be resized.
+ * @param map The map to resize.
  * @param new_size The new capacity of the map.
  */
-void resize_map(int new_size)
+void resize_name_map(NameMap *map, int new_size)
+{
+  // Make sure we don't allow resizing if the new size is less than 1. It would be good to return
+  // some code for this, but I don't want to change the interface
+  if (new_size < 1)
+    return;
+  resize_name_map_to_capacity(map, (size_t) new_size);
+}
+
+/**
+ * Changes the capacity of the map to the new given capacity, as <code>resize_name_map</code> does,
+ * but without limiting the capacity to the range of an int.
+ * @param map The map to resize.
+ * @param new_capacity The new capacity of the map. Must be no more than <code>INT64_MAX</code>.
+ */
+void resize_name_map_to_capacity(NameMap *map, size_t new_capacity)
 {
   // Make sure we don't allow resizing if the new size is less than 1, or if the new size would
-  // cause the max load factor to be exceeded. It would be good to return some code for this, but I
-  // don't want to change the interface
-  if (new_size < 1 || ((double) number_of_items) / ((double) new_size) > MAX_LOAD_FACTOR)
+  // cause the max load factor to be exceeded
+  int64_t new_size = (int64_t) new_capacity;
+  if (new_size < 1 || ((double) total_items(map)) / ((double) new_size) > max_load_factor_of(map))
     return;
 
-  // Reset the number of items. This will be updated iteratively as we re-add the values from the
-  // old map
-  number_of_items = 0;
+  // An explicit resize can't be done incrementally, so any incremental resize has to be finished
+  // first
+  finish_incremental_resize(map);
 
-  // Store a reference to the old map so we can copy values over after the resizing
-  char** old_map = hash_map;
+  // Giving an uninitialised map its first storage doesn't move any names, so isn't counted
+  uint64_t started = start_rehash_timer(map);
+  if (map->current_size > 0)
+    map->resizes++;
+  map->engine->resize(map, new_size);
 
-  // Allocate the new size
-  hash_map = calloc(new_size, sizeof(char*));
+  // Every name has to be visited anyway, so this is a good time to reclaim the arena space used by
+  // removed names
+  compact_name_map(map);
+  stop_rehash_timer(map, started);
+}
 
-  if (!hash_map) {
-    printf("Failed to allocate memory for the hash_map\n");
-    exit(1);
+/**
+ * Reclaims the arena space used by names that have since been removed, by copying every live name
+ * into a fresh arena. The copies end up contiguous, in slot order. If the map has a Bloom filter,
+ * this also rebuilds it without the removed names.
+ * @param map The map to compact.
+ */
+void compact_name_map(NameMap *map)
+{
+  rebuild_bloom_filter(map);
+
+  // Engines that copy names into their own storage reclaim it themselves, including in storage
+  // that an incremental resize is still moving names out of
+  if (map->engine->compact_names)
+  {
+    for (NameMap *storage = map; storage; storage = storage->retiring)
+      storage->engine->compact_names(storage);
+    return;
   }
+  if (!map->key_arena)
+    return;
 
-  // Update the size, but keep a record of the old one so we can still iterate over the old array
-  int old_size = current_size;
-  current_size = new_size;
+  KeyArena *old_arena = map->key_arena;
+  map->key_arena = create_key_arena(map->live_key_bytes);
 
-  // If the old hash map was uninitialised (i.e. has a size of 0), don't bother copying over the old
-  // values
-  if (old_size > 0)
+  // The other engines store their names in hash_map, so we only need the engine to tell us which
+  // slots are live. Names that an incremental resize hasn't moved yet need copying too.
+  for (NameMap *storage = map; storage; storage = storage->retiring)
   {
-    // Loop through the old array. Any non-null and non-tombstone entries should be added to the new
-    // map.
-    for (int i = 0; i < old_size; i++)
+    for (int64_t i = 0; i < storage->current_size; i++)
     {
-      if (old_map[i] && old_map[i] != tombstone)
-        add_to_map_without_resizing(old_map[i]);
+      const char *name = storage->engine->name_at(storage, i);
+      if (name)
+        storage->hash_map[i] = copy_into_key_arena(map->key_arena, name);
     }
   }
 
-  // Free up the memory for the old structure that is no longer required
-  if (old_map)
+  free_key_arena(old_arena);
+}
+
+/**
+ * Moves every name in a linear probing map into new storage of the given size.
+ * @param map The map to resize.
+ * @param new_size The new capacity of the map.
+ */
+static void linear_probing_resize(NameMap *map, int64_t new_size)
+{
+  // Store a reference to the old map so we can copy values over after the resizing
+  NameMap old = *map;
+
+  // Allocate the new size. This also resets the number of items, which will be updated iteratively
+  // as we re-add the values from the old map
+  allocate_slots(map, new_size);
+
+  // Loop through the old array. Any non-null and non-tombstone entries should be added to the new
+  // map. Cached fingerprints are carried over so the names don't need fingerprinting again. If the
+  // old hash map was uninitialised (i.e. has a size of 0), there's nothing to copy.
+  for (int64_t i = 0; i < old.current_size; i++)
   {
-    free(old_map);
-    old_map = NULL;
+    if (old.hash_map[i] && old.hash_map[i] != tombstone)
+    {
+      add_to_map_without_resizing(
+          map, old.hash_map[i], stored_hash_at(&old, i), old.fingerprints ? old.fingerprints[i] : 0,
+          stored_count_at(&old, i)
+      );
+    }
   }
+
+  // Free up the memory for the old structure that is no longer required
+  free_slots(&old);
+}
+
+/**
+ * Changes the capacity of the default map. See <code>resize_name_map</code>.
+ * @param new_size The new capacity of the map.
+ */
+void resize_map(int new_size)
+{
+  resize_name_map(get_default_map(), new_size);
 }
 
 /**
  * Attempts to add the name to the map. The name will not be added if an equivalent value already
- * exists in the map. This may trigger a doubling of the size of the map if the maximum load factor
- * is exceeded after adding the element. Finally, if the map is uninitialised, calling this method
- * will initialise the map with an initial capacity of 10.
+ * exists in the map, although if the map counts names, that value's count goes up. This may
+ * trigger a doubling of the size of the map if the maximum load factor is exceeded after adding
+ * the element. Finally, if the map is uninitialised, calling this method will initialise the map
+ * with an initial capacity of 10.
+ * @param map The map to add the name to.
  * @param name The value to be added to the map.
  */
-void add_to_map(const char *name)
+void add_to_name_map(NameMap *map, const char *name)
 {
   // If the map is uninitialised, give it a default size of 10 so this operation doesn't fail
-  if (current_size == 0)
-    resize_map(10);
+  if (map->current_size == 0)
+    resize_name_map(map, DEFAULT_INITIAL_SIZE);
+
+  // If the map is part way through an incremental resize, do the next bit of it. A name that hasn't
+  // been moved yet is still a duplicate, and is counted where it is.
+  uint64_t hash = hash_of(map, name);
+  if (map->retiring)
+  {
+    migrate_slots(map, map->config.incremental_resize_step);
+    int64_t retiring_index = map->retiring
+        ? map->retiring->engine->index_of(map->retiring, name, hash)
+        : -1;
+    if (retiring_index != -1)
+    {
+      if (map->retiring->counts)
+        map->retiring->counts[retiring_index]++;
+      return;
+    }
+  }
 
   // Provided the load factor is enforced in other parts of the application, there'll always be room
   // to add the element first before resizing (if necessary).
-  add_to_map_without_resizing(name);
 
-  // Check if adding the value put us over the 0.7 load factor threshold. If so, double the size of
+  // If the map owns its names, store a copy of the name instead. If the name turns out to be a
+  // duplicate, the copy is handed straight back to the arena.
+  const char *stored_name = map->key_arena ? copy_into_key_arena(map->key_arena, name) : name;
+  int64_t previous_number_of_items = map->number_of_items;
+  map->engine->insert(map, stored_name, hash, fingerprint_of(map, name, hash), 1);
+  if (map->number_of_items == previous_number_of_items)
+  {
+    if (map->key_arena)
+      release_last_from_key_arena(map->key_arena, stored_name);
+  } else
+  {
+    if (map->key_arena)
+      map->live_key_bytes += strlen(name) + 1;
+    add_name_to_bloom_filters(map, name, hash);
+  }
+
+  // Check if adding the value put us over the max load factor threshold. If so, double the size of
   // the underlying data structure. Note that we can't do this operation prior to adding the
   // element. Although this would be convenient to save us from having the rehash the value, we
   // wouldn't be sure if adding the value actually increased the number of elements in the
   // structure, as duplicates aren't added.
-  if (((double) (number_of_items)) / ((double) current_size) > MAX_LOAD_FACTOR)
-    resize_map(current_size * 2); // Assume that doubling the size of the map is sensible
+  grow_after_insert(map);
+}
+
+/**
+ * Grows the map if a name has just been added and the map is now too full, or rehashes it in place
+ * if its names and tombstones together are. Every path that adds names one at a time calls this
+ * after each insert, so they all share the same growth policy.
+ * @param map The map that a name was just added to.
+ */
+void grow_after_insert(NameMap *map)
+{
+  if (is_nearly_full(map, total_items(map)))
+  {
+    // Assume that doubling the size is sensible. If we're still moving names from the last resize,
+    // the new storage has filled up faster than the step allows for, so that has to be finished.
+    if (map->config.incremental_resize_step > 0)
+    {
+      finish_incremental_resize(map);
+      start_incremental_resize(map, map->current_size * 2);
+    }
+    else
+      resize_name_map_to_capacity(map, (size_t) map->current_size * 2);
+  }
+  // Searches only stop at an empty slot, so the names and tombstones together mustn't be allowed to
+  // fill the map either. With a high enough max_load_factor, they'd otherwise be able to. Names
+  // that an incremental resize hasn't moved yet will need slots here too, so they count as well:
+  // otherwise, finishing the resize could fill every slot of the storage that is about to retire.
+  else if (is_nearly_full(
+      map, map->number_of_items + map->number_of_tombstones
+          + (map->retiring ? map->retiring->number_of_items : 0)))
+  {
+    resize_name_map_to_capacity(map, (size_t) map->current_size);
+    map->tombstone_purges++;
+  }
+}
+
+/**
+ * Checks whether the map is too full to keep adding names to, i.e. whether the given number of
+ * used slots is over the max load factor. However high the max load factor is, at least two slots
+ * are always kept empty: one so that every search stops, and one for the name being added, as the
+ * map may keep being searched after it has stopped growing (e.g. while it is being moved by an
+ * incremental resize).
+ * @param map The map.
+ * @param used_slots The number of slots in use.
+ * @return <code>true</code> if the map should grow (or be rehashed).
+ */
+static bool is_nearly_full(const NameMap *map, int64_t used_slots)
+{
+  return ((double) used_slots) / ((double) map->current_size) > max_load_factor_of(map)
+      || used_slots >= map->current_size - 1;
+}
+
+/**
+ * Gets the number of names in the map, including any that haven't yet been moved by an incremental
+ * resize.
+ * @param map The map.
+ * @return The number of names.
+ */
+static int64_t total_items(const NameMap *map)
+{
+  return map->number_of_items + (map->retiring ? map->retiring->number_of_items : 0);
+}
+
+/**
+ * Adds the name to the default map. See <code>add_to_name_map</code>.
+ * @param name The value to be added to the map.
+ */
+void add_to_map(const char *name)
+{
+  add_to_name_map(get_default_map(), name);
 }
 
 /**
  * Attempts to remove an entry matching <code>name</code> from the map. If a value is found and
- * removed, the map will not be resized.
+ * removed, the map will not be resized unless its config sets a <code>max_tombstone_fraction</code>
+ * or <code>min_load_factor</code> that the removal takes it past.
+ * @param map The map to remove the name from.
  * @param name The value to remove from the map.
  * @return <code>1</code> if the value was found and removed, or <code>0</code> if the value was not
  * found.
  */
-int remove_from_map(const char *name)
+int remove_from_name_map(NameMap *map, const char *name)
+{
+  // An uninitialised map can't contain anything (and would otherwise cause a modulo by zero)
+  if (map->current_size == 0)
+    return 0;
+
+  uint64_t hash = hash_of(map, name);
+  if (!filter_may_contain(map, name, hash))
+    return 0;
+
+  // If the map is part way through an incremental resize, do the next bit of it. The name might not
+  // have been moved yet.
+  migrate_slots(map, map->config.incremental_resize_step);
+  if (!remove_name(map, name, hash) && !(map->retiring && remove_name(map->retiring, name, hash)))
+    return 0;
+
+  // The arena space can't be reused until the map is compacted
+  if (map->key_arena)
+    map->live_key_bytes -= strlen(name) + 1;
+
+  apply_removal_policy(map);
+  return 1;
+}
+
+/**
+ * Shrinks the map, or rehashes it at its current size, if a removal has taken it past one of the
+ * thresholds in its config. Shrinking takes priority, as it clears out the tombstones too.
+ * @param map The map that a name has just been removed from.
+ */
+static void apply_removal_policy(NameMap *map)
+{
+  // Resizing now would just mean finishing the incremental resize in one go
+  if (map->retiring)
+    return;
+
+  double load_factor = ((double) map->number_of_items) / ((double) map->current_size);
+  if (map->config.min_load_factor > 0 && load_factor < map->config.min_load_factor)
+  {
+    // Aim for a load factor halfway between the two thresholds so that a few adds or removes won't
+    // immediately trigger another resize
+    double target_size = (double) map->number_of_items / SHRINK_TARGET_LOAD_FACTOR(map);
+    int64_t new_size = (int64_t) target_size + 1;
+    if (new_size < DEFAULT_INITIAL_SIZE)
+      new_size = DEFAULT_INITIAL_SIZE;
+
+    // Some engines round the capacity up, so check that the map really did shrink
+    int64_t old_size = map->current_size;
+    if (new_size < old_size)
+    {
+      resize_name_map_to_capacity(map, (size_t) new_size);
+      if (map->current_size < old_size)
+      {
+        map->shrinks++;
+        return;
+      }
+    }
+  }
+
+  double tombstone_fraction = ((double) map->number_of_tombstones) / ((double) map->current_size);
+  if (map->config.max_tombstone_fraction > 0
+      && tombstone_fraction > map->config.max_tombstone_fraction)
+  {
+    resize_name_map_to_capacity(map, (size_t) map->current_size);
+    map->tombstone_purges++;
+  }
+}
+
+/**
+ * Gets the current values of the map's counters. This is cheap enough to be called as often as
+ * needed.
+ * @param map The map.
+ * @return The counters.
+ */
+NameMapCounters get_name_map_counters(const NameMap *map)
 {
-  int removed_index = index_of(name);
+  size_t bytes_per_slot = map->name_offsets ? sizeof(uint32_t) : sizeof(char*);
+  if (map->fingerprints)
+    bytes_per_slot += sizeof(uint64_t);
+  if (map->probe_distances)
+    bytes_per_slot += sizeof(int);
+  if (map->counts)
+    bytes_per_slot += sizeof(uint64_t);
+  if (map->control_bytes)
+    bytes_per_slot += sizeof(uint8_t);
+  bytes_per_slot += (size_t) map->inline_key_words * sizeof(uint64_t);
+
+  NameMapCounters counters = {
+      .capacity = (size_t) map->current_size,
+      .live_entries = (size_t) map->number_of_items,
+      .tombstones = (size_t) map->number_of_tombstones,
+      .tombstone_purges = map->tombstone_purges,
+      .shrinks = map->shrinks,
+      .memory_bytes = sizeof(NameMap) + bytes_per_slot * (size_t) map->current_size
+  };
+  if (map->key_arena)
+    counters.memory_bytes += sizeof(KeyArena) + map->key_arena->bytes_reserved;
+  counters.memory_bytes += map->string_pool_capacity;
+  counters.memory_bytes += bloom_filter_bytes(map->bloom_filter);
+  counters.memory_bytes += bloom_filter_bytes(map->next_bloom_filter);
+  counters.filter_false_positive_rate = bloom_filter_false_positive_rate(map->bloom_filter);
+
+  // Include the storage that an incremental resize is still moving names out of
+  if (map->retiring)
+  {
+    NameMapCounters retiring = get_name_map_counters(map->retiring);
+    counters.live_entries += retiring.live_entries;
+    counters.tombstones += retiring.tombstones;
+    counters.memory_bytes += retiring.memory_bytes;
+  }
+  return counters;
+}
+
+/**
+ * Gets the number of names in the map, including any that an incremental resize hasn't yet moved.
+ * @param map The map.
+ * @return The number of names.
+ */
+size_t name_map_size(const NameMap *map)
+{
+  return (size_t) total_items(map);
+}
+
+/**
+ * Gets the number of slots in the map. While an incremental resize is in progress, this is the
+ * capacity of the new storage.
+ * @param map The map.
+ * @return The number of slots, or <code>0</code> if the map is uninitialised.
+ */
+size_t name_map_capacity(const NameMap *map)
+{
+  return (size_t) map->current_size;
+}
+
+/**
+ * Calculates the full 64-bit hash of a name, according to the map's hash policy. Unlike
+ * <code>hash_function</code>, this isn't reduced to a slot, so isn't truncated to an int.
+ * @param map The map whose hash policy (and seed) should be used.
+ * @param name The name to hash.
+ * @return The hash.
+ */
+uint64_t name_map_hash(const NameMap *map, const char *name)
+{
+  return hash_of(map, name);
+}
+
+/**
+ * Gets the first slot that a search of the map for a name would look at. This is the 64-bit
+ * equivalent of <code>hash_function</code>, and works for any map and engine.
+ * @param map The map.
+ * @param name The name.
+ * @return The index of the slot, or <code>0</code> if the map is uninitialised.
+ */
+size_t name_map_home_slot(const NameMap *map, const char *name)
+{
+  if (map->current_size == 0)
+    return 0;
+  return (size_t) map->engine->home_index(map, name, hash_of(map, name));
+}
+
+/**
+ * Finds a name and removes it from the map's storage, using whichever engine the map uses.
+ * Unlike <code>remove_from_name_map</code>, this doesn't look at any retiring map or apply any
+ * policies.
+ * @param map The map to remove the name from.
+ * @param name The value to remove from the map.
+ * @param hash The hash of the value, as given by <code>hash_of</code>.
+ * @return <code>1</code> if the value was found and removed, or <code>0</code> if the value was not
+ * found.
+ */
+int remove_name(NameMap *map, const char *name, uint64_t hash)
+{
+  int64_t removed_index = map->engine->index_of(map, name, hash);
   if (removed_index == -1)
     return 0; // Element not found so there's nothing to remove
 
+  map->engine->remove_at(map, removed_index);
+  return 1;
+}
+
+/**
+ * Removes the name in the given slot of a linear probing map by replacing it with a tombstone.
+ * @param map The map to remove the name from.
+ * @param removed_index The slot holding the name.
+ */
+static void linear_probing_remove_at(NameMap *map, int64_t removed_index)
+{
   // Deleted elements should be replaced with a tombstone to indicate that there is no longer an
   // element in this position. This is deliberately different from NULL, as a NULL pointer would
   // break the searching mechanism.
-  hash_map[removed_index] = (char*) tombstone;
+  map->hash_map[removed_index] = (char*) tombstone;
+  map->number_of_tombstones++;
 
   // We've successfully removed an element, to decrement the number of items so we can calculate the
   // new load factor on subsequent operations
-  number_of_items--;
+  map->number_of_items--;
 
-  // We could resize the map here if we wanted to but this would be computationally expensive. For
-  // now, we'll assume that optimising for speed is more important than optimising for memory
-  // utilisation.
-  return 1;
+  // We don't resize the map here, as this would be computationally expensive. If the caller would
+  // rather optimise for memory utilisation, they can ask for this in the map's config.
+}
+
+/**
+ * Removes the name from the default map. See <code>remove_from_name_map</code>.
+ * @param name The value to remove from the map.
+ * @return <code>1</code> if the value was found and removed, or <code>0</code> if the value was not
+ * found.
+ */
+int remove_from_map(const char *name)
+{
+  return remove_from_name_map(get_default_map(), name);
+}
+
+/**
+ * Checks the map's Bloom filter for a name.
+ * @param map The map.
+ * @param name The name to check for.
+ * @param hash The hash of the name, as given by <code>hash_of</code>.
+ * @return <code>false</code> if the name is definitely not in the map, or <code>true</code> if it
+ * may be (including whenever the map has no filter).
+ */
+static bool filter_may_contain(const NameMap *map, const char *name, uint64_t hash)
+{
+  if (!map->bloom_filter)
+    return true;
+  return bloom_filter_may_contain(map->bloom_filter, filter_hash_of(map, name, hash));
 }
 
 /**
  * Searches the map for the given name.
+ * @param map The map to search.
+ * @param name The value to search for.
+ * @return <code>1</code> if the name was found in the map, or <code>0</code> if not.
+ */
+int search_name_map(const NameMap *map, const char *name)
+{
+  // An uninitialised map can't contain anything (and would otherwise cause a modulo by zero)
+  if (map->current_size == 0)
+    return 0;
+
+  uint64_t hash = hash_of(map, name);
+  if (!filter_may_contain(map, name, hash))
+    return 0;
+
+  // If the index is -1 then the value could not be found. Names that an incremental resize hasn't
+  // moved yet are still in the retiring map.
+  if (map->engine->index_of(map, name, hash) != -1)
+    return 1;
+  return map->retiring && map->retiring->engine->index_of(map->retiring, name, hash) != -1;
+}
+
+/**
+ * Gets the number of times the given name has been added to the map since it was last removed.
+ * @param map The map to search.
+ * @param name The value to search for.
+ * @return The number of times the name has been added, which is <code>1</code> for any name in a
+ * map that doesn't count names, or <code>0</code> if the name isn't in the map.
+ */
+uint64_t count_in_name_map(const NameMap *map, const char *name)
+{
+  // A name is only ever in one of the two storages, so its count is never split between them
+  const NameMap *storage;
+  int64_t index = find_name(map, name, hash_of(map, name), &storage);
+  return index != -1 ? stored_count_at(storage, index) : 0;
+}
+
+/**
+ * Finds the slot holding the given name, checking the map's Bloom filter first, and then both the
+ * map's storage and any storage that an incremental resize hasn't finished moving.
+ * @param map The map to search.
+ * @param name The value to search for.
+ * @param hash The hash of the value, as given by <code>hash_of</code>.
+ * @param storage Will be set to the storage holding the name, if it was found.
+ * @return The index of the name in <code>storage</code>, or <code>-1</code> if the value is not
+ * stored in the map.
+ */
+int64_t find_name(const NameMap *map, const char *name, uint64_t hash, const NameMap **storage)
+{
+  if (map->current_size == 0 || !filter_may_contain(map, name, hash))
+    return -1;
+
+  for (*storage = map; *storage; *storage = (*storage)->retiring)
+  {
+    int64_t index = (*storage)->engine->index_of(*storage, name, hash);
+    if (index != -1)
+      return index;
+  }
+  return -1;
+}
+
+/**
+ * Searches the default map for the given name. See <code>search_name_map</code>.
  * @param name The value to search for.
  * @return <code>1</code> if the name was found in the map, or <code>0</code> if not.
  */
 int search_map(const char *name)
 {
-  // If the index is -1 then the value could not be found
-  return index_of(name) == -1 ? 0 : 1;
+  return search_name_map(get_default_map(), name);
 }
 
 /**
  * Gets the index of the given value in the map.
+ * @param map The map to search.
  * @param name The value to search for.
+ * @param hash The hash of the value, as given by <code>hash_of</code>.
  * @return The index of an entry matching <code>name</code>, or <code>-1</code> if the value is not
  * stored in the map.
  */
-static int index_of(const char *name)
+static int64_t index_of(const NameMap *map, const char *name, uint64_t hash)
 {
+  uint64_t fingerprint = fingerprint_of(map, name, hash);
+  InlineKey key;
+  if (map->inline_keys)
+    make_inline_key(map, name, &key);
+
   // Loop through the array from the hash of the name up until the first NULL entry
-  for (int index = hash_function(name); hash_map[index]; index = next_index(index))
+  for (int64_t index = index_for_hash(map, hash); map->hash_map[index];
+       index = next_index(map, index))
   {
+    // Tombstones and (if we're caching hashes) names with a different fingerprint can't possibly
+    // match, so there's no need to compare them character by character
+    if (map->hash_map[index] == tombstone
+        || (map->fingerprints && map->fingerprints[index] != fingerprint))
+      continue;
+
     // If the value at this index is equal to name, we've found a match so return that index
-    if (strcmp(name, hash_map[index]) == 0)
+    if (slot_holds_name(map, index, &key, name))
       return index;
   }
   // Return the status code -1 to indicate that the value could not be found in the map
@@ -249,22 +1285,48 @@ static int index_of(const char *name)
  * shows the implementation detail which the caller shouldn't really need to know. However, it's
  * probably suitable for coursework as it allows the assessor (hi) to easily check how map's
  * internal state.
+ * @param map The map to print.
  */
-void print_map()
+void print_name_map(const NameMap *map)
+{
+  print_slots(map);
+
+  // If an incremental resize is in progress, the names that haven't been moved yet are still in the
+  // retiring map
+  if (map->retiring)
+  {
+    printf("Resizing from: ");
+    print_slots(map->retiring);
+  }
+}
+
+/**
+ * Prints every slot in the map, separated by commas, followed by a new line.
+ * @param map The map to print.
+ */
+static void print_slots(const NameMap *map)
 {
   // Iterate through the array and print each element except for the last one. Each element is
   // proceeded by a comma
-  for (int i = 0; i < current_size-1; i++)
+  for (int64_t i = 0; i < map->current_size-1; i++)
   {
-    if (hash_map[i])
-      print_value_at_index(i);
+    map->engine->print_slot(map, i);
     printf(", ");
   }
   // Print the last element, not proceeded by a comma
-  print_value_at_index(current_size-1);
+  if (map->current_size > 0)
+    map->engine->print_slot(map, map->current_size-1);
   printf("\n");
 }
 
+/**
+ * Prints the default map. See <code>print_name_map</code>.
+ */
+void print_map()
+{
+  print_name_map(get_default_map());
+}
+
 /**
  * Prints out the value at the given index in the map. The value will be printed as follows:
  * <ul>
@@ -272,14 +1334,62 @@ void print_map()
  *   <li><b>Matches a tombstone</b>: <code>[TOMBSTONE]</code></li>
  *   <li><b>Matches a <code>NULL</code> element</b>: No value will be printed</li>
  * </ul>
+ * @param map The map to print from.
  * @param index The index in the map to print.
  */
-static void print_value_at_index(int index)
+static void print_value_at_index(const NameMap *map, int64_t index)
 {
-  if (hash_map[index])
-    printf("%s", hash_map[index] == tombstone ? "[TOMBSTONE]" : hash_map[index]);
+  if (map->hash_map[index])
+    printf("%s", map->hash_map[index] == tombstone ? "[TOMBSTONE]" : map->hash_map[index]);
+}
+
+/**
+ * Gets the name at the given index in the map.
+ * @param map The map.
+ * @param index The index in the map.
+ * @return The name, or <code>NULL</code> if the slot is empty or holds a tombstone.
+ */
+static const char *linear_probing_name_at(const NameMap *map, int64_t index)
+{
+  return map->hash_map[index] == tombstone ? NULL : map->hash_map[index];
+}
+
+/**
+ * Records the probe lengths of a linear probing map. A search for a name in the map probes every
+ * slot from the name's ideal position up to its own, while a search for a name that isn't in the
+ * map probes every slot up to and including the next empty one. The compact engine probes in the
+ * same way, so shares this.
+ * @param map The map.
+ * @param stats The statistics being gathered.
+ */
+void linear_probing_probe_lengths(const NameMap *map, NameMapStats *stats)
+{
+  int64_t size = map->current_size;
+  for (int64_t index = 0; index < size; index++)
+  {
+    if (map->engine->name_at(map, index))
+    {
+      int64_t ideal_index = index_for_hash(map, stored_hash_at(map, index));
+      record_probe_length(stats, true, (index - ideal_index + size) % size + 1);
+    }
+  }
+
+  // Walk backwards from an empty slot, counting how many slots there are before the next empty
+  // one. Without any empty slots, a miss checks every slot (and, in fact, never stops).
+  int64_t empty_index = 0;
+  while (empty_index < size && slot_in_use(map, empty_index))
+    empty_index++;
+
+  int64_t slots_before_empty = 0;
+  for (int64_t step = 0; step < size; step++)
+  {
+    int64_t index = (empty_index - step + size) % size;
+    slots_before_empty = slot_in_use(map, index) ? slots_before_empty + 1 : 0;
+    record_probe_length(stats, false, empty_index == size ? size : slots_before_empty + 1);
+  }
 }
 
+#ifndef CWK2Q3_NO_MAIN
 int main(int argc, char *argv[])
 {
   char *stringOne = "#Hello world";
@@ -313,8 +1423,9 @@ int main(int argc, char *argv[])
 
   // Clean up! No need to free the strings added to the map as (in this instance) these exist on the
   // stack so will be freed when the function completes.
-  free(hash_map);
-  hash_map = NULL;
+  free_name_map(default_map);
+  default_map = NULL;
 
   return EXIT_SUCCESS;
 }
+#endif // CWK2Q3_NO_MAIN
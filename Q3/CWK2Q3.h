@@ -1,14 +1,445 @@
 #ifndef CWK2Q3_H
 #define CWK2Q3_H
 
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+typedef struct NameMap NameMap;
+typedef struct ConcurrentNameMap ConcurrentNameMap;
+typedef struct ConcurrentNameMapSnapshot ConcurrentNameMapSnapshot;
+typedef struct FrozenNameMap FrozenNameMap;
+
+#define NAME_MAP_PROBE_BUCKETS 32
+
+/**
+ * The function used to decide where each name is stored.
+ */
+typedef enum HashPolicy
+{
+  /**
+   * The sum of the ASCII values of the name, as specified. This is the default, but spreads names
+   * poorly: every anagram of a name shares its hash, and short names cluster together.
+   */
+  HASH_POLICY_ASCII_SUM,
+
+  /**
+   * A fast, well-distributed 64-bit hash that consumes the name a word at a time.
+   */
+  HASH_POLICY_FAST,
+
+  /**
+   * As <code>HASH_POLICY_FAST</code>, but mixed with <code>NameMapConfig.hash_seed</code>. If no
+   * seed is given, a seed is chosen when the map is created. This gives different maps (and
+   * different runs) different layouts, but doesn't stop names being chosen to collide, as there
+   * are sets of names that collide whatever the seed. Use <code>HASH_POLICY_SIPHASH</code> for
+   * names that come from untrusted input.
+   */
+  HASH_POLICY_SEEDED,
+
+  /**
+   * The 64-bit FNV-1a hash.
+   */
+  HASH_POLICY_FNV1A,
+
+  /**
+   * SipHash-1-3, keyed with <code>NameMapConfig.hash_seed</code>. If no seed is given, a random
+   * seed is chosen when the map is created. Without the seed, there is no way of choosing names
+   * that collide more often than chance, so searches stay fast however the names were picked.
+   * Like <code>HASH_POLICY_FAST</code>, it consumes a name a word at a time, so costs little more
+   * for short names.
+   */
+  HASH_POLICY_SIPHASH
+} HashPolicy;
+
+/**
+ * The collision resolution scheme used by a map. Every engine supports the full interface below.
+ */
+typedef enum NameMapEngine
+{
+  /**
+   * Linear probing with an interval of 1, as specified. Removed names leave a tombstone behind,
+   * which is only cleared when the map is resized.
+   */
+  NAME_MAP_ENGINE_LINEAR_PROBING,
+
+  /**
+   * Linear probing with Robin Hood insertion: a name that is further from its ideal position takes
+   * the slot of one that is closer to its own. Removal shifts the following names back instead of
+   * leaving a tombstone, so probe lengths stay bounded under heavy insert/remove churn.
+   */
+  NAME_MAP_ENGINE_ROBIN_HOOD,
+
+  /**
+   * Slots are probed in groups of 16, guided by one control byte per slot holding a 7-bit fragment
+   * of the name's hash. A whole group's control bytes are compared at once (with SSE2 where
+   * available), so names are only loaded and compared when their fragment matches. The capacity is
+   * rounded up to a multiple of 16.
+   */
+  NAME_MAP_ENGINE_GROUP_PROBING,
+
+  /**
+   * Bucketized cuckoo hashing: each name can only be stored in one of two buckets of 4 slots,
+   * chosen by two different hashes, or in a small stash. A search checks at most those two buckets
+   * (plus the stash, if anything is in it), however full the map is, so the worst case search is
+   * as cheap as the average. Adding a name may move others to their other bucket, which is
+   * bounded, after which the name goes in the stash, or the map grows if the stash is full. Copes
+   * with load factors of 0.95 (see <code>max_load_factor</code>). The capacity is rounded up to a
+   * multiple of 4, plus the stash.
+   */
+  NAME_MAP_ENGINE_CUCKOO,
+
+  /**
+   * Linear probing, as <code>NAME_MAP_ENGINE_LINEAR_PROBING</code>, but each slot is a 4-byte
+   * offset into a single block holding every name back to back, rather than an 8-byte pointer.
+   * This halves the size of the slots, so twice as many fit in a cache line. The map always copies
+   * its names into the block (whether or not <code>own_keys</code> is set), and space used by
+   * removed names is reclaimed whenever the map is resized or compacted. The block can hold at
+   * most 4 GiB of names.
+   */
+  NAME_MAP_ENGINE_COMPACT
+} NameMapEngine;
+
+/**
+ * Options that can be given when creating a map. Use <code>default_name_map_config</code> to get a
+ * config with every option set to its default.
+ */
+typedef struct NameMapConfig
+{
+  /**
+   * If <code>true</code>, a 64-bit fingerprint of each name is stored alongside it. Names are then
+   * only compared character by character when their fingerprints match, at the cost of an extra 8
+   * bytes per slot.
+   */
+  bool cache_hashes;
+
+  /**
+   * The function used to decide where each name is stored.
+   */
+  HashPolicy hash_policy;
+
+  /**
+   * The seed used by <code>HASH_POLICY_SEEDED</code> and <code>HASH_POLICY_SIPHASH</code>. Ignored
+   * by the other policies.
+   */
+  uint64_t hash_seed;
+
+  /**
+   * The collision resolution scheme used by the map.
+   */
+  NameMapEngine engine;
+
+  /**
+   * If <code>true</code>, the map copies every name it stores into its own arena, so callers
+   * needn't keep names alive after adding them. Space used by removed names is reclaimed whenever
+   * the map is resized or compacted. Always the case for <code>NAME_MAP_ENGINE_COMPACT</code>.
+   */
+  bool own_keys;
+
+  /**
+   * If greater than <code>0</code>, the map is rehashed at its current capacity (clearing out every
+   * tombstone) as soon as a removal leaves more than this fraction of its slots holding tombstones.
+   */
+  double max_tombstone_fraction;
+
+  /**
+   * If greater than <code>0</code>, the map shrinks as soon as a removal leaves less than this
+   * fraction of its slots holding names. The new capacity puts the load factor halfway between
+   * this and the maximum, so should be well below half the maximum to avoid the map growing again
+   * soon after shrinking.
+   */
+  double min_load_factor;
+
+  /**
+   * If between <code>0</code> and <code>1</code>, the map grows as soon as more than this fraction
+   * of its slots hold names. Otherwise, the default of 0.7 is used. Higher load factors save space
+   * at the cost of longer probes, which the cuckoo engine is best able to bear.
+   */
+  double max_load_factor;
+
+  /**
+   * If greater than <code>0</code>, growing the map doesn't move every name at once. Instead, the
+   * old storage is kept alive and each subsequent add or remove moves at most this many of its
+   * slots into the new storage, bounding the cost of any single operation. Searches check both
+   * until every slot has been moved.
+   */
+  int incremental_resize_step;
+
+  /**
+   * If <code>true</code>, the map keeps a Bloom filter of its names, which searches and removals
+   * check before probing the map. Most names that aren't in the map are then rejected without
+   * comparing against any name, at the cost of around 12 bits per name the map can hold before
+   * growing. Names that are removed stay in the filter until the map is resized or compacted.
+   */
+  bool bloom_filter;
+
+  /**
+   * If <code>true</code>, the map measures the time it spends moving names when it resizes, which
+   * is reported by <code>get_name_map_stats</code>. This reads the clock around every resize (and
+   * every step of an incremental resize), so is off by default.
+   */
+  bool time_resizes;
+
+  /**
+   * If greater than <code>0</code>, each slot also holds an inline copy of names of up to this many
+   * bytes, along with their length, so that searches can compare against a slot a word at a time
+   * without following its pointer. Longer names only have their first bytes copied, so still need
+   * the pointer following to confirm a match. This is rounded up to one less than a multiple of 8
+   * (so 15 and 23 are used as they are), and is at most 63. Costs this many bytes plus one per
+   * slot.
+   */
+  int inline_key_bytes;
+
+  /**
+   * If <code>true</code>, each slot also holds the number of times its name has been added, so the
+   * map counts names rather than just removing duplicates. See <code>count_in_name_map</code> and
+   * <code>get_top_names</code>. Costs an extra 8 bytes per slot. Removing a name removes every
+   * occurrence of it.
+   */
+  bool count_names;
+} NameMapConfig;
+
+/**
+ * An operation combining the names in two maps, as done by <code>combine_name_maps</code>.
+ */
+typedef enum NameSetOperation
+{
+  /**
+   * Every name that is in either map. In a map that counts names, the counts of a name in both
+   * maps are added together.
+   */
+  NAME_SET_UNION,
+
+  /**
+   * Every name that is in both maps, with its count from the first.
+   */
+  NAME_SET_INTERSECTION,
+
+  /**
+   * Every name in the first map that isn't in the second, with its count from the first.
+   */
+  NAME_SET_DIFFERENCE
+} NameSetOperation;
+
+/**
+ * A snapshot of the counters kept by a map.
+ */
+typedef struct NameMapCounters
+{
+  /**
+   * The number of slots in the map.
+   */
+  size_t capacity;
+
+  /**
+   * The number of names in the map.
+   */
+  size_t live_entries;
+
+  /**
+   * The number of slots holding a tombstone.
+   */
+  size_t tombstones;
+
+  /**
+   * The number of times the map has been rehashed to clear out tombstones.
+   */
+  long tombstone_purges;
+
+  /**
+   * The number of times the map has shrunk.
+   */
+  long shrinks;
+
+  /**
+   * The number of bytes allocated by the map, including its arena (or, for the compact engine,
+   * its string pool) if it owns its names.
+   */
+  size_t memory_bytes;
+
+  /**
+   * If the map has a Bloom filter, the estimated chance that a name that isn't in the map passes
+   * it. Otherwise, <code>1</code>.
+   */
+  double filter_false_positive_rate;
+} NameMapCounters;
+
+/**
+ * Statistics about the shape of a map, as returned by <code>get_name_map_stats</code>. Probe
+ * lengths are counted in slots, except for the group probing engine, which counts the groups it
+ * checks, and the cuckoo engine, which counts the buckets it checks (with the stash as a third).
+ */
+typedef struct NameMapStats
+{
+  /**
+   * The number of slots in the map.
+   */
+  size_t capacity;
+
+  /**
+   * The number of names in the map.
+   */
+  size_t live_entries;
+
+  /**
+   * The number of slots holding a tombstone.
+   */
+  size_t tombstones;
+
+  /**
+   * <code>live_entries</code> divided by <code>capacity</code>.
+   */
+  double load_factor;
+
+  /**
+   * The number of names in the map whose search takes each number of probes. Bucket
+   * <code>b</code> counts the names that take from <code>2^b</code> to <code>2^(b + 1) - 1</code>
+   * probes.
+   */
+  long hit_probe_histogram[NAME_MAP_PROBE_BUCKETS];
+
+  /**
+   * The mean number of probes a search for a name in the map takes.
+   */
+  double mean_hit_probes;
+
+  /**
+   * The most probes a search for a name in the map takes.
+   */
+  size_t max_hit_probes;
+
+  /**
+   * For every slot, the number of probes a search for a name that isn't in the map takes if it
+   * starts from that slot, bucketed in the same way as <code>hit_probe_histogram</code>.
+   */
+  long miss_probe_histogram[NAME_MAP_PROBE_BUCKETS];
+
+  /**
+   * The mean number of probes a search for a name that isn't in the map takes, assuming it is
+   * equally likely to start from any slot.
+   */
+  double mean_miss_probes;
+
+  /**
+   * The most probes a search for a name that isn't in the map takes.
+   */
+  size_t max_miss_probes;
+
+  /**
+   * The length of the longest run of consecutive slots that aren't empty.
+   */
+  size_t longest_cluster;
+
+  /**
+   * The number of times the map has moved its names into new storage, including the rehashes
+   * counted by <code>NameMapCounters.tombstone_purges</code> and <code>shrinks</code>.
+   */
+  long resizes;
+
+  /**
+   * The total time spent moving names into new storage, if the map was created with
+   * <code>time_resizes</code> set. Otherwise, <code>0</code>.
+   */
+  uint64_t rehash_nanoseconds;
+} NameMapStats;
+
+/**
+ * A name and the number of times it has been added, as returned by <code>get_top_names</code>.
+ */
+typedef struct NameCount
+{
+  /**
+   * The name, which points into the map it came from.
+   */
+  const char *name;
+
+  /**
+   * The number of times the name has been added.
+   */
+  uint64_t count;
+} NameCount;
+
+// Instance-based interface. Each map is entirely independent of every other map.
+NameMapConfig default_name_map_config();
+NameMap *create_name_map(int initial_size);
+NameMap *create_name_map_with_config(int initial_size, const NameMapConfig *config);
+void free_name_map(NameMap *map);
+void resize_name_map(NameMap *map, int new_size);
+void add_to_name_map(NameMap *map, const char *name);
+int remove_from_name_map(NameMap *map, const char *name);
+int search_name_map(const NameMap *map, const char *name);
+size_t search_name_map_batch(
+    const NameMap *map, const char *const *names, size_t count, uint64_t *found);
+void print_name_map(const NameMap *map);
+void compact_name_map(NameMap *map);
+NameMapCounters get_name_map_counters(const NameMap *map);
+NameMapStats get_name_map_stats(const NameMap *map);
+int load_names_from_buffer(NameMap *map, const char *buffer, size_t length);
+int load_names_from_file(NameMap *map, const char *path);
+uint64_t hash_name(const char *name);
+
+// Counting interface, for maps created with count_names set. Delimited loading suits streams where
+// most names are repeats, so it doesn't size the map up front.
+uint64_t count_in_name_map(const NameMap *map, const char *name);
+size_t get_top_names(const NameMap *map, size_t k, NameCount *out);
+int64_t load_delimited_names_from_buffer(
+    NameMap *map, const char *buffer, size_t length, char delimiter);
+int64_t load_delimited_names_from_file(NameMap *map, const char *path, char delimiter);
+
+// 64-bit interface. As above, but capacities and counts are size_t, so maps may have more than
+// 2^31 slots. Maps created through either interface can be used with both, as long as their
+// capacity fits the int functions.
+NameMap *create_name_map_with_capacity(size_t initial_capacity, const NameMapConfig *config);
+void resize_name_map_to_capacity(NameMap *map, size_t new_capacity);
+size_t name_map_size(const NameMap *map);
+size_t name_map_capacity(const NameMap *map);
+uint64_t name_map_hash(const NameMap *map, const char *name);
+size_t name_map_home_slot(const NameMap *map, const char *name);
+
+// Parallel construction. Builds an ordinary map from many names at once, split across threads.
+NameMap *build_name_map_in_parallel(
+    const char *const *names, size_t count, int thread_count, const NameMapConfig *config);
+
+// Set operations. The result is a new map with the first map's config, sized for its names.
+NameMap *combine_name_maps(
+    const NameMap *first, const NameMap *second, NameSetOperation operation, int thread_count);
+NameMap *union_of_name_maps(const NameMap *first, const NameMap *second);
+NameMap *intersection_of_name_maps(const NameMap *first, const NameMap *second);
+NameMap *difference_of_name_maps(const NameMap *first, const NameMap *second);
+
+// Thread-safe interface. Searches take no lock, and writers only contend within a shard.
+ConcurrentNameMap *create_concurrent_name_map(
+    int initial_size, int shard_count, const NameMapConfig *config);
+void free_concurrent_name_map(ConcurrentNameMap *map);
+void add_to_concurrent_name_map(ConcurrentNameMap *map, const char *name);
+int remove_from_concurrent_name_map(ConcurrentNameMap *map, const char *name);
+int search_concurrent_name_map(ConcurrentNameMap *map, const char *name);
+int concurrent_name_map_size(ConcurrentNameMap *map);
+
+// Snapshots of a concurrent map. Taking one doesn't copy the map, and reading one takes no lock.
+ConcurrentNameMapSnapshot *snapshot_concurrent_name_map(ConcurrentNameMap *map);
+void free_concurrent_name_map_snapshot(ConcurrentNameMapSnapshot *snapshot);
+int concurrent_name_map_snapshot_size(const ConcurrentNameMapSnapshot *snapshot);
+int search_concurrent_name_map_snapshot(
+    const ConcurrentNameMapSnapshot *snapshot, const char *name);
+const char *next_in_concurrent_name_map_snapshot(
+    const ConcurrentNameMapSnapshot *snapshot, uint64_t *position);
+
+// Immutable interface. A frozen map is a read-only copy of a map, searched with a perfect hash.
+FrozenNameMap *freeze_name_map(const NameMap *map);
+void free_frozen_name_map(FrozenNameMap *map);
+int search_frozen_name_map(const FrozenNameMap *map, const char *name);
+NameMapCounters get_frozen_name_map_counters(const FrozenNameMap *map);
+int save_frozen_name_map(const FrozenNameMap *map, const char *path);
+int save_name_map(const NameMap *map, const char *path);
+FrozenNameMap *load_frozen_name_map(const char *path);
+
+// Legacy interface. These operate on a single default map.
 int hash_function(const char*);
 void resize_map(int new_size);
 void add_to_map(const char *name);
-static void add_to_map_without_resizing(const char *name);
-static int next_index(int);
 int remove_from_map(const char *name);
 int search_map(const char *name);
-static int index_of(const char*);
-static void print_value_at_index(int);
+void print_map();
 
 #endif // CWK2Q3_H
@@ -0,0 +1,157 @@
+/*
+ ============================================================================
+ Name        : CWK2Q3Arena.c
+ Description :
+ A bump allocator for the names owned by a Q3 hash map. Names are copied
+ back to back into large chunks, so there is one allocation per chunk rather
+ than one per name, and names added together sit together in memory. Space
+ is never freed name by name: removed names are only reclaimed when the map
+ compacts its arena into a fresh one.
+
+ ============================================================================
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "CWK2Q3Internal.h"
+
+#define ARENA_CHUNK_SIZE (64 * 1024)
+
+/**
+ * A single block of memory that names are copied into.
+ */
+struct ArenaChunk
+{
+  /**
+   * The chunk that was filled before this one, or <code>NULL</code> if this is the first chunk.
+   */
+  struct ArenaChunk *previous;
+
+  /**
+   * The number of bytes of <code>data</code> that have been handed out.
+   */
+  size_t used;
+
+  /**
+   * The size of <code>data</code>.
+   */
+  size_t capacity;
+
+  /**
+   * The names.
+   */
+  char data[];
+};
+
+static ArenaChunk *create_chunk(KeyArena*, size_t);
+
+/**
+ * Creates a new, empty arena.
+ * @param initial_capacity The number of bytes to reserve up front. If this is smaller than the
+ * usual chunk size, the usual chunk size is used instead.
+ * @return The arena. This must be freed with <code>free_key_arena</code>.
+ */
+KeyArena *create_key_arena(size_t initial_capacity)
+{
+  KeyArena *arena = calloc(1, sizeof(KeyArena));
+  if (!arena) {
+    printf("Failed to allocate memory for the key arena\n");
+    exit(1);
+  }
+  arena->current = create_chunk(arena, initial_capacity);
+  return arena;
+}
+
+/**
+ * Allocates a new chunk.
+ * @param arena The arena the chunk is for.
+ * @param capacity The minimum number of bytes the chunk should hold.
+ * @return The chunk.
+ */
+static ArenaChunk *create_chunk(KeyArena *arena, size_t capacity)
+{
+  if (capacity < ARENA_CHUNK_SIZE)
+    capacity = ARENA_CHUNK_SIZE;
+
+  ArenaChunk *chunk = malloc(sizeof(ArenaChunk) + capacity);
+  if (!chunk) {
+    printf("Failed to allocate memory for an arena chunk\n");
+    exit(1);
+  }
+  arena->bytes_reserved += capacity;
+  chunk->previous = NULL;
+  chunk->used = 0;
+  chunk->capacity = capacity;
+  return chunk;
+}
+
+/**
+ * Copies a name into the arena.
+ * @param arena The arena to copy the name into.
+ * @param name The name to copy.
+ * @return The copy, which lives until the arena is freed.
+ */
+char *copy_into_key_arena(KeyArena *arena, const char *name)
+{
+  return copy_bytes_into_key_arena(arena, name, strlen(name));
+}
+
+/**
+ * Copies a name that isn't null-terminated into the arena, adding a null terminator to the copy.
+ * @param arena The arena to copy the name into.
+ * @param name The name to copy.
+ * @param length The number of bytes in the name.
+ * @return The copy, which lives until the arena is freed.
+ */
+char *copy_bytes_into_key_arena(KeyArena *arena, const char *name, size_t length)
+{
+  size_t size = length + 1;
+
+  // Start a new chunk if there isn't room in the current one. A name bigger than a whole chunk gets
+  // a chunk to itself.
+  if (arena->current->capacity - arena->current->used < size)
+  {
+    ArenaChunk *chunk = create_chunk(arena, size);
+    chunk->previous = arena->current;
+    arena->current = chunk;
+  }
+
+  char *copy = &arena->current->data[arena->current->used];
+  memcpy(copy, name, length);
+  copy[length] = '\0';
+  arena->current->used += size;
+  arena->bytes_used += size;
+  return copy;
+}
+
+/**
+ * Hands back the space used by the most recent copy, e.g. if it turned out to be a duplicate.
+ * @param arena The arena the copy was made in.
+ * @param copy The value returned by the most recent call to <code>copy_into_key_arena</code>.
+ */
+void release_last_from_key_arena(KeyArena *arena, const char *copy)
+{
+  size_t size = strlen(copy) + 1;
+  arena->current->used -= size;
+  arena->bytes_used -= size;
+}
+
+/**
+ * Frees the arena and every name in it.
+ * @param arena The arena to free. May be <code>NULL</code>, in which case nothing happens.
+ */
+void free_key_arena(KeyArena *arena)
+{
+  if (!arena)
+    return;
+
+  ArenaChunk *chunk = arena->current;
+  while (chunk)
+  {
+    ArenaChunk *previous = chunk->previous;
+    free(chunk);
+    chunk = previous;
+  }
+  free(arena);
+}
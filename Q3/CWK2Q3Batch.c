@@ -0,0 +1,189 @@
+/*
+ ============================================================================
+ Name        : CWK2Q3Batch.c
+ Description :
+ Batched searches of a Q3 hash map. Searching for names one at a time waits
+ for each cache miss in turn: first for the name being searched for, then
+ for its home slot, then for the name stored there. Once the map is much
+ larger than the cache, that waiting is almost all of the cost of a search.
+
+ A batch search instead runs the names through a software pipeline. While
+ one name is being resolved, the names behind it are at earlier stages, each
+ of which only starts loading memory that a later stage will need:
+
+    1. prefetch the name being searched for
+    2. hash it, and prefetch its home slot (and its Bloom filter block)
+    3. check the filter, and prefetch the name stored in the home slot
+    4. search the map as usual, by which point it is hopefully all cached
+
+ so that several cache misses are always in flight at once. The results are
+ returned as a bitmap, with one bit per name searched for.
+
+ ============================================================================
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "CWK2Q3Internal.h"
+
+// The number of names between each stage of the pipeline. Each stage has this long for the memory
+// it prefetched to arrive before the next stage needs it.
+#define BATCH_PREFETCH_DISTANCE 8
+#define BATCH_STAGES 4
+// A power of two that can hold every name between the first and last stages
+#define BATCH_WINDOW 32
+
+/**
+ * The progress of a name through the pipeline.
+ */
+typedef struct PendingSearch
+{
+  /**
+   * The hash of the name, as given by <code>hash_of</code>.
+   */
+  uint64_t hash;
+
+  /**
+   * The first slot that searching for the name looks at.
+   */
+  int64_t home_index;
+
+  /**
+   * The hash of the name used by the map's Bloom filter, if the map has one.
+   */
+  uint64_t filter_hash;
+
+  /**
+   * Whether the Bloom filter has ruled out the name being in the map.
+   */
+  bool rejected;
+} PendingSearch;
+
+static void start_search(const NameMap*, const char*, PendingSearch*);
+static void prefetch_candidate(const NameMap*, PendingSearch*);
+static int finish_search(const NameMap*, const char*, const PendingSearch*);
+
+/**
+ * Searches the map for each of the given names. This gives the same results as calling
+ * <code>search_name_map</code> for each name, but overlaps the cache misses of different names, so
+ * is much faster for large maps.
+ * @param map The map to search.
+ * @param names The names to search for.
+ * @param count The number of names in <code>names</code>.
+ * @param found A bitmap of at least <code>(count + 63) / 64</code> words, which is overwritten.
+ * Bit <code>i % 64</code> of word <code>i / 64</code> is set if <code>names[i]</code> was found in
+ * the map.
+ * @return The number of names that were found.
+ */
+size_t search_name_map_batch(
+    const NameMap *map, const char *const *names, size_t count, uint64_t *found
+)
+{
+  memset(found, 0, (count + 63) / 64 * sizeof(uint64_t));
+
+  // An uninitialised map can't contain anything (and would otherwise cause a modulo by zero)
+  if (map->current_size == 0)
+    return 0;
+
+  PendingSearch pending[BATCH_WINDOW];
+  size_t total = 0;
+
+  // Each iteration advances every name in the pipeline by one stage, with stage s handling the name
+  // s * BATCH_PREFETCH_DISTANCE places behind the newest one
+  size_t drain = (BATCH_STAGES - 1) * BATCH_PREFETCH_DISTANCE;
+  for (size_t newest = 0; newest < count + drain; newest++)
+  {
+    if (newest < count)
+      __builtin_prefetch(names[newest]);
+
+    size_t i = newest - BATCH_PREFETCH_DISTANCE;
+    if (newest >= BATCH_PREFETCH_DISTANCE && i < count)
+      start_search(map, names[i], &pending[i % BATCH_WINDOW]);
+
+    i -= BATCH_PREFETCH_DISTANCE;
+    if (newest >= 2 * BATCH_PREFETCH_DISTANCE && i < count)
+      prefetch_candidate(map, &pending[i % BATCH_WINDOW]);
+
+    i -= BATCH_PREFETCH_DISTANCE;
+    if (newest >= drain && i < count && finish_search(map, names[i], &pending[i % BATCH_WINDOW]))
+    {
+      found[i / 64] |= 1ULL << (i % 64);
+      total++;
+    }
+  }
+  return total;
+}
+
+/**
+ * Hashes a name, and starts loading the memory needed to check its home slot.
+ * @param map The map being searched.
+ * @param name The name being searched for.
+ * @param search Where to record the name's progress.
+ */
+static void start_search(const NameMap *map, const char *name, PendingSearch *search)
+{
+  search->hash = hash_of(map, name);
+  search->home_index = map->engine->home_index(map, name, search->hash);
+  search->rejected = false;
+
+  if (map->bloom_filter)
+  {
+    search->filter_hash = filter_hash_of(map, name, search->hash);
+    prefetch_bloom_filter(map->bloom_filter, search->filter_hash);
+  }
+
+  // Only the newer storage is prefetched during an incremental resize. Names that haven't been
+  // moved yet are still found, but without the benefit of prefetching.
+  int64_t index = search->home_index;
+  if (map->name_offsets)
+    __builtin_prefetch(&map->name_offsets[index]);
+  else
+    __builtin_prefetch(&map->hash_map[index]);
+  if (map->fingerprints)
+    __builtin_prefetch(&map->fingerprints[index]);
+  if (map->probe_distances)
+    __builtin_prefetch(&map->probe_distances[index]);
+  if (map->control_bytes)
+    __builtin_prefetch(&map->control_bytes[index]);
+  if (map->inline_keys)
+    __builtin_prefetch(&map->inline_keys[(size_t) index * map->inline_key_words]);
+}
+
+/**
+ * Checks a name against the Bloom filter, and if it passes, starts loading the name stored in its
+ * home slot, which is the one most likely to be compared against.
+ * @param map The map being searched.
+ * @param search The name's progress.
+ */
+static void prefetch_candidate(const NameMap *map, PendingSearch *search)
+{
+  if (map->bloom_filter && !bloom_filter_may_contain(map->bloom_filter, search->filter_hash))
+  {
+    search->rejected = true;
+    return;
+  }
+
+  // Inline keys are compared without following the slot's pointer, and were prefetched along with
+  // the slot. Otherwise, prefetching never faults, so it doesn't matter if the slot is empty or
+  // holds a tombstone (which, for the compact engine, points at the start of its string pool).
+  if (!map->inline_keys)
+    __builtin_prefetch(slot_name(map, search->home_index));
+}
+
+/**
+ * Finishes searching for a name.
+ * @param map The map being searched.
+ * @param name The name being searched for.
+ * @param search The name's progress.
+ * @return <code>1</code> if the name was found in the map, or <code>0</code> if not.
+ */
+static int finish_search(const NameMap *map, const char *name, const PendingSearch *search)
+{
+  if (search->rejected)
+    return 0;
+
+  if (map->engine->index_of(map, name, search->hash) != -1)
+    return 1;
+  return map->retiring && map->retiring->engine->index_of(map->retiring, name, search->hash) != -1;
+}
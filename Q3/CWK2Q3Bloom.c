@@ -0,0 +1,231 @@
+/*
+ ============================================================================
+ Name        : CWK2Q3Bloom.c
+ Description :
+ An optional Bloom filter in front of a Q3 hash map, so that most searches
+ and removals of names that aren't in the map return without probing it.
+
+ The filter is "blocked": a name's bits all fall in a single 64-byte block,
+ so checking a name touches one cache line, however many bits it sets. Each
+ block is split into eight 64-bit words, and a name sets one bit in each word
+ (as in the split block Bloom filters used by Impala and Parquet).
+
+ A Bloom filter can't forget a name, so removed names leave their bits set
+ and the false positive rate creeps up until the map is next resized or
+ compacted, at which point the filter is rebuilt from the names still in the
+ map. While an incremental resize is running, a second filter sized for the
+ new storage is filled in as names are moved, and replaces the first once
+ every name has been moved.
+
+ ============================================================================
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "CWK2Q3Internal.h"
+
+#define BLOOM_BITS_PER_NAME 12
+#define BLOOM_WORDS_PER_BLOCK 8
+#define BLOOM_BLOCK_BYTES (BLOOM_WORDS_PER_BLOCK * sizeof(uint64_t))
+
+/**
+ * A blocked Bloom filter of name hashes.
+ */
+struct BloomFilter
+{
+  /**
+   * The bits of the filter, <code>BLOOM_WORDS_PER_BLOCK</code> words per block.
+   */
+  uint64_t *words;
+
+  /**
+   * The number of blocks in the filter.
+   */
+  size_t block_count;
+};
+
+// Odd multipliers that pick a different bit of each word from the same 32 bits of hash
+static const uint32_t bloom_salts[BLOOM_WORDS_PER_BLOCK] = {
+    0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+    0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U
+};
+
+static const uint64_t *block_for(const BloomFilter*, uint64_t);
+
+/**
+ * Creates an empty filter.
+ * @param expected_names The number of names that the filter should be sized for.
+ * @return The filter. This must be freed with <code>free_bloom_filter</code>.
+ */
+BloomFilter *create_bloom_filter(size_t expected_names)
+{
+  BloomFilter *filter = malloc(sizeof(BloomFilter));
+  if (!filter) {
+    printf("Failed to allocate memory for the Bloom filter\n");
+    exit(1);
+  }
+
+  size_t bits = (expected_names > 0 ? expected_names : 1) * BLOOM_BITS_PER_NAME;
+  filter->block_count = (bits + BLOOM_BLOCK_BYTES * 8 - 1) / (BLOOM_BLOCK_BYTES * 8);
+
+  // Align the blocks to cache lines, so that checking a name only ever touches one line
+  filter->words = aligned_alloc(BLOOM_BLOCK_BYTES, filter->block_count * BLOOM_BLOCK_BYTES);
+  if (!filter->words) {
+    printf("Failed to allocate memory for the Bloom filter\n");
+    exit(1);
+  }
+  memset(filter->words, 0, filter->block_count * BLOOM_BLOCK_BYTES);
+  return filter;
+}
+
+/**
+ * Frees a filter.
+ * @param filter The filter to free. May be <code>NULL</code>, in which case nothing happens.
+ */
+void free_bloom_filter(BloomFilter *filter)
+{
+  if (!filter)
+    return;
+
+  free(filter->words);
+  free(filter);
+}
+
+/**
+ * Gets the block of the filter that a name's bits fall in.
+ * @param filter The filter.
+ * @param hash The name's hash, as given by <code>filter_hash_of</code>. The top 32 bits select the
+ * block, and the bottom 32 bits select the bits within it.
+ * @return The first word of the block.
+ */
+static const uint64_t *block_for(const BloomFilter *filter, uint64_t hash)
+{
+  size_t block = (size_t) (((hash >> 32) * (uint64_t) filter->block_count) >> 32);
+  return &filter->words[block * BLOOM_WORDS_PER_BLOCK];
+}
+
+/**
+ * Adds a name to a filter.
+ * @param filter The filter.
+ * @param hash The name's hash, as given by <code>filter_hash_of</code>.
+ */
+void add_to_bloom_filter(BloomFilter *filter, uint64_t hash)
+{
+  uint64_t *block = (uint64_t*) block_for(filter, hash);
+  for (int i = 0; i < BLOOM_WORDS_PER_BLOCK; i++)
+    block[i] |= 1ULL << (((uint32_t) hash * bloom_salts[i]) >> 26);
+}
+
+/**
+ * Checks whether a name may have been added to a filter.
+ * @param filter The filter.
+ * @param hash The name's hash, as given by <code>filter_hash_of</code>.
+ * @return <code>false</code> if the name has definitely not been added, or <code>true</code> if it
+ * may have been.
+ */
+bool bloom_filter_may_contain(const BloomFilter *filter, uint64_t hash)
+{
+  const uint64_t *block = block_for(filter, hash);
+  for (int i = 0; i < BLOOM_WORDS_PER_BLOCK; i++)
+  {
+    if (!(block[i] & (1ULL << (((uint32_t) hash * bloom_salts[i]) >> 26))))
+      return false;
+  }
+  return true;
+}
+
+/**
+ * Starts loading the block that a name's bits fall in into the cache, so that a later call to
+ * <code>bloom_filter_may_contain</code> doesn't have to wait for it.
+ * @param filter The filter.
+ * @param hash The name's hash, as given by <code>filter_hash_of</code>.
+ */
+void prefetch_bloom_filter(const BloomFilter *filter, uint64_t hash)
+{
+  __builtin_prefetch(block_for(filter, hash));
+}
+
+/**
+ * Gets the number of bytes allocated by a filter.
+ * @param filter The filter. May be <code>NULL</code>.
+ * @return The number of bytes.
+ */
+size_t bloom_filter_bytes(const BloomFilter *filter)
+{
+  return filter ? sizeof(BloomFilter) + filter->block_count * BLOOM_BLOCK_BYTES : 0;
+}
+
+/**
+ * Estimates the chance that a name that was never added passes the filter, from the fraction of
+ * bits set in each word.
+ * @param filter The filter. May be <code>NULL</code>, in which case every name passes.
+ * @return The estimated false positive rate.
+ */
+double bloom_filter_false_positive_rate(const BloomFilter *filter)
+{
+  if (!filter)
+    return 1;
+
+  double total = 0;
+  for (size_t block = 0; block < filter->block_count; block++)
+  {
+    // A name passes if the bit it checks in every word is set
+    double pass = 1;
+    for (int i = 0; i < BLOOM_WORDS_PER_BLOCK; i++)
+    {
+      int set_bits = 0;
+      for (uint64_t word = filter->words[block * BLOOM_WORDS_PER_BLOCK + i]; word; word &= word - 1)
+        set_bits++;
+      pass *= set_bits / 64.0;
+    }
+    total += pass;
+  }
+  return total / (double) filter->block_count;
+}
+
+/**
+ * Adds a name that has just been added to the map to the map's filters, including the filter being
+ * built for an incremental resize.
+ * @param map The map.
+ * @param name The name.
+ * @param hash The name's hash, as given by <code>hash_of</code>.
+ */
+void add_name_to_bloom_filters(NameMap *map, const char *name, uint64_t hash)
+{
+  if (!map->bloom_filter)
+    return;
+
+  uint64_t filter_hash = filter_hash_of(map, name, hash);
+  add_to_bloom_filter(map->bloom_filter, filter_hash);
+  if (map->next_bloom_filter)
+    add_to_bloom_filter(map->next_bloom_filter, filter_hash);
+}
+
+/**
+ * Replaces the map's filter with one sized for its current capacity, holding only the names still
+ * in the map (including any that an incremental resize hasn't moved yet). Nothing happens if the
+ * map wasn't created with <code>bloom_filter</code> set.
+ * @param map The map.
+ */
+void rebuild_bloom_filter(NameMap *map)
+{
+  if (!map->config.bloom_filter)
+    return;
+
+  free_bloom_filter(map->bloom_filter);
+  double expected_names = (double) map->current_size * max_load_factor_of(map);
+  map->bloom_filter = create_bloom_filter((size_t) expected_names);
+  for (NameMap *storage = map; storage; storage = storage->retiring)
+  {
+    for (int64_t i = 0; i < storage->current_size; i++)
+    {
+      const char *name = storage->engine->name_at(storage, i);
+      if (name)
+      {
+        uint64_t filter_hash = filter_hash_of(map, name, stored_hash_at(storage, i));
+        add_to_bloom_filter(map->bloom_filter, filter_hash);
+      }
+    }
+  }
+}
@@ -0,0 +1,343 @@
+/*
+ ============================================================================
+ Name        : CWK2Q3Compact.c
+ Description :
+ A compact table engine for the Q3 hash map. Names are stored by linear
+ probing with an interval of 1, exactly as by the default engine, but every
+ slot is a 32-bit offset into a string pool rather than a 64-bit pointer:
+
+    name_offsets:  | 0 | 7 | 1 | 2 | 0 | ...
+    string_pool:   |\0|\0|MARY\0|LINDA\0|...
+                    0  1  2      7       ...
+
+ Offset 0 marks an empty slot and offset 1 a tombstone, which is why the
+ first two bytes of the pool are reserved. So the slots take half the space,
+ and each cache line holds 16 slots rather than 8, which matters once the
+ table is much larger than the cache: a probe over a cluster touches half as
+ many lines.
+
+ Every name is copied into the pool as it is inserted, back to back, so the
+ names are as densely packed as in an arena, without the 8-byte pointer to
+ each one. Removed names are left in the pool until the map is resized or
+ compacted, when the live names are copied into a fresh pool in slot order.
+ Resizing doesn't move the names themselves, only their offsets.
+
+ ============================================================================
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "CWK2Q3Internal.h"
+
+// The first offset that can hold a name, after the reserved offsets
+#define COMPACT_FIRST_OFFSET 2
+#define STRING_POOL_INITIAL_CAPACITY 4096
+
+static void compact_resize(NameMap*, int64_t);
+static void compact_insert(NameMap*, const char*, uint64_t, uint64_t, uint64_t);
+static void place_offset(NameMap*, uint32_t, uint64_t, uint64_t, uint64_t);
+static void compact_remove_at(NameMap*, int64_t);
+static int64_t compact_index_of(const NameMap*, const char*, uint64_t);
+static void compact_print_slot(const NameMap*, int64_t);
+static const char *compact_name_at(const NameMap*, int64_t);
+static void compact_free_storage(NameMap*);
+static void compact_string_pool(NameMap*);
+static void reserve_string_pool(NameMap*, size_t);
+static uint32_t copy_into_string_pool(NameMap*, const char*);
+
+const NameMapEngineOps compact_engine = {
+    .resize = compact_resize,
+    .insert = compact_insert,
+    .remove_at = compact_remove_at,
+    .index_of = compact_index_of,
+    .home_index = home_index_for_hash,
+    .collect_probe_lengths = linear_probing_probe_lengths,
+    .print_slot = compact_print_slot,
+    .name_at = compact_name_at,
+    .free_storage = compact_free_storage,
+    .compact_names = compact_string_pool
+};
+
+/**
+ * Moves the offset of every name into new slots of the given size. The names stay where they are
+ * in the pool.
+ * @param map The map to resize.
+ * @param new_size The new capacity of the map.
+ */
+static void compact_resize(NameMap *map, int64_t new_size)
+{
+  // Keep a copy of the old map so we can move the offsets over once the new slots are allocated.
+  // The pool belongs to both until then.
+  NameMap old = *map;
+  allocate_slots(map, new_size);
+  reserve_string_pool(map, 0);
+
+  // Every name is already unique, so each just goes in the first free slot from its ideal position
+  for (int64_t i = 0; i < old.current_size; i++)
+  {
+    if (old.name_offsets[i] > COMPACT_SLOT_TOMBSTONE)
+    {
+      place_offset(
+          map, old.name_offsets[i], stored_hash_at(&old, i),
+          old.fingerprints ? old.fingerprints[i] : 0, stored_count_at(&old, i)
+      );
+    }
+  }
+
+  free_slots(&old);
+}
+
+/**
+ * Adds a name to the map, copying it into the pool, unless an equivalent name is already present.
+ * This does not grow the map, so there must be at least one empty slot.
+ * @param map The map to add the name to.
+ * @param name The value to add to the map. This mustn't point into the map's own pool, which may
+ * move as the name is copied in.
+ * @param hash The hash of <code>name</code>, as given by <code>hash_of</code>.
+ * @param fingerprint The fingerprint of <code>name</code>, as given by <code>fingerprint_of</code>.
+ * @param count If the map counts names, the count to store with the name, or to add to the count
+ * of the equivalent name if there is one.
+ */
+static void compact_insert(
+    NameMap *map, const char *name, uint64_t hash, uint64_t fingerprint, uint64_t count
+)
+{
+  int64_t index = index_for_hash(map, hash);
+  InlineKey key;
+  if (map->inline_keys)
+    make_inline_key(map, name, &key);
+
+  // As with the default engine, the name can go in the first tombstone, but only once we've made
+  // sure that it isn't further along
+  int64_t first_tombstone_index = -1;
+  while (map->name_offsets[index] != COMPACT_SLOT_EMPTY)
+  {
+    if (map->name_offsets[index] == COMPACT_SLOT_TOMBSTONE)
+    {
+      if (first_tombstone_index == -1)
+        first_tombstone_index = index;
+    }
+    else if ((!map->fingerprints || map->fingerprints[index] == fingerprint)
+             && slot_holds_name(map, index, &key, name))
+    {
+      if (map->counts)
+        map->counts[index] += count;
+      return;
+    }
+
+    index = next_index(map, index);
+  }
+
+  if (first_tombstone_index != -1)
+  {
+    index = first_tombstone_index;
+    map->number_of_tombstones--;
+  }
+  map->name_offsets[index] = copy_into_string_pool(map, name);
+  if (map->fingerprints)
+    map->fingerprints[index] = fingerprint;
+  if (map->inline_keys)
+    store_inline_key(map, index, &key);
+  if (map->counts)
+    map->counts[index] = count;
+  map->number_of_items++;
+}
+
+/**
+ * Stores the offset of a name that is already in the pool, and known not to be in the slots, in
+ * the first empty slot from its ideal position.
+ * @param map The map.
+ * @param offset The offset of the name in the pool.
+ * @param hash The hash of the name, as given by <code>hash_of</code>.
+ * @param fingerprint The fingerprint of the name, as given by <code>fingerprint_of</code>.
+ * @param count If the map counts names, the name's count.
+ */
+static void place_offset(
+    NameMap *map, uint32_t offset, uint64_t hash, uint64_t fingerprint, uint64_t count
+)
+{
+  int64_t index = index_for_hash(map, hash);
+  while (map->name_offsets[index] != COMPACT_SLOT_EMPTY)
+    index = next_index(map, index);
+
+  map->name_offsets[index] = offset;
+  if (map->fingerprints)
+    map->fingerprints[index] = fingerprint;
+  if (map->inline_keys)
+  {
+    InlineKey key;
+    make_inline_key(map, map->string_pool + offset, &key);
+    store_inline_key(map, index, &key);
+  }
+  if (map->counts)
+    map->counts[index] = count;
+  map->number_of_items++;
+}
+
+/**
+ * Removes the name in the given slot by replacing its offset with a tombstone. The name itself
+ * stays in the pool until the map is next resized or compacted.
+ * @param map The map to remove the name from.
+ * @param index The slot holding the name.
+ */
+static void compact_remove_at(NameMap *map, int64_t index)
+{
+  map->name_offsets[index] = COMPACT_SLOT_TOMBSTONE;
+  map->number_of_tombstones++;
+  map->number_of_items--;
+}
+
+/**
+ * Gets the index of the given value in the map.
+ * @param map The map to search.
+ * @param name The value to search for.
+ * @param hash The hash of the value, as given by <code>hash_of</code>.
+ * @return The index of an entry matching <code>name</code>, or <code>-1</code> if the value is not
+ * stored in the map.
+ */
+static int64_t compact_index_of(const NameMap *map, const char *name, uint64_t hash)
+{
+  uint64_t fingerprint = fingerprint_of(map, name, hash);
+  InlineKey key;
+  if (map->inline_keys)
+    make_inline_key(map, name, &key);
+
+  for (int64_t index = index_for_hash(map, hash); map->name_offsets[index] != COMPACT_SLOT_EMPTY;
+       index = next_index(map, index))
+  {
+    if (map->name_offsets[index] == COMPACT_SLOT_TOMBSTONE
+        || (map->fingerprints && map->fingerprints[index] != fingerprint))
+      continue;
+
+    if (slot_holds_name(map, index, &key, name))
+      return index;
+  }
+  return -1;
+}
+
+/**
+ * Prints the name in a slot, or <code>[TOMBSTONE]</code>, printing nothing for an empty slot.
+ * @param map The map to print from.
+ * @param index The index in the map to print.
+ */
+static void compact_print_slot(const NameMap *map, int64_t index)
+{
+  uint32_t offset = map->name_offsets[index];
+  if (offset != COMPACT_SLOT_EMPTY)
+    printf("%s", offset == COMPACT_SLOT_TOMBSTONE ? "[TOMBSTONE]" : map->string_pool + offset);
+}
+
+/**
+ * Gets the name at the given index in the map.
+ * @param map The map.
+ * @param index The index in the map.
+ * @return The name, which points into the pool, or <code>NULL</code> if the slot is empty or holds
+ * a tombstone.
+ */
+static const char *compact_name_at(const NameMap *map, int64_t index)
+{
+  uint32_t offset = map->name_offsets[index];
+  return offset > COMPACT_SLOT_TOMBSTONE ? map->string_pool + offset : NULL;
+}
+
+/**
+ * Frees the map's pool, and so every name in it.
+ * @param map The map (or a copy of the map) whose pool should be freed.
+ */
+static void compact_free_storage(NameMap *map)
+{
+  free(map->string_pool);
+  map->string_pool = NULL;
+  map->string_pool_used = 0;
+  map->string_pool_capacity = 0;
+}
+
+/**
+ * Reclaims the pool space used by names that have since been removed, by copying every live name
+ * into a fresh pool, sized to fit. The copies end up contiguous, in slot order.
+ * @param map The map to compact.
+ */
+static void compact_string_pool(NameMap *map)
+{
+  if (!map->string_pool)
+    return;
+
+  size_t live_bytes = 0;
+  for (int64_t i = 0; i < map->current_size; i++)
+  {
+    const char *name = compact_name_at(map, i);
+    if (name)
+      live_bytes += strlen(name) + 1;
+  }
+
+  char *old_pool = map->string_pool;
+  map->string_pool = NULL;
+  map->string_pool_used = 0;
+  map->string_pool_capacity = 0;
+  reserve_string_pool(map, live_bytes);
+
+  for (int64_t i = 0; i < map->current_size; i++)
+  {
+    if (map->name_offsets[i] > COMPACT_SLOT_TOMBSTONE)
+      map->name_offsets[i] = copy_into_string_pool(map, old_pool + map->name_offsets[i]);
+  }
+  free(old_pool);
+}
+
+/**
+ * Makes sure the map's pool has room for the given number of extra bytes, creating the pool if
+ * the map doesn't have one yet. The pool grows by at least half whenever it grows, so copying names
+ * in one at a time takes amortised constant time, without leaving as much of it unused as doubling
+ * would.
+ * @param map The map.
+ * @param extra_bytes The number of bytes about to be copied in.
+ */
+static void reserve_string_pool(NameMap *map, size_t extra_bytes)
+{
+  // A new pool starts with the reserved offsets, which are zeroed so that they read as empty names
+  size_t used = map->string_pool ? map->string_pool_used : COMPACT_FIRST_OFFSET;
+  size_t required = used + extra_bytes;
+  if (required > UINT32_MAX) {
+    printf("Too many bytes of names for a compact map\n");
+    exit(1);
+  }
+  if (map->string_pool && required <= map->string_pool_capacity)
+    return;
+
+  size_t capacity = map->string_pool_capacity + map->string_pool_capacity / 2;
+  if (capacity < STRING_POOL_INITIAL_CAPACITY)
+    capacity = STRING_POOL_INITIAL_CAPACITY;
+  if (capacity < required)
+    capacity = required;
+  if (capacity > UINT32_MAX)
+    capacity = UINT32_MAX;
+
+  char *pool = realloc(map->string_pool, capacity);
+  if (!pool) {
+    printf("Failed to allocate memory for the string pool\n");
+    exit(1);
+  }
+  if (!map->string_pool)
+    memset(pool, 0, COMPACT_FIRST_OFFSET);
+  map->string_pool = pool;
+  map->string_pool_used = used;
+  map->string_pool_capacity = capacity;
+}
+
+/**
+ * Copies a name onto the end of the map's pool.
+ * @param map The map.
+ * @param name The name to copy.
+ * @return The offset of the copy within the pool.
+ */
+static uint32_t copy_into_string_pool(NameMap *map, const char *name)
+{
+  size_t size = strlen(name) + 1;
+  reserve_string_pool(map, size);
+
+  uint32_t offset = (uint32_t) map->string_pool_used;
+  memcpy(map->string_pool + offset, name, size);
+  map->string_pool_used += size;
+  return offset;
+}
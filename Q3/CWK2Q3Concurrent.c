@@ -0,0 +1,1041 @@
+/*
+ ============================================================================
+ Name        : CWK2Q3Concurrent.c
+ Description :
+ A thread-safe variant of the Q3 hash map. Names are split between a number
+ of shards by the top bits of their hash, and each shard is an open
+ addressing table with linear probing.
+
+ Writers (add and remove) take the lock of the shard that the name belongs
+ to, so writers only contend when they touch the same shard. Readers take no
+ lock at all. This works because a writer never moves a name that is already
+ in a table: an add publishes the name into an empty slot, and a remove
+ overwrites it with a tombstone, so a reader probing the table concurrently
+ sees every slot either before or after the change, never in between.
+
+ Growing a shard (or clearing out its tombstones) builds a whole new table
+ and publishes it with a single atomic store. Readers that loaded the old
+ table keep using it, so it can't be freed straight away. Instead, each
+ reader records the map's epoch in its own slot while it is reading, and a
+ retired table is only freed once no reader is still in an epoch from
+ before it was retired. There are 256 reader slots, shared by every map. A
+ thread keeps its slot until it exits, when the slot is given back for reuse,
+ so only threads beyond the 256th running at once have to search under the
+ shard's lock.
+
+ The map always owns its names, as a reader may still be comparing against
+ a name after a writer has removed it. Removed names are reclaimed along
+ with the table that they were stored in.
+
+ Each table's slots are split into pages of 256, so that a snapshot of the
+ map can share them rather than copying them:
+
+    snapshot:  table A -> [ page 0 ][ page 1 ][ page 2 ]
+                               |                   |
+    live map:  table B -> [ page 0 ][ page 1'][ page 2 ]
+
+ Here, a name has been added to page 1 since the snapshot was taken, while
+ pages 0 and 2 are still shared.
+
+ Taking a snapshot holds every shard's lock for just long enough to record
+ each shard's table, which costs the same however many names the map holds.
+ A table held by a snapshot is never written to again: the next write to
+ the shard first replaces it with a new table sharing all of its pages, and
+ a write to a page that is still shared first copies that page alone. So a
+ snapshot only costs memory for the pages that have been written to since
+ it was taken, and reading it needs no lock, as nothing it holds can change.
+
+ ============================================================================
+*/
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "CWK2Q3Internal.h"
+
+#define DEFAULT_SHARD_COUNT 64
+#define MIN_SHARD_CAPACITY 16
+#define MAX_READERS 256
+#define CACHE_LINE_SIZE 64
+#define SHARD_PAGE_BITS 8
+#define SHARD_PAGE_SLOTS (1 << SHARD_PAGE_BITS)
+
+/**
+ * A single slot of a table. Aligned to its size, so that no slot straddles two cache lines.
+ */
+typedef struct ShardSlot
+{
+  /**
+   * The name in the slot. Empty slots are <code>NULL</code> and removed names are replaced with
+   * <code>table_tombstone</code>.
+   */
+  _Alignas(16) _Atomic(const char*) name;
+
+  /**
+   * The hash of the name in the slot. This is always written before the name is published.
+   */
+  _Atomic uint64_t hash;
+} ShardSlot;
+
+/**
+ * A run of consecutive slots in a table. A page may be shared by a table and the tables of any
+ * snapshots of the shard.
+ */
+typedef struct ShardPage
+{
+  /**
+   * The number of tables using the page. A page used by more than one table is never written to:
+   * a table that needs to change it replaces it with a copy first. Only accessed with the shard's
+   * lock held.
+   */
+  int tables;
+
+  /**
+   * The slots. There are <code>SHARD_PAGE_SLOTS</code> of these, or the capacity of the table if
+   * that is smaller.
+   */
+  ShardSlot slots[];
+} ShardPage;
+
+/**
+ * The arena holding the names of a table, shared with any tables whose pages are shared with it.
+ */
+typedef struct SharedKeyArena
+{
+  /**
+   * The names.
+   */
+  KeyArena *arena;
+
+  /**
+   * The number of tables using the arena. Only accessed with the shard's lock held.
+   */
+  int tables;
+} SharedKeyArena;
+
+/**
+ * A single open addressing table, holding the names in one shard. The capacity never changes
+ * once the table has been published: a shard grows by replacing its table.
+ */
+typedef struct ShardTable
+{
+  /**
+   * The pages holding the slots, in order, so that slot <code>i</code> is in page
+   * <code>i / SHARD_PAGE_SLOTS</code>. A shared page is only ever replaced by a copy of itself, so
+   * a reader sees every slot of the page either before or after the change.
+   */
+  _Atomic(ShardPage*) *pages;
+
+  /**
+   * The number of slots in the table. Always a power of two.
+   */
+  int capacity;
+
+  /**
+   * Every name added to the table is a copy held in this arena.
+   */
+  SharedKeyArena *key_arena;
+
+  /**
+   * The number of snapshots holding the table. A table with snapshots is never written to, and
+   * isn't freed until they have all been freed. Only accessed with the shard's lock held.
+   */
+  int snapshots;
+
+  /**
+   * Once the table has been replaced, the value of the map's epoch when this happened.
+   */
+  uint64_t retire_epoch;
+
+  /**
+   * The next table in the shard's list of retired tables.
+   */
+  struct ShardTable *next_retired;
+} ShardTable;
+
+/**
+ * One shard of the map. Padded to a cache line so that writers on different shards don't share
+ * one.
+ */
+typedef struct Shard
+{
+  /**
+   * The table currently holding the shard's names. Readers load this without taking the lock.
+   */
+  _Alignas(CACHE_LINE_SIZE) _Atomic(ShardTable*) table;
+
+  /**
+   * Held by any thread adding to or removing from the shard.
+   */
+  pthread_mutex_t lock;
+
+  /**
+   * The number of live names in <code>table</code>. Only accessed with the lock held.
+   */
+  int number_of_items;
+
+  /**
+   * The number of tombstones in <code>table</code>. Only accessed with the lock held.
+   */
+  int number_of_tombstones;
+
+  /**
+   * The tables that have been replaced but may still be in use by a reader or a snapshot. Only
+   * accessed with the lock held.
+   */
+  ShardTable *retired;
+} Shard;
+
+/**
+ * The epoch that a single reader thread is reading in, or <code>0</code> if it isn't reading.
+ * Padded to a cache line so that readers never write to a line that another reader writes to.
+ */
+typedef struct ReaderSlot
+{
+  _Alignas(CACHE_LINE_SIZE) _Atomic uint64_t epoch;
+} ReaderSlot;
+
+/**
+ * A hash map of names that can be used from any number of threads at once.
+ */
+struct ConcurrentNameMap
+{
+  /**
+   * The options the map was created with. Only the hash policy and seed are used.
+   */
+  NameMapConfig config;
+
+  /**
+   * The shards. The top <code>shard_bits</code> bits of a name's hash select its shard.
+   */
+  Shard *shards;
+
+  /**
+   * The number of bits of the hash used to select a shard.
+   */
+  int shard_bits;
+
+  /**
+   * Incremented every time a table is retired or a shared page is replaced. Starts at 1, so that
+   * a reader slot of <code>0</code> always means the reader isn't reading.
+   */
+  _Atomic uint64_t epoch;
+
+  /**
+   * One slot per reader thread. See <code>reader_index</code>.
+   */
+  ReaderSlot *readers;
+};
+
+/**
+ * A read-only view of a concurrent map at a single point in time.
+ */
+struct ConcurrentNameMapSnapshot
+{
+  /**
+   * The map that the snapshot was taken of.
+   */
+  ConcurrentNameMap *map;
+
+  /**
+   * The table of each shard when the snapshot was taken, in shard order. Each of these counts the
+   * snapshot in its <code>snapshots</code>.
+   */
+  ShardTable **tables;
+
+  /**
+   * The number of names in the snapshot.
+   */
+  int size;
+};
+
+static uint64_t concurrent_hash(const ConcurrentNameMap*, const char*);
+static int shard_index_for(const ConcurrentNameMap*, uint64_t);
+static Shard *shard_for(const ConcurrentNameMap*, uint64_t);
+static ShardTable *allocate_shard_table(int);
+static ShardTable *create_shard_table(int);
+static ShardPage *create_shard_page(int);
+static void free_shard_table(ShardTable*);
+static ShardSlot *table_slot(const ShardTable*, int);
+static int find_in_table(const ShardTable*, const char*, uint64_t);
+static void insert_into_table(ConcurrentNameMap*, Shard*, ShardTable*, const char*, uint64_t);
+static ShardTable *writable_table(ConcurrentNameMap*, Shard*);
+static ShardSlot *writable_slot(ConcurrentNameMap*, Shard*, ShardTable*, int);
+static void rebuild_shard(ConcurrentNameMap*, Shard*, int);
+static void replace_shard_table(ConcurrentNameMap*, Shard*, ShardTable*);
+static void reclaim_retired_tables(ConcurrentNameMap*, Shard*);
+static int current_reader_index();
+static int acquire_reader_index();
+static void create_reader_key();
+static void release_reader_index(void*);
+static void *aligned_calloc(size_t, size_t, const char*);
+
+static const char table_tombstone_value = '\0';
+// Marks a slot whose name has been removed. Compared by address, so can never match a real name
+static const char *const table_tombstone = &table_tombstone_value;
+
+// The number of reader indices that have ever been handed out, across every map. Never more than
+// MAX_READERS, as indices given back by exited threads are reused first
+static atomic_int readers_registered = 0;
+
+// The indices given back by threads that have exited, waiting to be reused. Only changed with
+// reader_index_lock held, but the count may be read without it
+static int free_reader_indices[MAX_READERS];
+static atomic_int free_reader_count = 0;
+static pthread_mutex_t reader_index_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Gives a thread's reader index back when the thread exits
+static pthread_key_t reader_key;
+static pthread_once_t reader_key_once = PTHREAD_ONCE_INIT;
+
+// The calling thread's reader index, or -1 if it hasn't searched any map yet
+static _Thread_local int reader_index = -1;
+
+/**
+ * Creates a new, empty concurrent map. The map always owns its names, and ignores every option
+ * in the config other than the hash policy and seed.
+ * @param initial_size The initial capacity of the map, spread between its shards.
+ * @param shard_count The number of shards, which is rounded up to a power of two. Writers to
+ * different shards never contend. If this is less than <code>1</code>, 64 shards are used.
+ * @param config The options for the map, or <code>NULL</code> to use the defaults.
+ * @return The new map. This must be freed with <code>free_concurrent_name_map</code>.
+ */
+ConcurrentNameMap *create_concurrent_name_map(
+    int initial_size, int shard_count, const NameMapConfig *config)
+{
+  ConcurrentNameMap *map = calloc(1, sizeof(ConcurrentNameMap));
+  if (!map) {
+    printf("Failed to allocate memory for the concurrent name map\n");
+    exit(1);
+  }
+  map->config = config ? *config : default_name_map_config();
+  if (hash_policy_uses_seed(map->config.hash_policy) && map->config.hash_seed == 0)
+    map->config.hash_seed = choose_hash_seed(map);
+
+  if (shard_count < 1)
+    shard_count = DEFAULT_SHARD_COUNT;
+  while ((1 << map->shard_bits) < shard_count)
+    map->shard_bits++;
+  shard_count = 1 << map->shard_bits;
+
+  // Size each shard so that its share of the initial names fits without it needing to grow
+  int shard_capacity = MIN_SHARD_CAPACITY;
+  while (shard_capacity * MAX_LOAD_FACTOR < (double) initial_size / shard_count)
+    shard_capacity *= 2;
+
+  map->shards = aligned_calloc(shard_count, sizeof(Shard), "the shards");
+  for (int i = 0; i < shard_count; i++)
+  {
+    if (pthread_mutex_init(&map->shards[i].lock, NULL) != 0) {
+      printf("Failed to initialise a shard lock\n");
+      exit(1);
+    }
+    atomic_init(&map->shards[i].table, create_shard_table(shard_capacity));
+  }
+
+  map->readers = aligned_calloc(MAX_READERS, sizeof(ReaderSlot), "the reader slots");
+  atomic_init(&map->epoch, 1);
+  return map;
+}
+
+/**
+ * Frees the map, including every name in it. No other thread may be using the map, and every
+ * snapshot of the map must already have been freed.
+ * @param map The map to free. May be <code>NULL</code>, in which case nothing happens.
+ */
+void free_concurrent_name_map(ConcurrentNameMap *map)
+{
+  if (!map)
+    return;
+
+  for (int i = 0; i < 1 << map->shard_bits; i++)
+  {
+    Shard *shard = &map->shards[i];
+    free_shard_table(atomic_load(&shard->table));
+    while (shard->retired)
+    {
+      ShardTable *next = shard->retired->next_retired;
+      free_shard_table(shard->retired);
+      shard->retired = next;
+    }
+    pthread_mutex_destroy(&shard->lock);
+  }
+  free(map->shards);
+  free(map->readers);
+  free(map);
+}
+
+/**
+ * Allocates a zeroed array whose elements start on a cache line boundary.
+ * @param count The number of elements.
+ * @param size The size of each element. This must be a multiple of the cache line size.
+ * @param description What is being allocated, for the error message.
+ * @return The array. This can be freed with <code>free</code>.
+ */
+static void *aligned_calloc(size_t count, size_t size, const char *description)
+{
+  void *memory = aligned_alloc(CACHE_LINE_SIZE, count * size);
+  if (!memory) {
+    printf("Failed to allocate memory for %s\n", description);
+    exit(1);
+  }
+  memset(memory, 0, count * size);
+  return memory;
+}
+
+/**
+ * Hashes a name. The ASCII-sum hash is mixed first, as its low and high bits are both too poorly
+ * spread to select a shard or a slot.
+ * @param map The map that the hash is being calculated for.
+ * @param name The name to hash.
+ * @return The hash.
+ */
+static uint64_t concurrent_hash(const ConcurrentNameMap *map, const char *name)
+{
+  uint64_t hash = hash_with_config(&map->config, name);
+  return map->config.hash_policy == HASH_POLICY_ASCII_SUM ? mix64(hash) : hash;
+}
+
+/**
+ * Gets the index of the shard that a name belongs to. This uses the top bits of the hash, so that
+ * it is independent of the slot within the shard, which uses the bottom bits.
+ * @param map The map.
+ * @param hash The hash of the name.
+ * @return The index of the shard.
+ */
+static int shard_index_for(const ConcurrentNameMap *map, uint64_t hash)
+{
+  return map->shard_bits ? (int) (hash >> (64 - map->shard_bits)) : 0;
+}
+
+/**
+ * Gets the shard that a name belongs to.
+ * @param map The map.
+ * @param hash The hash of the name.
+ * @return The shard.
+ */
+static Shard *shard_for(const ConcurrentNameMap *map, uint64_t hash)
+{
+  return &map->shards[shard_index_for(map, hash)];
+}
+
+/**
+ * Allocates a table without any pages or arena, for the caller to fill in.
+ * @param capacity The number of slots. This must be a power of two.
+ * @return The table.
+ */
+static ShardTable *allocate_shard_table(int capacity)
+{
+  ShardTable *table = calloc(1, sizeof(ShardTable));
+  int page_count = (capacity + SHARD_PAGE_SLOTS - 1) / SHARD_PAGE_SLOTS;
+  if (table)
+    table->pages = calloc(page_count, sizeof(table->pages[0]));
+  if (!table || !table->pages) {
+    printf("Failed to allocate memory for a shard table\n");
+    exit(1);
+  }
+  table->capacity = capacity;
+  return table;
+}
+
+/**
+ * Creates an empty table, with its own pages and arena.
+ * @param capacity The number of slots. This must be a power of two.
+ * @return The table. This must be freed with <code>free_shard_table</code>.
+ */
+static ShardTable *create_shard_table(int capacity)
+{
+  ShardTable *table = allocate_shard_table(capacity);
+  int page_slots = capacity < SHARD_PAGE_SLOTS ? capacity : SHARD_PAGE_SLOTS;
+  for (int i = 0; i * SHARD_PAGE_SLOTS < capacity; i++)
+    atomic_init(&table->pages[i], create_shard_page(page_slots));
+
+  table->key_arena = malloc(sizeof(SharedKeyArena));
+  if (!table->key_arena) {
+    printf("Failed to allocate memory for a shard table\n");
+    exit(1);
+  }
+  table->key_arena->arena = create_key_arena(0);
+  table->key_arena->tables = 1;
+  return table;
+}
+
+/**
+ * Creates a page of empty slots, used by a single table.
+ * @param page_slots The number of slots in the page.
+ * @return The page. This is freed by the last table using it.
+ */
+static ShardPage *create_shard_page(int page_slots)
+{
+  ShardPage *page = calloc(1, sizeof(ShardPage) + page_slots * sizeof(ShardSlot));
+  if (!page) {
+    printf("Failed to allocate memory for a shard page\n");
+    exit(1);
+  }
+  page->tables = 1;
+  return page;
+}
+
+/**
+ * Frees a table. Its pages and arena, including every name that was ever added to the arena, are
+ * freed too, unless another table is still using them.
+ * @param table The table to free.
+ */
+static void free_shard_table(ShardTable *table)
+{
+  for (int i = 0; i * SHARD_PAGE_SLOTS < table->capacity; i++)
+  {
+    ShardPage *page = atomic_load_explicit(&table->pages[i], memory_order_relaxed);
+    if (--page->tables == 0)
+      free(page);
+  }
+  if (--table->key_arena->tables == 0)
+  {
+    free_key_arena(table->key_arena->arena);
+    free(table->key_arena);
+  }
+  free((void*) table->pages);
+  free(table);
+}
+
+/**
+ * Gets the calling thread's reader index. Each thread is given a free index the first time it
+ * searches any map, and keeps it until it exits, when the index is given back for another thread
+ * to reuse. So at most <code>MAX_READERS</code> threads can search without a lock at any one time,
+ * however many threads come and go.
+ * @return The index. This is <code>MAX_READERS</code> if every index is in use, in which case the
+ * thread doesn't have a reader slot, and tries again once another thread has given one back.
+ */
+static int current_reader_index()
+{
+  if (reader_index == -1
+      || (reader_index == MAX_READERS
+          && atomic_load_explicit(&free_reader_count, memory_order_relaxed) > 0))
+    reader_index = acquire_reader_index();
+  return reader_index;
+}
+
+/**
+ * Takes a reader index for the calling thread, preferring one given back by an exited thread.
+ * @return The index, or <code>MAX_READERS</code> if every index is in use.
+ */
+static int acquire_reader_index()
+{
+  if (pthread_once(&reader_key_once, create_reader_key) != 0) {
+    printf("Failed to create the reader index key\n");
+    exit(1);
+  }
+
+  pthread_mutex_lock(&reader_index_lock);
+  int index = MAX_READERS;
+  int free_count = atomic_load_explicit(&free_reader_count, memory_order_relaxed);
+  if (free_count > 0)
+  {
+    index = free_reader_indices[free_count - 1];
+    atomic_store_explicit(&free_reader_count, free_count - 1, memory_order_relaxed);
+  } else if (atomic_load(&readers_registered) < MAX_READERS)
+  {
+    index = atomic_fetch_add(&readers_registered, 1);
+  }
+  pthread_mutex_unlock(&reader_index_lock);
+
+  // Stored off by one, as the destructor is only called for values other than NULL
+  if (index < MAX_READERS && pthread_setspecific(reader_key, (void*) (intptr_t) (index + 1)) != 0) {
+    printf("Failed to record the reader index\n");
+    exit(1);
+  }
+  return index;
+}
+
+/**
+ * Creates the key whose destructor gives a thread's reader index back. Called once.
+ */
+static void create_reader_key()
+{
+  if (pthread_key_create(&reader_key, release_reader_index) != 0) {
+    printf("Failed to create the reader index key\n");
+    exit(1);
+  }
+}
+
+/**
+ * Gives an exiting thread's reader index back, so that another thread can reuse it. The thread's
+ * epoch is already <code>0</code> in every map's slot, as it stores that after every search.
+ * @param value The index, plus one.
+ */
+static void release_reader_index(void *value)
+{
+  pthread_mutex_lock(&reader_index_lock);
+  int free_count = atomic_load_explicit(&free_reader_count, memory_order_relaxed);
+  free_reader_indices[free_count] = (int) ((intptr_t) value - 1);
+  atomic_store_explicit(&free_reader_count, free_count + 1, memory_order_relaxed);
+  pthread_mutex_unlock(&reader_index_lock);
+}
+
+/**
+ * Gets a slot of a table. This is safe to call without the shard's lock, as long as the table
+ * can't be freed during the call.
+ * @param table The table.
+ * @param index The index of the slot.
+ * @return The slot, in whichever page the table held when this was called.
+ */
+static ShardSlot *table_slot(const ShardTable *table, int index)
+{
+  // Sequentially consistent, like the load of the table itself, so that a page replaced after the
+  // reader recorded its epoch isn't freed until the reader has finished
+  ShardPage *page = atomic_load(&table->pages[index >> SHARD_PAGE_BITS]);
+  return &page->slots[index & (SHARD_PAGE_SLOTS - 1)];
+}
+
+/**
+ * Finds a name in a table. This is safe to call without the shard's lock, as long as the table
+ * can't be freed during the call.
+ * @param table The table to search.
+ * @param name The name to search for.
+ * @param hash The hash of the name.
+ * @return The slot holding the name, or <code>-1</code> if the name isn't in the table.
+ */
+static int find_in_table(const ShardTable *table, const char *name, uint64_t hash)
+{
+  int mask = table->capacity - 1;
+  int index = (int) (hash & (uint64_t) mask);
+
+  // The load factor (including tombstones) is kept below 1, so there is always an empty slot to
+  // stop at
+  ShardSlot *slot = table_slot(table, index);
+  for (;;)
+  {
+    // The acquire pairs with the release in insert_into_table, so the hash and the characters of
+    // the name are visible once the name is
+    const char *stored = atomic_load_explicit(&slot->name, memory_order_acquire);
+    if (!stored)
+      return -1;
+
+    if (stored != table_tombstone
+        && atomic_load_explicit(&slot->hash, memory_order_relaxed) == hash
+        && NAME_MAP_STRCMP(stored, name) == 0)
+      return index;
+
+    // Only look the page up again when the probe moves onto the next one
+    index = (index + 1) & mask;
+    slot = index & (SHARD_PAGE_SLOTS - 1) ? slot + 1 : table_slot(table, index);
+  }
+}
+
+/**
+ * Adds a name to the first empty slot in its probe sequence. Tombstones are never reused, so each
+ * removal counts towards the load until the next rebuild, which is what reclaims the removed name's
+ * copy in the arena. The caller must hold the shard's lock and have checked that the name isn't
+ * already present.
+ * @param map The map that the shard belongs to.
+ * @param shard The shard that the table belongs to.
+ * @param table The table to add to. This mustn't be held by a snapshot.
+ * @param name The name to add. This must already be owned by the table.
+ * @param hash The hash of the name.
+ */
+static void insert_into_table(
+    ConcurrentNameMap *map, Shard *shard, ShardTable *table, const char *name, uint64_t hash)
+{
+  int mask = table->capacity - 1;
+  int index = (int) (hash & (uint64_t) mask);
+  while (atomic_load_explicit(&table_slot(table, index)->name, memory_order_relaxed))
+    index = (index + 1) & mask;
+
+  ShardSlot *slot = writable_slot(map, shard, table, index);
+  atomic_store_explicit(&slot->hash, hash, memory_order_relaxed);
+  atomic_store_explicit(&slot->name, name, memory_order_release);
+}
+
+/**
+ * Gets the shard's table, ready to be written to. If the table is held by a snapshot, it is first
+ * replaced by a new table sharing all of its pages and its arena, which costs one pointer per page
+ * rather than a copy of every slot. The caller must hold the shard's lock.
+ * @param map The map that the shard belongs to.
+ * @param shard The shard.
+ * @return The table, which isn't held by any snapshot.
+ */
+static ShardTable *writable_table(ConcurrentNameMap *map, Shard *shard)
+{
+  ShardTable *table = atomic_load_explicit(&shard->table, memory_order_relaxed);
+  if (table->snapshots == 0)
+    return table;
+
+  ShardTable *copy = allocate_shard_table(table->capacity);
+  for (int i = 0; i * SHARD_PAGE_SLOTS < table->capacity; i++)
+  {
+    ShardPage *page = atomic_load_explicit(&table->pages[i], memory_order_relaxed);
+    page->tables++;
+    atomic_init(&copy->pages[i], page);
+  }
+  copy->key_arena = table->key_arena;
+  copy->key_arena->tables++;
+
+  replace_shard_table(map, shard, copy);
+  return copy;
+}
+
+/**
+ * Gets a slot of a table, ready to be written to. If the slot's page is shared with another table,
+ * the page is first replaced by a copy of it, used only by this table. The caller must hold the
+ * shard's lock.
+ * @param map The map that the shard belongs to.
+ * @param shard The shard that the table belongs to.
+ * @param table The table, which mustn't be held by a snapshot.
+ * @param index The index of the slot.
+ * @return The slot.
+ */
+static ShardSlot *writable_slot(ConcurrentNameMap *map, Shard *shard, ShardTable *table, int index)
+{
+  _Atomic(ShardPage*) *link = &table->pages[index >> SHARD_PAGE_BITS];
+  ShardPage *page = atomic_load_explicit(link, memory_order_relaxed);
+  if (page->tables > 1)
+  {
+    int page_slots = table->capacity < SHARD_PAGE_SLOTS ? table->capacity : SHARD_PAGE_SLOTS;
+    ShardPage *copy = create_shard_page(page_slots);
+    for (int i = 0; i < page_slots; i++)
+    {
+      atomic_init(
+          &copy->slots[i].hash, atomic_load_explicit(&page->slots[i].hash, memory_order_relaxed)
+      );
+      atomic_init(
+          &copy->slots[i].name, atomic_load_explicit(&page->slots[i].name, memory_order_relaxed)
+      );
+    }
+    atomic_store(link, copy);
+
+    // The old page is still used by the retired tables that share it, so it can't be freed yet.
+    // Readers of this table may still be using it too, though, so hold those tables back as if
+    // they had only just been retired
+    page->tables--;
+    uint64_t epoch = atomic_fetch_add(&map->epoch, 1) + 1;
+    for (ShardTable *retired = shard->retired; retired; retired = retired->next_retired)
+      retired->retire_epoch = epoch;
+    page = copy;
+  }
+  return &page->slots[index & (SHARD_PAGE_SLOTS - 1)];
+}
+
+/**
+ * Replaces a shard's table with a new one holding the same names and no tombstones, doubling the
+ * capacity until the new table is at most half of the maximum load. The old table is retired. The
+ * caller must hold the shard's lock.
+ * @param map The map that the shard belongs to.
+ * @param shard The shard to rebuild.
+ * @param items_needed The number of names that the new table needs room for.
+ */
+static void rebuild_shard(ConcurrentNameMap *map, Shard *shard, int items_needed)
+{
+  ShardTable *old_table = atomic_load_explicit(&shard->table, memory_order_relaxed);
+  int capacity = old_table->capacity;
+  while (items_needed > capacity * MAX_LOAD_FACTOR / 2)
+    capacity *= 2;
+
+  // Only live names are copied, which reclaims the space used by removed names. The new table
+  // shares nothing with the old one, which may be held by a snapshot
+  ShardTable *new_table = create_shard_table(capacity);
+  for (int i = 0; i < old_table->capacity; i++)
+  {
+    ShardSlot *slot = table_slot(old_table, i);
+    const char *name = atomic_load_explicit(&slot->name, memory_order_relaxed);
+    if (name && name != table_tombstone)
+    {
+      insert_into_table(
+          map, shard, new_table, copy_into_key_arena(new_table->key_arena->arena, name),
+          atomic_load_explicit(&slot->hash, memory_order_relaxed)
+      );
+    }
+  }
+
+  replace_shard_table(map, shard, new_table);
+  shard->number_of_tombstones = 0;
+}
+
+/**
+ * Publishes a new table for a shard, and retires the old one. The caller must hold the shard's
+ * lock.
+ * @param map The map that the shard belongs to.
+ * @param shard The shard.
+ * @param new_table The new table.
+ */
+static void replace_shard_table(ConcurrentNameMap *map, Shard *shard, ShardTable *new_table)
+{
+  ShardTable *old_table = atomic_load_explicit(&shard->table, memory_order_relaxed);
+
+  // Publish the new table before advancing the epoch. Any reader that could still be using the old
+  // table must have recorded an epoch from before the advance
+  atomic_store(&shard->table, new_table);
+  old_table->retire_epoch = atomic_fetch_add(&map->epoch, 1) + 1;
+  old_table->next_retired = shard->retired;
+  shard->retired = old_table;
+
+  reclaim_retired_tables(map, shard);
+}
+
+/**
+ * Frees each of the shard's retired tables that no reader or snapshot can still be using. The
+ * caller must hold the shard's lock.
+ * @param map The map that the shard belongs to.
+ * @param shard The shard.
+ */
+static void reclaim_retired_tables(ConcurrentNameMap *map, Shard *shard)
+{
+  // Find the oldest epoch that any reader is still reading in
+  uint64_t oldest_reader = UINT64_MAX;
+  int registered = atomic_load(&readers_registered);
+  for (int i = 0; i < registered && i < MAX_READERS; i++)
+  {
+    uint64_t epoch = atomic_load(&map->readers[i].epoch);
+    if (epoch && epoch < oldest_reader)
+      oldest_reader = epoch;
+  }
+
+  // A table retired in epoch R can only be in use by a reader whose epoch is less than R
+  ShardTable **link = &shard->retired;
+  while (*link)
+  {
+    ShardTable *table = *link;
+    if (table->retire_epoch <= oldest_reader && table->snapshots == 0)
+    {
+      *link = table->next_retired;
+      free_shard_table(table);
+    } else
+    {
+      link = &table->next_retired;
+    }
+  }
+}
+
+/**
+ * Adds a copy of a name to the map, unless it is already present. Safe to call from any thread.
+ * @param map The map to add to.
+ * @param name The name to add. This is copied, so needn't outlive the call.
+ */
+void add_to_concurrent_name_map(ConcurrentNameMap *map, const char *name)
+{
+  uint64_t hash = concurrent_hash(map, name);
+  Shard *shard = shard_for(map, hash);
+  pthread_mutex_lock(&shard->lock);
+
+  ShardTable *table = atomic_load_explicit(&shard->table, memory_order_relaxed);
+  if (find_in_table(table, name, hash) == -1)
+  {
+    // Tombstones are never reused, so count them towards the load
+    int used = shard->number_of_items + shard->number_of_tombstones + 1;
+    if (used > table->capacity * MAX_LOAD_FACTOR)
+      rebuild_shard(map, shard, shard->number_of_items + 1);
+
+    table = writable_table(map, shard);
+    insert_into_table(map, shard, table, copy_into_key_arena(table->key_arena->arena, name), hash);
+    shard->number_of_items++;
+  }
+
+  pthread_mutex_unlock(&shard->lock);
+}
+
+/**
+ * Removes a name from the map. Safe to call from any thread.
+ * @param map The map to remove from.
+ * @param name The name to remove.
+ * @return <code>1</code> if the name was removed, or <code>0</code> if it wasn't in the map.
+ */
+int remove_from_concurrent_name_map(ConcurrentNameMap *map, const char *name)
+{
+  uint64_t hash = concurrent_hash(map, name);
+  Shard *shard = shard_for(map, hash);
+  pthread_mutex_lock(&shard->lock);
+
+  ShardTable *table = atomic_load_explicit(&shard->table, memory_order_relaxed);
+  int index = find_in_table(table, name, hash);
+  if (index != -1)
+  {
+    // The name itself stays in the table's arena, as a reader may still be comparing against it.
+    // If a snapshot holds the table, the replacement keeps every name in the same slot
+    table = writable_table(map, shard);
+    ShardSlot *slot = writable_slot(map, shard, table, index);
+    atomic_store_explicit(&slot->name, table_tombstone, memory_order_release);
+    shard->number_of_items--;
+    shard->number_of_tombstones++;
+  }
+
+  pthread_mutex_unlock(&shard->lock);
+  return index != -1;
+}
+
+/**
+ * Searches the map for a name without taking any lock. Safe to call from any thread.
+ * @param map The map to search.
+ * @param name The name to search for.
+ * @return <code>1</code> if the name is in the map, or <code>0</code> if it isn't.
+ */
+int search_concurrent_name_map(ConcurrentNameMap *map, const char *name)
+{
+  uint64_t hash = concurrent_hash(map, name);
+  Shard *shard = shard_for(map, hash);
+  int reader = current_reader_index();
+
+  // Threads beyond the last reader slot can't protect the table from being freed, so fall back to
+  // taking the lock until another thread exits and gives its slot back
+  if (reader >= MAX_READERS)
+  {
+    pthread_mutex_lock(&shard->lock);
+    int found = find_in_table(atomic_load(&shard->table), name, hash) != -1;
+    pthread_mutex_unlock(&shard->lock);
+    return found;
+  }
+
+  // Record the epoch before loading the table. Both are sequentially consistent, so if a writer
+  // retires this table after we load it, we've already recorded an epoch from before it did
+  _Atomic uint64_t *reader_epoch = &map->readers[reader].epoch;
+  atomic_store(reader_epoch, atomic_load(&map->epoch));
+  int found = find_in_table(atomic_load(&shard->table), name, hash) != -1;
+  atomic_store_explicit(reader_epoch, 0, memory_order_release);
+  return found;
+}
+
+/**
+ * Counts the names in the map. Each shard is counted under its own lock, so if other threads are
+ * writing to the map, the count may not match the map at any single point in time. Use a snapshot
+ * for a count that does.
+ * @param map The map.
+ * @return The number of names in the map.
+ */
+int concurrent_name_map_size(ConcurrentNameMap *map)
+{
+  int size = 0;
+  for (int i = 0; i < 1 << map->shard_bits; i++)
+  {
+    pthread_mutex_lock(&map->shards[i].lock);
+    size += map->shards[i].number_of_items;
+    pthread_mutex_unlock(&map->shards[i].lock);
+  }
+  return size;
+}
+
+/**
+ * Takes a snapshot of the map, which can be searched and iterated without any lock while other
+ * threads keep writing to the map. This holds every shard's lock at once, so that the snapshot is
+ * of a single point in time, but only for long enough to record each shard's table: no names or
+ * slots are copied. Safe to call from any thread.
+ * @param map The map.
+ * @return The snapshot. This must be freed with <code>free_concurrent_name_map_snapshot</code>
+ * before the map is freed.
+ */
+ConcurrentNameMapSnapshot *snapshot_concurrent_name_map(ConcurrentNameMap *map)
+{
+  int shard_count = 1 << map->shard_bits;
+  ConcurrentNameMapSnapshot *snapshot = calloc(1, sizeof(ConcurrentNameMapSnapshot));
+  if (snapshot)
+    snapshot->tables = malloc(shard_count * sizeof(snapshot->tables[0]));
+  if (!snapshot || !snapshot->tables) {
+    printf("Failed to allocate memory for the snapshot\n");
+    exit(1);
+  }
+  snapshot->map = map;
+
+  // Writers only ever hold one lock, and snapshots take them in shard order, so this can't deadlock
+  for (int i = 0; i < shard_count; i++)
+  {
+    Shard *shard = &map->shards[i];
+    pthread_mutex_lock(&shard->lock);
+    ShardTable *table = atomic_load_explicit(&shard->table, memory_order_relaxed);
+    table->snapshots++;
+    snapshot->tables[i] = table;
+    snapshot->size += shard->number_of_items;
+  }
+  for (int i = 0; i < shard_count; i++)
+    pthread_mutex_unlock(&map->shards[i].lock);
+  return snapshot;
+}
+
+/**
+ * Frees a snapshot, along with any pages that only it was still using. Safe to call from any
+ * thread.
+ * @param snapshot The snapshot to free. May be <code>NULL</code>, in which case nothing happens.
+ */
+void free_concurrent_name_map_snapshot(ConcurrentNameMapSnapshot *snapshot)
+{
+  if (!snapshot)
+    return;
+
+  ConcurrentNameMap *map = snapshot->map;
+  for (int i = 0; i < 1 << map->shard_bits; i++)
+  {
+    Shard *shard = &map->shards[i];
+    pthread_mutex_lock(&shard->lock);
+    snapshot->tables[i]->snapshots--;
+
+    // If a writer has since replaced the table, it is waiting in the retired list
+    if (snapshot->tables[i] != atomic_load_explicit(&shard->table, memory_order_relaxed))
+      reclaim_retired_tables(map, shard);
+    pthread_mutex_unlock(&shard->lock);
+  }
+  free(snapshot->tables);
+  free(snapshot);
+}
+
+/**
+ * Counts the names in a snapshot.
+ * @param snapshot The snapshot.
+ * @return The number of names in the map when the snapshot was taken.
+ */
+int concurrent_name_map_snapshot_size(const ConcurrentNameMapSnapshot *snapshot)
+{
+  return snapshot->size;
+}
+
+/**
+ * Searches a snapshot for a name, without taking any lock.
+ * @param snapshot The snapshot to search.
+ * @param name The name to search for.
+ * @return <code>1</code> if the name was in the map when the snapshot was taken, or
+ * <code>0</code> if it wasn't.
+ */
+int search_concurrent_name_map_snapshot(const ConcurrentNameMapSnapshot *snapshot, const char *name)
+{
+  uint64_t hash = concurrent_hash(snapshot->map, name);
+  return find_in_table(snapshot->tables[shard_index_for(snapshot->map, hash)], name, hash) != -1;
+}
+
+/**
+ * Gets the next name in a snapshot, without taking any lock. Every name in the snapshot is visited
+ * exactly once, in no particular order:
+ * <pre>
+ * uint64_t position = 0;
+ * for (const char *name; (name = next_in_concurrent_name_map_snapshot(snapshot, &position)); )
+ *   ...
+ * </pre>
+ * @param snapshot The snapshot.
+ * @param position Where to continue from, which is updated to just after the name returned. This
+ * should start at <code>0</code>.
+ * @return The next name, which is valid until the snapshot is freed, or <code>NULL</code> if every
+ * name has been visited.
+ */
+const char *next_in_concurrent_name_map_snapshot(
+    const ConcurrentNameMapSnapshot *snapshot, uint64_t *position)
+{
+  // The shard is in the top half of the position, and the slot within it in the bottom half
+  int shard_count = 1 << snapshot->map->shard_bits;
+  int shard = (int) (*position >> 32);
+  int index = (int) (*position & UINT32_MAX);
+  for (; shard < shard_count; shard++, index = 0)
+  {
+    const ShardTable *table = snapshot->tables[shard];
+    for (; index < table->capacity; index++)
+    {
+      // Nothing the snapshot holds is ever written to again, so the slots can be read in any order
+      ShardSlot *slot = table_slot(table, index);
+      const char *name = atomic_load_explicit(&slot->name, memory_order_relaxed);
+      if (name && name != table_tombstone)
+      {
+        *position = (uint64_t) shard << 32 | (uint64_t) (index + 1);
+        return name;
+      }
+    }
+  }
+  *position = (uint64_t) shard << 32;
+  return NULL;
+}
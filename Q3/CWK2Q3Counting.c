@@ -0,0 +1,118 @@
+/*
+ ============================================================================
+ Name        : CWK2Q3Counting.c
+ Description :
+ Top-K queries over a Q3 hash map that counts names (see count_names). The
+ most frequent names are picked out in a single pass over the slots, using a
+ min-heap holding the K best names seen so far: each name is compared
+ against the least frequent name in the heap, and only replaces it if it
+ was added more often. This costs O(n log K) time and O(K) space, rather
+ than sorting every name in the map.
+
+ ============================================================================
+*/
+
+#include <string.h>
+#include <stdbool.h>
+#include "CWK2Q3Internal.h"
+
+static bool ranks_below(const NameCount*, const NameCount*);
+static void sift_down(NameCount*, size_t, size_t);
+
+/**
+ * Gets the most frequently added names in the map, including names that an incremental resize
+ * hasn't moved yet. Names that were added equally often are ordered alphabetically, so the result
+ * doesn't depend on where the names happen to be stored. In a map that doesn't count names, every
+ * name has a count of <code>1</code>, so this gives the alphabetically first names.
+ * @param map The map.
+ * @param k The most names to get.
+ * @param out Will be filled with the names and their counts, most frequent first. Must have room
+ * for <code>k</code> entries. The names point into the map, so are only valid until the map is
+ * next changed.
+ * @return The number of names written to <code>out</code>, which is less than <code>k</code> if
+ * the map holds fewer names than that.
+ */
+size_t get_top_names(const NameMap *map, size_t k, NameCount *out)
+{
+  if (k == 0)
+    return 0;
+
+  // out[0 .. found) is a min-heap, with the name that ranks lowest at the top
+  size_t found = 0;
+  for (const NameMap *storage = map; storage; storage = storage->retiring)
+  {
+    for (int64_t index = 0; index < storage->current_size; index++)
+    {
+      const char *name = storage->engine->name_at(storage, index);
+      if (!name)
+        continue;
+
+      NameCount candidate = { name, stored_count_at(storage, index) };
+      if (found < k)
+      {
+        // Sift the new name up from the bottom of the heap
+        size_t position = found++;
+        while (position > 0 && ranks_below(&candidate, &out[(position - 1) / 2]))
+        {
+          out[position] = out[(position - 1) / 2];
+          position = (position - 1) / 2;
+        }
+        out[position] = candidate;
+      }
+      else if (ranks_below(&out[0], &candidate))
+      {
+        out[0] = candidate;
+        sift_down(out, found, 0);
+      }
+    }
+  }
+
+  // Repeatedly move the lowest ranked name to the end of the heap, which leaves the names sorted
+  // from highest to lowest
+  for (size_t heap_size = found; heap_size > 1; heap_size--)
+  {
+    NameCount lowest = out[0];
+    out[0] = out[heap_size - 1];
+    out[heap_size - 1] = lowest;
+    sift_down(out, heap_size - 1, 0);
+  }
+  return found;
+}
+
+/**
+ * Checks whether one name ranks below another, i.e. was added fewer times, or the same number of
+ * times but comes later alphabetically.
+ * @param a The first name.
+ * @param b The second name.
+ * @return <code>true</code> if <code>a</code> ranks below <code>b</code>.
+ */
+static bool ranks_below(const NameCount *a, const NameCount *b)
+{
+  if (a->count != b->count)
+    return a->count < b->count;
+  return strcmp(a->name, b->name) > 0;
+}
+
+/**
+ * Moves the name at the given position down the heap until neither of its children ranks below it.
+ * @param heap The heap.
+ * @param heap_size The number of names in the heap.
+ * @param position The position of the name to move.
+ */
+static void sift_down(NameCount *heap, size_t heap_size, size_t position)
+{
+  NameCount moving = heap[position];
+  for (;;)
+  {
+    size_t child = position * 2 + 1;
+    if (child >= heap_size)
+      break;
+    if (child + 1 < heap_size && ranks_below(&heap[child + 1], &heap[child]))
+      child++;
+    if (!ranks_below(&heap[child], &moving))
+      break;
+    heap[position] = heap[child];
+    position = child;
+  }
+  heap[position] = moving;
+}
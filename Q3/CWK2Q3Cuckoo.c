@@ -0,0 +1,498 @@
+/*
+ ============================================================================
+ Name        : CWK2Q3Cuckoo.c
+ Description :
+ A bucketized cuckoo table engine for the Q3 hash map. The slots are split
+ into buckets of 4, followed by a stash of 4 more:
+
+    | bucket 0 | bucket 1 | ... | bucket n - 1 | stash |
+
+ Each name has two candidate buckets, chosen by two different hashes, and
+ is only ever stored in one of them (or in the stash). A search checks the
+ control bytes of both buckets, which hold a 7-bit fragment of the name's
+ hash, only comparing names whose fragment matches, then checks the stash if
+ anything is in it. Unlike the probing engines, this bound doesn't depend on
+ how full the map is or how well the hash spreads the names.
+
+ Adding a name to two full buckets evicts a name from one of them into its
+ other bucket, which may evict another in turn. After a bounded number of
+ evictions, the name being carried goes in the stash, and only if the stash
+ is full does the map grow.
+
+ ============================================================================
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "CWK2Q3Internal.h"
+
+#define BUCKET_WIDTH 4
+#define STASH_SLOTS 4
+#define MAX_EVICTIONS 500
+#define SECOND_HASH_SEED 0x5851f42d4c957f2dULL
+#define CONTROL_EMPTY ((uint8_t) 0)
+
+static void cuckoo_resize(NameMap*, int64_t);
+static void cuckoo_insert(NameMap*, const char*, uint64_t, uint64_t, uint64_t);
+static void cuckoo_place(NameMap*, const char*, uint64_t, uint64_t, uint64_t);
+static void cuckoo_remove_at(NameMap*, int64_t);
+static int64_t cuckoo_find(const NameMap*, const char*, uint64_t, uint64_t);
+static int64_t cuckoo_index_of(const NameMap*, const char*, uint64_t);
+static int64_t cuckoo_home_index(const NameMap*, const char*, uint64_t);
+static void cuckoo_print_slot(const NameMap*, int64_t);
+static const char *cuckoo_name_at(const NameMap*, int64_t);
+static void cuckoo_free_storage(NameMap*);
+static void cuckoo_probe_lengths(const NameMap*, NameMapStats*);
+static uint64_t spread_hash(const NameMap*, const char*, uint64_t);
+static int64_t bucket_count(const NameMap*);
+static int64_t first_bucket(const NameMap*, uint64_t);
+static int64_t second_bucket(const NameMap*, uint64_t);
+static uint8_t control_byte_for(uint64_t);
+static int64_t find_in_slots(
+    const NameMap*, int64_t, int64_t, uint8_t, uint64_t, const InlineKey*, const char*
+);
+static int64_t free_slot_in(const NameMap*, int64_t, int64_t);
+static void store_in_slot(NameMap*, int64_t, const char*, uint64_t, uint64_t, uint64_t);
+static void refill_from_stash(NameMap*, int64_t);
+
+const NameMapEngineOps cuckoo_engine = {
+    .resize = cuckoo_resize,
+    .insert = cuckoo_insert,
+    .remove_at = cuckoo_remove_at,
+    .index_of = cuckoo_index_of,
+    .home_index = cuckoo_home_index,
+    .collect_probe_lengths = cuckoo_probe_lengths,
+    .print_slot = cuckoo_print_slot,
+    .name_at = cuckoo_name_at,
+    .free_storage = cuckoo_free_storage,
+    .compact_names = NULL
+};
+
+/**
+ * Gets a well spread hash of a name, from which both of its buckets and its control byte are taken.
+ * The 64-bit policies already are, but the ASCII sum gives every anagram the same hash, and no
+ * number of evictions could fit more than two buckets and a stash worth of names with the same
+ * buckets. So that policy uses the same FNV-1a based hash as the Bloom filter instead.
+ * @param map The map the hash belongs to.
+ * @param name The name.
+ * @param hash The hash of the name, as given by <code>hash_of</code>.
+ * @return The spread hash.
+ */
+static uint64_t spread_hash(const NameMap *map, const char *name, uint64_t hash)
+{
+  return map->config.hash_policy == HASH_POLICY_ASCII_SUM ? filter_hash_of(map, name, hash) : hash;
+}
+
+/**
+ * Gets the number of buckets in the map, not counting the stash.
+ * @param map The map.
+ * @return The number of buckets.
+ */
+static int64_t bucket_count(const NameMap *map)
+{
+  return (map->current_size - STASH_SLOTS) / BUCKET_WIDTH;
+}
+
+/**
+ * Gets the first of a name's two buckets.
+ * @param map The map.
+ * @param spread The name's hash, as given by <code>spread_hash</code>.
+ * @return The bucket.
+ */
+static int64_t first_bucket(const NameMap *map, uint64_t spread)
+{
+  return (int64_t) (spread % (uint64_t) bucket_count(map));
+}
+
+/**
+ * Gets the second of a name's two buckets, which is chosen by a different hash to the first. This
+ * is never the same as the first bucket, unless the map only has one.
+ * @param map The map.
+ * @param spread The name's hash, as given by <code>spread_hash</code>.
+ * @return The bucket.
+ */
+static int64_t second_bucket(const NameMap *map, uint64_t spread)
+{
+  int64_t buckets = bucket_count(map);
+  int64_t first = first_bucket(map, spread);
+  int64_t second = (int64_t) (mix64(spread ^ SECOND_HASH_SEED) % (uint64_t) buckets);
+  return second == first ? (first + 1) % buckets : second;
+}
+
+/**
+ * Gets the control byte stored alongside a name. The top bit is always set, so that it can never
+ * be mistaken for an empty slot.
+ * @param spread The name's hash, as given by <code>spread_hash</code>.
+ * @return The control byte.
+ */
+static uint8_t control_byte_for(uint64_t spread)
+{
+  return (uint8_t) (0x80 | (spread >> 57));
+}
+
+/**
+ * Moves every name into new storage. The capacity is rounded up to a whole number of buckets, plus
+ * the stash.
+ * @param map The map to resize.
+ * @param new_size The new capacity of the map.
+ */
+static void cuckoo_resize(NameMap *map, int64_t new_size)
+{
+  NameMap old = *map;
+
+  int64_t buckets = (new_size + BUCKET_WIDTH - 1) / BUCKET_WIDTH;
+  allocate_slots(map, buckets * BUCKET_WIDTH + STASH_SLOTS);
+
+  map->control_bytes = calloc((size_t) map->current_size, sizeof(uint8_t));
+  if (!map->control_bytes) {
+    printf("Failed to allocate memory for the control bytes\n");
+    exit(1);
+  }
+  map->stashed_items = 0;
+
+  // None of the old names can be equal, so there's no need to search for each one first
+  for (int64_t i = 0; i < old.current_size; i++)
+  {
+    if (old.hash_map[i])
+    {
+      cuckoo_place(
+          map, old.hash_map[i], stored_hash_at(&old, i), old.fingerprints ? old.fingerprints[i] : 0,
+          stored_count_at(&old, i)
+      );
+    }
+  }
+
+  free_slots(&old);
+  cuckoo_free_storage(&old);
+}
+
+/**
+ * Adds the name to the map, unless an equivalent name is already present.
+ * @param map The map to add the name to.
+ * @param name The value to add to the map.
+ * @param hash The hash of <code>name</code>, as given by <code>hash_of</code>.
+ * @param fingerprint The fingerprint of <code>name</code>, as given by <code>fingerprint_of</code>.
+ * @param count If the map counts names, the count to store with the name, or to add to the count
+ * of the equivalent name if there is one.
+ */
+static void cuckoo_insert(
+    NameMap *map, const char *name, uint64_t hash, uint64_t fingerprint, uint64_t count
+)
+{
+  int64_t existing_index = cuckoo_find(map, name, hash, fingerprint);
+  if (existing_index == -1)
+    cuckoo_place(map, name, hash, fingerprint, count);
+  else if (map->counts)
+    map->counts[existing_index] += count;
+}
+
+/**
+ * Adds a name that isn't already in the map. If both of its buckets are full, names are evicted
+ * into their other bucket until one of them finds a free slot. If that takes too many evictions,
+ * the name left over goes in the stash, or if the stash is full too, the map is grown.
+ * @param map The map to add the name to.
+ * @param name The value to add to the map.
+ * @param hash The hash of <code>name</code>, as given by <code>hash_of</code>.
+ * @param fingerprint The fingerprint of <code>name</code>, as given by <code>fingerprint_of</code>.
+ * @param count If the map counts names, the count to store with the name.
+ */
+static void cuckoo_place(
+    NameMap *map, const char *name, uint64_t hash, uint64_t fingerprint, uint64_t count
+)
+{
+  uint64_t spread = spread_hash(map, name, hash);
+  int64_t bucket = first_bucket(map, spread);
+  int64_t index = free_slot_in(map, bucket * BUCKET_WIDTH, BUCKET_WIDTH);
+  if (index == -1)
+    index = free_slot_in(map, second_bucket(map, spread) * BUCKET_WIDTH, BUCKET_WIDTH);
+
+  // The name (and its details) that we're currently trying to find a home for
+  const char *carried_name = name;
+  uint64_t carried_hash = hash;
+  uint64_t carried_fingerprint = fingerprint;
+  uint64_t carried_count = count;
+  for (int evictions = 0; index == -1 && evictions < MAX_EVICTIONS; evictions++)
+  {
+    // Evict a name from the bucket, varying which slot is picked so that two buckets can't keep
+    // swapping the same pair of names back and forth
+    int64_t victim = bucket * BUCKET_WIDTH + (int) (((spread >> 32) + evictions) % BUCKET_WIDTH);
+    const char *evicted_name = map->hash_map[victim];
+    uint64_t evicted_hash = stored_hash_at(map, victim);
+    uint64_t evicted_fingerprint = map->fingerprints ? map->fingerprints[victim] : 0;
+    uint64_t evicted_count = stored_count_at(map, victim);
+    store_in_slot(map, victim, carried_name, carried_fingerprint, carried_count, spread);
+
+    // The evicted name can only go in its other bucket
+    carried_name = evicted_name;
+    carried_hash = evicted_hash;
+    carried_fingerprint = evicted_fingerprint;
+    carried_count = evicted_count;
+    spread = spread_hash(map, carried_name, carried_hash);
+    int64_t first = first_bucket(map, spread);
+    bucket = bucket == first ? second_bucket(map, spread) : first;
+    index = free_slot_in(map, bucket * BUCKET_WIDTH, BUCKET_WIDTH);
+  }
+
+  if (index == -1)
+  {
+    index = free_slot_in(map, bucket_count(map) * BUCKET_WIDTH, STASH_SLOTS);
+    if (index == -1)
+    {
+      // Every name but the one being carried is in the map, so grow it and try again
+      uint64_t started = start_rehash_timer(map);
+      map->resizes++;
+      cuckoo_resize(map, map->current_size * 2);
+      stop_rehash_timer(map, started);
+      cuckoo_place(map, carried_name, carried_hash, carried_fingerprint, carried_count);
+      return;
+    }
+    map->stashed_items++;
+  }
+
+  store_in_slot(map, index, carried_name, carried_fingerprint, carried_count, spread);
+  map->number_of_items++;
+}
+
+/**
+ * Stores a name in a slot, overwriting whatever was there.
+ * @param map The map.
+ * @param index The slot.
+ * @param name The name.
+ * @param fingerprint The fingerprint of <code>name</code>, as given by <code>fingerprint_of</code>.
+ * @param count If the map counts names, the count of <code>name</code>.
+ * @param spread The hash of <code>name</code>, as given by <code>spread_hash</code>.
+ */
+static void store_in_slot(
+    NameMap *map, int64_t index, const char *name, uint64_t fingerprint, uint64_t count,
+    uint64_t spread
+)
+{
+  map->hash_map[index] = (char*) name;
+  map->control_bytes[index] = control_byte_for(spread);
+  if (map->fingerprints)
+    map->fingerprints[index] = fingerprint;
+  if (map->counts)
+    map->counts[index] = count;
+  if (map->inline_keys)
+  {
+    InlineKey key;
+    make_inline_key(map, name, &key);
+    store_inline_key(map, index, &key);
+  }
+}
+
+/**
+ * Finds the first empty slot in a run of slots.
+ * @param map The map.
+ * @param start The first slot of the run, e.g. of a bucket or the stash.
+ * @param count The number of slots in the run.
+ * @return The index of the empty slot, or <code>-1</code> if every slot is in use.
+ */
+static int64_t free_slot_in(const NameMap *map, int64_t start, int64_t count)
+{
+  for (int64_t index = start; index < start + count; index++)
+  {
+    if (!map->hash_map[index])
+      return index;
+  }
+  return -1;
+}
+
+/**
+ * Removes the name in the given slot, which is simply emptied. If that frees up a slot in a bucket
+ * that a stashed name could go in, the stashed name is moved there to keep the stash empty.
+ * @param map The map to remove the name from.
+ * @param index The slot holding the name.
+ */
+static void cuckoo_remove_at(NameMap *map, int64_t index)
+{
+  map->hash_map[index] = NULL;
+  map->control_bytes[index] = CONTROL_EMPTY;
+  map->number_of_items--;
+
+  if (index >= bucket_count(map) * BUCKET_WIDTH)
+    map->stashed_items--;
+  else if (map->stashed_items > 0)
+    refill_from_stash(map, index);
+}
+
+/**
+ * Moves a stashed name into a newly emptied slot, if the slot's bucket is one of the name's two.
+ * @param map The map.
+ * @param index The empty slot, which must be in a bucket.
+ */
+static void refill_from_stash(NameMap *map, int64_t index)
+{
+  int64_t bucket = index / BUCKET_WIDTH;
+  int64_t stash = bucket_count(map) * BUCKET_WIDTH;
+  for (int64_t stashed = stash; stashed < stash + STASH_SLOTS; stashed++)
+  {
+    if (!map->hash_map[stashed])
+      continue;
+
+    uint64_t spread = spread_hash(map, map->hash_map[stashed], stored_hash_at(map, stashed));
+    if (first_bucket(map, spread) == bucket || second_bucket(map, spread) == bucket)
+    {
+      map->hash_map[index] = map->hash_map[stashed];
+      map->control_bytes[index] = map->control_bytes[stashed];
+      if (map->fingerprints)
+        map->fingerprints[index] = map->fingerprints[stashed];
+      if (map->counts)
+        map->counts[index] = map->counts[stashed];
+      if (map->inline_keys)
+        move_inline_key(map, index, stashed);
+
+      map->hash_map[stashed] = NULL;
+      map->control_bytes[stashed] = CONTROL_EMPTY;
+      map->stashed_items--;
+      return;
+    }
+  }
+}
+
+/**
+ * Finds the slot holding the given name. Only the name's two buckets, and the stash if it isn't
+ * empty, are ever checked.
+ * @param map The map to search.
+ * @param name The value to search for.
+ * @param hash The hash of <code>name</code>, as given by <code>hash_of</code>.
+ * @param fingerprint The fingerprint of <code>name</code>, as given by <code>fingerprint_of</code>.
+ * @return The index of an entry matching <code>name</code>, or <code>-1</code> if the value is not
+ * stored in the map.
+ */
+static int64_t cuckoo_find(
+    const NameMap *map, const char *name, uint64_t hash, uint64_t fingerprint
+)
+{
+  uint64_t spread = spread_hash(map, name, hash);
+  uint8_t control = control_byte_for(spread);
+  InlineKey key;
+  if (map->inline_keys)
+    make_inline_key(map, name, &key);
+
+  int64_t index = find_in_slots(
+      map, first_bucket(map, spread) * BUCKET_WIDTH, BUCKET_WIDTH, control, fingerprint, &key, name
+  );
+  if (index == -1)
+  {
+    index = find_in_slots(
+        map, second_bucket(map, spread) * BUCKET_WIDTH, BUCKET_WIDTH, control, fingerprint, &key,
+        name
+    );
+  }
+  if (index == -1 && map->stashed_items > 0)
+  {
+    index = find_in_slots(
+        map, bucket_count(map) * BUCKET_WIDTH, STASH_SLOTS, control, fingerprint, &key, name
+    );
+  }
+  return index;
+}
+
+/**
+ * Finds the given name in a run of slots. Only names whose control byte matches are compared.
+ * @param map The map to search.
+ * @param start The first slot of the run, e.g. of a bucket or the stash.
+ * @param count The number of slots in the run.
+ * @param control The control byte of <code>name</code>, as given by <code>control_byte_for</code>.
+ * @param fingerprint The fingerprint of <code>name</code>, as given by <code>fingerprint_of</code>.
+ * @param key The inline key of <code>name</code>, if the map stores inline keys.
+ * @param name The value to search for.
+ * @return The index of an entry matching <code>name</code>, or <code>-1</code> if the value is not
+ * stored in any of the slots.
+ */
+static int64_t find_in_slots(
+    const NameMap *map, int64_t start, int64_t count, uint8_t control, uint64_t fingerprint,
+    const InlineKey *key, const char *name
+)
+{
+  for (int64_t index = start; index < start + count; index++)
+  {
+    if (map->control_bytes[index] == control
+        && (!map->fingerprints || map->fingerprints[index] == fingerprint)
+        && slot_holds_name(map, index, key, name))
+      return index;
+  }
+  return -1;
+}
+
+/**
+ * Gets the index of the given value in the map.
+ * @param map The map to search.
+ * @param name The value to search for.
+ * @param hash The hash of the value, as given by <code>hash_of</code>.
+ * @return The index of an entry matching <code>name</code>, or <code>-1</code> if the value is not
+ * stored in the map.
+ */
+static int64_t cuckoo_index_of(const NameMap *map, const char *name, uint64_t hash)
+{
+  return cuckoo_find(map, name, hash, fingerprint_of(map, name, hash));
+}
+
+/**
+ * Gets the first slot of the first bucket that a search for a name checks.
+ * @param map The map.
+ * @param name The name. Needed to spread the ASCII sum.
+ * @param hash The hash of the name, as given by <code>hash_of</code>.
+ * @return The index of the first slot in the name's first bucket.
+ */
+static int64_t cuckoo_home_index(const NameMap *map, const char *name, uint64_t hash)
+{
+  return first_bucket(map, spread_hash(map, name, hash)) * BUCKET_WIDTH;
+}
+
+/**
+ * Prints out the value at the given index in the map, printing nothing for empty slots.
+ * @param map The map to print from.
+ * @param index The index in the map to print.
+ */
+static void cuckoo_print_slot(const NameMap *map, int64_t index)
+{
+  if (map->hash_map[index])
+    printf("%s", map->hash_map[index]);
+}
+
+/**
+ * Gets the name at the given index in the map.
+ * @param map The map.
+ * @param index The index in the map.
+ * @return The name, or <code>NULL</code> if the slot is empty.
+ */
+static const char *cuckoo_name_at(const NameMap *map, int64_t index)
+{
+  return map->hash_map[index];
+}
+
+/**
+ * Frees the control bytes.
+ * @param map The map (or a copy of the map) whose control bytes should be freed.
+ */
+static void cuckoo_free_storage(NameMap *map)
+{
+  free(map->control_bytes);
+  map->control_bytes = NULL;
+}
+
+/**
+ * Records the probe lengths of a cuckoo map, in buckets (counting the stash as a third bucket). A
+ * search for a name in the map checks 1 bucket if the name is in its first bucket, 2 if it's in its
+ * second, or 3 if it's stashed. A search for a name that isn't in the map always checks both of its
+ * buckets, and the stash too if it isn't empty, so every miss is recorded the same.
+ * @param map The map.
+ * @param stats The statistics being gathered.
+ */
+static void cuckoo_probe_lengths(const NameMap *map, NameMapStats *stats)
+{
+  int64_t stash = bucket_count(map) * BUCKET_WIDTH;
+  for (int64_t index = 0; index < map->current_size; index++)
+  {
+    if (map->hash_map[index])
+    {
+      uint64_t spread = spread_hash(map, map->hash_map[index], stored_hash_at(map, index));
+      int probes = index >= stash ? 3 : index / BUCKET_WIDTH == first_bucket(map, spread) ? 1 : 2;
+      record_probe_length(stats, true, probes);
+    }
+    record_probe_length(stats, false, map->stashed_items > 0 ? 3 : 2);
+  }
+}
@@ -0,0 +1,378 @@
+/*
+ ============================================================================
+ Name        : CWK2Q3Frozen.c
+ Description :
+ Immutable snapshots of a Q3 hash map, built on a minimal perfect hash in
+ the style of CHD and PTHash. Names are hashed into small buckets, and each
+ bucket is given a "pilot": a 16-bit value that, mixed with the hash of each
+ name in the bucket, sends every one of them to a different slot. Buckets are
+ placed largest first, while the table is still mostly empty, so each pilot
+ only takes a handful of attempts to find.
+
+ The table has slightly more slots than names, which keeps the last few
+ buckets cheap to place. Names that land in one of the extra slots are then
+ remapped to one of the slots that was left empty, so the final table has
+ exactly one slot per name. A search hashes the name once, reads its
+ bucket's pilot, and compares against the single name in the resulting slot.
+
+ The names themselves are copied into one block, and each slot stores the
+ 32-bit offset of its name within it rather than a pointer.
+
+ ============================================================================
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "CWK2Q3Internal.h"
+
+// The average number of names per bucket. Each bucket costs a 16-bit pilot
+#define FROZEN_BUCKET_SIZE 4
+// The fraction of the table's slots that names are placed into before remapping
+#define FROZEN_LOAD_FACTOR 0.99
+#define MAX_PILOT UINT16_MAX
+#define PILOT_MULTIPLIER 0x9e3779b97f4a7c15ULL
+// The number of seeds to try before giving up. A seed should only fail if two names in the same
+// bucket share a full hash
+#define MAX_FREEZE_ATTEMPTS 16
+
+static const char **collect_names(const NameMap*, int*);
+static bool place_names(FrozenNameMap*, const uint64_t*, int*);
+static void remap_slots(FrozenNameMap*, int*);
+static uint32_t reduce(uint64_t, int);
+static int position_for(const FrozenNameMap*, uint64_t, uint16_t);
+static void *allocate(size_t, const char*);
+
+/**
+ * Creates an immutable copy of the names in a map. Searching the copy always takes exactly one
+ * slot and one key comparison, and it needs a few bits per name on top of the names themselves.
+ * @param map The map to copy. This isn't modified, and needn't outlive the frozen map.
+ * @return The frozen map. This must be freed with <code>free_frozen_name_map</code>.
+ */
+FrozenNameMap *freeze_name_map(const NameMap *map)
+{
+  FrozenNameMap *frozen = calloc(1, sizeof(FrozenNameMap));
+  if (!frozen) {
+    printf("Failed to allocate memory for the frozen name map\n");
+    exit(1);
+  }
+
+  int count;
+  const char **names = collect_names(map, &count);
+  frozen->number_of_names = count;
+  frozen->table_size = count ? (int) (count / FROZEN_LOAD_FACTOR) + 1 : 0;
+  frozen->bucket_count = count / FROZEN_BUCKET_SIZE + 1;
+  frozen->hash_config = default_name_map_config();
+  frozen->hash_config.hash_policy = HASH_POLICY_SEEDED;
+
+  uint64_t *hashes = allocate(count * sizeof(uint64_t), "the name hashes");
+  int *positions = allocate(count * sizeof(int), "the name positions");
+  frozen->pilots = allocate(frozen->bucket_count * sizeof(uint16_t), "the pilots");
+
+  // Try new seeds until every bucket can be placed
+  bool placed = false;
+  for (int attempt = 0; attempt < MAX_FREEZE_ATTEMPTS && !placed; attempt++)
+  {
+    frozen->hash_config.hash_seed = mix64((uint64_t) attempt + 1);
+    for (int i = 0; i < count; i++)
+      hashes[i] = hash_with_config(&frozen->hash_config, names[i]);
+    placed = place_names(frozen, hashes, positions);
+  }
+  if (!placed) {
+    printf("Failed to find a perfect hash for the names\n");
+    exit(1);
+  }
+  remap_slots(frozen, positions);
+
+  // Copy the names into a single block, and point each name's slot at its copy
+  for (int i = 0; i < count; i++)
+    frozen->name_bytes += strlen(names[i]) + 1;
+  if (frozen->name_bytes > UINT32_MAX) {
+    printf("Too many bytes of names to freeze\n");
+    exit(1);
+  }
+  frozen->names = allocate(frozen->name_bytes, "the frozen names");
+  frozen->offsets = allocate(count * sizeof(uint32_t), "the name offsets");
+  size_t offset = 0;
+  for (int i = 0; i < count; i++)
+  {
+    size_t length = strlen(names[i]) + 1;
+    memcpy(frozen->names + offset, names[i], length);
+    frozen->offsets[positions[i]] = (uint32_t) offset;
+    offset += length;
+  }
+
+  free(names);
+  free(hashes);
+  free(positions);
+  return frozen;
+}
+
+/**
+ * Frees a frozen map, including its copies of the names, or unmaps it if it was loaded from an
+ * image.
+ * @param map The map to free. May be <code>NULL</code>, in which case nothing happens.
+ */
+void free_frozen_name_map(FrozenNameMap *map)
+{
+  if (!map)
+    return;
+
+  // A loaded map's arrays all live in its image
+  if (map->mapping)
+  {
+    unmap_name_map_image(map);
+    return;
+  }
+
+  free(map->pilots);
+  free(map->remap);
+  free(map->offsets);
+  free(map->names);
+  free(map);
+}
+
+/**
+ * Allocates memory, exiting if it can't be allocated.
+ * @param size The number of bytes to allocate. If this is <code>0</code>, a single byte is
+ * allocated so that the result can always be freed.
+ * @param description What is being allocated, for the error message.
+ * @return The memory.
+ */
+static void *allocate(size_t size, const char *description)
+{
+  void *memory = malloc(size ? size : 1);
+  if (!memory) {
+    printf("Failed to allocate memory for %s\n", description);
+    exit(1);
+  }
+  return memory;
+}
+
+/**
+ * Gets every live name in a map, including any that an incremental resize hasn't moved yet.
+ * @param map The map.
+ * @param count Will be set to the number of names.
+ * @return The names, which still belong to the map. The array itself must be freed.
+ */
+static const char **collect_names(const NameMap *map, int *count)
+{
+  const char **names = allocate(get_name_map_counters(map).live_entries * sizeof(char*), "names");
+  *count = 0;
+  for (const NameMap *storage = map; storage; storage = storage->retiring)
+  {
+    for (int64_t i = 0; i < storage->current_size; i++)
+    {
+      const char *name = storage->engine->name_at(storage, i);
+      if (name)
+        names[(*count)++] = name;
+    }
+  }
+  return names;
+}
+
+/**
+ * Maps a 64-bit value onto <code>[0, range)</code> with a multiply rather than a division.
+ * @param value The value to reduce. Only the bottom 32 bits are used.
+ * @param range The size of the range.
+ * @return The reduced value.
+ */
+static uint32_t reduce(uint64_t value, int range)
+{
+  return (uint32_t) (((value & UINT32_MAX) * (uint64_t) range) >> 32);
+}
+
+/**
+ * Gets the slot that a name is placed into, before remapping.
+ * @param map The frozen map.
+ * @param hash The hash of the name.
+ * @param pilot The pilot of the name's bucket.
+ * @return The slot.
+ */
+static int position_for(const FrozenNameMap *map, uint64_t hash, uint16_t pilot)
+{
+  // Mix after combining with the pilot, so that names that collide under one pilot are no more
+  // likely than any other pair to collide under the next
+  return (int) reduce(mix64(hash + pilot * PILOT_MULTIPLIER), map->table_size);
+}
+
+/**
+ * Finds a pilot for every bucket, so that every name is sent to a different slot.
+ * @param map The frozen map, with its sizes and seed set.
+ * @param hashes The hash of each name.
+ * @param positions Will be set to the slot of each name, before remapping.
+ * @return <code>true</code> if every bucket was placed, or <code>false</code> if the seed needs
+ * changing.
+ */
+static bool place_names(FrozenNameMap *map, const uint64_t *hashes, int *positions)
+{
+  int count = map->number_of_names;
+  int buckets = map->bucket_count;
+
+  // Group the names by bucket, with a counting sort. bucket_starts[b] is the index in by_bucket of
+  // the first name in bucket b
+  int *bucket_starts = calloc(buckets + 1, sizeof(int));
+  int *by_bucket = allocate(count * sizeof(int), "the bucketed names");
+  int *by_size = allocate(buckets * sizeof(int), "the sorted buckets");
+  bool *taken = calloc(map->table_size + 1, sizeof(bool));
+  if (!bucket_starts || !taken) {
+    printf("Failed to allocate memory for the buckets\n");
+    exit(1);
+  }
+
+  for (int i = 0; i < count; i++)
+    bucket_starts[reduce(hashes[i] >> 32, buckets) + 1]++;
+  int largest = 0;
+  for (int b = 0; b < buckets; b++)
+  {
+    if (bucket_starts[b + 1] > largest)
+      largest = bucket_starts[b + 1];
+    bucket_starts[b + 1] += bucket_starts[b];
+  }
+  int *filled = allocate((buckets + largest + 1) * sizeof(int), "the bucket counts");
+  memcpy(filled, bucket_starts, buckets * sizeof(int));
+  for (int i = 0; i < count; i++)
+    by_bucket[filled[reduce(hashes[i] >> 32, buckets)]++] = i;
+
+  // Order the buckets from largest to smallest, again with a counting sort
+  int *size_starts = filled + buckets;
+  memset(size_starts, 0, (largest + 1) * sizeof(int));
+  for (int b = 0; b < buckets; b++)
+    size_starts[largest - (bucket_starts[b + 1] - bucket_starts[b])]++;
+  for (int size = 0, total = 0; size <= largest; size++)
+  {
+    int bucket_total = size_starts[size];
+    size_starts[size] = total;
+    total += bucket_total;
+  }
+  for (int b = 0; b < buckets; b++)
+    by_size[size_starts[largest - (bucket_starts[b + 1] - bucket_starts[b])]++] = b;
+
+  bool placed = true;
+  for (int i = 0; i < buckets && placed; i++)
+  {
+    int bucket = by_size[i];
+    int start = bucket_starts[bucket];
+    int end = bucket_starts[bucket + 1];
+    map->pilots[bucket] = 0;
+    if (start == end)
+      continue;
+
+    // Try each pilot until every name in the bucket lands in a different free slot
+    placed = false;
+    for (int pilot = 0; pilot <= MAX_PILOT && !placed; pilot++)
+    {
+      int j;
+      for (j = start; j < end; j++)
+      {
+        int name = by_bucket[j];
+        positions[name] = position_for(map, hashes[name], (uint16_t) pilot);
+        if (taken[positions[name]])
+          break;
+        taken[positions[name]] = true;
+      }
+
+      if (j == end)
+      {
+        map->pilots[bucket] = (uint16_t) pilot;
+        placed = true;
+      } else
+      {
+        // Release the slots claimed by this pilot before trying the next one
+        while (--j >= start)
+          taken[positions[by_bucket[j]]] = false;
+      }
+    }
+  }
+
+  free(bucket_starts);
+  free(by_bucket);
+  free(by_size);
+  free(filled);
+  free(taken);
+  return placed;
+}
+
+/**
+ * Moves every name placed beyond the last slot into one of the slots that was left empty, so that
+ * there is exactly one slot per name.
+ * @param map The frozen map, with every bucket placed.
+ * @param positions The slot of each name. These are updated to the remapped slots.
+ */
+static void remap_slots(FrozenNameMap *map, int *positions)
+{
+  int count = map->number_of_names;
+  int extra = map->table_size - count;
+  map->remap = allocate(extra * sizeof(uint32_t), "the remapped slots");
+
+  bool *taken = calloc(map->table_size + 1, sizeof(bool));
+  if (!taken) {
+    printf("Failed to allocate memory for the remapped slots\n");
+    exit(1);
+  }
+  for (int i = 0; i < count; i++)
+    taken[positions[i]] = true;
+
+  // Pair each extra slot with the next empty slot, whether or not a name landed in it, so that a
+  // search never needs to check whether a remap entry is in use
+  int empty = 0;
+  for (int i = 0; i < extra; i++)
+  {
+    while (empty < count && taken[empty])
+      empty++;
+    map->remap[i] = (uint32_t) (empty < count ? empty : 0);
+    if (empty < count && taken[count + i])
+      taken[empty] = true;
+  }
+
+  for (int i = 0; i < count; i++)
+  {
+    if (positions[i] >= count)
+      positions[i] = (int) map->remap[positions[i] - count];
+  }
+  free(taken);
+}
+
+/**
+ * Searches a frozen map for a name.
+ * @param map The map to search.
+ * @param name The name to search for.
+ * @return <code>1</code> if the name is in the map, or <code>0</code> if it isn't.
+ */
+int search_frozen_name_map(const FrozenNameMap *map, const char *name)
+{
+  if (!map->number_of_names)
+    return 0;
+
+  uint64_t hash = hash_with_config(&map->hash_config, name);
+  int position = position_for(
+      map, hash, map->pilots[reduce(hash >> 32, map->bucket_count)]
+  );
+  if (position >= map->number_of_names)
+    position = (int) map->remap[position - map->number_of_names];
+
+  return NAME_MAP_STRCMP(map->names + map->offsets[position], name) == 0;
+}
+
+/**
+ * Gets a snapshot of a frozen map's counters. Frozen maps never hold tombstones, purge or shrink.
+ * @param map The map.
+ * @return The counters.
+ */
+NameMapCounters get_frozen_name_map_counters(const FrozenNameMap *map)
+{
+  NameMapCounters counters = {
+      .capacity = (size_t) map->number_of_names,
+      .live_entries = (size_t) map->number_of_names,
+      .tombstones = 0,
+      .tombstone_purges = 0,
+      .shrinks = 0,
+      .memory_bytes = sizeof(FrozenNameMap)
+          + map->bucket_count * sizeof(uint16_t)
+          + (size_t) (map->table_size - map->number_of_names) * sizeof(uint32_t)
+          + (size_t) map->number_of_names * sizeof(uint32_t)
+          + map->name_bytes
+  };
+  return counters;
+}
@@ -0,0 +1,358 @@
+/*
+ ============================================================================
+ Name        : CWK2Q3GroupProbing.c
+ Description :
+ A group probing table engine for the Q3 hash map. Alongside the names, the
+ table keeps one control byte per slot, which is either empty, deleted or
+ holds a 7-bit fragment of the name's hash. Slots are probed in aligned
+ groups of 16: the control bytes of a whole group are compared against the
+ fragment at once (using SSE2 where available), so only names whose fragment
+ matches are ever loaded and compared.
+
+ ============================================================================
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "CWK2Q3Internal.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define GROUP_WIDTH 16
+#define CONTROL_EMPTY ((uint8_t) 0x80)
+#define CONTROL_DELETED ((uint8_t) 0xFE)
+
+static void group_probing_resize(NameMap*, int64_t);
+static void group_probing_insert(NameMap*, const char*, uint64_t, uint64_t, uint64_t);
+static void group_probing_remove_at(NameMap*, int64_t);
+static int64_t group_probing_find(const NameMap*, const char*, uint64_t, uint64_t);
+static int64_t group_probing_index_of(const NameMap*, const char*, uint64_t);
+static int64_t group_probing_home_index(const NameMap*, const char*, uint64_t);
+static void group_probing_print_slot(const NameMap*, int64_t);
+static const char *group_probing_name_at(const NameMap*, int64_t);
+static void group_probing_free_storage(NameMap*);
+static void group_probing_probe_lengths(const NameMap*, NameMapStats*);
+static uint64_t spread_hash(const NameMap*, uint64_t);
+static uint16_t match_byte(const uint8_t*, uint8_t);
+static int lowest_set_bit(uint16_t);
+
+const NameMapEngineOps group_probing_engine = {
+    .resize = group_probing_resize,
+    .insert = group_probing_insert,
+    .remove_at = group_probing_remove_at,
+    .index_of = group_probing_index_of,
+    .home_index = group_probing_home_index,
+    .collect_probe_lengths = group_probing_probe_lengths,
+    .print_slot = group_probing_print_slot,
+    .name_at = group_probing_name_at,
+    .free_storage = group_probing_free_storage,
+    .compact_names = NULL
+};
+
+/**
+ * Gets a hash whose high bits are as well distributed as its low bits, so that the control byte
+ * fragment and the group can both be taken from it. The 64-bit policies already are, but the ASCII
+ * sum needs mixing.
+ * @param map The map the hash belongs to.
+ * @param hash The hash, as given by <code>hash_of</code>.
+ * @return The spread hash.
+ */
+static uint64_t spread_hash(const NameMap *map, uint64_t hash)
+{
+  return map->config.hash_policy == HASH_POLICY_ASCII_SUM ? mix64(hash) : hash;
+}
+
+/**
+ * Finds every control byte in a group that equals the given value.
+ * @param group The first control byte of the group.
+ * @param value The value to look for.
+ * @return A mask with bit <code>i</code> set if <code>group[i] == value</code>.
+ */
+static uint16_t match_byte(const uint8_t *group, uint8_t value)
+{
+#ifdef __SSE2__
+  __m128i control = _mm_loadu_si128((const __m128i*) group);
+  return (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(control, _mm_set1_epi8((char) value)));
+#else
+  uint16_t mask = 0;
+  for (int i = 0; i < GROUP_WIDTH; i++)
+  {
+    if (group[i] == value)
+      mask |= (uint16_t) (1u << i);
+  }
+  return mask;
+#endif
+}
+
+/**
+ * Gets the position of the lowest set bit in a non-zero mask.
+ * @param mask The mask.
+ * @return The position of the lowest set bit.
+ */
+static int lowest_set_bit(uint16_t mask)
+{
+  return __builtin_ctz(mask);
+}
+
+/**
+ * Moves every name into new storage. The capacity is rounded up to a whole number of groups.
+ * @param map The map to resize.
+ * @param new_size The new capacity of the map.
+ */
+static void group_probing_resize(NameMap *map, int64_t new_size)
+{
+  NameMap old = *map;
+
+  allocate_slots(map, (new_size + GROUP_WIDTH - 1) / GROUP_WIDTH * GROUP_WIDTH);
+
+  map->control_bytes = malloc((size_t) map->current_size);
+  if (!map->control_bytes) {
+    printf("Failed to allocate memory for the control bytes\n");
+    exit(1);
+  }
+  memset(map->control_bytes, CONTROL_EMPTY, (size_t) map->current_size);
+
+  // Deleted slots are simply skipped, so resizing also clears them out
+  for (int64_t i = 0; i < old.current_size; i++)
+  {
+    if (old.hash_map[i] && old.control_bytes[i] != CONTROL_DELETED)
+    {
+      group_probing_insert(
+          map, old.hash_map[i], stored_hash_at(&old, i), old.fingerprints ? old.fingerprints[i] : 0,
+          stored_count_at(&old, i)
+      );
+    }
+  }
+
+  free_slots(&old);
+  group_probing_free_storage(&old);
+}
+
+/**
+ * Adds the name to the map, unless an equivalent name is already present. The name is placed in
+ * the first empty or deleted slot along its probe sequence.
+ * @param map The map to add the name to.
+ * @param name The value to add to the map.
+ * @param hash The hash of <code>name</code>, as given by <code>hash_of</code>.
+ * @param fingerprint The fingerprint of <code>name</code>, as given by <code>fingerprint_of</code>.
+ * @param count If the map counts names, the count to store with the name, or to add to the count
+ * of the equivalent name if there is one.
+ */
+static void group_probing_insert(
+    NameMap *map, const char *name, uint64_t hash, uint64_t fingerprint, uint64_t count
+)
+{
+  int64_t existing_index = group_probing_find(map, name, hash, fingerprint);
+  if (existing_index != -1)
+  {
+    if (map->counts)
+      map->counts[existing_index] += count;
+    return;
+  }
+
+  uint64_t spread = spread_hash(map, hash);
+  int64_t group_count = map->current_size / GROUP_WIDTH;
+  int64_t group = (int64_t) (spread % (uint64_t) group_count);
+
+  // The name isn't present, so the first free slot is the best place for it. The load factor
+  // guarantees that there is one.
+  uint16_t available;
+  while (!(available = match_byte(&map->control_bytes[group * GROUP_WIDTH], CONTROL_EMPTY)
+                        | match_byte(&map->control_bytes[group * GROUP_WIDTH], CONTROL_DELETED)))
+    group = group + 1 == group_count ? 0 : group + 1;
+
+  int64_t index = group * GROUP_WIDTH + lowest_set_bit(available);
+  if (map->control_bytes[index] == CONTROL_DELETED)
+    map->number_of_tombstones--;
+  map->control_bytes[index] = (uint8_t) (spread >> 57);
+  map->hash_map[index] = (char*) name;
+  if (map->fingerprints)
+    map->fingerprints[index] = fingerprint;
+  if (map->inline_keys)
+  {
+    InlineKey key;
+    make_inline_key(map, name, &key);
+    store_inline_key(map, index, &key);
+  }
+  if (map->counts)
+    map->counts[index] = count;
+  map->number_of_items++;
+}
+
+/**
+ * Removes the name in the given slot. If the slot's group still has an empty slot, then no probe
+ * sequence has ever passed through the group, so the slot can simply be marked empty. Otherwise,
+ * it has to be marked as deleted so that later names in the probe sequence can still be found.
+ * @param map The map to remove the name from.
+ * @param index The slot holding the name.
+ */
+static void group_probing_remove_at(NameMap *map, int64_t index)
+{
+  const uint8_t *group = &map->control_bytes[index / GROUP_WIDTH * GROUP_WIDTH];
+  if (match_byte(group, CONTROL_EMPTY))
+  {
+    map->control_bytes[index] = CONTROL_EMPTY;
+    map->hash_map[index] = NULL;
+  }
+  else
+  {
+    map->control_bytes[index] = CONTROL_DELETED;
+    map->number_of_tombstones++;
+  }
+
+  map->number_of_items--;
+}
+
+/**
+ * Finds the slot holding the given name. Each group is checked for control bytes matching the
+ * name's hash fragment, and only those slots are compared. The search stops at the first group
+ * with an empty slot, as insertion would never have passed over it.
+ * @param map The map to search.
+ * @param name The value to search for.
+ * @param hash The hash of <code>name</code>, as given by <code>hash_of</code>.
+ * @param fingerprint The fingerprint of <code>name</code>, as given by <code>fingerprint_of</code>.
+ * @return The index of an entry matching <code>name</code>, or <code>-1</code> if the value is not
+ * stored in the map.
+ */
+static int64_t group_probing_find(
+    const NameMap *map, const char *name, uint64_t hash, uint64_t fingerprint
+)
+{
+  uint64_t spread = spread_hash(map, hash);
+  uint8_t fragment = (uint8_t) (spread >> 57);
+  int64_t group_count = map->current_size / GROUP_WIDTH;
+  int64_t group = (int64_t) (spread % (uint64_t) group_count);
+  InlineKey key;
+  if (map->inline_keys)
+    make_inline_key(map, name, &key);
+
+  // If every group is full of names and deleted slots, we give up after visiting each one once
+  for (int64_t probes = 0; probes < group_count; probes++)
+  {
+    const uint8_t *control = &map->control_bytes[group * GROUP_WIDTH];
+    for (uint16_t matches = match_byte(control, fragment); matches; matches &= matches - 1)
+    {
+      int64_t index = group * GROUP_WIDTH + lowest_set_bit(matches);
+      if ((!map->fingerprints || map->fingerprints[index] == fingerprint)
+          && slot_holds_name(map, index, &key, name))
+        return index;
+    }
+
+    if (match_byte(control, CONTROL_EMPTY))
+      return -1;
+
+    group = group + 1 == group_count ? 0 : group + 1;
+  }
+  return -1;
+}
+
+/**
+ * Gets the index of the given value in the map.
+ * @param map The map to search.
+ * @param name The value to search for.
+ * @param hash The hash of the value, as given by <code>hash_of</code>.
+ * @return The index of an entry matching <code>name</code>, or <code>-1</code> if the value is not
+ * stored in the map.
+ */
+static int64_t group_probing_index_of(const NameMap *map, const char *name, uint64_t hash)
+{
+  return group_probing_find(map, name, hash, fingerprint_of(map, name, hash));
+}
+
+/**
+ * Gets the first slot of the group that a search for a name with the given hash starts at.
+ * @param map The map.
+ * @param name The name. Not needed by this engine.
+ * @param hash The hash of the name, as given by <code>hash_of</code>.
+ * @return The index of the first slot in the name's home group.
+ */
+static int64_t group_probing_home_index(const NameMap *map, const char *name, uint64_t hash)
+{
+  (void) name;
+  int64_t group_count = map->current_size / GROUP_WIDTH;
+  return (int64_t) (spread_hash(map, hash) % (uint64_t) group_count) * GROUP_WIDTH;
+}
+
+/**
+ * Prints out the value at the given index in the map, printing <code>[TOMBSTONE]</code> for
+ * deleted slots and nothing for empty slots.
+ * @param map The map to print from.
+ * @param index The index in the map to print.
+ */
+static void group_probing_print_slot(const NameMap *map, int64_t index)
+{
+  if (map->control_bytes[index] == CONTROL_DELETED)
+    printf("[TOMBSTONE]");
+  else if (map->control_bytes[index] != CONTROL_EMPTY)
+    printf("%s", map->hash_map[index]);
+}
+
+/**
+ * Gets the name at the given index in the map.
+ * @param map The map.
+ * @param index The index in the map.
+ * @return The name, or <code>NULL</code> if the slot is empty or deleted.
+ */
+static const char *group_probing_name_at(const NameMap *map, int64_t index)
+{
+  return map->control_bytes[index] == CONTROL_DELETED ? NULL : map->hash_map[index];
+}
+
+/**
+ * Frees the control bytes.
+ * @param map The map (or a copy of the map) whose control bytes should be freed.
+ */
+static void group_probing_free_storage(NameMap *map)
+{
+  free(map->control_bytes);
+  map->control_bytes = NULL;
+}
+
+/**
+ * Records the probe lengths of a group probing map, in groups rather than slots. A search for a
+ * name in the map checks every group from the name's home group up to its own, while a search for
+ * a name that isn't in the map checks every group up to and including the next one with an empty
+ * slot. Misses are recorded once for each slot of the home group, so that they are weighted the
+ * same way as for the other engines.
+ * @param map The map.
+ * @param stats The statistics being gathered.
+ */
+static void group_probing_probe_lengths(const NameMap *map, NameMapStats *stats)
+{
+  int64_t group_count = map->current_size / GROUP_WIDTH;
+  for (int64_t index = 0; index < map->current_size; index++)
+  {
+    if (group_probing_name_at(map, index))
+    {
+      uint64_t hash = stored_hash_at(map, index);
+      int64_t home_group = group_probing_home_index(map, map->hash_map[index], hash) / GROUP_WIDTH;
+      record_probe_length(
+          stats, true, (index / GROUP_WIDTH - home_group + group_count) % group_count + 1
+      );
+    }
+  }
+
+  // Walk backwards from a group with an empty slot, counting how many groups there are before the
+  // next one. Without any such groups, a miss checks every group.
+  int64_t open_group = 0;
+  while (open_group < group_count
+         && !match_byte(&map->control_bytes[open_group * GROUP_WIDTH], CONTROL_EMPTY))
+    open_group++;
+
+  int64_t groups_before_open = 0;
+  for (int64_t step = 0; step < group_count; step++)
+  {
+    int64_t group = (open_group - step + group_count) % group_count;
+    bool open = match_byte(&map->control_bytes[group * GROUP_WIDTH], CONTROL_EMPTY);
+    groups_before_open = open ? 0 : groups_before_open + 1;
+    for (int slot = 0; slot < GROUP_WIDTH; slot++)
+    {
+      record_probe_length(
+          stats, false, open_group == group_count ? group_count : groups_before_open + 1
+      );
+    }
+  }
+}
@@ -0,0 +1,320 @@
+/*
+ ============================================================================
+ Name        : CWK2Q3Image.c
+ Description :
+ A binary image format for frozen Q3 hash maps, so that a process can start
+ serving searches without rebuilding its names. A frozen map holds no
+ pointers (slots refer to names by their offset in a single block), so the
+ image is simply a header followed by each of the frozen map's arrays:
+
+    header | pilots | remap | offsets | names
+
+ Each section starts on an 8-byte boundary, and the header records where.
+ Loading an image maps the file into memory and points a frozen map's arrays
+ straight into the mapping, so nothing is parsed, copied or rehashed, and
+ pages are only read from disk as searches touch them.
+
+ Images use the byte order of the machine that saved them, which is
+ recorded in the header so that a mismatched image is rejected. The header
+ and section bounds are checked when an image is loaded, but the contents of
+ the sections are trusted.
+
+ ============================================================================
+*/
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "CWK2Q3Internal.h"
+
+#define IMAGE_MAGIC "Q3NAMES"
+#define IMAGE_VERSION 1
+#define IMAGE_BYTE_ORDER 0x01020304
+#define IMAGE_ALIGNMENT 8
+
+/**
+ * The start of every image.
+ */
+typedef struct NameMapImageHeader
+{
+  /**
+   * Always <code>IMAGE_MAGIC</code>, followed by a null terminator.
+   */
+  char magic[8];
+
+  /**
+   * The version of the format. Images with a different version are rejected.
+   */
+  uint32_t version;
+
+  /**
+   * <code>IMAGE_BYTE_ORDER</code>, as written by the machine that saved the image.
+   */
+  uint32_t byte_order;
+
+  /**
+   * The number of names in the image.
+   */
+  uint32_t number_of_names;
+
+  /**
+   * The number of slots that names were placed into before remapping.
+   */
+  uint32_t table_size;
+
+  /**
+   * The number of buckets, and so of pilots.
+   */
+  uint32_t bucket_count;
+
+  /**
+   * The <code>HashPolicy</code> used to hash names.
+   */
+  uint32_t hash_policy;
+
+  /**
+   * The seed used to hash names.
+   */
+  uint64_t hash_seed;
+
+  /**
+   * The offset of the pilots section from the start of the image.
+   */
+  uint64_t pilots_offset;
+
+  /**
+   * The offset of the remap section from the start of the image.
+   */
+  uint64_t remap_offset;
+
+  /**
+   * The offset of the slots' name offsets from the start of the image.
+   */
+  uint64_t offsets_offset;
+
+  /**
+   * The offset of the names section from the start of the image.
+   */
+  uint64_t names_offset;
+
+  /**
+   * The number of bytes in the names section.
+   */
+  uint64_t name_bytes;
+
+  /**
+   * The size of the whole image, which must match the size of the file.
+   */
+  uint64_t image_bytes;
+} NameMapImageHeader;
+
+static uint64_t align_section(uint64_t);
+static bool write_section(FILE*, const void*, size_t, uint64_t*);
+static bool section_fits(uint64_t, uint64_t, uint64_t);
+
+/**
+ * Saves a frozen map as an image that can be loaded with <code>load_frozen_name_map</code>.
+ * @param map The map to save.
+ * @param path The path of the file to write. Any existing file is replaced.
+ * @return <code>1</code> if the image was saved, or <code>0</code> if the file couldn't be written.
+ */
+int save_frozen_name_map(const FrozenNameMap *map, const char *path)
+{
+  FILE *file = fopen(path, "wb");
+  if (!file) {
+    printf("Could not open %s\n", path);
+    return 0;
+  }
+
+  size_t pilot_bytes = (size_t) map->bucket_count * sizeof(uint16_t);
+  size_t remap_bytes = (size_t) (map->table_size - map->number_of_names) * sizeof(uint32_t);
+  size_t offset_bytes = (size_t) map->number_of_names * sizeof(uint32_t);
+
+  NameMapImageHeader header = {
+      .magic = IMAGE_MAGIC,
+      .version = IMAGE_VERSION,
+      .byte_order = IMAGE_BYTE_ORDER,
+      .number_of_names = (uint32_t) map->number_of_names,
+      .table_size = (uint32_t) map->table_size,
+      .bucket_count = (uint32_t) map->bucket_count,
+      .hash_policy = (uint32_t) map->hash_config.hash_policy,
+      .hash_seed = map->hash_config.hash_seed,
+      .name_bytes = map->name_bytes
+  };
+  header.pilots_offset = align_section(sizeof(NameMapImageHeader));
+  header.remap_offset = align_section(header.pilots_offset + pilot_bytes);
+  header.offsets_offset = align_section(header.remap_offset + remap_bytes);
+  header.names_offset = align_section(header.offsets_offset + offset_bytes);
+  header.image_bytes = header.names_offset + map->name_bytes;
+
+  uint64_t written = 0;
+  bool saved = write_section(file, &header, sizeof(header), &written)
+      && write_section(file, map->pilots, pilot_bytes, &written)
+      && write_section(file, map->remap, remap_bytes, &written)
+      && write_section(file, map->offsets, offset_bytes, &written)
+      && write_section(file, map->names, map->name_bytes, &written);
+
+  if (fclose(file) != 0 || !saved) {
+    printf("Could not write %s\n", path);
+    return 0;
+  }
+  return 1;
+}
+
+/**
+ * Freezes a map and saves it as an image. See <code>freeze_name_map</code>.
+ * @param map The map to save.
+ * @param path The path of the file to write. Any existing file is replaced.
+ * @return <code>1</code> if the image was saved, or <code>0</code> if the file couldn't be written.
+ */
+int save_name_map(const NameMap *map, const char *path)
+{
+  FrozenNameMap *frozen = freeze_name_map(map);
+  int saved = save_frozen_name_map(frozen, path);
+  free_frozen_name_map(frozen);
+  return saved;
+}
+
+/**
+ * Rounds an offset up to the start of the next section.
+ * @param offset The offset.
+ * @return The offset, rounded up to a multiple of <code>IMAGE_ALIGNMENT</code>.
+ */
+static uint64_t align_section(uint64_t offset)
+{
+  return (offset + IMAGE_ALIGNMENT - 1) / IMAGE_ALIGNMENT * IMAGE_ALIGNMENT;
+}
+
+/**
+ * Pads the file to the start of the next section, then writes the section.
+ * @param file The file being written.
+ * @param data The contents of the section.
+ * @param length The number of bytes in the section.
+ * @param written The number of bytes written to the file so far. This is updated.
+ * @return <code>true</code> if the section was written.
+ */
+static bool write_section(FILE *file, const void *data, size_t length, uint64_t *written)
+{
+  static const char padding[IMAGE_ALIGNMENT] = { 0 };
+  size_t padding_length = (size_t) (align_section(*written) - *written);
+  if (fwrite(padding, 1, padding_length, file) != padding_length
+      || fwrite(data, 1, length, file) != length)
+    return false;
+
+  *written += padding_length + length;
+  return true;
+}
+
+/**
+ * Checks that a section lies entirely within the image.
+ * @param offset The offset of the section.
+ * @param length The number of bytes in the section.
+ * @param image_bytes The size of the image.
+ * @return <code>true</code> if the section fits.
+ */
+static bool section_fits(uint64_t offset, uint64_t length, uint64_t image_bytes)
+{
+  return offset % IMAGE_ALIGNMENT == 0 && offset <= image_bytes && length <= image_bytes - offset;
+}
+
+/**
+ * Loads an image saved by <code>save_frozen_name_map</code> or <code>save_name_map</code>. The file
+ * is mapped into memory rather than read, so this takes the same time however many names the image
+ * holds. The file mustn't be modified while the map is in use.
+ * @param path The path of the image.
+ * @return The frozen map, or <code>NULL</code> if the file couldn't be read or isn't a valid image.
+ * This must be freed with <code>free_frozen_name_map</code>, which unmaps the file.
+ */
+FrozenNameMap *load_frozen_name_map(const char *path)
+{
+  int descriptor = open(path, O_RDONLY);
+  if (descriptor == -1) {
+    printf("Could not open %s\n", path);
+    return NULL;
+  }
+
+  struct stat file_status;
+  if (fstat(descriptor, &file_status) != 0
+      || (size_t) file_status.st_size < sizeof(NameMapImageHeader)) {
+    printf("%s is not a name map image\n", path);
+    close(descriptor);
+    return NULL;
+  }
+
+  size_t length = (size_t) file_status.st_size;
+  void *mapping = mmap(NULL, length, PROT_READ, MAP_PRIVATE, descriptor, 0);
+  close(descriptor); // The mapping keeps the file open
+  if (mapping == MAP_FAILED) {
+    printf("Could not map %s\n", path);
+    return NULL;
+  }
+
+  // Check the header and that every section lies within the file
+  const NameMapImageHeader *header = mapping;
+  const char *image = mapping;
+  bool valid = memcmp(header->magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC)) == 0
+      && header->version == IMAGE_VERSION
+      && header->byte_order == IMAGE_BYTE_ORDER
+      && header->image_bytes == length
+      && header->number_of_names <= INT32_MAX
+      && header->table_size <= INT32_MAX
+      && header->number_of_names <= header->table_size
+      && header->bucket_count > 0
+      && header->hash_policy <= HASH_POLICY_FNV1A
+      && section_fits(header->pilots_offset, header->bucket_count * sizeof(uint16_t), length)
+      && section_fits(
+          header->remap_offset,
+          (uint64_t) (header->table_size - header->number_of_names) * sizeof(uint32_t), length
+      )
+      && section_fits(
+          header->offsets_offset, (uint64_t) header->number_of_names * sizeof(uint32_t), length
+      )
+      && section_fits(header->names_offset, header->name_bytes, length)
+      && (header->number_of_names == 0
+          || (header->name_bytes > 0
+              && image[header->names_offset + header->name_bytes - 1] == '\0'));
+  if (!valid) {
+    printf("%s is not a valid name map image\n", path);
+    munmap(mapping, length);
+    return NULL;
+  }
+
+  FrozenNameMap *map = calloc(1, sizeof(FrozenNameMap));
+  if (!map) {
+    printf("Failed to allocate memory for the frozen name map\n");
+    exit(1);
+  }
+  map->number_of_names = (int) header->number_of_names;
+  map->table_size = (int) header->table_size;
+  map->bucket_count = (int) header->bucket_count;
+  map->hash_config = default_name_map_config();
+  map->hash_config.hash_policy = (HashPolicy) header->hash_policy;
+  map->hash_config.hash_seed = header->hash_seed;
+
+  // The arrays are never written to, so can point straight into the read-only mapping
+  map->pilots = (uint16_t*) (image + header->pilots_offset);
+  map->remap = (uint32_t*) (image + header->remap_offset);
+  map->offsets = (uint32_t*) (image + header->offsets_offset);
+  map->names = (char*) (image + header->names_offset);
+  map->name_bytes = header->name_bytes;
+  map->mapping = mapping;
+  map->mapping_length = length;
+  return map;
+}
+
+/**
+ * Unmaps the image that a frozen map was loaded from, and frees the map.
+ * @param map The map, which must have been loaded with <code>load_frozen_name_map</code>.
+ */
+void unmap_name_map_image(FrozenNameMap *map)
+{
+  munmap(map->mapping, map->mapping_length);
+  free(map);
+}
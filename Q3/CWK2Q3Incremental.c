@@ -0,0 +1,161 @@
+/*
+ ============================================================================
+ Name        : CWK2Q3Incremental.c
+ Description :
+ Incremental resizing for the Q3 hash map. Rather than moving every name in
+ one pass, growing the map allocates the new storage and keeps the old
+ storage alive as a "retiring" map. Each subsequent add or remove then moves
+ a bounded number of the retiring map's slots across, so no single operation
+ pays for the whole rehash. Every name lives in exactly one of the two, so
+ searches check the new storage and then the retiring storage.
+
+ ============================================================================
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include "CWK2Q3Internal.h"
+
+/**
+ * Starts moving the map's names into new storage of the given size. The existing storage becomes
+ * the map's retiring map, and the map itself is left with empty storage of the new size.
+ * @param map The map to resize. This must not already be resizing.
+ * @param new_size The new capacity of the map.
+ */
+void start_incremental_resize(NameMap *map, int64_t new_size)
+{
+  uint64_t started = start_rehash_timer(map);
+  map->resizes++;
+
+  // Searches of the retiring map only stop at an empty slot, and nothing is ever added to it again
+  // to change that. If the names and tombstones have used up every slot, move everything at once
+  // instead, so that a search can never loop round it forever
+  if (map->number_of_items + map->number_of_tombstones >= map->current_size)
+  {
+    map->engine->resize(map, new_size);
+    compact_name_map(map);
+    stop_rehash_timer(map, started);
+    return;
+  }
+
+  NameMap *retiring = malloc(sizeof(NameMap));
+  if (!retiring) {
+    printf("Failed to allocate memory for the retiring map\n");
+    exit(1);
+  }
+  *retiring = *map;
+
+  // Detach the storage from the map, so that the engine's resize has nothing to move and simply
+  // allocates empty storage
+  map->hash_map = NULL;
+  map->fingerprints = NULL;
+  map->probe_distances = NULL;
+  map->control_bytes = NULL;
+  map->inline_keys = NULL;
+  map->counts = NULL;
+  map->name_offsets = NULL;
+  map->current_size = 0;
+
+  // The compact engine's names stay in the retiring map's pool, and are copied into a new pool as
+  // they are moved
+  map->string_pool = NULL;
+  map->string_pool_used = 0;
+  map->string_pool_capacity = 0;
+  map->engine->resize(map, new_size);
+
+  // The arena stays with the map, which may replace it (e.g. when compacting) while names are still
+  // being moved, so the retiring map mustn't keep its own pointer to it
+  retiring->key_arena = NULL;
+
+  // The filter keeps covering every name, while a filter for the new storage is filled in as names
+  // are moved into it
+  retiring->bloom_filter = NULL;
+  if (map->bloom_filter)
+  {
+    double expected_names = (double) new_size * max_load_factor_of(map);
+    map->next_bloom_filter = create_bloom_filter((size_t) expected_names);
+  }
+
+  map->retiring = retiring;
+  map->migration_index = 0;
+  stop_rehash_timer(map, started);
+}
+
+/**
+ * Moves up to the given number of the retiring map's slots into the map's new storage. Each name
+ * that is moved is removed from the retiring map, so that it is never found in both. Once every
+ * slot has been moved, the retiring map is freed.
+ * @param map The map that is resizing. Nothing happens if the map isn't resizing.
+ * @param slots The maximum number of slots to move.
+ */
+void migrate_slots(NameMap *map, int slots)
+{
+  NameMap *retiring = map->retiring;
+  if (!retiring)
+    return;
+
+  uint64_t started = start_rehash_timer(map);
+  for (int work = 0; work < slots && map->migration_index < retiring->current_size; work++)
+  {
+    int64_t index = map->migration_index;
+    const char *name = retiring->engine->name_at(retiring, index);
+    if (!name)
+    {
+      map->migration_index++;
+      continue;
+    }
+
+    uint64_t hash = stored_hash_at(retiring, index);
+    uint64_t fingerprint = retiring->fingerprints ? retiring->fingerprints[index] : 0;
+    map->engine->insert(map, name, hash, fingerprint, stored_count_at(retiring, index));
+    if (map->next_bloom_filter)
+      add_to_bloom_filter(map->next_bloom_filter, filter_hash_of(map, name, hash));
+    retiring->engine->remove_at(retiring, index);
+
+    // We don't move on to the next slot here, as removing the name may have shifted another name
+    // into this slot (e.g. with the Robin Hood engine)
+  }
+
+  if (map->migration_index >= retiring->current_size)
+  {
+    // Every name is now in the new storage, so its filter is complete
+    if (map->next_bloom_filter)
+    {
+      free_bloom_filter(map->bloom_filter);
+      map->bloom_filter = map->next_bloom_filter;
+      map->next_bloom_filter = NULL;
+    }
+    free_retiring_map(map);
+  }
+  stop_rehash_timer(map, started);
+}
+
+/**
+ * Moves every remaining slot of the retiring map into the map's new storage.
+ * @param map The map that is resizing. Nothing happens if the map isn't resizing.
+ */
+void finish_incremental_resize(NameMap *map)
+{
+  while (map->retiring)
+    migrate_slots(map, INT_MAX);
+}
+
+/**
+ * Frees the map's retiring map, without moving any of its names. The names themselves (and any
+ * arena they live in) belong to the map, so these aren't freed.
+ * @param map The map. Nothing happens if the map isn't resizing.
+ */
+void free_retiring_map(NameMap *map)
+{
+  NameMap *retiring = map->retiring;
+  if (!retiring)
+    return;
+
+  if (retiring->engine->free_storage)
+    retiring->engine->free_storage(retiring);
+  free_slots(retiring);
+  free(retiring);
+  map->retiring = NULL;
+  map->migration_index = 0;
+}
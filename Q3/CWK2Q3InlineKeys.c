@@ -0,0 +1,107 @@
+/*
+ ============================================================================
+ Name        : CWK2Q3InlineKeys.c
+ Description :
+ Inline copies of short names, kept in an array that runs parallel to a Q3
+ hash map's slots. Every slot of the map is a pointer to a name stored
+ somewhere else, so comparing against a slot's name normally costs a cache
+ miss before the comparison can even begin. With inline keys, each slot also
+ has a few words holding:
+
+    length | name | zero padding
+
+ where the length takes a single byte. A name is compared against a slot by
+ building the same words for it once, then comparing them a whole word at a
+ time, without ever following the slot's pointer. Names too long to fit are
+ marked with a length of INLINE_KEY_LONG and store as much of the name as
+ fits, so most mismatches are still found without following the pointer,
+ which is only needed to confirm a match.
+
+ The slots keep their pointers, so everything else that reads the names
+ (printing, freezing, compaction and so on) is unaffected.
+
+ ============================================================================
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "CWK2Q3Internal.h"
+
+/**
+ * Gets the number of words of inline key stored per slot for the given config.
+ * @param config The map's config.
+ * @return The number of words, or <code>0</code> if the map doesn't store inline keys.
+ */
+int inline_key_words_for(const NameMapConfig *config)
+{
+  if (config->inline_key_bytes <= 0)
+    return 0;
+
+  // Round up to a whole number of words, including the length byte
+  int words = (config->inline_key_bytes + (int) sizeof(uint64_t)) / (int) sizeof(uint64_t);
+  return words < MAX_INLINE_KEY_WORDS ? words : MAX_INLINE_KEY_WORDS;
+}
+
+/**
+ * Builds the inline key of a name, in the form it is stored in a slot.
+ * @param map The map that the name is being stored in or searched for.
+ * @param name The name.
+ * @param key Where to build the inline key. Only the map's number of words are written.
+ */
+void make_inline_key(const NameMap *map, const char *name, InlineKey *key)
+{
+  size_t capacity = (size_t) map->inline_key_words * sizeof(uint64_t) - 1;
+  size_t length = strlen(name);
+
+  uint8_t *bytes = (uint8_t*) key->words;
+  memset(bytes, 0, (size_t) map->inline_key_words * sizeof(uint64_t));
+  bytes[0] = length <= capacity ? (uint8_t) length : INLINE_KEY_LONG;
+  memcpy(&bytes[1], name, length <= capacity ? length : capacity);
+}
+
+/**
+ * Stores an inline key in a slot.
+ * @param map The map.
+ * @param index The slot.
+ * @param key The inline key, as built by <code>make_inline_key</code>.
+ */
+void store_inline_key(NameMap *map, int64_t index, const InlineKey *key)
+{
+  memcpy(
+      &map->inline_keys[(size_t) index * map->inline_key_words], key->words,
+      (size_t) map->inline_key_words * sizeof(uint64_t)
+  );
+}
+
+/**
+ * Swaps the inline key in a slot with another inline key.
+ * @param map The map.
+ * @param index The slot.
+ * @param key The inline key to store in the slot, which is replaced by the one that was there.
+ */
+void swap_inline_key(NameMap *map, int64_t index, InlineKey *key)
+{
+  uint64_t *slot = &map->inline_keys[(size_t) index * map->inline_key_words];
+  for (int i = 0; i < map->inline_key_words; i++)
+  {
+    uint64_t word = slot[i];
+    slot[i] = key->words[i];
+    key->words[i] = word;
+  }
+}
+
+/**
+ * Copies the inline key in one slot to another.
+ * @param map The map.
+ * @param to The slot to copy to.
+ * @param from The slot to copy from.
+ */
+void move_inline_key(NameMap *map, int64_t to, int64_t from)
+{
+  memcpy(
+      &map->inline_keys[(size_t) to * map->inline_key_words],
+      &map->inline_keys[(size_t) from * map->inline_key_words],
+      (size_t) map->inline_key_words * sizeof(uint64_t)
+  );
+}
@@ -0,0 +1,494 @@
+#ifndef CWK2Q3_INTERNAL_H
+#define CWK2Q3_INTERNAL_H
+
+// Shared between the translation units that implement the Q3 map. Users of the map should only
+// include CWK2Q3.h.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "CWK2Q3.h"
+
+#define MAX_LOAD_FACTOR 0.7
+#define MAX_INLINE_KEY_WORDS 8
+#define INLINE_KEY_LONG ((uint8_t) 0xFF)
+// The compact engine's reserved offsets. Every name is stored at a higher offset.
+#define COMPACT_SLOT_EMPTY ((uint32_t) 0)
+#define COMPACT_SLOT_TOMBSTONE ((uint32_t) 1)
+
+// Benchmarks can count key comparisons by compiling with -DNAME_MAP_STRCMP=<function>
+#ifdef NAME_MAP_STRCMP
+int NAME_MAP_STRCMP(const char*, const char*);
+#else
+#define NAME_MAP_STRCMP strcmp
+#endif
+
+typedef struct ArenaChunk ArenaChunk;
+typedef struct BloomFilter BloomFilter;
+
+/**
+ * Storage for the names owned by a map. See CWK2Q3Arena.c.
+ */
+typedef struct KeyArena
+{
+  /**
+   * The chunk that names are currently being copied into.
+   */
+  ArenaChunk *current;
+
+  /**
+   * The number of bytes that have been handed out, including those of names that have since been
+   * removed from the map.
+   */
+  size_t bytes_used;
+
+  /**
+   * The total size of every chunk in the arena.
+   */
+  size_t bytes_reserved;
+} KeyArena;
+
+/**
+ * The inline copy of a name, as stored in a slot of a map with inline keys. See CWK2Q3InlineKeys.c.
+ */
+typedef struct InlineKey
+{
+  /**
+   * The length byte, then the name, then zero padding. Only the map's number of words are used.
+   */
+  uint64_t words[MAX_INLINE_KEY_WORDS];
+} InlineKey;
+
+/**
+ * The operations that differ between table engines. The public functions in CWK2Q3.c take care of
+ * everything that is common to all engines (hashing, initialisation and growth), then delegate to
+ * these.
+ */
+typedef struct NameMapEngineOps
+{
+  /**
+   * Moves every name into new storage with the given capacity. The load factor has already been
+   * checked, so this should always succeed.
+   */
+  void (*resize)(NameMap *map, int64_t new_size);
+
+  /**
+   * Adds a name, unless it is already present, without growing the map. If the map counts names,
+   * the name's count is set to the given count, or increased by it if the name is already present.
+   */
+  void (*insert)(
+      NameMap *map, const char *name, uint64_t hash, uint64_t fingerprint, uint64_t count
+  );
+
+  /**
+   * Removes the name in the given slot, which must hold a live name.
+   */
+  void (*remove_at)(NameMap *map, int64_t index);
+
+  /**
+   * Gets the slot index of a name, or <code>-1</code> if it isn't present. The hash is as given by
+   * <code>hash_of</code>.
+   */
+  int64_t (*index_of)(const NameMap *map, const char *name, uint64_t hash);
+
+  /**
+   * Gets the first slot that <code>index_of</code> would look at for a name with the given hash,
+   * so that batched searches can prefetch it.
+   */
+  int64_t (*home_index)(const NameMap *map, const char *name, uint64_t hash);
+
+  /**
+   * Records the number of probes a search for each name in the map takes, and the number a search
+   * for a name that isn't in the map takes from each slot, with <code>record_probe_length</code>.
+   */
+  void (*collect_probe_lengths)(const NameMap *map, NameMapStats *stats);
+
+  /**
+   * Prints the value in a single slot, printing nothing for an empty slot.
+   */
+  void (*print_slot)(const NameMap *map, int64_t index);
+
+  /**
+   * Gets the name in a slot, or <code>NULL</code> if the slot doesn't hold a live name.
+   */
+  const char *(*name_at)(const NameMap *map, int64_t index);
+
+  /**
+   * Frees any storage that is specific to the engine. May be <code>NULL</code>.
+   */
+  void (*free_storage)(NameMap *map);
+
+  /**
+   * Reclaims the space used by removed names, for engines that copy every name they insert into
+   * storage of their own. <code>NULL</code> for engines that store the pointers they are given,
+   * which leave owning the names to the map's arena.
+   */
+  void (*compact_names)(NameMap *map);
+} NameMapEngineOps;
+
+/**
+ * A single, independent hash map of names. Each map owns its own underlying array, so any number
+ * of maps can live side by side (e.g. one per tenant or worker thread) without sharing any state.
+ */
+struct NameMap
+{
+  /**
+   * This is where the names are stored.
+   */
+  char **hash_map;
+
+  /**
+   * The capacity of <code>hash_map</code>. This is signed, like the slot indices (which use
+   * <code>-1</code> for a missing name), but 64-bit, so that maps can grow beyond 2^31 slots. The
+   * legacy hash_function interface narrows it back to an int.
+   */
+  int64_t current_size;
+
+  /**
+   * The number of live (i.e. non-tombstone) names stored in the map.
+   */
+  int64_t number_of_items;
+
+  /**
+   * The number of slots holding a tombstone. Always <code>0</code> for engines that don't use
+   * tombstones.
+   */
+  int64_t number_of_tombstones;
+
+  /**
+   * The number of times the map has been rehashed to clear out tombstones.
+   */
+  long tombstone_purges;
+
+  /**
+   * The number of times the map has shrunk because too few of its slots were in use.
+   */
+  long shrinks;
+
+  /**
+   * The number of times the map has moved its names into new storage.
+   */
+  long resizes;
+
+  /**
+   * If <code>config.time_resizes</code> is set, the total time spent moving names into new
+   * storage.
+   */
+  uint64_t rehash_nanoseconds;
+
+  /**
+   * The options the map was created with.
+   */
+  NameMapConfig config;
+
+  /**
+   * The implementation of the engine selected by <code>config.engine</code>.
+   */
+  const NameMapEngineOps *engine;
+
+  /**
+   * If <code>config.cache_hashes</code> is set, this runs parallel to <code>hash_map</code> and
+   * stores a fingerprint of the name in each occupied slot. Otherwise, this is <code>NULL</code>.
+   */
+  uint64_t *fingerprints;
+
+  /**
+   * If <code>config.inline_key_bytes</code> is set, this runs parallel to <code>hash_map</code> and
+   * stores <code>inline_key_words</code> words of inline key for each occupied slot. Otherwise,
+   * this is <code>NULL</code>.
+   */
+  uint64_t *inline_keys;
+
+  /**
+   * If <code>config.count_names</code> is set, this runs parallel to <code>hash_map</code> and
+   * stores the number of times the name in each occupied slot has been added. Otherwise, this is
+   * <code>NULL</code>.
+   */
+  uint64_t *counts;
+
+  /**
+   * The number of words of inline key per slot, or <code>0</code> if the map doesn't store inline
+   * keys.
+   */
+  int inline_key_words;
+
+  /**
+   * Only used by the Robin Hood engine. Runs parallel to <code>hash_map</code> and stores how far
+   * each name is from its ideal position.
+   */
+  int *probe_distances;
+
+  /**
+   * Only used by the group probing and cuckoo engines. Runs parallel to <code>hash_map</code> and
+   * stores one control byte per slot.
+   */
+  uint8_t *control_bytes;
+
+  /**
+   * Only used by the cuckoo engine. The number of names in the stash at the end of
+   * <code>hash_map</code>, so that searches can skip the stash while it is empty.
+   */
+  int stashed_items;
+
+  /**
+   * Only used by the compact engine, in place of <code>hash_map</code>, which is then
+   * <code>NULL</code>. Stores the offset of each slot's name within <code>string_pool</code>, or
+   * <code>COMPACT_SLOT_EMPTY</code> or <code>COMPACT_SLOT_TOMBSTONE</code>.
+   */
+  uint32_t *name_offsets;
+
+  /**
+   * Only used by the compact engine. Every name stored in the map, each followed by a null
+   * terminator, along with any removed names that haven't been reclaimed yet. The first bytes are
+   * reserved, so that no name's offset is one of the reserved offsets.
+   */
+  char *string_pool;
+
+  /**
+   * The number of bytes of <code>string_pool</code> in use.
+   */
+  size_t string_pool_used;
+
+  /**
+   * The size of <code>string_pool</code>.
+   */
+  size_t string_pool_capacity;
+
+  /**
+   * If <code>config.own_keys</code> is set, every name in the map is a copy held in this arena.
+   * Otherwise, this is <code>NULL</code> and the names belong to the caller.
+   */
+  KeyArena *key_arena;
+
+  /**
+   * If <code>config.own_keys</code> is set, the number of arena bytes taken up by live names.
+   */
+  size_t live_key_bytes;
+
+  /**
+   * If <code>config.bloom_filter</code> is set, a filter holding every name in the map (and
+   * possibly some that have been removed). Otherwise, this is <code>NULL</code>.
+   */
+  BloomFilter *bloom_filter;
+
+  /**
+   * If the map has a filter and is part way through an incremental resize, a filter sized for the
+   * new storage, holding every name that has been added to it. Otherwise, this is
+   * <code>NULL</code>.
+   */
+  BloomFilter *next_bloom_filter;
+
+  /**
+   * If the map is part way through an incremental resize, this holds the old storage that names
+   * are still being moved out of. Otherwise, this is <code>NULL</code>.
+   */
+  struct NameMap *retiring;
+
+  /**
+   * The first slot of <code>retiring</code> that hasn't yet been moved.
+   */
+  int64_t migration_index;
+};
+
+/**
+ * An immutable set of names, searched with a minimal perfect hash. See CWK2Q3Frozen.c.
+ */
+struct FrozenNameMap
+{
+  /**
+   * The number of names, which is also the number of slots.
+   */
+  int number_of_names;
+
+  /**
+   * The number of slots that names were placed into before remapping. Slightly more than
+   * <code>number_of_names</code>.
+   */
+  int table_size;
+
+  /**
+   * The number of buckets, and so of pilots.
+   */
+  int bucket_count;
+
+  /**
+   * The hash policy and seed used to hash names. The seed is chosen when the map is frozen.
+   */
+  NameMapConfig hash_config;
+
+  /**
+   * The pilot of each bucket.
+   */
+  uint16_t *pilots;
+
+  /**
+   * For each slot from <code>number_of_names</code> to <code>table_size</code>, the slot that a
+   * name placed there was moved to.
+   */
+  uint32_t *remap;
+
+  /**
+   * The offset within <code>names</code> of the name in each slot.
+   */
+  uint32_t *offsets;
+
+  /**
+   * Every name, each followed by a null terminator.
+   */
+  char *names;
+
+  /**
+   * The number of bytes in <code>names</code>.
+   */
+  size_t name_bytes;
+
+  /**
+   * If the map was loaded from an image, the mapping of the image, which every array above points
+   * into. Otherwise, this is <code>NULL</code> and the arrays are separately allocated.
+   */
+  void *mapping;
+
+  /**
+   * The number of bytes in <code>mapping</code>.
+   */
+  size_t mapping_length;
+};
+
+extern const NameMapEngineOps linear_probing_engine;
+extern const NameMapEngineOps robin_hood_engine;
+extern const NameMapEngineOps group_probing_engine;
+extern const NameMapEngineOps cuckoo_engine;
+extern const NameMapEngineOps compact_engine;
+
+uint64_t mix64(uint64_t value);
+uint64_t choose_hash_seed(const void *owner);
+uint64_t hash_of(const NameMap *map, const char *key);
+uint64_t hash_with_config(const NameMapConfig *config, const char *key);
+int64_t index_for_hash(const NameMap *map, uint64_t hash);
+int64_t home_index_for_hash(const NameMap *map, const char *name, uint64_t hash);
+uint64_t fingerprint_of(const NameMap *map, const char *key, uint64_t hash);
+uint64_t stored_hash_at(const NameMap *map, int64_t index);
+uint64_t stored_count_at(const NameMap *map, int64_t index);
+uint64_t filter_hash_of(const NameMap *map, const char *key, uint64_t hash);
+int64_t next_index(const NameMap *map, int64_t current_index);
+void linear_probing_probe_lengths(const NameMap *map, NameMapStats *stats);
+int remove_name(NameMap *map, const char *name, uint64_t hash);
+int64_t find_name(const NameMap *map, const char *name, uint64_t hash, const NameMap **storage);
+void allocate_slots(NameMap *map, int64_t size);
+void free_slots(NameMap *map);
+void grow_after_insert(NameMap *map);
+
+void start_incremental_resize(NameMap *map, int64_t new_size);
+void migrate_slots(NameMap *map, int slots);
+void finish_incremental_resize(NameMap *map);
+void free_retiring_map(NameMap *map);
+
+KeyArena *create_key_arena(size_t initial_capacity);
+char *copy_into_key_arena(KeyArena *arena, const char *name);
+char *copy_bytes_into_key_arena(KeyArena *arena, const char *name, size_t length);
+void release_last_from_key_arena(KeyArena *arena, const char *copy);
+void free_key_arena(KeyArena *arena);
+
+void unmap_name_map_image(FrozenNameMap *map);
+
+int parallel_thread_count(int requested, size_t count);
+
+int inline_key_words_for(const NameMapConfig *config);
+void make_inline_key(const NameMap *map, const char *name, InlineKey *key);
+void store_inline_key(NameMap *map, int64_t index, const InlineKey *key);
+void swap_inline_key(NameMap *map, int64_t index, InlineKey *key);
+void move_inline_key(NameMap *map, int64_t to, int64_t from);
+
+void record_probe_length(NameMapStats *stats, bool hit, int64_t probes);
+uint64_t start_rehash_timer(const NameMap *map);
+void stop_rehash_timer(NameMap *map, uint64_t started);
+
+BloomFilter *create_bloom_filter(size_t expected_names);
+void free_bloom_filter(BloomFilter *filter);
+void add_to_bloom_filter(BloomFilter *filter, uint64_t hash);
+bool bloom_filter_may_contain(const BloomFilter *filter, uint64_t hash);
+size_t bloom_filter_bytes(const BloomFilter *filter);
+double bloom_filter_false_positive_rate(const BloomFilter *filter);
+void prefetch_bloom_filter(const BloomFilter *filter, uint64_t hash);
+void add_name_to_bloom_filters(NameMap *map, const char *name, uint64_t hash);
+void rebuild_bloom_filter(NameMap *map);
+
+/**
+ * Checks whether a hash policy mixes in <code>NameMapConfig.hash_seed</code>.
+ * @param policy The hash policy.
+ * @return <code>true</code> if maps with different seeds hash names differently.
+ */
+static inline bool hash_policy_uses_seed(HashPolicy policy)
+{
+  return policy == HASH_POLICY_SEEDED || policy == HASH_POLICY_SIPHASH;
+}
+
+/**
+ * Gets the load factor above which the map grows.
+ * @param map The map.
+ * @return The map's <code>max_load_factor</code>, if it is valid, or <code>MAX_LOAD_FACTOR</code>.
+ */
+static inline double max_load_factor_of(const NameMap *map)
+{
+  double max_load_factor = map->config.max_load_factor;
+  return max_load_factor > 0 && max_load_factor < 1 ? max_load_factor : MAX_LOAD_FACTOR;
+}
+
+/**
+ * Gets the name in a slot that holds a live name, wherever the map's engine keeps it.
+ * @param map The map.
+ * @param index The slot, which must hold a live name.
+ * @return The name.
+ */
+static inline const char *slot_name(const NameMap *map, int64_t index)
+{
+  return map->name_offsets ? map->string_pool + map->name_offsets[index] : map->hash_map[index];
+}
+
+/**
+ * Checks whether a slot is in use, i.e. holds a name, a tombstone or (for engines that mark
+ * deleted slots some other way) anything else that a search has to pass over.
+ * @param map The map.
+ * @param index The slot.
+ * @return <code>false</code> if the slot is empty.
+ */
+static inline bool slot_in_use(const NameMap *map, int64_t index)
+{
+  if (map->name_offsets)
+    return map->name_offsets[index] != COMPACT_SLOT_EMPTY;
+  return map->hash_map[index] != NULL;
+}
+
+/**
+ * Checks whether a slot holds the given name. If the map stores inline keys, the slot's inline key
+ * is compared a word at a time, and the slot's name is only read to confirm a match between names
+ * too long to fit. Otherwise, the names are compared directly. Defined here so that it is inlined
+ * into each engine's probe loop.
+ * @param map The map.
+ * @param index The slot, which must hold a live name.
+ * @param key The inline key of <code>name</code>, as built by <code>make_inline_key</code>. Ignored
+ * if the map doesn't store inline keys.
+ * @param name The name.
+ * @return <code>true</code> if the slot holds the name.
+ */
+static inline bool slot_holds_name(
+    const NameMap *map, int64_t index, const InlineKey *key, const char *name
+)
+{
+  if (!map->inline_keys)
+    return NAME_MAP_STRCMP(name, slot_name(map, index)) == 0;
+
+  const uint64_t *slot = &map->inline_keys[(size_t) index * map->inline_key_words];
+  uint64_t difference = 0;
+  for (int i = 0; i < map->inline_key_words; i++)
+    difference |= slot[i] ^ key->words[i];
+  if (difference)
+    return false;
+
+  // Matching words mean matching names, unless both are too long to fit, in which case only the
+  // start of each name has been compared
+  return ((const uint8_t*) key->words)[0] != INLINE_KEY_LONG
+      || NAME_MAP_STRCMP(name, slot_name(map, index)) == 0;
+}
+
+#endif // CWK2Q3_INTERNAL_H
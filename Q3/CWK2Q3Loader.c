@@ -0,0 +1,454 @@
+/*
+ ============================================================================
+ Name        : CWK2Q3Loader.c
+ Description :
+ Bulk loading of names into a Q3 hash map from the quoted, comma-separated
+ format used by names.txt, e.g. "MARY","PATRICIA","LINDA". Rather than
+ growing the map repeatedly as names are added one at a time, the number of
+ names is counted (for a buffer) or estimated (for a file) up front so that
+ the map is sized once. Names are parsed in a single pass and copied
+ straight into the map's arena. Quotes inside names are not supported.
+
+ Streams of names separated by a single delimiter (e.g. one name per line)
+ can be loaded too. These are usually event logs in which most names are
+ repeats, so the map isn't sized up front, and in a map that counts names
+ every occurrence is counted.
+
+ ============================================================================
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "CWK2Q3Internal.h"
+
+#define LOADER_CHUNK_SIZE (1024 * 1024)
+
+/**
+ * The state of a parse that may be split across several chunks of input.
+ */
+typedef struct NameParser
+{
+  /**
+   * Whether the last chunk ended part way through a name.
+   */
+  bool in_quotes;
+
+  /**
+   * The start of a name that was split across chunks.
+   */
+  char *partial;
+
+  /**
+   * The number of bytes in <code>partial</code>.
+   */
+  size_t partial_length;
+
+  /**
+   * The size of the <code>partial</code> buffer.
+   */
+  size_t partial_capacity;
+
+  /**
+   * If the map copies names into storage of its own rather than its arena, an arena that each
+   * name is null-terminated in while it is added. Otherwise, <code>NULL</code>.
+   */
+  KeyArena *scratch;
+} NameParser;
+
+static void take_ownership_of_names(NameMap*);
+static void presize_for(NameMap*, size_t);
+static int add_loaded_name(NameMap*, NameParser*, const char*, size_t);
+static void append_partial(NameParser*, const char*, size_t);
+static int parse_names(NameMap*, NameParser*, const char*, size_t);
+static int64_t parse_delimited_names(NameMap*, NameParser*, const char*, size_t, char);
+static int64_t add_delimited_name(NameMap*, NameParser*, const char*, size_t, char);
+
+/**
+ * Adds every name in a buffer of quoted, comma-separated names to the map. The map is sized once
+ * for the number of names in the buffer, and the names are copied into the map's arena, so the
+ * buffer needn't outlive the call. If the map didn't already own its names, it takes ownership of
+ * every name already in it as well.
+ * @param map The map to add the names to.
+ * @param buffer The names, e.g. <code>"MARY","PATRICIA"</code>. This needn't be null-terminated.
+ * @param length The number of bytes in <code>buffer</code>.
+ * @return The number of names that were added, not counting duplicates.
+ */
+int load_names_from_buffer(NameMap *map, const char *buffer, size_t length)
+{
+  // Every name is surrounded by a pair of quotes, so counting quotes gives an exact count
+  size_t quotes = 0;
+  for (const char *quote = buffer;
+       (quote = memchr(quote, '"', length - (size_t) (quote - buffer)));
+       quote++)
+    quotes++;
+
+  take_ownership_of_names(map);
+  presize_for(map, quotes / 2);
+
+  NameParser parser = { false, NULL, 0, 0, NULL };
+  int added = parse_names(map, &parser, buffer, length);
+  free(parser.partial);
+  free_key_arena(parser.scratch);
+  return added;
+}
+
+/**
+ * Adds every name in a file of quoted, comma-separated names to the map. The file is streamed in
+ * chunks. The map is sized once, based on the size of the file and the density of names in its
+ * first chunk. If the estimate turns out to be too small, or the file's size can't be found (e.g.
+ * because it is a pipe), the map grows as usual. As with
+ * <code>load_names_from_buffer</code>, the names are copied into the map's arena.
+ * @param map The map to add the names to.
+ * @param path The path of the file.
+ * @return The number of names that were added, not counting duplicates, or <code>-1</code> if the
+ * file couldn't be read.
+ */
+int load_names_from_file(NameMap *map, const char *path)
+{
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    printf("Could not open %s\n", path);
+    return -1;
+  }
+
+  // The size is only used to presize the map, so a file whose size can't be found (e.g. a pipe) is
+  // simply loaded without presizing
+  long file_size = -1;
+  if (fseek(file, 0, SEEK_END) == 0)
+  {
+    file_size = ftell(file);
+    if (fseek(file, 0, SEEK_SET) != 0)
+      file_size = -1;
+  }
+
+  char *chunk = malloc(LOADER_CHUNK_SIZE);
+  if (!chunk) {
+    printf("Failed to allocate memory for the loader\n");
+    exit(1);
+  }
+
+  take_ownership_of_names(map);
+  bool first_chunk = file_size > 0;
+  if (!first_chunk)
+    presize_for(map, 0);
+
+  NameParser parser = { false, NULL, 0, 0, NULL };
+  int added = 0;
+  size_t length;
+  while ((length = fread(chunk, 1, LOADER_CHUNK_SIZE, file)) > 0)
+  {
+    if (first_chunk)
+    {
+      // Extrapolate from the number of names in the first chunk, with a little headroom
+      size_t quotes = 0;
+      for (size_t i = 0; i < length; i++)
+        quotes += chunk[i] == '"';
+      double names_per_byte = (double) quotes / 2.0 / (double) length;
+      presize_for(map, (size_t) (names_per_byte * (double) file_size * 1.1));
+      first_chunk = false;
+    }
+    added += parse_names(map, &parser, chunk, length);
+  }
+
+  free(parser.partial);
+  free_key_arena(parser.scratch);
+  free(chunk);
+  fclose(file);
+  return added;
+}
+
+/**
+ * Adds every name in a buffer of delimited names to the map, in a single pass. Empty names are
+ * skipped, and if the delimiter is a newline, so is a carriage return at the end of each name. As
+ * with <code>load_names_from_buffer</code>, the names are copied into the map's arena, but the map
+ * grows as usual rather than being sized for the buffer up front.
+ * @param map The map to add the names to.
+ * @param buffer The names, e.g. <code>MARY\nPATRICIA\nMARY</code>. This needn't be
+ * null-terminated, and the last name needn't be followed by a delimiter.
+ * @param length The number of bytes in <code>buffer</code>.
+ * @param delimiter The character separating the names.
+ * @return The number of names that were read, including duplicates.
+ */
+int64_t load_delimited_names_from_buffer(
+    NameMap *map, const char *buffer, size_t length, char delimiter)
+{
+  // This only makes sure the map has storage to add names to, without guessing how many are new
+  take_ownership_of_names(map);
+  presize_for(map, 0);
+
+  NameParser parser = { false, NULL, 0, 0, NULL };
+  int64_t read = parse_delimited_names(map, &parser, buffer, length, delimiter);
+  read += add_delimited_name(map, &parser, parser.partial, parser.partial_length, delimiter);
+  free(parser.partial);
+  free_key_arena(parser.scratch);
+  return read;
+}
+
+/**
+ * Adds every name in a file of delimited names to the map. The file is streamed in chunks, so can
+ * be much larger than memory as long as its distinct names aren't. See
+ * <code>load_delimited_names_from_buffer</code>.
+ * @param map The map to add the names to.
+ * @param path The path of the file.
+ * @param delimiter The character separating the names.
+ * @return The number of names that were read, including duplicates, or <code>-1</code> if the file
+ * couldn't be read.
+ */
+int64_t load_delimited_names_from_file(NameMap *map, const char *path, char delimiter)
+{
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    printf("Could not open %s\n", path);
+    return -1;
+  }
+
+  char *chunk = malloc(LOADER_CHUNK_SIZE);
+  if (!chunk) {
+    printf("Failed to allocate memory for the loader\n");
+    exit(1);
+  }
+
+  take_ownership_of_names(map);
+  presize_for(map, 0);
+
+  NameParser parser = { false, NULL, 0, 0, NULL };
+  int64_t read = 0;
+  size_t length;
+  while ((length = fread(chunk, 1, LOADER_CHUNK_SIZE, file)) > 0)
+    read += parse_delimited_names(map, &parser, chunk, length, delimiter);
+  read += add_delimited_name(map, &parser, parser.partial, parser.partial_length, delimiter);
+
+  free(parser.partial);
+  free_key_arena(parser.scratch);
+  free(chunk);
+  fclose(file);
+  return read;
+}
+
+/**
+ * Makes sure the map owns its names, copying every name already in the map into a new arena if it
+ * didn't already. Maps whose engine copies names into its own storage already own them.
+ * @param map The map.
+ */
+static void take_ownership_of_names(NameMap *map)
+{
+  if (map->key_arena || map->engine->compact_names)
+    return;
+
+  // Work out how much space the existing names need, then let compaction copy them in
+  finish_incremental_resize(map);
+  map->config.own_keys = true;
+  map->live_key_bytes = 0;
+  for (int64_t i = 0; i < map->current_size; i++)
+  {
+    const char *name = map->engine->name_at(map, i);
+    if (name)
+      map->live_key_bytes += strlen(name) + 1;
+  }
+  map->key_arena = create_key_arena(0);
+  compact_name_map(map);
+}
+
+/**
+ * Grows the map, if necessary, so that the given number of extra names can be added without the
+ * map needing to grow again. The map at least doubles whenever it grows, so loading names a few at
+ * a time still takes amortised constant time per name.
+ * @param map The map.
+ * @param extra_names The number of names that are about to be added. This may overestimate, e.g.
+ * by counting duplicates. If this is <code>0</code>, the map is only given storage if it has none.
+ */
+static void presize_for(NameMap *map, size_t extra_names)
+{
+  finish_incremental_resize(map);
+
+  // With no names to add, all that matters is that the map has some storage to add to
+  if (extra_names == 0 && map->current_size > 0)
+    return;
+
+  size_t names = (size_t) map->number_of_items + extra_names;
+  int64_t required_size = (int64_t) ((double) names / max_load_factor_of(map)) + 1;
+  if (required_size <= map->current_size)
+    return;
+
+  if (required_size < map->current_size * 2)
+    required_size = map->current_size * 2;
+  resize_name_map_to_capacity(map, (size_t) required_size);
+}
+
+/**
+ * Copies a parsed name into the map's arena and adds it to the map.
+ * @param map The map to add the name to.
+ * @param parser The parser that read the name.
+ * @param name The name. This needn't be null-terminated.
+ * @param length The number of bytes in <code>name</code>.
+ * @return <code>1</code> if the name was added, or <code>0</code> if it was a duplicate.
+ */
+static int add_loaded_name(NameMap *map, NameParser *parser, const char *name, size_t length)
+{
+  // A map without an arena copies the name into its own storage as it is inserted, so the name
+  // only needs null-terminating until then
+  KeyArena *arena = map->key_arena;
+  if (!arena)
+  {
+    if (!parser->scratch)
+      parser->scratch = create_key_arena(0);
+    arena = parser->scratch;
+  }
+  char *copy = copy_bytes_into_key_arena(arena, name, length);
+  uint64_t hash = hash_of(map, copy);
+
+  int64_t previous_number_of_items = map->number_of_items;
+  map->engine->insert(map, copy, hash, fingerprint_of(map, copy, hash), 1);
+  if (map->number_of_items == previous_number_of_items)
+  {
+    release_last_from_key_arena(arena, copy);
+    return 0;
+  }
+  add_name_to_bloom_filters(map, copy, hash);
+  if (arena == map->key_arena)
+    map->live_key_bytes += length + 1;
+  else
+    release_last_from_key_arena(arena, copy);
+
+  // Only grows if the number of names was underestimated, or tombstones have filled the map. The
+  // names are inserted straight into the map's storage, so any incremental resize is finished
+  grow_after_insert(map);
+  finish_incremental_resize(map);
+  return 1;
+}
+
+/**
+ * Adds bytes to the partial name carried between chunks.
+ * @param parser The parser.
+ * @param bytes The bytes to add.
+ * @param length The number of bytes.
+ */
+static void append_partial(NameParser *parser, const char *bytes, size_t length)
+{
+  if (parser->partial_length + length > parser->partial_capacity)
+  {
+    parser->partial_capacity = (parser->partial_length + length) * 2;
+    parser->partial = realloc(parser->partial, parser->partial_capacity);
+    if (!parser->partial) {
+      printf("Failed to allocate memory for a partial name\n");
+      exit(1);
+    }
+  }
+  memcpy(&parser->partial[parser->partial_length], bytes, length);
+  parser->partial_length += length;
+}
+
+/**
+ * Parses a chunk of input, adding every complete name to the map. A name that runs off the end of
+ * the chunk is kept in the parser and finished off by the next chunk.
+ * @param map The map to add the names to.
+ * @param parser The state carried over from the previous chunk.
+ * @param chunk The input.
+ * @param length The number of bytes in <code>chunk</code>.
+ * @return The number of names that were added, not counting duplicates.
+ */
+static int parse_names(NameMap *map, NameParser *parser, const char *chunk, size_t length)
+{
+  const char *position = chunk;
+  const char *end = chunk + length;
+  int added = 0;
+
+  // Finish off any name that was split across the previous chunk and this one
+  if (parser->in_quotes)
+  {
+    const char *closing_quote = memchr(position, '"', (size_t) (end - position));
+    if (!closing_quote)
+    {
+      append_partial(parser, position, (size_t) (end - position));
+      return 0;
+    }
+    append_partial(parser, position, (size_t) (closing_quote - position));
+    added += add_loaded_name(map, parser, parser->partial, parser->partial_length);
+    parser->partial_length = 0;
+    parser->in_quotes = false;
+    position = closing_quote + 1;
+  }
+
+  // Everything between a pair of quotes is a name, and everything else (the commas) is ignored
+  const char *opening_quote;
+  while ((opening_quote = memchr(position, '"', (size_t) (end - position))))
+  {
+    const char *name = opening_quote + 1;
+    const char *closing_quote = memchr(name, '"', (size_t) (end - name));
+    if (!closing_quote)
+    {
+      append_partial(parser, name, (size_t) (end - name));
+      parser->in_quotes = true;
+      break;
+    }
+    added += add_loaded_name(map, parser, name, (size_t) (closing_quote - name));
+    position = closing_quote + 1;
+  }
+  return added;
+}
+
+/**
+ * Parses a chunk of delimited input, adding every complete name to the map. The bytes after the
+ * last delimiter are kept in the parser, as the name they start may carry on in the next chunk.
+ * @param map The map to add the names to.
+ * @param parser The state carried over from the previous chunk.
+ * @param chunk The input.
+ * @param length The number of bytes in <code>chunk</code>.
+ * @param delimiter The character separating the names.
+ * @return The number of names that were read, including duplicates.
+ */
+static int64_t parse_delimited_names(
+    NameMap *map, NameParser *parser, const char *chunk, size_t length, char delimiter)
+{
+  const char *position = chunk;
+  const char *end = chunk + length;
+  int64_t read = 0;
+
+  const char *next_delimiter;
+  while ((next_delimiter = memchr(position, delimiter, (size_t) (end - position))))
+  {
+    // Only a name that was split across chunks needs copying into the parser first
+    if (parser->partial_length > 0)
+    {
+      append_partial(parser, position, (size_t) (next_delimiter - position));
+      read += add_delimited_name(
+          map, parser, parser->partial, parser->partial_length, delimiter
+      );
+      parser->partial_length = 0;
+    }
+    else
+      read += add_delimited_name(
+          map, parser, position, (size_t) (next_delimiter - position), delimiter
+      );
+    position = next_delimiter + 1;
+  }
+
+  if (position < end)
+    append_partial(parser, position, (size_t) (end - position));
+  return read;
+}
+
+/**
+ * Adds a name read from delimited input to the map, unless it is empty.
+ * @param map The map to add the name to.
+ * @param parser The parser that read the name.
+ * @param name The name. This needn't be null-terminated.
+ * @param length The number of bytes in <code>name</code>.
+ * @param delimiter The character that separated the names, which decides whether a trailing
+ * carriage return is part of the name.
+ * @return <code>1</code> if the name was read (whether or not it was a duplicate), or
+ * <code>0</code> if it was empty.
+ */
+static int64_t add_delimited_name(
+    NameMap *map, NameParser *parser, const char *name, size_t length, char delimiter)
+{
+  if (delimiter == '\n' && length > 0 && name[length - 1] == '\r')
+    length--;
+  if (length == 0)
+    return 0;
+
+  add_loaded_name(map, parser, name, length);
+  return 1;
+}
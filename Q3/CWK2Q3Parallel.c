@@ -0,0 +1,502 @@
+/*
+ ============================================================================
+ Name        : CWK2Q3Parallel.c
+ Description :
+ Parallel construction of a Q3 hash map from an array of names. The map is
+ sized for every name up front, then built in four phases, each split
+ across the threads:
+
+    hash       each thread hashes a contiguous share of the names, and
+               counts how many of them belong to each region
+    partition  each thread scatters the indices of its share into an
+               array grouped by region, at offsets worked out from the
+               counts (a radix partition on the name's home slot)
+    insert     each thread takes whole regions, and inserts their names
+               into the region's slots only
+    finish     the few names that didn't fit are inserted one by one
+
+ A region is a contiguous range of slots, so the names in a region are
+ exactly those whose home slot (and so the top bits of their position in
+ the table) lies in the range. As no two threads ever write to the same
+ region, the insert phase takes no locks. A name whose probe would run off
+ the end of its region is left for the finish phase, where it is inserted
+ by the engine as normal, carrying on into the next region.
+
+ The result is an ordinary map, which can be searched and changed with the
+ rest of the interface. Only the linear probing engine is built region by
+ region; the other engines move names around as they insert, so their names
+ are hashed in parallel but inserted one by one.
+
+ ============================================================================
+*/
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "CWK2Q3Internal.h"
+
+#define REGIONS_PER_THREAD 8
+#define MIN_NAMES_PER_THREAD 4096
+
+/**
+ * The state shared by every thread taking part in a build.
+ */
+typedef struct ParallelBuild
+{
+  /**
+   * The map being built. Already sized for every name.
+   */
+  NameMap *map;
+
+  /**
+   * The names being added.
+   */
+  const char *const *names;
+
+  /**
+   * The number of names being added.
+   */
+  size_t count;
+
+  /**
+   * The number of threads taking part, including the calling thread.
+   */
+  int thread_count;
+
+  /**
+   * The number of regions that the map's slots are divided into.
+   */
+  int region_count;
+
+  /**
+   * The number of slots in each region, except possibly the last, which may be smaller.
+   */
+  int64_t region_size;
+
+  /**
+   * The hash of each name, as given by <code>hash_of</code>.
+   */
+  uint64_t *hashes;
+
+  /**
+   * For each thread and region (in that order), the number of the thread's names that belong to
+   * the region. Once partitioned, the position in <code>order</code> of the thread's next name in
+   * the region.
+   */
+  size_t *region_offsets;
+
+  /**
+   * The index of each name, grouped by region. Names a region couldn't hold are moved to the start
+   * of the region's group.
+   */
+  size_t *order;
+
+  /**
+   * The position in <code>order</code> of each region's first name, followed by the number of
+   * names.
+   */
+  size_t *region_starts;
+
+  /**
+   * For each region, the number of its names that have to be inserted one by one.
+   */
+  size_t *deferred;
+
+  /**
+   * For each region, the number of names added to its slots.
+   */
+  int64_t *added;
+
+  /**
+   * If the map owns its names, the number of arena bytes needed by the names added to each
+   * region's slots.
+   */
+  size_t *key_bytes;
+} ParallelBuild;
+
+/**
+ * The part of a build done by a single thread.
+ */
+typedef struct BuildWorker
+{
+  /**
+   * The build.
+   */
+  ParallelBuild *build;
+
+  /**
+   * The thread's position, from <code>0</code> to <code>thread_count - 1</code>.
+   */
+  int thread;
+} BuildWorker;
+
+static void *allocate_for_build(size_t, const char*);
+static void run_phase(ParallelBuild*, void *(*)(void*));
+static void share_of(const ParallelBuild*, int, size_t*, size_t*);
+static void *hash_share(void*);
+static void *partition_share(void*);
+static void *insert_regions(void*);
+static int region_of(const ParallelBuild*, uint64_t);
+static void insert_region(ParallelBuild*, int);
+static bool place_in_region(NameMap*, const char*, uint64_t, int64_t, bool*);
+static void insert_one_by_one(ParallelBuild*);
+
+/**
+ * Creates a map holding every given name, using several threads. Gives the same map as adding
+ * each name in turn to a map created with the same config, but sized once for every name, and
+ * with the slot each name ends up in possibly differing where names collided.
+ * @param names The names to add. Duplicates are only added once. Unless <code>own_keys</code> is
+ * set, these must outlive the map, as with <code>add_to_name_map</code>.
+ * @param count The number of names.
+ * @param thread_count The number of threads to use, including the calling thread. If this is less
+ * than <code>1</code>, one thread is used per core. Fewer threads are used for small inputs.
+ * @param config The options for the map. These are copied, so needn't outlive the call.
+ * @return The new map. This must be freed with <code>free_name_map</code>.
+ */
+NameMap *build_name_map_in_parallel(
+    const char *const *names, size_t count, int thread_count, const NameMapConfig *config
+)
+{
+  NameMap *map = create_name_map_with_capacity(0, config);
+  if (count == 0)
+    return map;
+  resize_name_map_to_capacity(map, (size_t) ((double) count / max_load_factor_of(map)) + 1);
+
+  ParallelBuild build = {
+      .map = map,
+      .names = names,
+      .count = count,
+      .thread_count = parallel_thread_count(thread_count, count)
+  };
+  build.region_count = build.thread_count * REGIONS_PER_THREAD;
+  build.region_size = (map->current_size + build.region_count - 1) / build.region_count;
+  size_t regions = (size_t) build.region_count;
+  build.hashes = allocate_for_build(count * sizeof(uint64_t), "hashes");
+  build.region_offsets = calloc((size_t) build.thread_count * regions, sizeof(size_t));
+  build.order = allocate_for_build(count * sizeof(size_t), "partitioned names");
+  build.region_starts = allocate_for_build((regions + 1) * sizeof(size_t), "region starts");
+  build.deferred = calloc(regions, sizeof(size_t));
+  build.added = calloc(regions, sizeof(int64_t));
+  build.key_bytes = calloc(regions, sizeof(size_t));
+  if (!build.region_offsets || !build.deferred || !build.added || !build.key_bytes) {
+    printf("Failed to allocate memory for the region counts\n");
+    exit(1);
+  }
+
+  run_phase(&build, hash_share);
+  if (map->engine != &linear_probing_engine)
+  {
+    insert_one_by_one(&build);
+  } else
+  {
+    // Turn the counts into offsets, so that each region's names are contiguous and, within a
+    // region, each thread's names follow those of the threads before it
+    size_t offset = 0;
+    for (size_t region = 0; region < regions; region++)
+    {
+      build.region_starts[region] = offset;
+      for (int thread = 0; thread < build.thread_count; thread++)
+      {
+        size_t *region_offset = &build.region_offsets[(size_t) thread * regions + region];
+        size_t names_in_region = *region_offset;
+        *region_offset = offset;
+        offset += names_in_region;
+      }
+    }
+    build.region_starts[regions] = offset;
+
+    run_phase(&build, partition_share);
+    run_phase(&build, insert_regions);
+
+    // Every region has finished, so the names that ran off the end of theirs can go wherever the
+    // engine puts them
+    for (size_t region = 0; region < regions; region++)
+    {
+      map->number_of_items += build.added[region];
+      map->live_key_bytes += build.key_bytes[region];
+    }
+    for (size_t region = 0; region < regions; region++)
+    {
+      for (size_t i = 0; i < build.deferred[region]; i++)
+      {
+        size_t name = build.order[build.region_starts[region] + i];
+        uint64_t hash = build.hashes[name];
+        int64_t previous_number_of_items = map->number_of_items;
+        map->engine->insert(
+            map, names[name], hash, fingerprint_of(map, names[name], hash), 1
+        );
+        if (map->key_arena && map->number_of_items != previous_number_of_items)
+          map->live_key_bytes += strlen(names[name]) + 1;
+      }
+    }
+  }
+
+  // The map holds the caller's names, so if it should own them, copy them in now. This also fills
+  // in the Bloom filter, if the map has one.
+  compact_name_map(map);
+
+  free(build.hashes);
+  free(build.region_offsets);
+  free(build.order);
+  free(build.region_starts);
+  free(build.deferred);
+  free(build.added);
+  free(build.key_bytes);
+  return map;
+}
+
+/**
+ * Works out how many threads to split work on many names across.
+ * @param requested The number of threads asked for, or less than <code>1</code> for one per core.
+ * @param count The number of names.
+ * @return The number of threads. At least <code>1</code>, and small enough that each thread has a
+ * worthwhile share of the names.
+ */
+int parallel_thread_count(int requested, size_t count)
+{
+  long threads = requested;
+  if (threads < 1)
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+  long worthwhile = (long) (count / MIN_NAMES_PER_THREAD);
+  if (threads > worthwhile)
+    threads = worthwhile;
+  return threads > 1 ? (int) threads : 1;
+}
+
+/**
+ * Allocates memory for a build, exiting if it can't be allocated.
+ * @param bytes The number of bytes.
+ * @param description What the memory is for.
+ * @return The memory.
+ */
+static void *allocate_for_build(size_t bytes, const char *description)
+{
+  void *memory = malloc(bytes);
+  if (!memory) {
+    printf("Failed to allocate memory for the %s\n", description);
+    exit(1);
+  }
+  return memory;
+}
+
+/**
+ * Runs a phase of a build on every thread, returning once they have all finished. The calling
+ * thread takes the first share itself.
+ * @param build The build.
+ * @param phase The function that does a single thread's share of the phase, given its
+ * <code>BuildWorker</code>.
+ */
+static void run_phase(ParallelBuild *build, void *(*phase)(void*))
+{
+  size_t thread_count = (size_t) build->thread_count;
+  pthread_t *threads = allocate_for_build(thread_count * sizeof(pthread_t), "threads");
+  BuildWorker *workers = allocate_for_build(thread_count * sizeof(BuildWorker), "workers");
+  for (int t = 0; t < build->thread_count; t++)
+    workers[t] = (BuildWorker) { build, t };
+
+  for (int t = 1; t < build->thread_count; t++)
+  {
+    if (pthread_create(&threads[t], NULL, phase, &workers[t]) != 0) {
+      printf("Failed to create a thread\n");
+      exit(1);
+    }
+  }
+  phase(&workers[0]);
+  for (int t = 1; t < build->thread_count; t++)
+    pthread_join(threads[t], NULL);
+
+  free(threads);
+  free(workers);
+}
+
+/**
+ * Gets the range of names that make up a thread's share.
+ * @param build The build.
+ * @param thread The thread.
+ * @param first Will be set to the first name in the share.
+ * @param end Will be set to one past the last name in the share.
+ */
+static void share_of(const ParallelBuild *build, int thread, size_t *first, size_t *end)
+{
+  *first = build->count * (size_t) thread / (size_t) build->thread_count;
+  *end = build->count * (size_t) (thread + 1) / (size_t) build->thread_count;
+}
+
+/**
+ * Hashes a thread's share of the names, counting how many belong to each region.
+ * @param argument The thread's <code>BuildWorker</code>.
+ * @return <code>NULL</code>.
+ */
+static void *hash_share(void *argument)
+{
+  BuildWorker *worker = argument;
+  ParallelBuild *build = worker->build;
+  size_t *counts = &build->region_offsets[(size_t) worker->thread * (size_t) build->region_count];
+  bool partitioning = build->map->engine == &linear_probing_engine;
+
+  size_t first, end;
+  share_of(build, worker->thread, &first, &end);
+  for (size_t i = first; i < end; i++)
+  {
+    build->hashes[i] = hash_of(build->map, build->names[i]);
+    if (partitioning)
+      counts[region_of(build, build->hashes[i])]++;
+  }
+  return NULL;
+}
+
+/**
+ * Copies the index of each name in a thread's share to its region's part of <code>order</code>.
+ * @param argument The thread's <code>BuildWorker</code>.
+ * @return <code>NULL</code>.
+ */
+static void *partition_share(void *argument)
+{
+  BuildWorker *worker = argument;
+  ParallelBuild *build = worker->build;
+  size_t *offsets = &build->region_offsets[(size_t) worker->thread * (size_t) build->region_count];
+
+  size_t first, end;
+  share_of(build, worker->thread, &first, &end);
+  for (size_t i = first; i < end; i++)
+    build->order[offsets[region_of(build, build->hashes[i])]++] = i;
+  return NULL;
+}
+
+/**
+ * Inserts the names of every region belonging to a thread. Regions are dealt out in turn, so that
+ * a cluster of busy regions is shared between threads.
+ * @param argument The thread's <code>BuildWorker</code>.
+ * @return <code>NULL</code>.
+ */
+static void *insert_regions(void *argument)
+{
+  BuildWorker *worker = argument;
+  ParallelBuild *build = worker->build;
+  for (int region = worker->thread; region < build->region_count; region += build->thread_count)
+    insert_region(build, region);
+  return NULL;
+}
+
+/**
+ * Gets the region holding a name's home slot.
+ * @param build The build.
+ * @param hash The name's hash.
+ * @return The region.
+ */
+static int region_of(const ParallelBuild *build, uint64_t hash)
+{
+  return (int) (index_for_hash(build->map, hash) / build->region_size);
+}
+
+/**
+ * Inserts every name in a region into the region's slots. Names that don't fit before the end of
+ * the region are moved to the start of the region's part of <code>order</code>, to be inserted
+ * once every region is done.
+ * @param build The build.
+ * @param region The region.
+ */
+static void insert_region(ParallelBuild *build, int region)
+{
+  NameMap *map = build->map;
+  int64_t region_end = (region + 1) * build->region_size;
+  if (region_end > map->current_size)
+    region_end = map->current_size;
+
+  // Neighbouring regions belong to different threads, so their totals are only written at the
+  // end, rather than sharing a cache line throughout
+  size_t first = build->region_starts[region];
+  size_t end = build->region_starts[region + 1];
+  size_t deferred = 0;
+  int64_t added_names = 0;
+  size_t key_bytes = 0;
+  for (size_t position = first; position < end; position++)
+  {
+    size_t name = build->order[position];
+    bool added;
+    if (!place_in_region(map, build->names[name], build->hashes[name], region_end, &added))
+      build->order[first + deferred++] = name;
+    else if (added)
+    {
+      added_names++;
+      if (map->key_arena)
+        key_bytes += strlen(build->names[name]) + 1;
+    }
+  }
+
+  build->deferred[region] = deferred;
+  build->added[region] = added_names;
+  build->key_bytes[region] = key_bytes;
+}
+
+/**
+ * Inserts a name into a linear probing map that has no tombstones, without probing past the end
+ * of the name's region. Unlike the engine's own insert, this doesn't update the map's number of
+ * items, so that threads never write to anything outside their own regions.
+ * @param map The map.
+ * @param name The name.
+ * @param hash The hash of the name, as given by <code>hash_of</code>.
+ * @param region_end One past the last slot in the region holding the name's home slot.
+ * @param added Will be set to <code>true</code> if the name was added, or <code>false</code> if
+ * an equal name was already there.
+ * @return <code>false</code> if the name's probe reached the end of the region before finding
+ * an empty slot or an equal name, in which case the map is unchanged.
+ */
+static bool place_in_region(
+    NameMap *map, const char *name, uint64_t hash, int64_t region_end, bool *added
+)
+{
+  uint64_t fingerprint = fingerprint_of(map, name, hash);
+  InlineKey key;
+  if (map->inline_keys)
+    make_inline_key(map, name, &key);
+
+  int64_t index = index_for_hash(map, hash);
+  while (map->hash_map[index])
+  {
+    if ((!map->fingerprints || map->fingerprints[index] == fingerprint)
+        && slot_holds_name(map, index, &key, name))
+    {
+      if (map->counts)
+        map->counts[index]++;
+      *added = false;
+      return true;
+    }
+    if (++index == region_end)
+      return false;
+  }
+
+  map->hash_map[index] = (char*) name;
+  if (map->fingerprints)
+    map->fingerprints[index] = fingerprint;
+  if (map->counts)
+    map->counts[index] = 1;
+  if (map->inline_keys)
+    store_inline_key(map, index, &key);
+  *added = true;
+  return true;
+}
+
+/**
+ * Inserts every name with the map's engine, in order, using the hashes that have already been
+ * calculated.
+ * @param build The build.
+ */
+static void insert_one_by_one(ParallelBuild *build)
+{
+  NameMap *map = build->map;
+  for (size_t i = 0; i < build->count; i++)
+  {
+    const char *name = build->names[i];
+    int64_t previous_number_of_items = map->number_of_items;
+    uint64_t hash = build->hashes[i];
+    map->engine->insert(map, name, hash, fingerprint_of(map, name, hash), 1);
+    if (map->key_arena && map->number_of_items != previous_number_of_items)
+      map->live_key_bytes += strlen(name) + 1;
+  }
+}
@@ -0,0 +1,292 @@
+/*
+ ============================================================================
+ Name        : CWK2Q3RobinHood.c
+ Description :
+ A Robin Hood table engine for the Q3 hash map. Names are still stored by
+ linear probing with an interval of 1, but on insertion a name that is
+ further from its ideal position than the name occupying a slot takes that
+ slot, and the displaced name carries on probing. This keeps the variance of
+ probe lengths low and lets unsuccessful searches stop early. Removal uses
+ backward-shift deletion rather than tombstones, so the table never fills up
+ with dead slots.
+
+ ============================================================================
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "CWK2Q3Internal.h"
+
+static void robin_hood_resize(NameMap*, int64_t);
+static void robin_hood_insert(NameMap*, const char*, uint64_t, uint64_t, uint64_t);
+static void robin_hood_remove_at(NameMap*, int64_t);
+static int64_t robin_hood_find(const NameMap*, const char*, uint64_t, uint64_t);
+static int64_t robin_hood_index_of(const NameMap*, const char*, uint64_t);
+static void robin_hood_print_slot(const NameMap*, int64_t);
+static const char *robin_hood_name_at(const NameMap*, int64_t);
+static void robin_hood_free_storage(NameMap*);
+static void robin_hood_probe_lengths(const NameMap*, NameMapStats*);
+
+const NameMapEngineOps robin_hood_engine = {
+    .resize = robin_hood_resize,
+    .insert = robin_hood_insert,
+    .remove_at = robin_hood_remove_at,
+    .index_of = robin_hood_index_of,
+    .home_index = home_index_for_hash,
+    .collect_probe_lengths = robin_hood_probe_lengths,
+    .print_slot = robin_hood_print_slot,
+    .name_at = robin_hood_name_at,
+    .free_storage = robin_hood_free_storage,
+    .compact_names = NULL
+};
+
+/**
+ * Moves every name into new storage of the given size.
+ * @param map The map to resize.
+ * @param new_size The new capacity of the map.
+ */
+static void robin_hood_resize(NameMap *map, int64_t new_size)
+{
+  // Keep a copy of the old map so we can move the names over once the new storage is allocated
+  NameMap old = *map;
+
+  allocate_slots(map, new_size);
+
+  // The distances are only meaningful in occupied slots, so these needn't be zeroed. They stay as
+  // ints even in maps with more slots than that, as no cluster gets anywhere near that long.
+  map->probe_distances = malloc((size_t) new_size * sizeof(int));
+  if (!map->probe_distances) {
+    printf("Failed to allocate memory for the probe distances\n");
+    exit(1);
+  }
+
+  // There are no tombstones to skip, so every occupied slot holds a live name
+  for (int64_t i = 0; i < old.current_size; i++)
+  {
+    if (old.hash_map[i])
+    {
+      robin_hood_insert(
+          map, old.hash_map[i], stored_hash_at(&old, i), old.fingerprints ? old.fingerprints[i] : 0,
+          stored_count_at(&old, i)
+      );
+    }
+  }
+
+  free_slots(&old);
+  robin_hood_free_storage(&old);
+}
+
+/**
+ * Adds the name to the map, unless an equivalent name is already present. This does not grow the
+ * map, so there must be at least one empty slot.
+ * @param map The map to add the name to.
+ * @param name The value to add to the map.
+ * @param hash The hash of <code>name</code>, as given by <code>hash_of</code>.
+ * @param fingerprint The fingerprint of <code>name</code>, as given by <code>fingerprint_of</code>.
+ * @param count If the map counts names, the count to store with the name, or to add to the count
+ * of the equivalent name if there is one.
+ */
+static void robin_hood_insert(
+    NameMap *map, const char *name, uint64_t hash, uint64_t fingerprint, uint64_t count
+)
+{
+  // Names can be moved around as we insert, so we have to make sure this isn't a duplicate first.
+  // As searches can stop early, this is much cheaper than walking to the end of the cluster.
+  int64_t existing_index = robin_hood_find(map, name, hash, fingerprint);
+  if (existing_index != -1)
+  {
+    if (map->counts)
+      map->counts[existing_index] += count;
+    return;
+  }
+
+  // The name (and its details) that we're currently trying to find a home for
+  char *carried_name = (char*) name;
+  uint64_t carried_fingerprint = fingerprint;
+  uint64_t carried_count = count;
+  int carried_distance = 0;
+  InlineKey carried_key;
+  if (map->inline_keys)
+    make_inline_key(map, name, &carried_key);
+
+  int64_t index = index_for_hash(map, hash);
+  while (map->hash_map[index])
+  {
+    // If the name in this slot is closer to its ideal position than the carried name, the carried
+    // name takes its place. The displaced name then carries on looking for a slot.
+    if (map->probe_distances[index] < carried_distance)
+    {
+      char *displaced_name = map->hash_map[index];
+      int displaced_distance = map->probe_distances[index];
+      map->hash_map[index] = carried_name;
+      map->probe_distances[index] = carried_distance;
+      carried_name = displaced_name;
+      carried_distance = displaced_distance;
+
+      if (map->fingerprints)
+      {
+        uint64_t displaced_fingerprint = map->fingerprints[index];
+        map->fingerprints[index] = carried_fingerprint;
+        carried_fingerprint = displaced_fingerprint;
+      }
+      if (map->counts)
+      {
+        uint64_t displaced_count = map->counts[index];
+        map->counts[index] = carried_count;
+        carried_count = displaced_count;
+      }
+      if (map->inline_keys)
+        swap_inline_key(map, index, &carried_key);
+    }
+
+    index = next_index(map, index);
+    carried_distance++;
+  }
+
+  // We've found an empty slot, so whichever name we're carrying can go here
+  map->hash_map[index] = carried_name;
+  map->probe_distances[index] = carried_distance;
+  if (map->fingerprints)
+    map->fingerprints[index] = carried_fingerprint;
+  if (map->counts)
+    map->counts[index] = carried_count;
+  if (map->inline_keys)
+    store_inline_key(map, index, &carried_key);
+
+  map->number_of_items++;
+}
+
+/**
+ * Removes the name in the given slot. Rather than leaving a tombstone, the names following it in
+ * the cluster are each shifted back by one slot until we reach an empty slot or a name that is
+ * already in its ideal position.
+ * @param map The map to remove the name from.
+ * @param index The slot holding the name.
+ */
+static void robin_hood_remove_at(NameMap *map, int64_t index)
+{
+  int64_t following_index = next_index(map, index);
+  while (map->hash_map[following_index] && map->probe_distances[following_index] > 0)
+  {
+    map->hash_map[index] = map->hash_map[following_index];
+    map->probe_distances[index] = map->probe_distances[following_index] - 1;
+    if (map->fingerprints)
+      map->fingerprints[index] = map->fingerprints[following_index];
+    if (map->counts)
+      map->counts[index] = map->counts[following_index];
+    if (map->inline_keys)
+      move_inline_key(map, index, following_index);
+
+    index = following_index;
+    following_index = next_index(map, index);
+  }
+
+  // The last slot we shifted from is now empty
+  map->hash_map[index] = NULL;
+  map->number_of_items--;
+}
+
+/**
+ * Finds the slot holding the given name. The search stops as soon as we reach a name that is closer
+ * to its ideal position than the name we're looking for would be in that slot, as insertion would
+ * have placed the name there if it were present.
+ * @param map The map to search.
+ * @param name The value to search for.
+ * @param hash The hash of <code>name</code>, as given by <code>hash_of</code>.
+ * @param fingerprint The fingerprint of <code>name</code>, as given by <code>fingerprint_of</code>.
+ * @return The index of an entry matching <code>name</code>, or <code>-1</code> if the value is not
+ * stored in the map.
+ */
+static int64_t robin_hood_find(
+    const NameMap *map, const char *name, uint64_t hash, uint64_t fingerprint
+)
+{
+  int64_t index = index_for_hash(map, hash);
+  InlineKey key;
+  if (map->inline_keys)
+    make_inline_key(map, name, &key);
+
+  for (int64_t distance = 0;
+       map->hash_map[index] && map->probe_distances[index] >= distance;
+       distance++, index = next_index(map, index))
+  {
+    if ((!map->fingerprints || map->fingerprints[index] == fingerprint)
+        && slot_holds_name(map, index, &key, name))
+      return index;
+  }
+  return -1;
+}
+
+/**
+ * Gets the index of the given value in the map.
+ * @param map The map to search.
+ * @param name The value to search for.
+ * @param hash The hash of the value, as given by <code>hash_of</code>.
+ * @return The index of an entry matching <code>name</code>, or <code>-1</code> if the value is not
+ * stored in the map.
+ */
+static int64_t robin_hood_index_of(const NameMap *map, const char *name, uint64_t hash)
+{
+  return robin_hood_find(map, name, hash, fingerprint_of(map, name, hash));
+}
+
+/**
+ * Prints out the value at the given index in the map, or nothing if the slot is empty.
+ * @param map The map to print from.
+ * @param index The index in the map to print.
+ */
+static void robin_hood_print_slot(const NameMap *map, int64_t index)
+{
+  if (map->hash_map[index])
+    printf("%s", map->hash_map[index]);
+}
+
+/**
+ * Gets the name at the given index in the map.
+ * @param map The map.
+ * @param index The index in the map.
+ * @return The name, or <code>NULL</code> if the slot is empty.
+ */
+static const char *robin_hood_name_at(const NameMap *map, int64_t index)
+{
+  return map->hash_map[index];
+}
+
+/**
+ * Frees the probe distances.
+ * @param map The map (or a copy of the map) whose probe distances should be freed.
+ */
+static void robin_hood_free_storage(NameMap *map)
+{
+  free(map->probe_distances);
+  map->probe_distances = NULL;
+}
+
+/**
+ * Records the probe lengths of a Robin Hood map. A search for a name in the map probes one more
+ * slot than the name's distance from its ideal position, while a search for a name that isn't in
+ * the map stops at the first slot holding a name closer to its own ideal position.
+ * @param map The map.
+ * @param stats The statistics being gathered.
+ */
+static void robin_hood_probe_lengths(const NameMap *map, NameMapStats *stats)
+{
+  for (int64_t index = 0; index < map->current_size; index++)
+  {
+    if (map->hash_map[index])
+      record_probe_length(stats, true, map->probe_distances[index] + 1);
+  }
+
+  for (int64_t ideal_index = 0; ideal_index < map->current_size; ideal_index++)
+  {
+    int64_t index = ideal_index;
+    int64_t distance = 0;
+    while (map->hash_map[index] && map->probe_distances[index] >= distance)
+    {
+      distance++;
+      index = next_index(map, index);
+    }
+    record_probe_length(stats, false, distance + 1);
+  }
+}
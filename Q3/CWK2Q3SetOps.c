@@ -0,0 +1,415 @@
+/*
+ ============================================================================
+ Name        : CWK2Q3SetOps.c
+ Description :
+ Set operations between two Q3 hash maps: union, intersection and
+ difference. Each operation visits the slots of one map (the smaller one,
+ where the operation allows) and searches the other for each name, then
+ adds the names it keeps to a new map. The result is only created once the
+ kept names are known, so it is sized for exactly the names it will hold
+ and never grows while they are added.
+
+ Names aren't rehashed where it can be avoided: a name's hash is recovered
+ from its map's cached fingerprint if it has one, and used both to search
+ the other map and to add the name to the result, as long as the maps
+ share a hash function. The result uses the first map's config, so always
+ shares its hash function.
+
+ Searching the other map is the bulk of the work, and only reads the two
+ maps, so it can be split across threads, each taking a contiguous share of
+ the slots and keeping its own list of names. The lists are then added to
+ the result one after another.
+
+ ============================================================================
+*/
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "CWK2Q3Internal.h"
+
+/**
+ * A name that will be added to the result of a set operation.
+ */
+typedef struct SetMember
+{
+  /**
+   * The name, which belongs to one of the maps being combined.
+   */
+  const char *name;
+
+  /**
+   * The hash of the name, as given by <code>hash_of</code> for the first map.
+   */
+  uint64_t hash;
+
+  /**
+   * The count to add the name with.
+   */
+  uint64_t count;
+} SetMember;
+
+/**
+ * The names kept by a single thread.
+ */
+typedef struct SetShare
+{
+  /**
+   * The names.
+   */
+  SetMember *members;
+
+  /**
+   * The number of names in <code>members</code>.
+   */
+  size_t count;
+
+  /**
+   * The size of the <code>members</code> array.
+   */
+  size_t capacity;
+} SetShare;
+
+/**
+ * The state shared by every thread taking part in a set operation.
+ */
+typedef struct SetCombination
+{
+  /**
+   * The map whose slots are visited.
+   */
+  const NameMap *source;
+
+  /**
+   * The map searched for each name in <code>source</code>.
+   */
+  const NameMap *other;
+
+  /**
+   * Whether <code>source</code> is the first of the two maps, and so has the hash function (and
+   * counts) that the result uses.
+   */
+  bool source_is_first;
+
+  /**
+   * Whether the two maps hash names in the same way, so that the hash of a name in
+   * <code>source</code> can be used to search <code>other</code>.
+   */
+  bool shared_hash;
+
+  /**
+   * Whether to keep the names that are in <code>other</code>.
+   */
+  bool keep_found;
+
+  /**
+   * Whether to keep the names that aren't in <code>other</code>.
+   */
+  bool keep_missing;
+
+  /**
+   * The number of slots in <code>source</code>, including those of any storage that an
+   * incremental resize hasn't finished moving.
+   */
+  int64_t slot_count;
+
+  /**
+   * The number of threads taking part, including the calling thread.
+   */
+  int thread_count;
+
+  /**
+   * The names kept by each thread.
+   */
+  SetShare *shares;
+} SetCombination;
+
+/**
+ * The part of a set operation done by a single thread.
+ */
+typedef struct SetWorker
+{
+  /**
+   * The set operation.
+   */
+  SetCombination *combination;
+
+  /**
+   * The thread's position, from <code>0</code> to <code>thread_count - 1</code>.
+   */
+  int thread;
+} SetWorker;
+
+static bool same_hash_function(const NameMapConfig*, const NameMapConfig*);
+static void run_share_searches(SetCombination*);
+static void *search_share(void*);
+static void keep_member(SetShare*, const char*, uint64_t, uint64_t);
+static void add_member(NameMap*, const char*, uint64_t, uint64_t);
+
+/**
+ * Creates a map holding the result of a set operation between two maps. Neither map is changed.
+ * The result has the first map's config, and is sized once for the names it holds. If the maps
+ * count names, see <code>NameSetOperation</code> for the counts the result is given.
+ * @param first The first map.
+ * @param second The second map.
+ * @param operation The operation.
+ * @param thread_count The number of threads to search with, including the calling thread. If this
+ * is less than <code>1</code>, one thread is used per core. Fewer threads are used for small maps.
+ * Neither map may be changed while they are being searched.
+ * @return The new map. This must be freed with <code>free_name_map</code>. Unless the first map
+ * owns its names, the result holds the same names as the maps, so they must outlive it.
+ */
+NameMap *combine_name_maps(
+    const NameMap *first, const NameMap *second, NameSetOperation operation, int thread_count
+)
+{
+  SetCombination combination = {
+      .shared_hash = same_hash_function(&first->config, &second->config)
+  };
+  if (operation == NAME_SET_INTERSECTION)
+  {
+    // Only names in both maps are kept, so searching for the smaller map's names finds them all
+    bool first_is_smaller = name_map_size(first) <= name_map_size(second);
+    combination.source = first_is_smaller ? first : second;
+    combination.other = first_is_smaller ? second : first;
+    combination.keep_found = true;
+  } else if (operation == NAME_SET_DIFFERENCE)
+  {
+    combination.source = first;
+    combination.other = second;
+    combination.keep_missing = true;
+  } else
+  {
+    // The first map's names are all added anyway, so only the second's need searching for. Names
+    // in both only need adding again if their counts are to be added together.
+    combination.source = second;
+    combination.other = first;
+    combination.keep_found = first->config.count_names;
+    combination.keep_missing = true;
+  }
+  combination.source_is_first = combination.source == first;
+
+  for (const NameMap *storage = combination.source; storage; storage = storage->retiring)
+    combination.slot_count += storage->current_size;
+  combination.thread_count = parallel_thread_count(
+      thread_count, name_map_size(combination.source)
+  );
+  combination.shares = calloc((size_t) combination.thread_count, sizeof(SetShare));
+  if (!combination.shares) {
+    printf("Failed to allocate memory for the set operation\n");
+    exit(1);
+  }
+  run_share_searches(&combination);
+
+  size_t names = operation == NAME_SET_UNION ? name_map_size(first) : 0;
+  for (int thread = 0; thread < combination.thread_count; thread++)
+    names += combination.shares[thread].count;
+
+  NameMap *result = create_name_map_with_capacity(0, &first->config);
+  if (names > 0)
+    resize_name_map_to_capacity(result, (size_t) ((double) names / max_load_factor_of(result)) + 1);
+
+  if (operation == NAME_SET_UNION)
+  {
+    for (const NameMap *storage = first; storage; storage = storage->retiring)
+    {
+      for (int64_t index = 0; index < storage->current_size; index++)
+      {
+        const char *name = storage->engine->name_at(storage, index);
+        if (name)
+          add_member(result, name, stored_hash_at(storage, index), stored_count_at(storage, index));
+      }
+    }
+  }
+  for (int thread = 0; thread < combination.thread_count; thread++)
+  {
+    SetShare *share = &combination.shares[thread];
+    for (size_t i = 0; i < share->count; i++)
+      add_member(result, share->members[i].name, share->members[i].hash, share->members[i].count);
+    free(share->members);
+  }
+  free(combination.shares);
+
+  // The result holds the maps' names, so if it should own them, copy them in now. This also fills
+  // in the Bloom filter, if the result has one.
+  compact_name_map(result);
+  return result;
+}
+
+/**
+ * Creates a map holding every name that is in either of two maps. See
+ * <code>combine_name_maps</code>.
+ * @param first The first map.
+ * @param second The second map.
+ * @return The new map. This must be freed with <code>free_name_map</code>.
+ */
+NameMap *union_of_name_maps(const NameMap *first, const NameMap *second)
+{
+  return combine_name_maps(first, second, NAME_SET_UNION, 1);
+}
+
+/**
+ * Creates a map holding every name that is in both of two maps. See
+ * <code>combine_name_maps</code>.
+ * @param first The first map.
+ * @param second The second map.
+ * @return The new map. This must be freed with <code>free_name_map</code>.
+ */
+NameMap *intersection_of_name_maps(const NameMap *first, const NameMap *second)
+{
+  return combine_name_maps(first, second, NAME_SET_INTERSECTION, 1);
+}
+
+/**
+ * Creates a map holding every name in one map that isn't in another. See
+ * <code>combine_name_maps</code>.
+ * @param first The map whose names are kept.
+ * @param second The map whose names are left out.
+ * @return The new map. This must be freed with <code>free_name_map</code>.
+ */
+NameMap *difference_of_name_maps(const NameMap *first, const NameMap *second)
+{
+  return combine_name_maps(first, second, NAME_SET_DIFFERENCE, 1);
+}
+
+/**
+ * Checks whether two maps hash every name in the same way.
+ * @param first The config of the first map.
+ * @param second The config of the second map.
+ * @return <code>true</code> if <code>hash_of</code> gives the same hash for every name in both.
+ */
+static bool same_hash_function(const NameMapConfig *first, const NameMapConfig *second)
+{
+  return first->hash_policy == second->hash_policy
+      && (!hash_policy_uses_seed(first->hash_policy) || first->hash_seed == second->hash_seed);
+}
+
+/**
+ * Searches for the source map's names on every thread, returning once they have all finished. The
+ * calling thread takes the first share itself.
+ * @param combination The set operation.
+ */
+static void run_share_searches(SetCombination *combination)
+{
+  size_t thread_count = (size_t) combination->thread_count;
+  pthread_t *threads = malloc(thread_count * sizeof(pthread_t));
+  SetWorker *workers = malloc(thread_count * sizeof(SetWorker));
+  if (!threads || !workers) {
+    printf("Failed to allocate memory for the set operation's threads\n");
+    exit(1);
+  }
+  for (int t = 0; t < combination->thread_count; t++)
+    workers[t] = (SetWorker) { combination, t };
+
+  for (int t = 1; t < combination->thread_count; t++)
+  {
+    if (pthread_create(&threads[t], NULL, search_share, &workers[t]) != 0) {
+      printf("Failed to create a thread\n");
+      exit(1);
+    }
+  }
+  search_share(&workers[0]);
+  for (int t = 1; t < combination->thread_count; t++)
+    pthread_join(threads[t], NULL);
+
+  free(threads);
+  free(workers);
+}
+
+/**
+ * Searches the other map for each name in a thread's share of the source map's slots, keeping the
+ * names that the operation wants. The slots of any storage that an incremental resize hasn't
+ * finished moving follow on from the map's own.
+ * @param argument The thread's <code>SetWorker</code>.
+ * @return <code>NULL</code>.
+ */
+static void *search_share(void *argument)
+{
+  SetWorker *worker = argument;
+  SetCombination *combination = worker->combination;
+  SetShare *share = &combination->shares[worker->thread];
+  int64_t threads = combination->thread_count;
+  int64_t position = combination->slot_count * worker->thread / threads;
+  int64_t end = combination->slot_count * (worker->thread + 1) / threads;
+  if (position == end)
+    return NULL;
+
+  // Find the storage and slot that the share starts at
+  const NameMap *storage = combination->source;
+  while (position >= storage->current_size)
+  {
+    position -= storage->current_size;
+    end -= storage->current_size;
+    storage = storage->retiring;
+  }
+
+  for (int64_t index = position; index < end; index++)
+  {
+    if (index == storage->current_size)
+    {
+      end -= storage->current_size;
+      index = 0;
+      storage = storage->retiring;
+    }
+
+    const char *name = storage->engine->name_at(storage, index);
+    if (!name)
+      continue;
+
+    uint64_t hash = stored_hash_at(storage, index);
+    uint64_t other_hash = combination->shared_hash ? hash : hash_of(combination->other, name);
+    const NameMap *other_storage;
+    int64_t other_index = find_name(combination->other, name, other_hash, &other_storage);
+    if (other_index != -1 ? !combination->keep_found : !combination->keep_missing)
+      continue;
+
+    // The result hashes names in the same way as the first map, and keeps the first map's counts
+    // of names that are in both (unless they're being added together)
+    if (combination->source_is_first)
+      keep_member(share, name, hash, stored_count_at(storage, index));
+    else if (other_index != -1 && !combination->keep_missing)
+      keep_member(share, name, other_hash, stored_count_at(other_storage, other_index));
+    else
+      keep_member(share, name, other_hash, stored_count_at(storage, index));
+  }
+  return NULL;
+}
+
+/**
+ * Adds a name to a thread's list of names to add to the result.
+ * @param share The thread's names.
+ * @param name The name.
+ * @param hash The hash of the name, as given by <code>hash_of</code> for the first map.
+ * @param count The count to add the name with.
+ */
+static void keep_member(SetShare *share, const char *name, uint64_t hash, uint64_t count)
+{
+  if (share->count == share->capacity)
+  {
+    share->capacity = share->capacity > 0 ? share->capacity * 2 : 64;
+    share->members = realloc(share->members, share->capacity * sizeof(SetMember));
+    if (!share->members) {
+      printf("Failed to allocate memory for the set operation's names\n");
+      exit(1);
+    }
+  }
+  share->members[share->count++] = (SetMember) { name, hash, count };
+}
+
+/**
+ * Adds a name to the result of a set operation, which has already been sized to hold it.
+ * @param result The result.
+ * @param name The name.
+ * @param hash The hash of the name, as given by <code>hash_of</code>.
+ * @param count The count to add the name with.
+ */
+static void add_member(NameMap *result, const char *name, uint64_t hash, uint64_t count)
+{
+  int64_t previous_number_of_items = result->number_of_items;
+  result->engine->insert(result, name, hash, fingerprint_of(result, name, hash), count);
+  if (result->key_arena && result->number_of_items != previous_number_of_items)
+    result->live_key_bytes += strlen(name) + 1;
+}
@@ -0,0 +1,161 @@
+/*
+ ============================================================================
+ Name        : CWK2Q3Stats.c
+ Description :
+ Statistics about the shape of a Q3 hash map, for exporting to metrics.
+
+ Probe lengths aren't recorded as searches happen, which would slow every
+ search down. Instead, they are worked out from the table itself when the
+ statistics are asked for: how many probes a search for each name in the map
+ takes (the hits), and how many a search for a name that isn't in the map
+ takes from each slot it could start at (the misses). So gathering them
+ costs a walk over every slot, but searches cost exactly what they did.
+
+ The only thing measured as the map runs is the time spent resizing, and
+ only if the map was created with time_resizes set.
+
+ ============================================================================
+*/
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "CWK2Q3Internal.h"
+
+static uint64_t now_in_nanoseconds();
+static size_t longest_cluster(const NameMap*);
+
+/**
+ * Gets statistics about the map, including every name that an incremental resize hasn't moved yet.
+ * This visits every slot, so is meant to be called periodically (e.g. by a metrics exporter)
+ * rather than alongside every operation.
+ * @param map The map.
+ * @return The statistics.
+ */
+NameMapStats get_name_map_stats(const NameMap *map)
+{
+  NameMapCounters counters = get_name_map_counters(map);
+  NameMapStats stats = {
+      .capacity = counters.capacity,
+      .live_entries = counters.live_entries,
+      .tombstones = counters.tombstones,
+      .load_factor = counters.capacity > 0
+          ? (double) counters.live_entries / (double) counters.capacity
+          : 0,
+      .resizes = map->resizes,
+      .rehash_nanoseconds = map->rehash_nanoseconds
+  };
+
+  // The means are built up as totals, then divided once every slot has been visited
+  long misses = 0;
+  for (const NameMap *storage = map; storage; storage = storage->retiring)
+  {
+    if (storage->current_size == 0)
+      continue;
+
+    storage->engine->collect_probe_lengths(storage, &stats);
+    misses += storage->current_size;
+    size_t cluster = longest_cluster(storage);
+    if (cluster > stats.longest_cluster)
+      stats.longest_cluster = cluster;
+  }
+  if (stats.live_entries > 0)
+    stats.mean_hit_probes /= (double) stats.live_entries;
+  if (misses > 0)
+    stats.mean_miss_probes /= (double) misses;
+  return stats;
+}
+
+/**
+ * Records the number of probes a single search takes. Engines call this from
+ * <code>collect_probe_lengths</code>.
+ * @param stats The statistics being gathered.
+ * @param hit <code>true</code> if the search finds a name, or <code>false</code> if it doesn't.
+ * @param probes The number of probes.
+ */
+void record_probe_length(NameMapStats *stats, bool hit, int64_t probes)
+{
+  // Bucket b holds lengths from 2^b up to 2^(b + 1) - 1
+  int bucket = 0;
+  while (bucket < NAME_MAP_PROBE_BUCKETS - 1 && probes >> (bucket + 1))
+    bucket++;
+
+  if (hit)
+  {
+    stats->hit_probe_histogram[bucket]++;
+    stats->mean_hit_probes += (double) probes;
+    if ((size_t) probes > stats->max_hit_probes)
+      stats->max_hit_probes = (size_t) probes;
+  } else
+  {
+    stats->miss_probe_histogram[bucket]++;
+    stats->mean_miss_probes += (double) probes;
+    if ((size_t) probes > stats->max_miss_probes)
+      stats->max_miss_probes = (size_t) probes;
+  }
+}
+
+/**
+ * Gets the length of the longest run of consecutive slots that aren't empty, wrapping around the
+ * end of the map. Every engine leaves empty slots (and only empty slots) <code>NULL</code>, or
+ * <code>COMPACT_SLOT_EMPTY</code> for the compact engine, while tombstones and deleted slots still
+ * count as part of a run, as searches have to pass over them.
+ * @param map The map.
+ * @return The length of the longest run.
+ */
+static size_t longest_cluster(const NameMap *map)
+{
+  // Start just after an empty slot so that no run is split by the wrap around
+  int64_t start = 0;
+  while (start < map->current_size && slot_in_use(map, start))
+    start++;
+  if (start == map->current_size)
+    return (size_t) map->current_size;
+
+  size_t longest = 0;
+  size_t run = 0;
+  for (int64_t step = 1; step <= map->current_size; step++)
+  {
+    int64_t index = (start + step) % map->current_size;
+    run = slot_in_use(map, index) ? run + 1 : 0;
+    if (run > longest)
+      longest = run;
+  }
+  return longest;
+}
+
+/**
+ * Starts timing a resize, if the map was created with <code>time_resizes</code> set.
+ * @param map The map being resized.
+ * @return The time to pass to <code>stop_rehash_timer</code>.
+ */
+uint64_t start_rehash_timer(const NameMap *map)
+{
+  return map->config.time_resizes ? now_in_nanoseconds() : 0;
+}
+
+/**
+ * Adds the time since <code>start_rehash_timer</code> was called to the map's total time spent
+ * resizing, if the map was created with <code>time_resizes</code> set.
+ * @param map The map being resized.
+ * @param started The time returned by <code>start_rehash_timer</code>.
+ */
+void stop_rehash_timer(NameMap *map, uint64_t started)
+{
+  if (map->config.time_resizes)
+    map->rehash_nanoseconds += now_in_nanoseconds() - started;
+}
+
+/**
+ * Gets the current time of a monotonic clock.
+ * @return The current time, in nanoseconds.
+ */
+static uint64_t now_in_nanoseconds()
+{
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return (uint64_t) time.tv_sec * 1000000000ULL + (uint64_t) time.tv_nsec;
+}
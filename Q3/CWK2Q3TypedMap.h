@@ -0,0 +1,383 @@
+#ifndef CWK2Q3_TYPED_MAP_H
+#define CWK2Q3_TYPED_MAP_H
+
+// Maps from keys to values, generated for particular key and value types by DEFINE_TYPED_MAP. These
+// probe the same way as the Q3 name map's linear probing engine (an interval of 1, tombstones for
+// removed keys and growth at a load factor of 0.7), but each slot holds a value inline alongside
+// its key, so finding a key finds its value with no second lookup. A control byte per slot holds a
+// fragment of the key's hash (as in the group probing engine), so keys are only compared when their
+// fragments match.
+//
+// Every generated function is static inline, and the hash and equality functions are macro
+// arguments rather than function pointers, so each instance compiles to code specialised for its
+// types. For example,
+//    DEFINE_TYPED_MAP(NameCounts, name_counts, const char*, int, hash_name_key, name_keys_equal)
+// defines the type NameCounts, and the functions create_name_counts, free_name_counts,
+// name_counts_size, get_from_name_counts, upsert_into_name_counts,
+// get_or_insert_into_name_counts and remove_from_name_counts.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "CWK2Q3.h"
+
+#define TYPED_MAP_EMPTY ((uint8_t) 0)
+#define TYPED_MAP_DELETED ((uint8_t) 1)
+#define TYPED_MAP_MIN_CAPACITY 16
+#define TYPED_MAP_MAX_LOAD_FACTOR 0.7
+
+/**
+ * Hashes a name key. This is the hash used by <code>HASH_POLICY_FAST</code>.
+ * @param key The name.
+ * @return The hash.
+ */
+static inline uint64_t hash_name_key(const char *key)
+{
+  return hash_name(key);
+}
+
+/**
+ * Compares two name keys.
+ * @param first The first name.
+ * @param second The second name.
+ * @return <code>true</code> if the names are equal.
+ */
+static inline bool name_keys_equal(const char *first, const char *second)
+{
+  return strcmp(first, second) == 0;
+}
+
+/**
+ * Hashes an integer key, using the same finaliser as the name map's hashes so that every bit of
+ * the key affects the slot it lands in.
+ * @param key The integer.
+ * @return The hash.
+ */
+static inline uint64_t hash_integer_key(uint64_t key)
+{
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdULL;
+  key ^= key >> 33;
+  key *= 0xc4ceb9fe1a85ec53ULL;
+  key ^= key >> 33;
+  return key;
+}
+
+/**
+ * Compares two integer keys.
+ * @param first The first integer.
+ * @param second The second integer.
+ * @return <code>true</code> if the integers are equal.
+ */
+static inline bool integer_keys_equal(uint64_t first, uint64_t second)
+{
+  return first == second;
+}
+
+/**
+ * Gets the control byte stored for a key. The top bit is always set, so this never equals
+ * <code>TYPED_MAP_EMPTY</code> or <code>TYPED_MAP_DELETED</code>.
+ * @param hash The hash of the key.
+ * @return The control byte.
+ */
+static inline uint8_t typed_map_fragment(uint64_t hash)
+{
+  return (uint8_t) (0x80 | (hash >> 57));
+}
+
+/**
+ * Checks whether a map must be rehashed before another key is added to it.
+ * @param used The number of slots holding a key or a tombstone.
+ * @param capacity The number of slots.
+ * @return <code>true</code> if adding a key would take the map over the maximum load factor.
+ */
+static inline bool typed_map_is_full(size_t used, size_t capacity)
+{
+  return (double) (used + 1) > (double) capacity * TYPED_MAP_MAX_LOAD_FACTOR;
+}
+
+/**
+ * Gets the smallest power of two capacity (of at least <code>TYPED_MAP_MIN_CAPACITY</code>) that
+ * holds the given number of keys without going over the maximum load factor.
+ * @param count The number of keys.
+ * @return The capacity.
+ */
+static inline size_t typed_map_capacity_for(size_t count)
+{
+  size_t capacity = TYPED_MAP_MIN_CAPACITY;
+  while (typed_map_is_full(count, capacity))
+    capacity *= 2;
+  return capacity;
+}
+
+/**
+ * Defines a map from <code>KeyType</code> to <code>ValueType</code>, named <code>Type</code>, and
+ * the functions that operate on it, whose names are built from <code>name</code>.
+ * <code>hash_key(key)</code> must return a well-distributed <code>uint64_t</code> hash of a key
+ * (<code>hash_name_key</code> or <code>hash_integer_key</code>, for example), and
+ * <code>keys_equal(first, second)</code> must return whether two keys are equal. Keys and values
+ * are copied into the map by assignment, so a map of names doesn't own the names themselves.
+ */
+#define DEFINE_TYPED_MAP(Type, name, KeyType, ValueType, hash_key, keys_equal)                    \
+                                                                                                  \
+/**                                                                                               \
+ * A key and its value.                                                                           \
+ */                                                                                               \
+typedef struct Type##Slot                                                                         \
+{                                                                                                 \
+  /**                                                                                             \
+   * The key. Only meaningful if the slot's control byte holds a fragment.                        \
+   */                                                                                             \
+  KeyType key;                                                                                    \
+                                                                                                  \
+  /**                                                                                             \
+   * The value stored for the key.                                                                \
+   */                                                                                             \
+  ValueType value;                                                                                \
+} Type##Slot;                                                                                     \
+                                                                                                  \
+/**                                                                                               \
+ * A map from keys to values.                                                                     \
+ */                                                                                               \
+typedef struct Type                                                                               \
+{                                                                                                 \
+  /**                                                                                             \
+   * The keys and their values.                                                                   \
+   */                                                                                             \
+  Type##Slot *slots;                                                                              \
+                                                                                                  \
+  /**                                                                                             \
+   * Runs parallel to <code>slots</code>, holding <code>TYPED_MAP_EMPTY</code>,                   \
+   * <code>TYPED_MAP_DELETED</code> or the fragment of the hash of the key in each slot.          \
+   */                                                                                             \
+  uint8_t *control_bytes;                                                                         \
+                                                                                                  \
+  /**                                                                                             \
+   * The number of slots. Always a power of two.                                                  \
+   */                                                                                             \
+  size_t capacity;                                                                                \
+                                                                                                  \
+  /**                                                                                             \
+   * The number of keys in the map.                                                               \
+   */                                                                                             \
+  size_t number_of_items;                                                                         \
+                                                                                                  \
+  /**                                                                                             \
+   * The number of slots holding a tombstone.                                                     \
+   */                                                                                             \
+  size_t number_of_tombstones;                                                                    \
+} Type;                                                                                           \
+                                                                                                  \
+/**                                                                                               \
+ * Replaces a map's slots with empty ones, without freeing the old slots.                         \
+ * @param map The map.                                                                            \
+ * @param capacity The number of slots, which must be a power of two.                             \
+ */                                                                                               \
+static inline void name##_allocate_slots(Type *map, size_t capacity)                              \
+{                                                                                                 \
+  map->slots = malloc(capacity * sizeof(Type##Slot));                                             \
+  map->control_bytes = calloc(capacity, 1);                                                       \
+  if (!map->slots || !map->control_bytes) {                                                       \
+    printf("Failed to allocate memory for the " #name " slots\n");                                \
+    exit(1);                                                                                      \
+  }                                                                                               \
+  map->capacity = capacity;                                                                       \
+  map->number_of_items = 0;                                                                       \
+  map->number_of_tombstones = 0;                                                                  \
+}                                                                                                 \
+                                                                                                  \
+/**                                                                                               \
+ * Creates an empty map.                                                                          \
+ * @param expected_items The number of keys the map should hold before it first needs to grow.    \
+ * @return The map. This must be freed with <code>free_##name</code>.                             \
+ */                                                                                               \
+static inline Type *create_##name(size_t expected_items)                                          \
+{                                                                                                 \
+  Type *map = malloc(sizeof(Type));                                                               \
+  if (!map) {                                                                                     \
+    printf("Failed to allocate memory for the " #name "\n");                                      \
+    exit(1);                                                                                      \
+  }                                                                                               \
+  name##_allocate_slots(map, typed_map_capacity_for(expected_items));                             \
+  return map;                                                                                     \
+}                                                                                                 \
+                                                                                                  \
+/**                                                                                               \
+ * Frees a map.                                                                                   \
+ * @param map The map to free.                                                                    \
+ */                                                                                               \
+static inline void free_##name(Type *map)                                                         \
+{                                                                                                 \
+  free(map->slots);                                                                               \
+  free(map->control_bytes);                                                                       \
+  free(map);                                                                                      \
+}                                                                                                 \
+                                                                                                  \
+/**                                                                                               \
+ * Gets the number of keys in a map.                                                              \
+ * @param map The map.                                                                            \
+ * @return The number of keys.                                                                    \
+ */                                                                                               \
+static inline size_t name##_size(const Type *map)                                                 \
+{                                                                                                 \
+  return map->number_of_items;                                                                    \
+}                                                                                                 \
+                                                                                                  \
+/**                                                                                               \
+ * Gets the slot holding a key.                                                                   \
+ * @param map The map to search.                                                                  \
+ * @param key The key to search for.                                                              \
+ * @param hash The hash of the key.                                                               \
+ * @return The slot, or <code>NULL</code> if the key isn't in the map.                            \
+ */                                                                                               \
+static inline Type##Slot *name##_find(const Type *map, KeyType key, uint64_t hash)                \
+{                                                                                                 \
+  uint8_t fragment = typed_map_fragment(hash);                                                    \
+  size_t mask = map->capacity - 1;                                                                \
+  for (size_t index = hash & mask; map->control_bytes[index] != TYPED_MAP_EMPTY;                  \
+       index = (index + 1) & mask)                                                                \
+  {                                                                                               \
+    if (map->control_bytes[index] == fragment && keys_equal(map->slots[index].key, key))          \
+      return &map->slots[index];                                                                  \
+  }                                                                                               \
+  return NULL;                                                                                    \
+}                                                                                                 \
+                                                                                                  \
+/**                                                                                               \
+ * Puts a key that isn't in the map into the first free slot along its probe sequence, without    \
+ * growing the map.                                                                               \
+ * @param map The map.                                                                            \
+ * @param key The key.                                                                            \
+ * @param hash The hash of the key.                                                               \
+ * @return The slot the key was put in. Its value is left uninitialised.                          \
+ */                                                                                               \
+static inline Type##Slot *name##_place(Type *map, KeyType key, uint64_t hash)                     \
+{                                                                                                 \
+  size_t mask = map->capacity - 1;                                                                \
+  size_t index = hash & mask;                                                                     \
+  while (map->control_bytes[index] > TYPED_MAP_DELETED)                                           \
+    index = (index + 1) & mask;                                                                   \
+                                                                                                  \
+  if (map->control_bytes[index] == TYPED_MAP_DELETED)                                             \
+    map->number_of_tombstones--;                                                                  \
+  map->control_bytes[index] = typed_map_fragment(hash);                                           \
+  map->slots[index].key = key;                                                                    \
+  map->number_of_items++;                                                                         \
+  return &map->slots[index];                                                                      \
+}                                                                                                 \
+                                                                                                  \
+/**                                                                                               \
+ * Moves every key and value into new slots, clearing out every tombstone.                        \
+ * @param map The map.                                                                            \
+ * @param capacity The new number of slots, which must be a power of two.                         \
+ */                                                                                               \
+static inline void name##_rehash(Type *map, size_t capacity)                                      \
+{                                                                                                 \
+  Type old = *map;                                                                                \
+  name##_allocate_slots(map, capacity);                                                           \
+  for (size_t i = 0; i < old.capacity; i++)                                                       \
+  {                                                                                               \
+    if (old.control_bytes[i] > TYPED_MAP_DELETED)                                                 \
+    {                                                                                             \
+      Type##Slot *slot = name##_place(map, old.slots[i].key, hash_key(old.slots[i].key));         \
+      slot->value = old.slots[i].value;                                                           \
+    }                                                                                             \
+  }                                                                                               \
+  free(old.slots);                                                                                \
+  free(old.control_bytes);                                                                        \
+}                                                                                                 \
+                                                                                                  \
+/**                                                                                               \
+ * Gets the slot holding a key, adding the key if it isn't already in the map.                    \
+ * @param map The map.                                                                            \
+ * @param key The key.                                                                            \
+ * @param inserted Will be set to whether the key was added.                                      \
+ * @return The key's slot. If the key was added, its value is left uninitialised.                 \
+ */                                                                                               \
+static inline Type##Slot *name##_claim(Type *map, KeyType key, bool *inserted)                    \
+{                                                                                                 \
+  uint64_t hash = hash_key(key);                                                                  \
+  Type##Slot *slot = name##_find(map, key, hash);                                                 \
+  *inserted = !slot;                                                                              \
+  if (slot)                                                                                       \
+    return slot;                                                                                  \
+                                                                                                  \
+  /* Rehashing clears out every tombstone, so the capacity only needs to double if keys */        \
+  /* (rather than tombstones) fill at least half of the slots that may be used */                 \
+  if (typed_map_is_full(map->number_of_items + map->number_of_tombstones, map->capacity))         \
+  {                                                                                               \
+    bool mostly_keys = typed_map_is_full(2 * map->number_of_items, map->capacity);                \
+    name##_rehash(map, mostly_keys ? 2 * map->capacity : map->capacity);                          \
+  }                                                                                               \
+  return name##_place(map, key, hash);                                                            \
+}                                                                                                 \
+                                                                                                  \
+/**                                                                                               \
+ * Gets the value stored for a key. The value can be updated in place through the pointer, which  \
+ * stays valid until the next key is added to the map.                                            \
+ * @param map The map to search.                                                                  \
+ * @param key The key to search for.                                                              \
+ * @return The value, or <code>NULL</code> if the key isn't in the map.                           \
+ */                                                                                               \
+static inline ValueType *get_from_##name(const Type *map, KeyType key)                            \
+{                                                                                                 \
+  Type##Slot *slot = name##_find(map, key, hash_key(key));                                        \
+  return slot ? &slot->value : NULL;                                                              \
+}                                                                                                 \
+                                                                                                  \
+/**                                                                                               \
+ * Stores a value for a key, replacing any value already stored for it.                           \
+ * @param map The map.                                                                            \
+ * @param key The key.                                                                            \
+ * @param value The value.                                                                        \
+ * @return <code>1</code> if the key was added, or <code>0</code> if its value was replaced.      \
+ */                                                                                               \
+static inline int upsert_into_##name(Type *map, KeyType key, ValueType value)                     \
+{                                                                                                 \
+  bool inserted;                                                                                  \
+  name##_claim(map, key, &inserted)->value = value;                                               \
+  return inserted;                                                                                \
+}                                                                                                 \
+                                                                                                  \
+/**                                                                                               \
+ * Gets the value stored for a key, first storing the given value if the key isn't in the map.    \
+ * This lets a value be updated in place with a single lookup, e.g.                               \
+ * <code>(*get_or_insert_into_##name(map, key, 0))++</code> to count occurrences of a key. The    \
+ * pointer stays valid until the next key is added to the map.                                    \
+ * @param map The map.                                                                            \
+ * @param key The key.                                                                            \
+ * @param initial_value The value to store if the key isn't in the map.                           \
+ * @return The value.                                                                             \
+ */                                                                                               \
+static inline ValueType *get_or_insert_into_##name(                                               \
+    Type *map, KeyType key, ValueType initial_value)                                              \
+{                                                                                                 \
+  bool inserted;                                                                                  \
+  Type##Slot *slot = name##_claim(map, key, &inserted);                                           \
+  if (inserted)                                                                                   \
+    slot->value = initial_value;                                                                  \
+  return &slot->value;                                                                            \
+}                                                                                                 \
+                                                                                                  \
+/**                                                                                               \
+ * Removes a key and its value from a map, leaving a tombstone behind.                            \
+ * @param map The map.                                                                            \
+ * @param key The key to remove.                                                                  \
+ * @param removed_value If not <code>NULL</code>, the removed value is copied here.               \
+ * @return <code>1</code> if the key was removed, or <code>0</code> if it wasn't in the map.      \
+ */                                                                                               \
+static inline int remove_from_##name(Type *map, KeyType key, ValueType *removed_value)            \
+{                                                                                                 \
+  Type##Slot *slot = name##_find(map, key, hash_key(key));                                        \
+  if (!slot)                                                                                      \
+    return 0;                                                                                     \
+                                                                                                  \
+  if (removed_value)                                                                              \
+    *removed_value = slot->value;                                                                 \
+  map->control_bytes[slot - map->slots] = TYPED_MAP_DELETED;                                      \
+  map->number_of_items--;                                                                         \
+  map->number_of_tombstones++;                                                                    \
+  return 1;                                                                                       \
+}
+
+#endif // CWK2Q3_TYPED_MAP_H
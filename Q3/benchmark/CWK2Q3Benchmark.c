@@ -0,0 +1,2896 @@
+/*
+ ============================================================================
+ Name        : CWK2Q3Benchmark.c
+ Description :
+ Benchmarks for the Q3 hash map. Build from the Q3 directory with:
+    gcc -std=c11 -O2 -pthread -DCWK2Q3_NO_MAIN -DNAME_MAP_STRCMP=counting_strcmp \
+        CWK2Q3*.c benchmark/CWK2Q3Benchmark.c -o benchmark/CWK2Q3Benchmark
+ and run with:
+    ./benchmark/CWK2Q3Benchmark <benchmark> [names file] [slots]
+ where the names file defaults to names.txt. The number of slots is only used
+ by the large benchmark, and may be beyond the range of an int (e.g.
+ 3000000000), given enough memory: 8 bytes per slot, plus the names.
+
+ ============================================================================
+*/
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include "../CWK2Q3.h"
+#include "../CWK2Q3TypedMap.h"
+
+#define LOOKUP_ROUNDS 200
+#define ENGINE_COPIES 20
+#define LATENCY_COPIES 200
+#define LATENCY_BUCKETS 32
+#define INCREMENTAL_RESIZE_STEP 16
+#define LOAD_ROUNDS 100
+#define SYNTHETIC_NAMES 10000000
+#define SYNTHETIC_FILE "synthetic_names.txt"
+#define CONCURRENCY_COPIES 20
+#define CONCURRENCY_OPERATIONS 1000000
+#define CONCURRENCY_MIN_THREADS 4
+#define SNAPSHOT_ROUNDS 100
+#define SNAPSHOT_WRITERS 2
+#define INCREMENTAL_CHURN_NAMES 400
+#define INCREMENTAL_CHURN_OPERATIONS 200000
+#define INCREMENTAL_CHURN_SEEDS 64
+#define FREEZE_COPIES 20
+#define IMAGE_FILE "names.q3image"
+#define BLOOM_COPIES 20
+#define BATCH_SIZE 1024
+#define TYPED_MAP_ROUNDS 20
+#define TYPED_MAP_ATTEMPTS 5
+#define STATS_COPIES 20
+#define INLINE_KEY_ROUNDS 3
+#define CUCKOO_COPIES 20
+#define CUCKOO_ROUNDS 10
+#define LARGE_DEFAULT_SLOTS (1ULL << 27)
+#define LONG_KEY_BYTES (32 << 20)
+#define PARALLEL_BUILD_MIN_THREADS 4
+#define COUNTING_EVENTS 10000000
+#define COUNTING_TOP 10
+#define COUNTING_FILE "counting_events.txt"
+#define SET_FEED_NAMES 4000000
+#define SET_WATCHLIST_NAMES 1000000
+#define ADVERSARIAL_NAMES 4000
+#define ADVERSARIAL_CAPACITY 8192
+#define ADVERSARIAL_ROUNDS 3
+// Each unit of a seedless collision is two words, so 12 units give 4096 names of 192 bytes
+#define SEEDLESS_COLLISION_UNITS 12
+#define MIX_FIRST_MULTIPLIER 0xff51afd7ed558ccdULL
+#define MIX_SECOND_MULTIPLIER 0xc4ceb9fe1a85ec53ULL
+// Kept small because, without a resize, enough churn leaves the linear probing engine with no empty
+// slots at all, at which point every miss loops forever
+#define CHURN_ROUNDS 6
+
+/**
+ * A list of names read from a file.
+ */
+typedef struct NameList
+{
+  /**
+   * The names. Each of these is a separately allocated, null-terminated string.
+   */
+  char **names;
+
+  /**
+   * The number of names in <code>names</code>.
+   */
+  size_t length;
+} NameList;
+
+/**
+ * One of the maps compared by the concurrency benchmark, along with the operations on it.
+ */
+typedef struct ThreadSafeMap
+{
+  /**
+   * A description of the map, for the output.
+   */
+  const char *label;
+
+  /**
+   * Creates the map, holding the given names.
+   */
+  void *(*create)(const NameList *names);
+
+  /**
+   * Adds a name to the map.
+   */
+  void (*add)(void *map, const char *name);
+
+  /**
+   * Removes a name from the map.
+   */
+  void (*remove)(void *map, const char *name);
+
+  /**
+   * Searches the map for a name, returning <code>1</code> if it was found.
+   */
+  int (*search)(void *map, const char *name);
+
+  /**
+   * Frees the map.
+   */
+  void (*free)(void *map);
+} ThreadSafeMap;
+
+/**
+ * The work done by one thread in the concurrency benchmark.
+ */
+typedef struct ConcurrencyWorker
+{
+  /**
+   * The operations on the map being benchmarked.
+   */
+  const ThreadSafeMap *implementation;
+
+  /**
+   * The map being benchmarked, shared by every thread.
+   */
+  void *map;
+
+  /**
+   * The names that are in the map before the benchmark starts, which are searched for.
+   */
+  const NameList *names;
+
+  /**
+   * The names that are added and removed.
+   */
+  const NameList *churn;
+
+  /**
+   * The percentage of operations that are an add or a remove, rather than a search.
+   */
+  int write_percentage;
+
+  /**
+   * The seed of the thread's random number generator.
+   */
+  uint64_t seed;
+} ConcurrencyWorker;
+
+typedef struct SnapshotReporter
+{
+  /**
+   * The map being reported on: a concurrent map if <code>use_snapshots</code> is set, or an
+   * ordinary map guarded by the global lock if it isn't.
+   */
+  void *map;
+
+  /**
+   * An empty ordinary map, which the ordinary map is copied by taking the union with.
+   */
+  const NameMap *empty;
+
+  /**
+   * Whether to take a snapshot of the concurrent map, rather than copying the ordinary map.
+   */
+  bool use_snapshots;
+
+  /**
+   * Set once the writers have finished, to stop the reporting thread.
+   */
+  atomic_bool stop;
+
+  /**
+   * The number of views of the map taken so far.
+   */
+  long reports;
+
+  /**
+   * The total number of names in those views.
+   */
+  long names_seen;
+} SnapshotReporter;
+
+/**
+ * A benchmark that can be selected from the command line.
+ */
+typedef struct Benchmark
+{
+  /**
+   * The name used to select the benchmark.
+   */
+  const char *name;
+
+  /**
+   * Runs the benchmark against the given names.
+   */
+  void (*run)(const NameList*);
+} Benchmark;
+
+/**
+ * A name and its count in the hand-written map.
+ */
+typedef struct HandWrittenSlot
+{
+  /**
+   * The name.
+   */
+  const char *name;
+
+  /**
+   * The number of times the name has been counted.
+   */
+  int count;
+} HandWrittenSlot;
+
+/**
+ * A map from names to counts, written by hand in the same way as the maps generated by
+ * <code>DEFINE_TYPED_MAP</code>, to check that the generated code is as fast.
+ */
+typedef struct HandWrittenCounts
+{
+  /**
+   * The names and their counts.
+   */
+  HandWrittenSlot *slots;
+
+  /**
+   * Runs parallel to <code>slots</code>, holding <code>0</code> for an empty slot or a fragment of
+   * the name's hash.
+   */
+  uint8_t *control_bytes;
+
+  /**
+   * The number of slots. Always a power of two.
+   */
+  size_t capacity;
+
+  /**
+   * The number of names in the map.
+   */
+  size_t number_of_items;
+} HandWrittenCounts;
+
+DEFINE_TYPED_MAP(NameCounts, name_counts, const char*, int, hash_name_key, name_keys_equal)
+DEFINE_TYPED_MAP(IntegerCounts, integer_counts, uint64_t, int, hash_integer_key, integer_keys_equal)
+
+// The number of times the map has compared two keys character by character on this thread. Thread
+// local, so that counting doesn't make threads contend on a shared cache line
+static _Thread_local long strcmp_calls = 0;
+
+// The path of the names file, for benchmarks that need to read it themselves
+static const char *list_path;
+
+// The number of slots in the map built by the large benchmark
+static size_t large_slots;
+
+/**
+ * Compares two strings, keeping a count of the number of comparisons made. The map is compiled to
+ * use this in place of <code>strcmp</code>.
+ * @param first The first string.
+ * @param second The second string.
+ * @return The result of <code>strcmp(first, second)</code>.
+ */
+int counting_strcmp(const char *first, const char *second)
+{
+  strcmp_calls++;
+  return strcmp(first, second);
+}
+
+/**
+ * Gets the current time of a monotonic clock.
+ * @return The current time, in nanoseconds.
+ */
+static double now_in_nanoseconds()
+{
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return (double) time.tv_sec * 1e9 + (double) time.tv_nsec;
+}
+
+/**
+ * Reads a file of quoted, comma-separated names, e.g. <code>"MARY","PATRICIA"</code>.
+ * @param path The path of the file to read.
+ * @return The names in the file. Exits if the file can't be read.
+ */
+static NameList read_names(const char *path)
+{
+  FILE *file = fopen(path, "r");
+  if (!file) {
+    printf("Could not open %s\n", path);
+    exit(1);
+  }
+
+  NameList list = { NULL, 0 };
+  size_t capacity = 0;
+  char buffer[256];
+  size_t buffer_length = 0;
+  bool in_quotes = false;
+  int character;
+
+  while ((character = fgetc(file)) != EOF)
+  {
+    if (character == '"')
+    {
+      // A closing quote marks the end of a name, so add it to the list
+      if (in_quotes)
+      {
+        if (list.length == capacity)
+        {
+          capacity = capacity ? capacity * 2 : 1024;
+          list.names = realloc(list.names, capacity * sizeof(char*));
+          if (!list.names) {
+            printf("Failed to allocate memory for the names\n");
+            exit(1);
+          }
+        }
+        buffer[buffer_length] = '\0';
+        list.names[list.length] = malloc(buffer_length + 1);
+        if (!list.names[list.length]) {
+          printf("Failed to allocate memory for a name\n");
+          exit(1);
+        }
+        memcpy(list.names[list.length++], buffer, buffer_length + 1);
+        buffer_length = 0;
+      }
+      in_quotes = !in_quotes;
+    }
+    else if (in_quotes && buffer_length < sizeof(buffer) - 1)
+      buffer[buffer_length++] = (char) character;
+  }
+
+  fclose(file);
+  return list;
+}
+
+/**
+ * Frees a list of names, including the names themselves.
+ * @param list The list to free.
+ */
+static void free_names(NameList *list)
+{
+  for (size_t i = 0; i < list->length; i++)
+    free(list->names[i]);
+  free(list->names);
+  list->names = NULL;
+  list->length = 0;
+}
+
+/**
+ * Creates a copy of every name in the list with its characters reversed. As these are anagrams of
+ * the originals, they always collide with them under the ASCII-sum hash, but are (almost all) not
+ * in the original list, so make for pathological misses.
+ * @param list The list to reverse.
+ * @return The reversed names. These must be freed with <code>free_names</code>.
+ */
+static NameList reverse_names(const NameList *list)
+{
+  NameList reversed = { malloc(list->length * sizeof(char*)), list->length };
+  if (!reversed.names) {
+    printf("Failed to allocate memory for the reversed names\n");
+    exit(1);
+  }
+
+  for (size_t i = 0; i < list->length; i++)
+  {
+    size_t length = strlen(list->names[i]);
+    reversed.names[i] = malloc(length + 1);
+    if (!reversed.names[i]) {
+      printf("Failed to allocate memory for a reversed name\n");
+      exit(1);
+    }
+    for (size_t j = 0; j < length; j++)
+      reversed.names[i][j] = list->names[i][length - j - 1];
+    reversed.names[i][length] = '\0';
+  }
+  return reversed;
+}
+
+/**
+ * Searches the map for every name in the list, many times over, and prints the average cost.
+ * @param label A description of the map, for the output.
+ * @param map The map to search.
+ * @param list The names to search for.
+ */
+static void time_lookups(const char *label, const NameMap *map, const NameList *list)
+{
+  long found = 0;
+  strcmp_calls = 0;
+  double start = now_in_nanoseconds();
+  for (int round = 0; round < LOOKUP_ROUNDS; round++)
+  {
+    for (size_t i = 0; i < list->length; i++)
+      found += search_name_map(map, list->names[i]);
+  }
+  double elapsed = now_in_nanoseconds() - start;
+
+  double lookups = (double) LOOKUP_ROUNDS * (double) list->length;
+  printf(
+      "  %-24s %8.2f strcmp/lookup %8.2f ns/lookup (%ld found)\n",
+      label, (double) strcmp_calls / lookups, elapsed / lookups, found / LOOKUP_ROUNDS
+  );
+}
+
+/**
+ * Compares lookups with and without cached fingerprints.
+ * @param list The names to store in the map.
+ */
+static void benchmark_fingerprints(const NameList *list)
+{
+  NameList misses = reverse_names(list);
+
+  for (int cache_hashes = 0; cache_hashes <= 1; cache_hashes++)
+  {
+    NameMapConfig config = default_name_map_config();
+    config.cache_hashes = cache_hashes;
+    NameMap *map = create_name_map_with_config(0, &config);
+    for (size_t i = 0; i < list->length; i++)
+      add_to_name_map(map, list->names[i]);
+
+    printf("cache_hashes = %s\n", cache_hashes ? "true" : "false");
+    time_lookups("hits", map, list);
+    time_lookups("reversed (mostly misses)", map, &misses);
+    free_name_map(map);
+  }
+
+  free_names(&misses);
+}
+
+/**
+ * Searches the map for every name in the list and prints a summary of the probe lengths. With
+ * fingerprints disabled and no tombstones, every slot in a probe sequence is compared with strcmp,
+ * so the number of comparisons is exactly the probe length.
+ * @param label A description of the names, for the output.
+ * @param map The map to search.
+ * @param list The names to search for.
+ */
+static void report_probe_lengths(const char *label, const NameMap *map, const NameList *list)
+{
+  long total = 0;
+  long longest = 0;
+  size_t displaced = 0;
+  for (size_t i = 0; i < list->length; i++)
+  {
+    strcmp_calls = 0;
+    search_name_map(map, list->names[i]);
+    total += strcmp_calls;
+    if (strcmp_calls > longest)
+      longest = strcmp_calls;
+    if (strcmp_calls > 1)
+      displaced++;
+  }
+  printf(
+      "  %-8s mean probe %8.2f  max probe %6ld  collided %6.2f%%\n",
+      label, (double) total / (double) list->length, longest,
+      100.0 * (double) displaced / (double) list->length
+  );
+}
+
+/**
+ * Compares the collisions and probe lengths of each hash policy.
+ * @param list The names to store in the map.
+ */
+static void benchmark_hash_policies(const NameList *list)
+{
+  const char *policy_names[] = { "ascii-sum", "fast", "seeded", "fnv1a", "siphash" };
+  HashPolicy policies[] = {
+      HASH_POLICY_ASCII_SUM, HASH_POLICY_FAST, HASH_POLICY_SEEDED, HASH_POLICY_FNV1A,
+      HASH_POLICY_SIPHASH
+  };
+  NameList misses = reverse_names(list);
+
+  for (size_t p = 0; p < sizeof(policies) / sizeof(policies[0]); p++)
+  {
+    NameMapConfig config = default_name_map_config();
+    config.hash_policy = policies[p];
+    NameMap *map = create_name_map_with_config(0, &config);
+    for (size_t i = 0; i < list->length; i++)
+      add_to_name_map(map, list->names[i]);
+
+    printf("hash_policy = %s\n", policy_names[p]);
+    report_probe_lengths("hits", map, list);
+    report_probe_lengths("reversed", map, &misses);
+    time_lookups("hits", map, list);
+    free_name_map(map);
+  }
+
+  free_names(&misses);
+}
+
+/**
+ * Creates a copy of every name in the list with a suffix appended, giving a list of names that are
+ * distinct from the originals.
+ * @param list The list to copy.
+ * @param suffix The value to add to the end of each name.
+ * @return The suffixed names. These must be freed with <code>free_names</code>.
+ */
+static NameList suffix_names(const NameList *list, int suffix)
+{
+  NameList suffixed = { malloc(list->length * sizeof(char*)), list->length };
+  if (!suffixed.names) {
+    printf("Failed to allocate memory for the suffixed names\n");
+    exit(1);
+  }
+
+  for (size_t i = 0; i < list->length; i++)
+  {
+    size_t length = strlen(list->names[i]) + 16;
+    suffixed.names[i] = malloc(length);
+    if (!suffixed.names[i]) {
+      printf("Failed to allocate memory for a suffixed name\n");
+      exit(1);
+    }
+    snprintf(suffixed.names[i], length, "%s#%d", list->names[i], suffix);
+  }
+  return suffixed;
+}
+
+/**
+ * Compares engines under insert/remove churn. Each round removes every name added in the previous
+ * round and adds the same number of new names, so the number of live names (and so the capacity)
+ * never changes, but tombstones can build up.
+ * @param list The names to base the churn on.
+ */
+static void benchmark_churn(const NameList *list)
+{
+  const char *engine_names[] = { "linear-probing", "robin-hood" };
+  NameMapEngine engines[] = { NAME_MAP_ENGINE_LINEAR_PROBING, NAME_MAP_ENGINE_ROBIN_HOOD };
+  NameList rounds[CHURN_ROUNDS];
+  for (int round = 0; round < CHURN_ROUNDS; round++)
+    rounds[round] = suffix_names(list, round);
+  NameList misses = reverse_names(list);
+
+  for (size_t e = 0; e < sizeof(engines) / sizeof(engines[0]); e++)
+  {
+    NameMapConfig config = default_name_map_config();
+    config.hash_policy = HASH_POLICY_FAST;
+    config.engine = engines[e];
+    NameMap *map = create_name_map_with_config(0, &config);
+    for (size_t i = 0; i < list->length; i++)
+      add_to_name_map(map, list->names[i]);
+
+    printf("engine = %s\n", engine_names[e]);
+    time_lookups("misses before churn", map, &misses);
+
+    const NameList *previous = list;
+    double start = now_in_nanoseconds();
+    for (int round = 0; round < CHURN_ROUNDS; round++)
+    {
+      for (size_t i = 0; i < previous->length; i++)
+        remove_from_name_map(map, previous->names[i]);
+      for (size_t i = 0; i < rounds[round].length; i++)
+        add_to_name_map(map, rounds[round].names[i]);
+      previous = &rounds[round];
+    }
+    double elapsed = now_in_nanoseconds() - start;
+    printf(
+        "  churn                    %8.2f ns/operation\n",
+        elapsed / (2.0 * CHURN_ROUNDS * (double) list->length)
+    );
+
+    time_lookups("hits after churn", map, previous);
+    time_lookups("misses after churn", map, &misses);
+    free_name_map(map);
+  }
+
+  for (int round = 0; round < CHURN_ROUNDS; round++)
+    free_names(&rounds[round]);
+  free_names(&misses);
+}
+
+/**
+ * Creates a list holding several suffixed copies of every name in the list, to give a larger but
+ * still realistic set of names.
+ * @param list The list to copy.
+ * @param copies The number of copies to make.
+ * @return The names. These must be freed with <code>free_names</code>.
+ */
+static NameList expand_names(const NameList *list, int copies)
+{
+  NameList expanded = { malloc(copies * list->length * sizeof(char*)), 0 };
+  if (!expanded.names) {
+    printf("Failed to allocate memory for the expanded names\n");
+    exit(1);
+  }
+
+  for (int copy = 0; copy < copies; copy++)
+  {
+    NameList suffixed = suffix_names(list, copy);
+    memcpy(&expanded.names[expanded.length], suffixed.names, suffixed.length * sizeof(char*));
+    expanded.length += suffixed.length;
+    free(suffixed.names); // The names themselves now belong to the expanded list
+  }
+  return expanded;
+}
+
+/**
+ * Compares the lookup cost of each engine, using several copies of the names so that the table is
+ * larger than the L1 and L2 caches.
+ * @param list The names to base the table on.
+ */
+static void benchmark_engines(const NameList *list)
+{
+  const char *engine_names[] = { "linear-probing", "robin-hood", "group-probing", "cuckoo" };
+  NameMapEngine engines[] = {
+      NAME_MAP_ENGINE_LINEAR_PROBING, NAME_MAP_ENGINE_ROBIN_HOOD, NAME_MAP_ENGINE_GROUP_PROBING,
+      NAME_MAP_ENGINE_CUCKOO
+  };
+  NameList names = expand_names(list, ENGINE_COPIES);
+  NameList misses = reverse_names(&names);
+  printf("Expanded to %zu names\n", names.length);
+
+  for (size_t e = 0; e < sizeof(engines) / sizeof(engines[0]); e++)
+  {
+    NameMapConfig config = default_name_map_config();
+    config.hash_policy = HASH_POLICY_FAST;
+    config.engine = engines[e];
+    NameMap *map = create_name_map_with_config(0, &config);
+    double start = now_in_nanoseconds();
+    for (size_t i = 0; i < names.length; i++)
+      add_to_name_map(map, names.names[i]);
+    double elapsed = now_in_nanoseconds() - start;
+
+    printf("engine = %s\n", engine_names[e]);
+    printf("  %-24s %8.2f ns/insert\n", "build", elapsed / (double) names.length);
+    time_lookups("hits", map, &names);
+    time_lookups("reversed (mostly misses)", map, &misses);
+    free_name_map(map);
+  }
+
+  free_names(&names);
+  free_names(&misses);
+}
+
+/**
+ * Compares two doubles, for use with <code>qsort</code>.
+ * @param first The first double.
+ * @param second The second double.
+ * @return A negative value, zero or a positive value if the first double is less than, equal to or
+ * greater than the second.
+ */
+static int compare_doubles(const void *first, const void *second)
+{
+  double difference = *(const double*) first - *(const double*) second;
+  return (difference > 0) - (difference < 0);
+}
+
+/**
+ * Prints percentiles and a power-of-two histogram of the given latencies.
+ * @param latencies The latencies, in nanoseconds. These are sorted by this function.
+ * @param count The number of latencies.
+ */
+static void report_latencies(double *latencies, size_t count)
+{
+  qsort(latencies, count, sizeof(double), compare_doubles);
+  printf(
+      "  p50 %8.0f ns  p99 %8.0f ns  p99.9 %8.0f ns  p99.99 %10.0f ns  max %10.0f ns\n",
+      latencies[count / 2], latencies[count * 99 / 100], latencies[count * 999 / 1000],
+      latencies[count * 9999 / 10000], latencies[count - 1]
+  );
+
+  size_t buckets[LATENCY_BUCKETS] = { 0 };
+  for (size_t i = 0; i < count; i++)
+  {
+    int bucket = 0;
+    while (bucket < LATENCY_BUCKETS - 1 && latencies[i] >= (double) (2UL << bucket))
+      bucket++;
+    buckets[bucket]++;
+  }
+  for (int bucket = 0; bucket < LATENCY_BUCKETS; bucket++)
+  {
+    if (buckets[bucket])
+      printf("    < %10lu ns: %zu\n", 2UL << bucket, buckets[bucket]);
+  }
+}
+
+/**
+ * Compares the latency of individual inserts with stop-the-world and incremental resizing, while
+ * building a table of around a million names.
+ * @param list The names to base the table on.
+ */
+static void benchmark_insert_latency(const NameList *list)
+{
+  NameList names = expand_names(list, LATENCY_COPIES);
+  double *latencies = malloc(names.length * sizeof(double));
+  if (!latencies) {
+    printf("Failed to allocate memory for the latencies\n");
+    exit(1);
+  }
+  printf("Expanded to %zu names\n", names.length);
+
+  for (int incremental = 0; incremental <= 1; incremental++)
+  {
+    NameMapConfig config = default_name_map_config();
+    config.hash_policy = HASH_POLICY_FAST;
+    config.incremental_resize_step = incremental ? INCREMENTAL_RESIZE_STEP : 0;
+    NameMap *map = create_name_map_with_config(0, &config);
+
+    for (size_t i = 0; i < names.length; i++)
+    {
+      double start = now_in_nanoseconds();
+      add_to_name_map(map, names.names[i]);
+      latencies[i] = now_in_nanoseconds() - start;
+    }
+
+    printf("incremental_resize_step = %d\n", config.incremental_resize_step);
+    report_latencies(latencies, names.length);
+    free_name_map(map);
+  }
+
+  free(latencies);
+  free_names(&names);
+}
+
+/**
+ * Creates a buffer of quoted, comma-separated names in the same format as names.txt, made by
+ * suffixing the given names with a counter.
+ * @param list The names to base the buffer on.
+ * @param count The number of names to put in the buffer.
+ * @param length Will be set to the number of bytes in the buffer.
+ * @return The buffer. This must be freed.
+ */
+static char *create_synthetic_buffer(const NameList *list, size_t count, size_t *length)
+{
+  size_t capacity = count * 32;
+  char *buffer = malloc(capacity);
+  if (!buffer) {
+    printf("Failed to allocate memory for the synthetic names\n");
+    exit(1);
+  }
+
+  *length = 0;
+  for (size_t i = 0; i < count; i++)
+  {
+    *length += (size_t) snprintf(
+        &buffer[*length], capacity - *length, "%s\"%.16s%zu\"",
+        i == 0 ? "" : ",", list->names[i % list->length], i / list->length
+    );
+  }
+  return buffer;
+}
+
+/**
+ * Splits a buffer created by <code>create_synthetic_buffer</code> into separate, null-terminated
+ * names, in place.
+ * @param buffer The buffer.
+ * @param length The number of bytes in the buffer.
+ * @param count The number of names in the buffer.
+ * @return Pointers to each name in the buffer. This must be freed, but the names themselves belong
+ * to the buffer.
+ */
+static char **split_buffer(char *buffer, size_t length, size_t count)
+{
+  char **names = malloc(count * sizeof(char*));
+  if (!names) {
+    printf("Failed to allocate memory for the split names\n");
+    exit(1);
+  }
+
+  char *end = buffer + length;
+  char *quote = buffer;
+  for (size_t found = 0; found < count && (quote = memchr(quote, '"', (size_t) (end - quote)));)
+  {
+    names[found++] = quote + 1;
+    quote = memchr(quote + 1, '"', (size_t) (end - quote - 1));
+    *quote++ = '\0';
+  }
+  return names;
+}
+
+/**
+ * Times building a map of owned names one <code>add_to_name_map</code> call at a time.
+ * @param names The names.
+ * @param count The number of names.
+ * @return The time taken, in nanoseconds.
+ */
+static double time_one_by_one(char **names, size_t count)
+{
+  NameMapConfig config = default_name_map_config();
+  config.hash_policy = HASH_POLICY_FAST;
+  config.own_keys = true;
+
+  double start = now_in_nanoseconds();
+  NameMap *map = create_name_map_with_config(0, &config);
+  for (size_t i = 0; i < count; i++)
+    add_to_name_map(map, names[i]);
+  double elapsed = now_in_nanoseconds() - start;
+
+  free_name_map(map);
+  return elapsed;
+}
+
+/**
+ * Times loading a file of names with <code>load_names_from_file</code>.
+ * @param path The path of the file.
+ * @return The time taken, in nanoseconds.
+ */
+static double time_file_load(const char *path)
+{
+  NameMapConfig config = default_name_map_config();
+  config.hash_policy = HASH_POLICY_FAST;
+
+  double start = now_in_nanoseconds();
+  NameMap *map = create_name_map_with_config(0, &config);
+  load_names_from_file(map, path);
+  double elapsed = now_in_nanoseconds() - start;
+
+  free_name_map(map);
+  return elapsed;
+}
+
+/**
+ * Compares bulk loading with adding names one at a time, for the given names file and for a
+ * synthetic file of ten million names.
+ * @param list The names in the names file.
+ */
+static void benchmark_bulk_load(const NameList *list)
+{
+  // The names file is small, so average over several rounds
+  double one_by_one = 0;
+  double bulk = 0;
+  for (int round = 0; round < LOAD_ROUNDS; round++)
+  {
+    one_by_one += time_one_by_one(list->names, list->length);
+    bulk += time_file_load(list_path);
+  }
+  printf("%s (%zu names)\n", list_path, list->length);
+  printf("  one by one               %10.3f ms\n", one_by_one / LOAD_ROUNDS / 1e6);
+  printf("  load_names_from_file     %10.3f ms\n", bulk / LOAD_ROUNDS / 1e6);
+
+  size_t length;
+  char *buffer = create_synthetic_buffer(list, SYNTHETIC_NAMES, &length);
+  printf("synthetic (%d names, %zu bytes)\n", SYNTHETIC_NAMES, length);
+
+  FILE *file = fopen(SYNTHETIC_FILE, "wb");
+  if (!file || fwrite(buffer, 1, length, file) != length) {
+    printf("Could not write %s\n", SYNTHETIC_FILE);
+    exit(1);
+  }
+  fclose(file);
+  printf("  load_names_from_file     %10.3f ms\n", time_file_load(SYNTHETIC_FILE) / 1e6);
+  remove(SYNTHETIC_FILE);
+
+  NameMapConfig config = default_name_map_config();
+  config.hash_policy = HASH_POLICY_FAST;
+  double start = now_in_nanoseconds();
+  NameMap *map = create_name_map_with_config(0, &config);
+  load_names_from_buffer(map, buffer, length);
+  printf("  load_names_from_buffer   %10.3f ms\n", (now_in_nanoseconds() - start) / 1e6);
+  free_name_map(map);
+
+  char **names = split_buffer(buffer, length, SYNTHETIC_NAMES);
+  printf("  one by one               %10.3f ms\n", time_one_by_one(names, SYNTHETIC_NAMES) / 1e6);
+  free(names);
+  free(buffer);
+}
+
+// The lock wrapped around the status quo map by the concurrency benchmark
+static pthread_mutex_t global_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Creates an ordinary map, for use behind a single global lock.
+ * @param names The names to add to the map.
+ * @return The map.
+ */
+static void *create_locked_map(const NameList *names)
+{
+  NameMapConfig config = default_name_map_config();
+  config.hash_policy = HASH_POLICY_FAST;
+  config.own_keys = true;
+  // The add/remove churn would otherwise fill every empty slot with a tombstone
+  config.max_tombstone_fraction = 0.2;
+  NameMap *map = create_name_map_with_config(0, &config);
+  for (size_t i = 0; i < names->length; i++)
+    add_to_name_map(map, names->names[i]);
+  return map;
+}
+
+/**
+ * Adds a name to an ordinary map, holding the global lock.
+ * @param map The map.
+ * @param name The name to add.
+ */
+static void locked_add(void *map, const char *name)
+{
+  pthread_mutex_lock(&global_lock);
+  add_to_name_map(map, name);
+  pthread_mutex_unlock(&global_lock);
+}
+
+/**
+ * Removes a name from an ordinary map, holding the global lock.
+ * @param map The map.
+ * @param name The name to remove.
+ */
+static void locked_remove(void *map, const char *name)
+{
+  pthread_mutex_lock(&global_lock);
+  remove_from_name_map(map, name);
+  pthread_mutex_unlock(&global_lock);
+}
+
+/**
+ * Searches an ordinary map, holding the global lock.
+ * @param map The map.
+ * @param name The name to search for.
+ * @return <code>1</code> if the name was found.
+ */
+static int locked_search(void *map, const char *name)
+{
+  pthread_mutex_lock(&global_lock);
+  int found = search_name_map(map, name);
+  pthread_mutex_unlock(&global_lock);
+  return found;
+}
+
+/**
+ * Frees an ordinary map.
+ * @param map The map.
+ */
+static void locked_free(void *map)
+{
+  free_name_map(map);
+}
+
+/**
+ * Creates a concurrent map with the default number of shards.
+ * @param names The names to add to the map.
+ * @return The map.
+ */
+static void *create_sharded_map(const NameList *names)
+{
+  NameMapConfig config = default_name_map_config();
+  config.hash_policy = HASH_POLICY_FAST;
+  ConcurrentNameMap *map = create_concurrent_name_map(0, 0, &config);
+  for (size_t i = 0; i < names->length; i++)
+    add_to_concurrent_name_map(map, names->names[i]);
+  return map;
+}
+
+/**
+ * Adds a name to a concurrent map.
+ * @param map The map.
+ * @param name The name to add.
+ */
+static void sharded_add(void *map, const char *name)
+{
+  add_to_concurrent_name_map(map, name);
+}
+
+/**
+ * Removes a name from a concurrent map.
+ * @param map The map.
+ * @param name The name to remove.
+ */
+static void sharded_remove(void *map, const char *name)
+{
+  remove_from_concurrent_name_map(map, name);
+}
+
+/**
+ * Searches a concurrent map.
+ * @param map The map.
+ * @param name The name to search for.
+ * @return <code>1</code> if the name was found.
+ */
+static int sharded_search(void *map, const char *name)
+{
+  return search_concurrent_name_map(map, name);
+}
+
+/**
+ * Frees a concurrent map.
+ * @param map The map.
+ */
+static void sharded_free(void *map)
+{
+  free_concurrent_name_map(map);
+}
+
+/**
+ * Runs one thread of the concurrency benchmark. Each operation picks a random name, and either
+ * searches for it or (with the worker's write percentage) adds or removes a churn name.
+ * @param argument The thread's <code>ConcurrencyWorker</code>.
+ * @return The number of searches that found their name, cast to a pointer.
+ */
+static void *run_concurrency_worker(void *argument)
+{
+  ConcurrencyWorker *worker = argument;
+  uint64_t state = worker->seed;
+  size_t found = 0;
+
+  for (int i = 0; i < CONCURRENCY_OPERATIONS; i++)
+  {
+    // xorshift64, so that threads don't share the state of rand()
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+
+    int roll = (int) (state % 100);
+    if (roll < worker->write_percentage)
+    {
+      const char *name = worker->churn->names[(state >> 8) % worker->churn->length];
+      if (roll % 2)
+        worker->implementation->add(worker->map, name);
+      else
+        worker->implementation->remove(worker->map, name);
+    } else
+    {
+      const char *name = worker->names->names[(state >> 8) % worker->names->length];
+      found += worker->implementation->search(worker->map, name);
+    }
+  }
+  return (void*) found;
+}
+
+/**
+ * Compares a single global lock around an ordinary map with the concurrent map, for read-heavy
+ * and mixed workloads, on 1 thread up to the number of cores (and at least 4 threads).
+ * @param list The names to base the table on.
+ */
+static void benchmark_concurrency(const NameList *list)
+{
+  const ThreadSafeMap implementations[] = {
+      { "global lock", create_locked_map, locked_add, locked_remove, locked_search, locked_free },
+      {
+          "concurrent", create_sharded_map, sharded_add, sharded_remove, sharded_search,
+          sharded_free
+      }
+  };
+  const char *workload_names[] = { "read-heavy (5% writes)", "mixed (50% writes)" };
+  int write_percentages[] = { 5, 50 };
+
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  int max_threads = cores > CONCURRENCY_MIN_THREADS ? (int) cores : CONCURRENCY_MIN_THREADS;
+  NameList names = expand_names(list, CONCURRENCY_COPIES);
+  NameList churn = reverse_names(&names);
+  printf("Expanded to %zu names, %ld cores online\n", names.length, cores);
+
+  pthread_t *threads = malloc(max_threads * sizeof(pthread_t));
+  ConcurrencyWorker *workers = malloc(max_threads * sizeof(ConcurrencyWorker));
+  if (!threads || !workers) {
+    printf("Failed to allocate memory for the threads\n");
+    exit(1);
+  }
+
+  for (size_t w = 0; w < sizeof(write_percentages) / sizeof(write_percentages[0]); w++)
+  {
+    printf("workload = %s\n", workload_names[w]);
+    for (size_t m = 0; m < sizeof(implementations) / sizeof(implementations[0]); m++)
+    {
+      double single_thread = 0;
+      for (int thread_count = 1; thread_count <= max_threads; thread_count *= 2)
+      {
+        void *map = implementations[m].create(&names);
+        double start = now_in_nanoseconds();
+        for (int t = 0; t < thread_count; t++)
+        {
+          workers[t] = (ConcurrencyWorker) {
+              &implementations[m], map, &names, &churn, write_percentages[w],
+              0x9e3779b9ULL * (t + 1)
+          };
+          if (pthread_create(&threads[t], NULL, run_concurrency_worker, &workers[t]) != 0) {
+            printf("Failed to create a thread\n");
+            exit(1);
+          }
+        }
+        for (int t = 0; t < thread_count; t++)
+          pthread_join(threads[t], NULL);
+        double elapsed = now_in_nanoseconds() - start;
+        implementations[m].free(map);
+
+        double throughput = (double) thread_count * CONCURRENCY_OPERATIONS / elapsed * 1e3;
+        if (thread_count == 1)
+          single_thread = throughput;
+        printf(
+            "  %-12s %3d threads %10.2f Mops/s  %5.2fx\n",
+            implementations[m].label, thread_count, throughput, throughput / single_thread
+        );
+      }
+    }
+  }
+
+  free(threads);
+  free(workers);
+  free_names(&names);
+  free_names(&churn);
+}
+
+/**
+ * Searches a frozen map for every name in the list, many times over, and prints the average cost.
+ * @param label A description of the names, for the output.
+ * @param map The map to search.
+ * @param list The names to search for.
+ */
+static void time_frozen_lookups(const char *label, const FrozenNameMap *map, const NameList *list)
+{
+  long found = 0;
+  strcmp_calls = 0;
+  double start = now_in_nanoseconds();
+  for (int round = 0; round < LOOKUP_ROUNDS; round++)
+  {
+    for (size_t i = 0; i < list->length; i++)
+      found += search_frozen_name_map(map, list->names[i]);
+  }
+  double elapsed = now_in_nanoseconds() - start;
+
+  double lookups = (double) LOOKUP_ROUNDS * (double) list->length;
+  printf(
+      "  %-24s %8.2f strcmp/lookup %8.2f ns/lookup (%zu found)\n",
+      label, (double) strcmp_calls / lookups, elapsed / lookups, found / LOOKUP_ROUNDS
+  );
+}
+
+/**
+ * Compares a live map with a frozen copy of it, for the names file and a larger expanded set of
+ * names.
+ * @param list The names to base the tables on.
+ */
+static void benchmark_freeze(const NameList *list)
+{
+  NameList expanded = expand_names(list, FREEZE_COPIES);
+  const NameList *sets[] = { list, &expanded };
+
+  for (size_t s = 0; s < sizeof(sets) / sizeof(sets[0]); s++)
+  {
+    const NameList *names = sets[s];
+    NameList misses = reverse_names(names);
+
+    // Own the names, so that both maps' memory includes them
+    NameMapConfig config = default_name_map_config();
+    config.hash_policy = HASH_POLICY_FAST;
+    config.own_keys = true;
+    NameMap *map = create_name_map_with_config(0, &config);
+    for (size_t i = 0; i < names->length; i++)
+      add_to_name_map(map, names->names[i]);
+
+    double start = now_in_nanoseconds();
+    FrozenNameMap *frozen = freeze_name_map(map);
+    double elapsed = now_in_nanoseconds() - start;
+
+    NameMapCounters live = get_name_map_counters(map);
+    NameMapCounters snapshot = get_frozen_name_map_counters(frozen);
+    printf("%zu names\n", names->length);
+    printf(
+        "  live                     %8.2f bytes/name\n",
+        (double) live.memory_bytes / (double) names->length
+    );
+    time_lookups("hits", map, names);
+    time_lookups("reversed (mostly misses)", map, &misses);
+    printf(
+        "  frozen                   %8.2f bytes/name, frozen in %.2f ms\n",
+        (double) snapshot.memory_bytes / (double) names->length, elapsed / 1e6
+    );
+    time_frozen_lookups("hits", frozen, names);
+    time_frozen_lookups("reversed (mostly misses)", frozen, &misses);
+
+    free_frozen_name_map(frozen);
+    free_name_map(map);
+    free_names(&misses);
+  }
+  free_names(&expanded);
+}
+
+/**
+ * Compares starting up from a saved image with rebuilding the map from its names, for ten million
+ * synthetic names.
+ * @param list The names to base the synthetic names on.
+ */
+static void benchmark_image(const NameList *list)
+{
+  size_t length;
+  char *buffer = create_synthetic_buffer(list, SYNTHETIC_NAMES, &length);
+  char **names = split_buffer(buffer, length, SYNTHETIC_NAMES);
+  printf("synthetic (%d names)\n", SYNTHETIC_NAMES);
+
+  // Rebuild the map the way every process currently does at startup
+  NameMapConfig config = default_name_map_config();
+  config.hash_policy = HASH_POLICY_FAST;
+  double start = now_in_nanoseconds();
+  NameMap *map = create_name_map_with_config(0, &config);
+  for (size_t i = 0; i < SYNTHETIC_NAMES; i++)
+    add_to_name_map(map, names[i]);
+  printf("  rebuild with add_to_name_map %10.3f ms\n", (now_in_nanoseconds() - start) / 1e6);
+
+  start = now_in_nanoseconds();
+  if (!save_name_map(map, IMAGE_FILE))
+    exit(1);
+  printf("  freeze and save image        %10.3f ms\n", (now_in_nanoseconds() - start) / 1e6);
+  free_name_map(map);
+
+  // Loading only maps the file, so time the first search too, which faults in the pages it needs
+  start = now_in_nanoseconds();
+  FrozenNameMap *frozen = load_frozen_name_map(IMAGE_FILE);
+  if (!frozen)
+    exit(1);
+  double loaded = now_in_nanoseconds();
+  int found = search_frozen_name_map(frozen, names[0]);
+  double searched = now_in_nanoseconds();
+  printf("  load_frozen_name_map         %10.3f ms\n", (loaded - start) / 1e6);
+  printf("  first search                 %10.3f ms (%s)\n", (searched - loaded) / 1e6,
+      found ? "found" : "not found");
+
+  long total = 0;
+  start = now_in_nanoseconds();
+  for (size_t i = 0; i < SYNTHETIC_NAMES; i++)
+    total += search_frozen_name_map(frozen, names[i]);
+  printf(
+      "  search every name            %10.3f ms (%ld found)\n",
+      (now_in_nanoseconds() - start) / 1e6, total
+  );
+
+  free_frozen_name_map(frozen);
+  remove(IMAGE_FILE);
+  free(names);
+  free(buffer);
+}
+
+/**
+ * Compares maps with and without a Bloom filter, for the ASCII-sum hash on the names file (where
+ * misses walk long clusters) and the fast hash on a larger expanded set of names.
+ * @param list The names to base the tables on.
+ */
+static void benchmark_bloom(const NameList *list)
+{
+  NameList expanded = expand_names(list, BLOOM_COPIES);
+  const NameList *sets[] = { list, &expanded };
+  HashPolicy policies[] = { HASH_POLICY_ASCII_SUM, HASH_POLICY_FAST };
+  const char *policy_names[] = { "ascii-sum", "fast" };
+
+  for (size_t s = 0; s < sizeof(sets) / sizeof(sets[0]); s++)
+  {
+    const NameList *names = sets[s];
+    // The suffix -1 is never used by expand_names, so every one of these is a miss
+    NameList misses = suffix_names(names, -1);
+    printf("%zu names, hash policy = %s\n", names->length, policy_names[s]);
+
+    double plain_strcmp_per_miss = 0;
+    for (int filtered = 0; filtered <= 1; filtered++)
+    {
+      NameMapConfig config = default_name_map_config();
+      config.hash_policy = policies[s];
+      config.bloom_filter = filtered;
+      NameMap *map = create_name_map_with_config(0, &config);
+      for (size_t i = 0; i < names->length; i++)
+        add_to_name_map(map, names->names[i]);
+
+      NameMapCounters counters = get_name_map_counters(map);
+      printf(
+          "  bloom_filter = %d          %8.2f bytes/name\n",
+          filtered, (double) counters.memory_bytes / (double) names->length
+      );
+      time_lookups("hits", map, names);
+      time_lookups("misses", map, &misses);
+
+      // A miss that passes the filter costs the same as a miss without one, so the ratio of
+      // comparisons estimates the rate at which misses pass
+      double strcmp_per_miss = (double) strcmp_calls / (LOOKUP_ROUNDS * (double) misses.length);
+      if (!filtered)
+        plain_strcmp_per_miss = strcmp_per_miss;
+      else
+        printf(
+            "  false positive rate      %8.4f%% estimated, %.4f%% measured\n",
+            100 * counters.filter_false_positive_rate,
+            100 * strcmp_per_miss / plain_strcmp_per_miss
+        );
+      free_name_map(map);
+    }
+    free_names(&misses);
+  }
+  free_names(&expanded);
+}
+
+/**
+ * Times searching for every name one <code>search_name_map</code> call at a time.
+ * @param map The map to search.
+ * @param names The names to search for.
+ * @param count The number of names.
+ * @param found Will be set to the number of names found.
+ * @return The time taken, in nanoseconds.
+ */
+static double time_scalar_searches(const NameMap *map, char **names, size_t count, size_t *found)
+{
+  *found = 0;
+  double start = now_in_nanoseconds();
+  for (size_t i = 0; i < count; i++)
+    *found += (size_t) search_name_map(map, names[i]);
+  return now_in_nanoseconds() - start;
+}
+
+/**
+ * Times searching for every name with <code>search_name_map_batch</code>, <code>BATCH_SIZE</code>
+ * names at a time.
+ * @param map The map to search.
+ * @param names The names to search for.
+ * @param count The number of names.
+ * @param found Will be set to the number of names found.
+ * @return The time taken, in nanoseconds.
+ */
+static double time_batch_searches(const NameMap *map, char **names, size_t count, size_t *found)
+{
+  uint64_t bitmap[(BATCH_SIZE + 63) / 64];
+  *found = 0;
+  double start = now_in_nanoseconds();
+  for (size_t i = 0; i < count; i += BATCH_SIZE)
+  {
+    size_t batch = count - i < BATCH_SIZE ? count - i : BATCH_SIZE;
+    *found += search_name_map_batch(map, (const char *const*) &names[i], batch, bitmap);
+  }
+  return now_in_nanoseconds() - start;
+}
+
+/**
+ * Shuffles names into a random (but repeatable) order.
+ * @param names The names to shuffle, in place.
+ * @param count The number of names.
+ */
+static void shuffle_names(char **names, size_t count)
+{
+  srand(1);
+  for (size_t i = count - 1; i > 0; i--)
+  {
+    size_t j = ((size_t) rand() * ((size_t) RAND_MAX + 1) + (size_t) rand()) % (i + 1);
+    char *swap = names[i];
+    names[i] = names[j];
+    names[j] = swap;
+  }
+}
+
+/**
+ * Compares batched searches with searching one name at a time, for each engine, on ten million
+ * synthetic names (so that the table is much larger than the last level cache). Half of the names
+ * searched for are in the map, and they are searched for in a random order.
+ * @param list The names to base the synthetic names on.
+ */
+static void benchmark_batch(const NameList *list)
+{
+  const char *engine_names[] = { "linear-probing", "robin-hood", "group-probing" };
+  NameMapEngine engines[] = {
+      NAME_MAP_ENGINE_LINEAR_PROBING, NAME_MAP_ENGINE_ROBIN_HOOD, NAME_MAP_ENGINE_GROUP_PROBING
+  };
+
+  // The second half of the synthetic names are never added, so are all misses
+  size_t length;
+  char *buffer = create_synthetic_buffer(list, 2 * (size_t) SYNTHETIC_NAMES, &length);
+  char **names = split_buffer(buffer, length, 2 * (size_t) SYNTHETIC_NAMES);
+  char **queries = malloc(2 * (size_t) SYNTHETIC_NAMES * sizeof(char*));
+  if (!queries) {
+    printf("Failed to allocate memory for the queries\n");
+    exit(1);
+  }
+  memcpy(queries, names, 2 * (size_t) SYNTHETIC_NAMES * sizeof(char*));
+  shuffle_names(queries, 2 * (size_t) SYNTHETIC_NAMES);
+  printf(
+      "synthetic (%d names, %d searched for in batches of %d)\n",
+      SYNTHETIC_NAMES, 2 * SYNTHETIC_NAMES, BATCH_SIZE
+  );
+
+  for (size_t e = 0; e < sizeof(engines) / sizeof(engines[0]); e++)
+  {
+    NameMapConfig config = default_name_map_config();
+    config.hash_policy = HASH_POLICY_FAST;
+    config.engine = engines[e];
+    NameMap *map = create_name_map_with_config(0, &config);
+    for (size_t i = 0; i < SYNTHETIC_NAMES; i++)
+      add_to_name_map(map, names[i]);
+
+    size_t scalar_found, batch_found;
+    double scalar = time_scalar_searches(map, queries, 2 * (size_t) SYNTHETIC_NAMES, &scalar_found);
+    double batch = time_batch_searches(map, queries, 2 * (size_t) SYNTHETIC_NAMES, &batch_found);
+    if (scalar_found != batch_found)
+    {
+      printf("Batched searches found %zu names, not %zu\n", batch_found, scalar_found);
+      exit(1);
+    }
+
+    NameMapCounters counters = get_name_map_counters(map);
+    printf("engine = %s (%.1f MB)\n", engine_names[e], (double) counters.memory_bytes / 1e6);
+    printf(
+        "  %-24s %8.2f M lookups/s\n", "search_name_map",
+        2 * SYNTHETIC_NAMES / scalar * 1e3
+    );
+    printf(
+        "  %-24s %8.2f M lookups/s (%.2fx)\n", "search_name_map_batch",
+        2 * SYNTHETIC_NAMES / batch * 1e3, scalar / batch
+    );
+    free_name_map(map);
+  }
+
+  free(queries);
+  free(names);
+  free(buffer);
+}
+
+/**
+ * Allocates empty slots for the hand-written map.
+ * @param map The map.
+ * @param capacity The number of slots, which must be a power of two.
+ */
+static void allocate_hand_written_counts(HandWrittenCounts *map, size_t capacity)
+{
+  map->slots = malloc(capacity * sizeof(HandWrittenSlot));
+  map->control_bytes = calloc(capacity, 1);
+  if (!map->slots || !map->control_bytes) {
+    printf("Failed to allocate memory for the hand-written map\n");
+    exit(1);
+  }
+  map->capacity = capacity;
+  map->number_of_items = 0;
+}
+
+/**
+ * Adds one to the count of a name in the hand-written map, adding the name if it isn't there.
+ * @param map The map.
+ * @param name The name.
+ */
+static void count_in_hand_written_map(HandWrittenCounts *map, const char *name)
+{
+  uint64_t hash = hash_name(name);
+  uint8_t fragment = (uint8_t) (0x80 | (hash >> 57));
+  size_t mask = map->capacity - 1;
+  size_t index = hash & mask;
+  for (; map->control_bytes[index]; index = (index + 1) & mask)
+  {
+    if (map->control_bytes[index] == fragment && strcmp(map->slots[index].name, name) == 0)
+    {
+      map->slots[index].count++;
+      return;
+    }
+  }
+
+  if ((double) (map->number_of_items + 1) > (double) map->capacity * 0.7)
+  {
+    HandWrittenCounts old = *map;
+    allocate_hand_written_counts(map, 2 * old.capacity);
+    for (size_t i = 0; i < old.capacity; i++)
+    {
+      if (!old.control_bytes[i])
+        continue;
+      size_t moved = hash_name(old.slots[i].name) & (map->capacity - 1);
+      while (map->control_bytes[moved])
+        moved = (moved + 1) & (map->capacity - 1);
+      map->control_bytes[moved] = old.control_bytes[i];
+      map->slots[moved] = old.slots[i];
+    }
+    map->number_of_items = old.number_of_items;
+    free(old.slots);
+    free(old.control_bytes);
+
+    mask = map->capacity - 1;
+    for (index = hash & mask; map->control_bytes[index]; index = (index + 1) & mask)
+      ;
+  }
+
+  map->control_bytes[index] = fragment;
+  map->slots[index].name = name;
+  map->slots[index].count = 1;
+  map->number_of_items++;
+}
+
+/**
+ * Times counting every name <code>TYPED_MAP_ROUNDS</code> times with the hand-written map.
+ * @param names The names, which must be distinct.
+ * @return The time taken, in nanoseconds.
+ */
+static double time_hand_written_counts(const NameList *names)
+{
+  HandWrittenCounts map;
+  allocate_hand_written_counts(&map, 16);
+  double start = now_in_nanoseconds();
+  for (int round = 0; round < TYPED_MAP_ROUNDS; round++)
+  {
+    for (size_t i = 0; i < names->length; i++)
+      count_in_hand_written_map(&map, names->names[i]);
+  }
+  double elapsed = now_in_nanoseconds() - start;
+
+  for (size_t i = 0; i < map.capacity; i++)
+  {
+    if (map.control_bytes[i] && map.slots[i].count != TYPED_MAP_ROUNDS)
+    {
+      printf("The hand-written map miscounted %s\n", map.slots[i].name);
+      exit(1);
+    }
+  }
+  free(map.slots);
+  free(map.control_bytes);
+  return elapsed;
+}
+
+/**
+ * Times counting every name <code>TYPED_MAP_ROUNDS</code> times with a generated map.
+ * @param names The names, which must be distinct.
+ * @return The time taken, in nanoseconds.
+ */
+static double time_generated_counts(const NameList *names)
+{
+  NameCounts *map = create_name_counts(0);
+  double start = now_in_nanoseconds();
+  for (int round = 0; round < TYPED_MAP_ROUNDS; round++)
+  {
+    for (size_t i = 0; i < names->length; i++)
+      (*get_or_insert_into_name_counts(map, names->names[i], 0))++;
+  }
+  double elapsed = now_in_nanoseconds() - start;
+
+  for (size_t i = 0; i < names->length; i++)
+  {
+    if (*get_from_name_counts(map, names->names[i]) != TYPED_MAP_ROUNDS)
+    {
+      printf("The generated map miscounted %s\n", names->names[i]);
+      exit(1);
+    }
+  }
+  free_name_counts(map);
+  return elapsed;
+}
+
+/**
+ * Compares counting occurrences of names with a map generated by <code>DEFINE_TYPED_MAP</code> and
+ * with an equivalent map written by hand, and times counting integers with a generated map. The
+ * two name maps take turns, and the best of several attempts is reported for each, as the cost is
+ * dominated by cache misses on the names and so is noisy.
+ * @param list The names to count.
+ */
+static void benchmark_typed_map(const NameList *list)
+{
+  NameList names = expand_names(list, ENGINE_COPIES);
+  double operations = (double) TYPED_MAP_ROUNDS * (double) names.length;
+  printf("Counting %zu distinct names %d times each\n", names.length, TYPED_MAP_ROUNDS);
+
+  double hand_written = 0;
+  double generated = 0;
+  for (int attempt = 0; attempt < TYPED_MAP_ATTEMPTS; attempt++)
+  {
+    double elapsed = time_hand_written_counts(&names);
+    hand_written = attempt == 0 || elapsed < hand_written ? elapsed : hand_written;
+    elapsed = time_generated_counts(&names);
+    generated = attempt == 0 || elapsed < generated ? elapsed : generated;
+  }
+  printf("  %-24s %8.2f ns/update\n", "hand-written", hand_written / operations);
+  printf("  %-24s %8.2f ns/update\n", "DEFINE_TYPED_MAP", generated / operations);
+
+  // Integer keys, spread out so that they don't simply fill consecutive slots
+  IntegerCounts *integers = create_integer_counts(0);
+  double start = now_in_nanoseconds();
+  for (int round = 0; round < TYPED_MAP_ROUNDS; round++)
+  {
+    for (size_t i = 0; i < names.length; i++)
+      (*get_or_insert_into_integer_counts(integers, i * 0x9e3779b97f4a7c15ULL, 0))++;
+  }
+  printf(
+      "  %-24s %8.2f ns/update (%zu keys)\n", "integer keys",
+      (now_in_nanoseconds() - start) / operations, integer_counts_size(integers)
+  );
+  free_integer_counts(integers);
+  free_names(&names);
+}
+
+/**
+ * Prints a probe length histogram on one line, from the first bucket to the last non-empty one.
+ * @param label A description of the histogram, for the output.
+ * @param histogram The histogram.
+ */
+static void print_probe_histogram(const char *label, const long *histogram)
+{
+  int last = NAME_MAP_PROBE_BUCKETS - 1;
+  while (last > 0 && histogram[last] == 0)
+    last--;
+
+  printf("  %-24s", label);
+  for (int bucket = 0; bucket <= last; bucket++)
+    printf(" %ld", histogram[bucket]);
+  printf("\n");
+}
+
+/**
+ * Prints the statistics of each engine, with the ASCII-sum hash on the names file and the fast
+ * hash on a larger expanded set of names (the ASCII-sum hash is far too slow to build that many),
+ * and compares the cost of building a map with and without <code>time_resizes</code>.
+ * @param list The names to base the tables on.
+ */
+static void benchmark_stats(const NameList *list)
+{
+  const char *engine_names[] = { "linear-probing", "robin-hood", "group-probing" };
+  NameMapEngine engines[] = {
+      NAME_MAP_ENGINE_LINEAR_PROBING, NAME_MAP_ENGINE_ROBIN_HOOD, NAME_MAP_ENGINE_GROUP_PROBING
+  };
+  NameList expanded = expand_names(list, STATS_COPIES);
+  const NameList *sets[] = { list, &expanded };
+  HashPolicy policies[] = { HASH_POLICY_ASCII_SUM, HASH_POLICY_FAST };
+  const char *policy_names[] = { "ascii-sum", "fast" };
+
+  for (size_t e = 0; e < sizeof(engines) / sizeof(engines[0]); e++)
+  {
+    for (size_t p = 0; p < sizeof(policies) / sizeof(policies[0]); p++)
+    {
+      const NameList *names = sets[p];
+      // Time the build without timing resizes, then again with, to show what timing costs
+      double build[2];
+      NameMap *map = NULL;
+      for (int timed = 0; timed <= 1; timed++)
+      {
+        NameMapConfig config = default_name_map_config();
+        config.hash_policy = policies[p];
+        config.engine = engines[e];
+        config.time_resizes = timed;
+        free_name_map(map);
+        map = create_name_map_with_config(0, &config);
+        double start = now_in_nanoseconds();
+        for (size_t i = 0; i < names->length; i++)
+          add_to_name_map(map, names->names[i]);
+        build[timed] = now_in_nanoseconds() - start;
+      }
+
+      double start = now_in_nanoseconds();
+      NameMapStats stats = get_name_map_stats(map);
+      double gathered = now_in_nanoseconds() - start;
+
+      printf(
+          "engine = %s, %zu names, hash policy = %s\n",
+          engine_names[e], names->length, policy_names[p]
+      );
+      printf(
+          "  %-24s %zu/%zu (%.3f), %zu tombstones\n", "live/capacity",
+          stats.live_entries, stats.capacity, stats.load_factor, stats.tombstones
+      );
+      printf(
+          "  %-24s mean %.2f, max %zu\n", "hit probes", stats.mean_hit_probes, stats.max_hit_probes
+      );
+      print_probe_histogram("  by power of two", stats.hit_probe_histogram);
+      printf(
+          "  %-24s mean %.2f, max %zu\n", "miss probes",
+          stats.mean_miss_probes, stats.max_miss_probes
+      );
+      print_probe_histogram("  by power of two", stats.miss_probe_histogram);
+      printf("  %-24s %zu\n", "longest cluster", stats.longest_cluster);
+      printf(
+          "  %-24s %ld, %.3f ms moving names\n", "resizes",
+          stats.resizes, (double) stats.rehash_nanoseconds / 1e6
+      );
+      printf(
+          "  %-24s %.2f ns/insert untimed, %.2f ns/insert timed\n", "build",
+          build[0] / (double) names->length, build[1] / (double) names->length
+      );
+      printf("  %-24s %.3f ms\n", "get_name_map_stats", gathered / 1e6);
+      free_name_map(map);
+    }
+  }
+  free_names(&expanded);
+}
+
+/**
+ * Compares maps with and without inline keys, for each engine, on ten million synthetic names (so
+ * that the table is much larger than the last level cache, and following a slot's pointer is
+ * usually a cache miss). Hits and misses are each searched for in a random order.
+ * @param list The names to base the synthetic names on.
+ */
+static void benchmark_inline_keys(const NameList *list)
+{
+  const char *engine_names[] = { "linear-probing", "robin-hood", "group-probing" };
+  NameMapEngine engines[] = {
+      NAME_MAP_ENGINE_LINEAR_PROBING, NAME_MAP_ENGINE_ROBIN_HOOD, NAME_MAP_ENGINE_GROUP_PROBING
+  };
+  int inline_key_bytes[] = { 0, 15, 23 };
+
+  // The names searched for are a separate copy of the names added, as a caller's names usually are,
+  // so that comparing them against the map's names can't be served from the copy just hashed. The
+  // second half of the synthetic names are never added, so are all misses.
+  size_t length;
+  char *buffer = create_synthetic_buffer(list, SYNTHETIC_NAMES, &length);
+  char **names = split_buffer(buffer, length, SYNTHETIC_NAMES);
+  char *query_buffer = create_synthetic_buffer(list, 2 * (size_t) SYNTHETIC_NAMES, &length);
+  char **queries = split_buffer(query_buffer, length, 2 * (size_t) SYNTHETIC_NAMES);
+  shuffle_names(queries, SYNTHETIC_NAMES);
+  shuffle_names(&queries[SYNTHETIC_NAMES], SYNTHETIC_NAMES);
+  char **hits = queries;
+  char **misses = &queries[SYNTHETIC_NAMES];
+  printf("synthetic (%d names)\n", SYNTHETIC_NAMES);
+
+  for (size_t e = 0; e < sizeof(engines) / sizeof(engines[0]); e++)
+  {
+    printf("engine = %s\n", engine_names[e]);
+    for (size_t k = 0; k < sizeof(inline_key_bytes) / sizeof(inline_key_bytes[0]); k++)
+    {
+      NameMapConfig config = default_name_map_config();
+      config.hash_policy = HASH_POLICY_FAST;
+      config.engine = engines[e];
+      config.inline_key_bytes = inline_key_bytes[k];
+      NameMap *map = create_name_map_with_config(0, &config);
+      for (size_t i = 0; i < SYNTHETIC_NAMES; i++)
+        add_to_name_map(map, names[i]);
+
+      NameMapCounters counters = get_name_map_counters(map);
+      printf(
+          "  inline_key_bytes = %-2d     %8.2f bytes/name (excluding the names)\n",
+          inline_key_bytes[k], (double) counters.memory_bytes / SYNTHETIC_NAMES
+      );
+
+      // Take the best of a few rounds, as the first touches memory that the others may not
+      char **sets[] = { hits, misses };
+      const char *set_names[] = { "hits", "misses" };
+      for (int s = 0; s < 2; s++)
+      {
+        double best = 0;
+        size_t found = 0;
+        strcmp_calls = 0;
+        for (int round = 0; round < INLINE_KEY_ROUNDS; round++)
+        {
+          double time = time_scalar_searches(map, sets[s], SYNTHETIC_NAMES, &found);
+          if (round == 0 || time < best)
+            best = time;
+        }
+        if (found != (s == 0 ? (size_t) SYNTHETIC_NAMES : 0))
+        {
+          printf("Found %zu of the %s\n", found, set_names[s]);
+          exit(1);
+        }
+        printf(
+            "    %-22s %8.2f ns/lookup, %.3f strcmp/lookup\n", set_names[s],
+            best / SYNTHETIC_NAMES,
+            (double) strcmp_calls / (INLINE_KEY_ROUNDS * (double) SYNTHETIC_NAMES)
+        );
+      }
+      free_name_map(map);
+    }
+  }
+
+  free(queries);
+  free(query_buffer);
+  free(names);
+  free(buffer);
+}
+
+/**
+ * Times searching for every name in the list, <code>CUCKOO_ROUNDS</code> times over.
+ * @param map The map to search.
+ * @param list The names to search for.
+ * @return The average time per search, in nanoseconds.
+ */
+static double time_cuckoo_rounds(const NameMap *map, const NameList *list)
+{
+  double start = now_in_nanoseconds();
+  for (int round = 0; round < CUCKOO_ROUNDS; round++)
+  {
+    for (size_t i = 0; i < list->length; i++)
+      search_name_map(map, list->names[i]);
+  }
+  return (now_in_nanoseconds() - start) / ((double) CUCKOO_ROUNDS * (double) list->length);
+}
+
+/**
+ * Compares the cuckoo engine with the probing engines as the maximum load factor is raised to
+ * 0.95, for the ASCII-sum hash on the names file (which clusters badly) and the fast hash on a
+ * larger expanded set of names. Each map is sized up front so that it ends up at the load factor.
+ * The worst case searches are given in the engine's own units: slots for linear probing and Robin
+ * Hood, groups of 16 for group probing and buckets of 4 for cuckoo (counting the stash as a third).
+ * @param list The names to base the tables on.
+ */
+static void benchmark_cuckoo(const NameList *list)
+{
+  const char *engine_names[] = { "linear-probing", "robin-hood", "group-probing", "cuckoo" };
+  NameMapEngine engines[] = {
+      NAME_MAP_ENGINE_LINEAR_PROBING, NAME_MAP_ENGINE_ROBIN_HOOD, NAME_MAP_ENGINE_GROUP_PROBING,
+      NAME_MAP_ENGINE_CUCKOO
+  };
+  double load_factors[] = { 0.7, 0.8, 0.9, 0.95 };
+  NameList expanded = expand_names(list, CUCKOO_COPIES);
+  const NameList *sets[] = { list, &expanded };
+  HashPolicy policies[] = { HASH_POLICY_ASCII_SUM, HASH_POLICY_FAST };
+  const char *policy_names[] = { "ascii-sum", "fast" };
+
+  for (size_t s = 0; s < sizeof(sets) / sizeof(sets[0]); s++)
+  {
+    const NameList *names = sets[s];
+    // The suffix -1 is never used by expand_names, so every one of these is a miss
+    NameList misses = suffix_names(names, -1);
+
+    for (size_t l = 0; l < sizeof(load_factors) / sizeof(load_factors[0]); l++)
+    {
+      printf(
+          "%zu names, hash policy = %s, max_load_factor = %.2f\n",
+          names->length, policy_names[s], load_factors[l]
+      );
+      printf(
+          "  %-16s %6s %10s %10s %10s %9s %9s %8s\n", "engine", "load", "insert ns",
+          "hit ns", "miss ns", "max hit", "max miss", "resizes"
+      );
+      for (size_t e = 0; e < sizeof(engines) / sizeof(engines[0]); e++)
+      {
+        NameMapConfig config = default_name_map_config();
+        config.hash_policy = policies[s];
+        config.engine = engines[e];
+        config.max_load_factor = load_factors[l];
+        NameMap *map = create_name_map_with_config(
+            (int) ((double) names->length / load_factors[l]) + 1, &config
+        );
+        double start = now_in_nanoseconds();
+        for (size_t i = 0; i < names->length; i++)
+          add_to_name_map(map, names->names[i]);
+        double build = (now_in_nanoseconds() - start) / (double) names->length;
+
+        double hits = time_cuckoo_rounds(map, names);
+        double missed = time_cuckoo_rounds(map, &misses);
+        NameMapStats stats = get_name_map_stats(map);
+        printf(
+            "  %-16s %6.3f %10.2f %10.2f %10.2f %9zu %9zu %8ld\n", engine_names[e],
+            stats.load_factor, build, hits, missed, stats.max_hit_probes, stats.max_miss_probes,
+            stats.resizes
+        );
+        free_name_map(map);
+      }
+    }
+    free_names(&misses);
+  }
+  free_names(&expanded);
+}
+
+/**
+ * Builds a map through the 64-bit interface with <code>large_slots</code> slots (which may be more
+ * than an int can index), adds ten million synthetic names to it, and times searching for them and
+ * for as many names that aren't in the map. Then checks that a single name of 32 MiB, whose ASCII
+ * sum is beyond the range of an int, is hashed and found correctly.
+ * @param list The names to base the synthetic names on.
+ */
+static void benchmark_large(const NameList *list)
+{
+  // The second half of the synthetic names are never added, so are all misses
+  size_t length;
+  char *buffer = create_synthetic_buffer(list, 2 * (size_t) SYNTHETIC_NAMES, &length);
+  char **names = split_buffer(buffer, length, 2 * (size_t) SYNTHETIC_NAMES);
+  char **misses = &names[SYNTHETIC_NAMES];
+
+  NameMapConfig config = default_name_map_config();
+  config.hash_policy = HASH_POLICY_FAST;
+  double start = now_in_nanoseconds();
+  NameMap *map = create_name_map_with_capacity(large_slots, &config);
+  printf(
+      "%zu slots (%.2f GiB of slots) allocated in %.3f ms\n", name_map_capacity(map),
+      (double) get_name_map_counters(map).memory_bytes / (1 << 30),
+      (now_in_nanoseconds() - start) / 1e6
+  );
+
+  start = now_in_nanoseconds();
+  size_t highest_home_slot = 0;
+  for (size_t i = 0; i < SYNTHETIC_NAMES; i++)
+  {
+    size_t home_slot = name_map_home_slot(map, names[i]);
+    if (home_slot > highest_home_slot)
+      highest_home_slot = home_slot;
+    add_to_name_map(map, names[i]);
+  }
+  double insert = (now_in_nanoseconds() - start) / SYNTHETIC_NAMES;
+  printf(
+      "  %d names added, %8.2f ns/insert, highest home slot %zu (INT_MAX is %d)\n",
+      SYNTHETIC_NAMES, insert, highest_home_slot, INT_MAX
+  );
+
+  char **sets[] = { names, misses };
+  const char *set_names[] = { "hits", "misses" };
+  for (int s = 0; s < 2; s++)
+  {
+    size_t found = 0;
+    double time = time_scalar_searches(map, sets[s], SYNTHETIC_NAMES, &found);
+    printf(
+        "  %-8s %8.2f ns/lookup, %zu found\n", set_names[s], time / SYNTHETIC_NAMES, found
+    );
+  }
+  printf("  name_map_size = %zu\n", name_map_size(map));
+  free_name_map(map);
+  free(names);
+  free(buffer);
+
+  // The ASCII sum of this name overflowed when sums were kept in an int
+  char *long_name = malloc(LONG_KEY_BYTES + 1);
+  if (!long_name) {
+    printf("Failed to allocate memory for the long name\n");
+    exit(1);
+  }
+  memset(long_name, 'z', LONG_KEY_BYTES);
+  long_name[LONG_KEY_BYTES] = '\0';
+
+  NameMap *ascii_map = create_name_map(0);
+  add_to_name_map(ascii_map, long_name);
+  printf(
+      "long name (%d bytes): ascii sum = %llu (expected %llu), found = %d\n", LONG_KEY_BYTES,
+      (unsigned long long) name_map_hash(ascii_map, long_name),
+      (unsigned long long) LONG_KEY_BYTES * 'z', search_name_map(ascii_map, long_name)
+  );
+  free_name_map(ascii_map);
+  free(long_name);
+}
+
+/**
+ * Compares adding ten million synthetic names one at a time with building the same map in
+ * parallel, on 1 thread up to the number of cores (and at least 4 threads).
+ * @param list The names to base the synthetic names on.
+ */
+static void benchmark_parallel_build(const NameList *list)
+{
+  size_t length;
+  char *buffer = create_synthetic_buffer(list, SYNTHETIC_NAMES, &length);
+  char **names = split_buffer(buffer, length, SYNTHETIC_NAMES);
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  int max_threads = cores > PARALLEL_BUILD_MIN_THREADS ? (int) cores : PARALLEL_BUILD_MIN_THREADS;
+  printf("synthetic (%d names), %ld cores online\n", SYNTHETIC_NAMES, cores);
+
+  NameMapConfig config = default_name_map_config();
+  config.hash_policy = HASH_POLICY_FAST;
+  double start = now_in_nanoseconds();
+  NameMap *map = create_name_map_with_config(0, &config);
+  for (size_t i = 0; i < SYNTHETIC_NAMES; i++)
+    add_to_name_map(map, names[i]);
+  printf("  %-24s %10.3f ms\n", "add_to_name_map", (now_in_nanoseconds() - start) / 1e6);
+  size_t expected = name_map_size(map);
+  free_name_map(map);
+
+  double single_thread = 0;
+  for (int thread_count = 1; thread_count <= max_threads; thread_count *= 2)
+  {
+    start = now_in_nanoseconds();
+    map = build_name_map_in_parallel(
+        (const char *const *) names, SYNTHETIC_NAMES, thread_count, &config
+    );
+    double elapsed = now_in_nanoseconds() - start;
+    if (name_map_size(map) != expected)
+    {
+      printf("Built a map of %zu names, rather than %zu\n", name_map_size(map), expected);
+      exit(1);
+    }
+    free_name_map(map);
+
+    if (thread_count == 1)
+      single_thread = elapsed;
+    printf(
+        "  %-12s %3d threads %10.3f ms  %5.2fx\n", "parallel", thread_count, elapsed / 1e6,
+        single_thread / elapsed
+    );
+  }
+
+  free(names);
+  free(buffer);
+}
+
+/**
+ * Creates a stream of newline-delimited names in which most names are repeats, as in an event log.
+ * Names are picked with a skewed distribution, so that a few names are far more common than the
+ * rest.
+ * @param list The names to pick from.
+ * @param count The number of names in the stream.
+ * @param length Will be set to the number of bytes in the stream.
+ * @return The stream. This must be freed.
+ */
+static char *create_event_stream(const NameList *list, size_t count, size_t *length)
+{
+  size_t capacity = count * 32;
+  char *buffer = malloc(capacity);
+  if (!buffer) {
+    printf("Failed to allocate memory for the event stream\n");
+    exit(1);
+  }
+
+  srand(1);
+  *length = 0;
+  for (size_t i = 0; i < count; i++)
+  {
+    // Squaring a uniform fraction makes the names at the start of the list the most common
+    double fraction = (double) rand() / ((double) RAND_MAX + 1);
+    size_t index = (size_t) (fraction * fraction * (double) list->length);
+    *length += (size_t) snprintf(
+        &buffer[*length], capacity - *length, "%.24s\n", list->names[index]
+    );
+  }
+  return buffer;
+}
+
+/**
+ * Compares two name pointers alphabetically.
+ * @param first A pointer to the first name.
+ * @param second A pointer to the second name.
+ * @return The result of <code>strcmp</code> on the names.
+ */
+static int compare_name_pointers(const void *first, const void *second)
+{
+  return strcmp(*(char *const *) first, *(char *const *) second);
+}
+
+/**
+ * Finds the most common names in a stream by sorting every name and counting each run of equal
+ * names, as a batch job would.
+ * @param stream The newline-delimited names. These are split in place.
+ * @param length The number of bytes in the stream.
+ * @param count The number of names in the stream.
+ * @param top Will be filled with the <code>COUNTING_TOP</code> most common names, ordered as by
+ * <code>get_top_names</code>.
+ */
+static void sort_and_count(char *stream, size_t length, size_t count, NameCount *top)
+{
+  char **names = malloc(count * sizeof(char*));
+  if (!names) {
+    printf("Failed to allocate memory for the sorted names\n");
+    exit(1);
+  }
+  char *name = stream;
+  for (size_t i = 0; i < count; i++)
+  {
+    char *newline = memchr(name, '\n', (size_t) (stream + length - name));
+    *newline = '\0';
+    names[i] = name;
+    name = newline + 1;
+  }
+
+  qsort(names, count, sizeof(char*), compare_name_pointers);
+
+  // Runs are visited alphabetically, so a run only displaces a kept name with a lower count
+  size_t kept = 0;
+  for (size_t start = 0, end; start < count; start = end)
+  {
+    for (end = start + 1; end < count && strcmp(names[end], names[start]) == 0; end++);
+    NameCount run = { names[start], end - start };
+    size_t position = kept < COUNTING_TOP ? kept++ : COUNTING_TOP;
+    while (position > 0 && top[position - 1].count < run.count)
+    {
+      if (position < COUNTING_TOP)
+        top[position] = top[position - 1];
+      position--;
+    }
+    if (position < COUNTING_TOP)
+      top[position] = run;
+  }
+  free(names);
+}
+
+/**
+ * Compares finding the most common names in a stream of ten million names by sorting and counting
+ * with a map that counts names, fed from a buffer and from a file.
+ * @param list The names to build the stream from.
+ */
+static void benchmark_counting(const NameList *list)
+{
+  size_t length;
+  char *stream = create_event_stream(list, COUNTING_EVENTS, &length);
+  printf("stream (%d names, %zu bytes)\n", COUNTING_EVENTS, length);
+
+  FILE *file = fopen(COUNTING_FILE, "wb");
+  if (!file || fwrite(stream, 1, length, file) != length) {
+    printf("Could not write %s\n", COUNTING_FILE);
+    exit(1);
+  }
+  fclose(file);
+
+  NameMapConfig config = default_name_map_config();
+  config.hash_policy = HASH_POLICY_FAST;
+  config.count_names = true;
+  double start = now_in_nanoseconds();
+  NameMap *file_map = create_name_map_with_config(0, &config);
+  int64_t read = load_delimited_names_from_file(file_map, COUNTING_FILE, '\n');
+  NameCount map_top[COUNTING_TOP];
+  get_top_names(file_map, COUNTING_TOP, map_top);
+  printf(
+      "  %-32s %10.3f ms  (%lld names, %zu distinct)\n", "load_delimited_names_from_file",
+      (now_in_nanoseconds() - start) / 1e6, (long long) read, name_map_size(file_map)
+  );
+  free_name_map(file_map);
+  remove(COUNTING_FILE);
+
+  // The names returned by get_top_names point into the map, so this map is kept for the comparison
+  start = now_in_nanoseconds();
+  NameMap *map = create_name_map_with_config(0, &config);
+  load_delimited_names_from_buffer(map, stream, length, '\n');
+  size_t map_found = get_top_names(map, COUNTING_TOP, map_top);
+  printf(
+      "  %-32s %10.3f ms\n", "load_delimited_names_from_buffer",
+      (now_in_nanoseconds() - start) / 1e6
+  );
+
+  NameCount sorted_top[COUNTING_TOP];
+  start = now_in_nanoseconds();
+  sort_and_count(stream, length, COUNTING_EVENTS, sorted_top);
+  printf("  %-32s %10.3f ms\n", "sort and count", (now_in_nanoseconds() - start) / 1e6);
+
+  for (size_t i = 0; i < map_found; i++)
+  {
+    if (strcmp(map_top[i].name, sorted_top[i].name) != 0 || map_top[i].count != sorted_top[i].count)
+    {
+      printf("Top names differ at %zu: %s (%llu) and %s (%llu)\n", i, map_top[i].name,
+             (unsigned long long) map_top[i].count, sorted_top[i].name,
+             (unsigned long long) sorted_top[i].count);
+      exit(1);
+    }
+  }
+  printf("  top name: %s (%llu)\n", map_top[0].name, (unsigned long long) map_top[0].count);
+  free_name_map(map);
+  free(stream);
+}
+
+/**
+ * Intersects two maps by hand, as callers had to before set operations were added: every name in
+ * the smaller map is searched for in the other, and added to a new map if it is found.
+ * @param smaller The names in the smaller map.
+ * @param count The number of names in the smaller map.
+ * @param other The other map.
+ * @return The intersection. This must be freed with <code>free_name_map</code>.
+ */
+static NameMap *intersect_by_hand(char **smaller, size_t count, const NameMap *other)
+{
+  NameMapConfig config = default_name_map_config();
+  config.hash_policy = HASH_POLICY_FAST;
+  NameMap *result = create_name_map_with_config(0, &config);
+  for (size_t i = 0; i < count; i++)
+  {
+    if (search_name_map(other, smaller[i]))
+      add_to_name_map(result, smaller[i]);
+  }
+  return result;
+}
+
+/**
+ * Compares set operations between a feed of four million synthetic names and a watchlist of a
+ * million, half of which are in the feed, with intersecting the maps by hand. The parallel runs
+ * use 1 thread up to the number of cores (and at least 4 threads).
+ * @param list The names to base the synthetic names on.
+ */
+static void benchmark_set_operations(const NameList *list)
+{
+  // The watchlist is the last half million names of the feed, followed by half a million others
+  size_t total = SET_FEED_NAMES + SET_WATCHLIST_NAMES / 2;
+  size_t length;
+  char *buffer = create_synthetic_buffer(list, total, &length);
+  char **names = split_buffer(buffer, length, total);
+  char **watchlist_names = &names[SET_FEED_NAMES - SET_WATCHLIST_NAMES / 2];
+
+  NameMapConfig config = default_name_map_config();
+  config.hash_policy = HASH_POLICY_FAST;
+  config.cache_hashes = true;
+  NameMap *feed = build_name_map_in_parallel(
+      (const char *const *) names, SET_FEED_NAMES, 1, &config
+  );
+  NameMap *watchlist = build_name_map_in_parallel(
+      (const char *const *) watchlist_names, SET_WATCHLIST_NAMES, 1, &config
+  );
+  printf(
+      "feed (%zu names), watchlist (%zu names)\n", name_map_size(feed), name_map_size(watchlist)
+  );
+
+  double start = now_in_nanoseconds();
+  NameMap *result = intersect_by_hand(watchlist_names, SET_WATCHLIST_NAMES, feed);
+  printf(
+      "  %-28s %10.3f ms  (%zu names)\n", "intersection by hand",
+      (now_in_nanoseconds() - start) / 1e6, name_map_size(result)
+  );
+  size_t expected = name_map_size(result);
+  free_name_map(result);
+
+  const char *operation_names[] = { "union", "intersection", "difference" };
+  for (int operation = NAME_SET_UNION; operation <= NAME_SET_DIFFERENCE; operation++)
+  {
+    start = now_in_nanoseconds();
+    result = combine_name_maps(feed, watchlist, operation, 1);
+    printf(
+        "  %-28s %10.3f ms  (%zu names)\n", operation_names[operation],
+        (now_in_nanoseconds() - start) / 1e6, name_map_size(result)
+    );
+    if (operation == NAME_SET_INTERSECTION && name_map_size(result) != expected)
+    {
+      printf("Intersected %zu names, rather than %zu\n", name_map_size(result), expected);
+      exit(1);
+    }
+    free_name_map(result);
+  }
+
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  int max_threads = cores > PARALLEL_BUILD_MIN_THREADS ? (int) cores : PARALLEL_BUILD_MIN_THREADS;
+  printf("difference in parallel, %ld cores online\n", cores);
+  double single_thread = 0;
+  for (int thread_count = 1; thread_count <= max_threads; thread_count *= 2)
+  {
+    start = now_in_nanoseconds();
+    result = combine_name_maps(feed, watchlist, NAME_SET_DIFFERENCE, thread_count);
+    double elapsed = now_in_nanoseconds() - start;
+    free_name_map(result);
+
+    if (thread_count == 1)
+      single_thread = elapsed;
+    printf(
+        "  %-12s %3d threads %10.3f ms  %5.2fx\n", "parallel", thread_count, elapsed / 1e6,
+        single_thread / elapsed
+    );
+  }
+
+  free_name_map(feed);
+  free_name_map(watchlist);
+  free(names);
+  free(buffer);
+}
+
+/**
+ * Copies a name into a new allocation.
+ * @param name The name.
+ * @return The copy. This must be freed.
+ */
+static char *copy_name(const char *name)
+{
+  size_t length = strlen(name);
+  char *copy = malloc(length + 1);
+  if (!copy) {
+    printf("Failed to allocate memory for a name\n");
+    exit(1);
+  }
+  memcpy(copy, name, length + 1);
+  return copy;
+}
+
+/**
+ * Creates an empty list with room for the given number of names.
+ * @param capacity The number of names.
+ * @return The list, which can be freed with <code>free_names</code>.
+ */
+static NameList create_name_list(size_t capacity)
+{
+  NameList list = { malloc(capacity * sizeof(char*)), 0 };
+  if (!list.names) {
+    printf("Failed to allocate memory for the names\n");
+    exit(1);
+  }
+  return list;
+}
+
+/**
+ * Generates permutations of the same eight letters, which all share an ASCII sum.
+ * @param count The number of names to generate. There are only 8! = 40320 of them.
+ * @return The names.
+ */
+static NameList anagram_names(size_t count)
+{
+  NameList list = create_name_list(count);
+  char letters[] = "ABCDEFGH";
+  while (list.length < count)
+  {
+    list.names[list.length++] = copy_name(letters);
+
+    // Step to the next permutation in lexicographic order
+    int pivot = 6;
+    while (pivot >= 0 && letters[pivot] >= letters[pivot + 1])
+      pivot--;
+    if (pivot < 0)
+      break;
+    int successor = 7;
+    while (letters[successor] <= letters[pivot])
+      successor--;
+    char swapped = letters[pivot];
+    letters[pivot] = letters[successor];
+    letters[successor] = swapped;
+    for (int left = pivot + 1, right = 7; left < right; left++, right--)
+    {
+      swapped = letters[left];
+      letters[left] = letters[right];
+      letters[right] = swapped;
+    }
+  }
+  return list;
+}
+
+/**
+ * Generates distinct names of eight capital letters that all have the same ASCII sum as MMMMMMMM,
+ * but aren't just permutations of each other.
+ * @param count The number of names to generate.
+ * @return The names.
+ */
+static NameList equal_sum_names(size_t count)
+{
+  NameList list = create_name_list(count);
+  NameMapConfig config = default_name_map_config();
+  config.hash_policy = HASH_POLICY_FAST;
+  NameMap *seen = create_name_map_with_config(0, &config);
+
+  srand(1);
+  while (list.length < count)
+  {
+    // Moving value from one letter to another keeps the sum the same
+    char name[] = "MMMMMMMM";
+    for (int move = 0; move < 8; move++)
+    {
+      int from = rand() % 8;
+      int to = rand() % 8;
+      int amount = rand() % 13;
+      if (name[from] - amount >= 'A' && name[to] + amount <= 'Z' && from != to)
+      {
+        name[from] = (char) (name[from] - amount);
+        name[to] = (char) (name[to] + amount);
+      }
+    }
+    if (!search_name_map(seen, name))
+    {
+      list.names[list.length] = copy_name(name);
+      add_to_name_map(seen, list.names[list.length++]);
+    }
+  }
+  free_name_map(seen);
+  return list;
+}
+
+/**
+ * Generates names that a map with the given (unseeded) hash policy and capacity puts in the same
+ * home slot, by trying names until enough have been found. This works against any hash that
+ * doesn't depend on a secret, however well it spreads names.
+ * @param policy The hash policy.
+ * @param count The number of names to generate.
+ * @return The names.
+ */
+static NameList slot_collision_names(HashPolicy policy, size_t count)
+{
+  NameList list = create_name_list(count);
+  NameMapConfig config = default_name_map_config();
+  config.hash_policy = policy;
+  NameMap *map = create_name_map_with_capacity(ADVERSARIAL_CAPACITY, &config);
+
+  char name[32];
+  for (unsigned long attempt = 0; list.length < count; attempt++)
+  {
+    snprintf(name, sizeof(name), "s%lu", attempt);
+    if (name_map_home_slot(map, name) == 0)
+      list.names[list.length++] = copy_name(name);
+  }
+  free_name_map(map);
+  return list;
+}
+
+/**
+ * Calculates the multiplicative inverse of an odd number, modulo 2^64, by Newton's method.
+ * @param value The number.
+ * @return The inverse.
+ */
+static uint64_t inverse_of(uint64_t value)
+{
+  uint64_t inverse = value;
+  for (int step = 0; step < 5; step++)
+    inverse *= 2 - value * inverse;
+  return inverse;
+}
+
+/**
+ * The MurmurHash3 finaliser used by the fast hash policies for each word of a name.
+ * @param value The value to mix.
+ * @return The mixed value.
+ */
+static uint64_t mix_word(uint64_t value)
+{
+  value ^= value >> 33;
+  value *= MIX_FIRST_MULTIPLIER;
+  value ^= value >> 33;
+  value *= MIX_SECOND_MULTIPLIER;
+  value ^= value >> 33;
+  return value;
+}
+
+/**
+ * Reverses <code>mix_word</code>. Each shift is by more than half a word, so undoes itself.
+ * @param value The mixed value.
+ * @return The value that mixes to it.
+ */
+static uint64_t unmix_word(uint64_t value)
+{
+  value ^= value >> 33;
+  value *= inverse_of(MIX_SECOND_MULTIPLIER);
+  value ^= value >> 33;
+  value *= inverse_of(MIX_FIRST_MULTIPLIER);
+  value ^= value >> 33;
+  return value;
+}
+
+/**
+ * Picks a random word of letters whose partner, the word that mixes to the same value but with the
+ * top bit flipped, has no zero bytes, so that both can be part of a name.
+ * @param word Will be set to the word.
+ * @param partner Will be set to its partner.
+ */
+static void pick_colliding_words(uint64_t *word, uint64_t *partner)
+{
+  for (;;)
+  {
+    char letters[8];
+    for (int i = 0; i < 8; i++)
+      letters[i] = (char) ('a' + rand() % 26);
+    memcpy(word, letters, sizeof(letters));
+    *partner = unmix_word(mix_word(*word) ^ (1ULL << 63));
+
+    bool has_zero_byte = false;
+    for (int i = 0; i < 8; i++)
+      has_zero_byte |= ((*partner >> (i * 8)) & 0xff) == 0;
+    if (!has_zero_byte)
+      return;
+  }
+}
+
+/**
+ * Generates names that collide in the full 64-bit hash of the fast and seeded policies, whatever
+ * the seed. Each word of a name is mixed and XORed into the hash state, which is then multiplied
+ * by an odd constant. If two words mix to values that differ only in their top bit, the states
+ * after them differ only in their top bit too, whatever the state was before (the seed included),
+ * as multiplying by an odd number leaves the top bit's difference alone. A second pair of words
+ * that differ in the same way then cancels the difference out. Each such unit of two words can be
+ * either of its pair, so a name of n units has 2^n variants that all collide.
+ * @param count The number of names to generate. At most 2^SEEDLESS_COLLISION_UNITS.
+ * @return The names.
+ */
+static NameList seedless_collision_names(size_t count)
+{
+  uint64_t words[SEEDLESS_COLLISION_UNITS][2][2];
+  srand(1);
+  for (int unit = 0; unit < SEEDLESS_COLLISION_UNITS; unit++)
+  {
+    pick_colliding_words(&words[unit][0][0], &words[unit][1][0]);
+    pick_colliding_words(&words[unit][0][1], &words[unit][1][1]);
+  }
+
+  NameList list = create_name_list(count);
+  char name[SEEDLESS_COLLISION_UNITS * 16 + 1];
+  while (list.length < count)
+  {
+    for (int unit = 0; unit < SEEDLESS_COLLISION_UNITS; unit++)
+    {
+      // Each bit of the name's position picks which variant of the unit it uses
+      int variant = (int) (list.length >> unit) & 1;
+      memcpy(&name[unit * 16], words[unit][variant], 16);
+    }
+    name[SEEDLESS_COLLISION_UNITS * 16] = '\0';
+    list.names[list.length++] = copy_name(name);
+  }
+  return list;
+}
+
+/**
+ * Checks that every name in the list has the same full hash in a map with the given policy.
+ * @param policy The hash policy. Seeded maps are given a random seed.
+ * @param list The names.
+ * @return <code>true</code> if every name has the same hash.
+ */
+static bool all_collide(HashPolicy policy, const NameList *list)
+{
+  NameMapConfig config = default_name_map_config();
+  config.hash_policy = policy;
+  NameMap *map = create_name_map_with_config(0, &config);
+  bool collide = true;
+  for (size_t i = 1; i < list->length; i++)
+    collide &= name_map_hash(map, list->names[i]) == name_map_hash(map, list->names[0]);
+  free_name_map(map);
+  return collide;
+}
+
+/**
+ * Adds every name in the list to maps with each hash policy, then searches for every name, and
+ * prints how long both took and how far the searches had to probe.
+ * @param label A description of the names, for the output.
+ * @param list The names.
+ */
+static void report_adversarial_names(const char *label, const NameList *list)
+{
+  const char *policy_names[] = { "ascii-sum", "fast", "seeded", "fnv1a", "siphash" };
+  HashPolicy policies[] = {
+      HASH_POLICY_ASCII_SUM, HASH_POLICY_FAST, HASH_POLICY_SEEDED, HASH_POLICY_FNV1A,
+      HASH_POLICY_SIPHASH
+  };
+  printf("%s (%zu names)\n", label, list->length);
+
+  for (size_t p = 0; p < sizeof(policies) / sizeof(policies[0]); p++)
+  {
+    // The capacity is fixed, as it would be for a server's table, so no resize spreads the names
+    NameMapConfig config = default_name_map_config();
+    config.hash_policy = policies[p];
+    double start = now_in_nanoseconds();
+    NameMap *map = create_name_map_with_capacity(ADVERSARIAL_CAPACITY, &config);
+    for (size_t i = 0; i < list->length; i++)
+      add_to_name_map(map, list->names[i]);
+    double insert_time = now_in_nanoseconds() - start;
+
+    strcmp_calls = 0;
+    start = now_in_nanoseconds();
+    for (int round = 0; round < ADVERSARIAL_ROUNDS; round++)
+    {
+      for (size_t i = 0; i < list->length; i++)
+        search_name_map(map, list->names[i]);
+    }
+    double lookups = (double) ADVERSARIAL_ROUNDS * (double) list->length;
+    double lookup_time = (now_in_nanoseconds() - start) / lookups;
+
+    NameMapStats stats = get_name_map_stats(map);
+    printf(
+        "  %-10s insert %9.3f ms  %10.1f ns/lookup %9.1f strcmp/lookup  max probe %zu\n",
+        policy_names[p], insert_time / 1e6, lookup_time, (double) strcmp_calls / lookups,
+        stats.max_hit_probes
+    );
+    free_name_map(map);
+  }
+}
+
+/**
+ * Compares each hash policy against sets of names chosen to collide: anagrams and equal-sum names
+ * (against the ASCII sum), names that share a home slot (against each unseeded policy), and names
+ * that share their full hash whatever the seed (against the fast and seeded policies). Only
+ * <code>HASH_POLICY_SIPHASH</code> keeps every search short against all of them.
+ * @param list Unused, as every name is generated.
+ */
+static void benchmark_adversarial(const NameList *list)
+{
+  (void) list;
+  NameList sets[] = {
+      anagram_names(ADVERSARIAL_NAMES),
+      equal_sum_names(ADVERSARIAL_NAMES),
+      slot_collision_names(HASH_POLICY_FAST, ADVERSARIAL_NAMES),
+      slot_collision_names(HASH_POLICY_FNV1A, ADVERSARIAL_NAMES),
+      seedless_collision_names(ADVERSARIAL_NAMES)
+  };
+  const char *set_names[] = {
+      "anagrams", "equal ASCII sums", "fast home slot collisions", "fnv1a home slot collisions",
+      "seedless collisions"
+  };
+
+  if (!all_collide(HASH_POLICY_FAST, &sets[4]) || !all_collide(HASH_POLICY_SEEDED, &sets[4]))
+  {
+    printf("The seedless collisions don't collide\n");
+    exit(1);
+  }
+
+  for (size_t s = 0; s < sizeof(sets) / sizeof(sets[0]); s++)
+  {
+    report_adversarial_names(set_names[s], &sets[s]);
+    free_names(&sets[s]);
+  }
+}
+
+/**
+ * Builds a map one name at a time, then reports the memory it takes per name and the time taken to
+ * add and search for names.
+ * @param label A description of the map's slot layout, for the output.
+ * @param config The options for the map.
+ * @param names The names to add.
+ * @param misses As many names that aren't in the map.
+ * @param count The number of names in each of <code>names</code> and <code>misses</code>.
+ * @param rounds The number of times to search for every name.
+ */
+static void report_slot_layout(
+    const char *label, const NameMapConfig *config, char **names, char **misses, size_t count,
+    int rounds
+)
+{
+  double start = now_in_nanoseconds();
+  NameMap *map = create_name_map_with_config(0, config);
+  for (size_t i = 0; i < count; i++)
+    add_to_name_map(map, names[i]);
+  double insert = (now_in_nanoseconds() - start) / (double) count;
+
+  char **sets[] = { names, misses };
+  double lookup[2];
+  for (int s = 0; s < 2; s++)
+  {
+    size_t found;
+    double elapsed = 0;
+    for (int round = 0; round < rounds; round++)
+      elapsed += time_scalar_searches(map, sets[s], count, &found);
+    lookup[s] = elapsed / ((double) rounds * (double) count);
+  }
+
+  // Only the slots differ in size between the layouts. The total also includes the map's copies of
+  // the names, for the layouts that keep copies.
+  NameMapCounters counters = get_name_map_counters(map);
+  double entries = (double) counters.live_entries;
+  size_t slot_bytes = config->engine == NAME_MAP_ENGINE_COMPACT ? sizeof(uint32_t) : sizeof(char*);
+  printf(
+      "  %-18s %6.3f %12.2f %13.2f %10.2f %9.2f %9.2f\n", label,
+      entries / (double) counters.capacity, (double) (slot_bytes * counters.capacity) / entries,
+      (double) counters.memory_bytes / entries, insert, lookup[0], lookup[1]
+  );
+  free_name_map(map);
+}
+
+/**
+ * Compares 8-byte pointer slots, with the names left with the caller or copied into the map's
+ * arena, against the compact engine's 4-byte offset slots, for the names file and for ten million
+ * synthetic names (where the slots are far larger than the cache). Reports the bytes per name taken
+ * by the slots alone and by the whole map, along with insert and lookup times.
+ * @param list The names file, which the synthetic names are also based on.
+ */
+static void benchmark_compact_slots(const NameList *list)
+{
+  const char *layout_names[] = { "pointers", "pointers + arena", "compact offsets" };
+  NameMapConfig layouts[3];
+  for (int l = 0; l < 3; l++)
+  {
+    layouts[l] = default_name_map_config();
+    layouts[l].hash_policy = HASH_POLICY_FAST;
+  }
+  layouts[1].own_keys = true;
+  layouts[2].engine = NAME_MAP_ENGINE_COMPACT;
+
+  // The second half of the synthetic names are never added, so are all misses, as is every name
+  // with the suffix -1
+  size_t length;
+  char *buffer = create_synthetic_buffer(list, 2 * (size_t) SYNTHETIC_NAMES, &length);
+  char **synthetic = split_buffer(buffer, length, 2 * (size_t) SYNTHETIC_NAMES);
+  NameList file_misses = suffix_names(list, -1);
+  char **names[] = { list->names, synthetic };
+  char **misses[] = { file_misses.names, &synthetic[SYNTHETIC_NAMES] };
+  size_t counts[] = { list->length, SYNTHETIC_NAMES };
+  int rounds[] = { LOOKUP_ROUNDS, 1 };
+
+  for (int s = 0; s < 2; s++)
+  {
+    printf("%zu names\n", counts[s]);
+    printf(
+        "  %-18s %6s %12s %13s %10s %9s %9s\n", "layout", "load", "slot B/name",
+        "total B/name", "insert ns", "hit ns", "miss ns"
+    );
+    for (int l = 0; l < 3; l++)
+      report_slot_layout(layout_names[l], &layouts[l], names[s], misses[s], counts[s], rounds[s]);
+  }
+
+  free_names(&file_misses);
+  free(synthetic);
+  free(buffer);
+}
+
+/**
+ * Takes a consistent view of the map for the snapshot benchmark, walks every name in it, and frees
+ * it. Without snapshots, this copies the ordinary map under the global lock, as the copy is what
+ * makes it safe to walk once the lock is released.
+ * @param reporter The reporter.
+ */
+static void report_once(SnapshotReporter *reporter)
+{
+  if (reporter->use_snapshots)
+  {
+    ConcurrentNameMapSnapshot *snapshot = snapshot_concurrent_name_map(reporter->map);
+    uint64_t position = 0;
+    while (next_in_concurrent_name_map_snapshot(snapshot, &position))
+      reporter->names_seen++;
+    free_concurrent_name_map_snapshot(snapshot);
+  } else
+  {
+    pthread_mutex_lock(&global_lock);
+    NameMap *copy = union_of_name_maps(reporter->map, reporter->empty);
+    pthread_mutex_unlock(&global_lock);
+    reporter->names_seen += (long) name_map_size(copy);
+    free_name_map(copy);
+  }
+  reporter->reports++;
+}
+
+/**
+ * Runs the reporting thread of the snapshot benchmark, until the writers have finished.
+ * @param argument The thread's <code>SnapshotReporter</code>.
+ * @return <code>NULL</code>.
+ */
+static void *run_snapshot_reporter(void *argument)
+{
+  SnapshotReporter *reporter = argument;
+  while (!atomic_load(&reporter->stop))
+    report_once(reporter);
+  return NULL;
+}
+
+/**
+ * Compares copying an ordinary map under a global lock with taking a snapshot of the concurrent
+ * map, for a reporting thread that needs a consistent view of every name. Reports the cost of a
+ * single view on an idle map, then the write throughput of a mixed workload while the reporting
+ * thread takes views back to back.
+ * @param list The names to base the table on.
+ */
+static void benchmark_snapshots(const NameList *list)
+{
+  const ThreadSafeMap implementations[] = {
+      { "copy", create_locked_map, locked_add, locked_remove, locked_search, locked_free },
+      {
+          "snapshot", create_sharded_map, sharded_add, sharded_remove, sharded_search,
+          sharded_free
+      }
+  };
+  NameList names = expand_names(list, CONCURRENCY_COPIES);
+  NameList churn = reverse_names(&names);
+  NameMapConfig config = default_name_map_config();
+  config.hash_policy = HASH_POLICY_FAST;
+  config.own_keys = true;
+  NameMap *empty = create_name_map_with_config(0, &config);
+  printf("Expanded to %zu names\n", names.length);
+
+  printf("idle map\n");
+  for (int m = 0; m < 2; m++)
+  {
+    void *map = implementations[m].create(&names);
+    SnapshotReporter reporter = {
+        .map = map, .empty = empty, .use_snapshots = m == 1, .reports = 0, .names_seen = 0
+    };
+    atomic_init(&reporter.stop, false);
+    double start = now_in_nanoseconds();
+    for (int r = 0; r < SNAPSHOT_ROUNDS; r++)
+      report_once(&reporter);
+    double report = (now_in_nanoseconds() - start) / SNAPSHOT_ROUNDS;
+
+    // For the snapshot, also time taking it alone, without walking it
+    double take = report;
+    if (reporter.use_snapshots)
+    {
+      start = now_in_nanoseconds();
+      for (int r = 0; r < SNAPSHOT_ROUNDS; r++)
+        free_concurrent_name_map_snapshot(snapshot_concurrent_name_map(map));
+      take = (now_in_nanoseconds() - start) / SNAPSHOT_ROUNDS;
+    }
+    printf(
+        "  %-9s take %10.1f us  take and walk %10.1f us\n", implementations[m].label,
+        take / 1e3, report / 1e3
+    );
+    implementations[m].free(map);
+  }
+
+  printf("mixed (50%% writes) on %d writer threads, with one reporting thread\n", SNAPSHOT_WRITERS);
+  pthread_t threads[SNAPSHOT_WRITERS + 1];
+  ConcurrencyWorker workers[SNAPSHOT_WRITERS];
+  for (int m = 0; m < 2; m++)
+  {
+    void *map = implementations[m].create(&names);
+    SnapshotReporter reporter = {
+        .map = map, .empty = empty, .use_snapshots = m == 1, .reports = 0, .names_seen = 0
+    };
+    atomic_init(&reporter.stop, false);
+    double start = now_in_nanoseconds();
+    for (int t = 0; t < SNAPSHOT_WRITERS; t++)
+    {
+      workers[t] = (ConcurrencyWorker) {
+          &implementations[m], map, &names, &churn, 50, 0x9e3779b9ULL * (t + 1)
+      };
+      if (pthread_create(&threads[t], NULL, run_concurrency_worker, &workers[t]) != 0) {
+        printf("Failed to create a thread\n");
+        exit(1);
+      }
+    }
+    if (pthread_create(&threads[SNAPSHOT_WRITERS], NULL, run_snapshot_reporter, &reporter) != 0) {
+      printf("Failed to create a thread\n");
+      exit(1);
+    }
+    for (int t = 0; t < SNAPSHOT_WRITERS; t++)
+      pthread_join(threads[t], NULL);
+    double elapsed = now_in_nanoseconds() - start;
+    atomic_store(&reporter.stop, true);
+    pthread_join(threads[SNAPSHOT_WRITERS], NULL);
+    implementations[m].free(map);
+
+    double throughput = (double) SNAPSHOT_WRITERS * CONCURRENCY_OPERATIONS / elapsed * 1e3;
+    printf(
+        "  %-9s %10.2f Mops/s  %6ld reports (%.0f names each)\n", implementations[m].label,
+        throughput, reporter.reports,
+        reporter.reports ? (double) reporter.names_seen / (double) reporter.reports : 0
+    );
+  }
+
+  free_name_map(empty);
+  free_names(&names);
+  free_names(&churn);
+}
+
+/**
+ * Churns a small set of names through maps with a max load factor of 0.95 that resize one slot at a
+ * time, checking every result, with a fresh map for each of a number of seeds. This is a regression
+ * case: storage whose names and tombstones filled every slot used to be left to retire, and
+ * searches of it then never stopped, which several of these seeds ran into.
+ * @param list The names to churn, of which only the first few hundred are used.
+ */
+static void benchmark_incremental_churn(const NameList *list)
+{
+  const char *engine_names[] = { "linear-probing", "compact" };
+  NameMapEngine engines[] = { NAME_MAP_ENGINE_LINEAR_PROBING, NAME_MAP_ENGINE_COMPACT };
+  size_t count = list->length < INCREMENTAL_CHURN_NAMES ? list->length : INCREMENTAL_CHURN_NAMES;
+  bool *present = malloc(count * sizeof(bool));
+  if (!present) {
+    printf("Failed to allocate memory for the expected results\n");
+    exit(1);
+  }
+
+  for (size_t e = 0; e < sizeof(engines) / sizeof(engines[0]); e++)
+  {
+    NameMapConfig config = default_name_map_config();
+    config.hash_policy = HASH_POLICY_FAST;
+    config.engine = engines[e];
+    config.max_load_factor = 0.95;
+    config.incremental_resize_step = 1;
+
+    long mismatches = 0;
+    long resizes = 0;
+    double start = now_in_nanoseconds();
+    for (uint64_t seed = 1; seed <= INCREMENTAL_CHURN_SEEDS; seed++)
+    {
+      memset(present, 0, count * sizeof(bool));
+      uint64_t state = seed * 0x9e3779b97f4a7c15ULL;
+      NameMap *map = create_name_map_with_config(0, &config);
+      for (int i = 0; i < INCREMENTAL_CHURN_OPERATIONS; i++)
+      {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+
+        // Half adds, so that the map keeps growing and shrinking around its resize thresholds
+        size_t n = (state >> 8) % count;
+        int roll = (int) (state % 10);
+        if (roll < 5)
+        {
+          add_to_name_map(map, list->names[n]);
+          present[n] = true;
+        } else if (roll < 8)
+        {
+          mismatches += remove_from_name_map(map, list->names[n]) != present[n];
+          present[n] = false;
+        } else
+        {
+          mismatches += search_name_map(map, list->names[n]) != present[n];
+        }
+      }
+      resizes += get_name_map_stats(map).resizes;
+      free_name_map(map);
+    }
+    double elapsed = now_in_nanoseconds() - start;
+
+    printf(
+        "  %-15s %8.1f ns/op  %ld resizes  %ld mismatches\n", engine_names[e],
+        elapsed / ((double) INCREMENTAL_CHURN_SEEDS * INCREMENTAL_CHURN_OPERATIONS), resizes,
+        mismatches
+    );
+  }
+  free(present);
+}
+
+static const Benchmark benchmarks[] = {
+    { "fingerprints", benchmark_fingerprints },
+    { "hash-policies", benchmark_hash_policies },
+    { "churn", benchmark_churn },
+    { "engines", benchmark_engines },
+    { "insert-latency", benchmark_insert_latency },
+    { "bulk-load", benchmark_bulk_load },
+    { "concurrency", benchmark_concurrency },
+    { "freeze", benchmark_freeze },
+    { "image", benchmark_image },
+    { "bloom", benchmark_bloom },
+    { "batch", benchmark_batch },
+    { "typed-map", benchmark_typed_map },
+    { "stats", benchmark_stats },
+    { "inline-keys", benchmark_inline_keys },
+    { "cuckoo", benchmark_cuckoo },
+    { "large", benchmark_large },
+    { "parallel-build", benchmark_parallel_build },
+    { "counting", benchmark_counting },
+    { "set-operations", benchmark_set_operations },
+    { "adversarial", benchmark_adversarial },
+    { "compact-slots", benchmark_compact_slots },
+    { "snapshots", benchmark_snapshots },
+    { "incremental-churn", benchmark_incremental_churn },
+};
+
+int main(int argc, char *argv[])
+{
+  size_t benchmark_count = sizeof(benchmarks) / sizeof(benchmarks[0]);
+  const Benchmark *benchmark = NULL;
+  for (size_t i = 0; argc > 1 && i < benchmark_count; i++)
+  {
+    if (strcmp(argv[1], benchmarks[i].name) == 0)
+      benchmark = &benchmarks[i];
+  }
+
+  if (!benchmark)
+  {
+    printf("Usage: %s <benchmark> [names file] [slots]\nBenchmarks:", argv[0]);
+    for (size_t i = 0; i < benchmark_count; i++)
+      printf(" %s", benchmarks[i].name);
+    printf("\n");
+    return EXIT_FAILURE;
+  }
+
+  list_path = argc > 2 ? argv[2] : "names.txt";
+  large_slots = argc > 3 ? (size_t) strtoull(argv[3], NULL, 10) : LARGE_DEFAULT_SLOTS;
+  NameList list = read_names(list_path);
+  printf("Loaded %zu names\n", list.length);
+  benchmark->run(&list);
+  free_names(&list);
+
+  return EXIT_SUCCESS;
+}